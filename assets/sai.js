@@ -1,4 +1,4 @@
-const SAI_JS_API_VERSION = 3;
+const SAI_JS_API_VERSION = 4;
 
 (function() {
 
@@ -553,6 +553,54 @@ function humanize(s)
 	return s;
 }
 
+/*
+ * The builder samples each step's cgroup while it runs and sends a
+ * downsampled series "cpu,mem,io,psi;..." with series_ms per point.  cpu is
+ * in 1/100ths of a core, mem in MiB, io in KiB/s and psi (time stalled on
+ * memory) in 0.1%.  Draw each as a small line, scaled to its own peak.
+ */
+
+function series_svg(jso)
+{
+	var pts = jso.series.split(";").map(x => x.split(",").map(Number)),
+	    w = 240, h = 32, names = [ "cpu", "mem", "io", "psi" ],
+	    s = "<div class=\"metric-series\">", i, n;
+
+	if (!pts.length || pts[0].length != 4)
+		return "";
+
+	for (i = 0; i < 4; i++) {
+		var peak = Math.max(...pts.map(p => p[i]), 1), line = "", lbl;
+
+		for (n = 0; n < pts.length; n++)
+			line += ((n * w) / Math.max(pts.length - 1, 1)).toFixed(1) +
+				"," + (h - ((pts[n][i] * h) / peak)).toFixed(1) + " ";
+
+		switch (i) {
+		case 0:
+			lbl = "CPU peak " + (peak / 100).toFixed(2) + " cores";
+			break;
+		case 1:
+			lbl = "Mem peak " + humanize(peak * 1024 * 1024) + "B";
+			break;
+		case 2:
+			lbl = "I/O peak " + humanize(peak * 1024) + "B/s";
+			break;
+		default:
+			lbl = "Mem pressure peak " + (peak / 10).toFixed(1) + "%";
+			break;
+		}
+
+		s += "<div class=\"metric-series-row\"><svg width=\"" + w +
+		     "\" height=\"" + h + "\"><polyline class=\"metric-series-" +
+		     names[i] + "\" points=\"" + line + "\"/></svg> " + lbl +
+		     "</div>";
+	}
+
+	return s + "<div class=\"metric-series-row\">" +
+		(jso.series_ms / 1000).toFixed(1) + "s per point</div></div>";
+}
+
 function ansiToHtml(text, state) {
     const classMap = {
         '1': 'ansi-bold', '4': 'ansi-underline',
@@ -815,6 +863,12 @@ function aging()
 }
 var sai, jso, s, sai_arts = "";
 
+/* version of the overview we are showing, patches must follow on from it */
+var ov_version = -1, ov_epoch = 0, ov_resync = 0;
+
+/* paging back through older events: where we got to, and if there's more */
+var ov_oldest = 0, ov_oldest_uuid = "", ov_more = 0, ov_page_pending = 0;
+
 function sai_plat_icon(plat, size)
 {
 	var s, s1 = "";
@@ -858,7 +912,8 @@ function sai_taskinfo_render(t, now_ut)
 		sai_event_render(t, now_ut, 0) + "</table></td><td class=\"ti\">" +
 		"<span class=\"ti1\">" + sai_plat_icon(t.t.platform, 2) +
 		san(t.t.platform) + "</span>&nbsp;";
-	if (authd && t.t.state != 0 && t.t.state != 3 && t.t.state != 4 && t.t.state != 5)
+	if (authd && t.t.state != 0 && t.t.state != 3 && t.t.state != 4 &&
+	    t.t.state != 5 && t.t.state != 10)
 		s += "<img class=\"rebuild\" alt=\"stop build\" src=\"stop.svg\" " +
 			"id=\"stop-" + san(t.t.uuid) + "\">&nbsp;";
 	if (authd)
@@ -881,6 +936,11 @@ function sai_taskinfo_render(t, now_ut)
 		sai_arts = "";
 	}
 
+	if (t.t.cached_from)
+		s += "&nbsp;&nbsp;<span class=\"ti5\">Passed before on this tree, " +
+			"<a href=\"/sai/index.html?task=" + san(t.t.cached_from) +
+			"\">see the original build</a></span>";
+
 	s += "</td></tr>";
 
 	s += "</td></tr></table></table>";
@@ -966,6 +1026,9 @@ function summarize_build_situation(event_uuid)
 	same = roo.querySelectorAll(".taskstate3");
 	if (same)
 		good = same.length;
+	same = roo.querySelectorAll(".taskstate10");
+	if (same)
+		good += same.length; // passed before, on the same tree
 	same = roo.querySelectorAll(".taskstate4");
 	if (same)
 		bad += same.length;
@@ -1037,6 +1100,7 @@ function sai_event_summary_render(o, now_ut, reset_all_icon)
 			"id=\"rebuild-ev-" + san(e.uuid) + "\">&nbsp;";
 		s += "<img class=\"rebuild\" alt=\"delete event\" src=\"/sai/delete.png\" " +
 				"id=\"delete-ev-" + san(e.uuid) + "\">";
+		s += "<br><span class=\"evprog\" id=\"evprog-" + san(e.uuid) + "\"></span>";
 	}
 	s += "</td>";
 
@@ -1107,7 +1171,10 @@ function sai_event_render(o, now_ut, reset_all_icon)
 
 			s1 += "<div id=\"taskstate_" + t.uuid + "\" class=\"taskstate taskstate" + t.state +
 				"\" data-event-uuid=\"" + san(e.uuid) + "\" data-platform=\"" + san(t.platform) +
-				"\" data-rebuildable=\"" + t.rebuildable + "\">";
+				"\" data-rebuildable=\"" + t.rebuildable +
+				"\" data-duration=\"" + (t.duration ? t.duration : 0) + "\"" +
+				(t.duration ? " title=\"Dur: " +
+				 (t.duration / 1000000).toFixed(1) + "s\"" : "") + ">";
 			s1 += "<a href=\"/sai/index.html?task=" + t.uuid + "\">" +
 				sai_plat_icon(t.platform, 0) + "</a>";
 			s1 += "</div>";
@@ -1157,13 +1224,40 @@ function refresh_state(task_uuid, task_state)
 		tsi.classList.remove("taskstate5");
 		tsi.classList.remove("taskstate6");
 		tsi.classList.remove("taskstate7");
+		tsi.classList.remove("taskstate10");
 		tsi.classList.add("taskstate" + task_state);
 		// console.log("refresh_state  taskstate" + task_state);
 	}
 }
 
-function after_delete() {
-	location.reload();
+function event_buttons_attach(event_uuid)
+{
+	if (document.getElementById("rebuild-ev-" + san(event_uuid)))
+		document.getElementById("rebuild-ev-" + san(event_uuid)).
+			addEventListener("click", function(e) {
+		console.log(e);
+		var rs= "{\"schema\":" +
+			 "\"com.warmcat.sai.eventreset\"," +
+			 "\"uuid\": " +
+			JSON.stringify(san(e.srcElement.id.substring(11))) + "}";
+
+		console.log(rs);
+		sai.send(rs);
+	});
+	if (document.getElementById("delete-ev-" + san(event_uuid)))
+		document.getElementById("delete-ev-" + san(event_uuid)).
+			addEventListener("click", function(e) {
+		console.log(e);
+		var rs= "{\"schema\":" +
+			 "\"com.warmcat.sai.eventdelete\"," +
+			 "\"uuid\": " +
+			JSON.stringify(san(e.srcElement.id.substring(10))) + "}";
+
+		console.log(rs);
+		sai.send(rs);
+		/* the server drops it from the overview and tells us */
+		e.srcElement.style.opacity = "0.3";
+	});
 }
 
 function createContextMenu(event, menuItems) {
@@ -1509,6 +1603,34 @@ function renderPconHierarchy(container) {
     }
 }
 
+var sai_text_decoder = new TextDecoder("utf-8");
+
+/*
+ * Binary ws messages from sai-web start with a type byte, turn them into the
+ * same kind of object the JSON version of the message would give us
+ */
+
+function sai_binary_to_jso(ab)
+{
+	var dv = new DataView(ab);
+
+	switch (dv.getUint8(0)) {
+	case 1: /* log chunk */
+		return {
+			schema:		"com-warmcat-sai-logs",
+			channel:	dv.getUint8(1),
+			finished:	dv.getUint32(4),
+			timestamp:	dv.getUint32(8) * 4294967296 +
+					dv.getUint32(12),
+			len:		ab.byteLength - 16,
+			log_text:	sai_text_decoder.decode(
+						new Uint8Array(ab, 16), { stream: true })
+		};
+	}
+
+	throw new Error("unknown binary message type");
+}
+
 function ws_open_sai()
 {
 	var s = "", q, qa, qi, q5, q5s;
@@ -1553,6 +1675,7 @@ function ws_open_sai()
 //	s1 = s1.split("?")[0];
 	console.log(s1);
 	sai = new WebSocket(s1, "com-warmcat-sai");
+	sai.binaryType = "arraybuffer";
 
 	try {
 		sai.onopen = function() {
@@ -1581,6 +1704,7 @@ function ws_open_sai()
 					  "\"com.warmcat.sai.taskinfo\"," +
 					  "\"js_api_version\": " + SAI_JS_API_VERSION + "," +
 					  "\"logs\": 1," +
+					  "\"bin\": 1," +
 					  "\"last_log_ts\":" + last_log_timestamp + "," +
 					  "\"task_hash\":" +
 					  JSON.stringify(tid) + "}");
@@ -1622,7 +1746,10 @@ function ws_open_sai()
 		//	if (msg.data.length < 10)
 		//		return;
 		try {
-			jso = JSON.parse(msg.data);
+			if (msg.data instanceof ArrayBuffer)
+				jso = sai_binary_to_jso(msg.data);
+			else
+				jso = JSON.parse(msg.data);
 		} catch {
 			console.log("Bad JSON received:");
 			console.log(msg.data);
@@ -1690,6 +1817,43 @@ function ws_open_sai()
 				}
 				break;
 
+			case "com.warmcat.sai.builder-deltas":
+				/*
+				 * Only the builders that changed since the last
+				 * full list, merge them in by name
+				 */
+				if (jso.builders && Array.isArray(jso.builders)) {
+					jso.builders.forEach(d => {
+						const i = last_builder_list.findIndex(b => b.name === d.name);
+
+						if (i >= 0)
+							last_builder_list[i] = d;
+					});
+					const container = document.getElementById("sai_builders");
+					if (container) renderPconHierarchy(container);
+				}
+				break;
+
+			case "com.warmcat.sai.eventprogress":
+				/*
+				 * A background event reset or delete is going on,
+				 * the event may already have gone from the overview
+				 */
+				var ep = document.getElementById("evprog-" + san(jso.event_hash));
+
+				if (!ep)
+					break;
+
+				if (jso.phase === "finished")
+					ep.textContent = "";
+				else
+					if (jso.phase === "running" && jso.total)
+						ep.textContent = jso.op + " " +
+							Math.floor((jso.done * 100) / jso.total) + "%";
+					else
+						ep.textContent = jso.op + " " + jso.phase;
+				break;
+
 			case "com.warmcat.sai.power_managed_builders":
 				/* Update PCON topology */
 				if (jso.power_controllers) {
@@ -1713,7 +1877,12 @@ function ws_open_sai()
 						"Mem: " + humanize(jso.peak_mem_rss) + "B; " +
 						"Stg: " + humanize(jso.stg_bytes) + "B; " +
 						"Parallel: " + jso.parallel +
+						((jso.cc_hits || jso.cc_misses) ?
+						 "; Compiler cache: " + jso.cc_hits + " hits, " +
+						 jso.cc_misses + " misses" : "") +
 						"</div>";
+					if (jso.series)
+						s += series_svg(jso);
 					summaryDiv.innerHTML += s;
 				}
 				break;
@@ -1754,6 +1923,45 @@ function ws_open_sai()
 				 * Update existing?
 				 */
 
+				ov_more = jso.more;
+				if (jso.oldest) {
+					ov_oldest = jso.oldest;
+					ov_oldest_uuid = jso.oldest_uuid || "";
+				}
+
+				if (jso.before) {
+					/*
+					 * A page of older events we asked for,
+					 * they go after what we already show
+					 */
+					var st = document.getElementById("sai_sticky"),
+					    tab = st ? st.querySelector("table") : null;
+
+					ov_page_pending = 0;
+					if (!tab || !jso.overview.length)
+						break;
+
+					s = "";
+					for (n = jso.overview.length - 1; n >= 0; n--)
+						s += sai_event_render(jso.overview[n], now_ut, 1);
+					tab.insertAdjacentHTML("beforeend", s);
+
+					for (n = jso.overview.length - 1; n >= 0; n--) {
+						document.getElementById("esr-" + jso.overview[n].e.uuid).innerHTML =
+							sai_event_summary_render(jso.overview[n], now_ut, 1);
+						update_summary_and_progress(jso.overview[n].e.uuid);
+						event_buttons_attach(jso.overview[n].e.uuid);
+					}
+					aging();
+					break;
+				}
+
+				if (jso.ov_version !== undefined) {
+					ov_version = jso.ov_version;
+					ov_epoch = jso.ov_epoch;
+					ov_resync = 0;
+				}
+
 				// console.log("jso.overview.length " + jso.overview.length);
 
 				if (jso.overview.length == 1 &&
@@ -1822,33 +2030,56 @@ function ws_open_sai()
 				}
 
 				if (jso.overview.length)
-					for (n = jso.overview.length - 1; n >= 0; n--) {
-						if (document.getElementById("rebuild-ev-" + san(jso.overview[n].e.uuid)))
-							document.getElementById("rebuild-ev-" + san(jso.overview[n].e.uuid)).
-								addEventListener("click", function(e) {
-					console.log(e);
-						var rs= "{\"schema\":" +
-						 "\"com.warmcat.sai.eventreset\"," +
-						 "\"uuid\": " +
-							JSON.stringify(san(e.srcElement.id.substring(11))) + "}";
-
-						console.log(rs);
-						sai.send(rs);
-					});
-					if (document.getElementById("delete-ev-" + san(jso.overview[n].e.uuid)))
-						document.getElementById("delete-ev-" + san(jso.overview[n].e.uuid)).
-							addEventListener("click", function(e) {
-					console.log(e);
-						var rs= "{\"schema\":" +
-						 "\"com.warmcat.sai.eventdelete\"," +
-						 "\"uuid\": " +
-							JSON.stringify(san(e.srcElement.id.substring(10))) + "}";
-
-						console.log(rs);
-						sai.send(rs);
-						setTimeout(after_delete, 750);
-					});
+					for (n = jso.overview.length - 1; n >= 0; n--)
+						event_buttons_attach(jso.overview[n].e.uuid);
+				break;
+
+			case "com.warmcat.sai.ovpatch":
+				/*
+				 * Changes to the overview since the version
+				 * we have... if we missed any, ask the server
+				 * to resume from what we have.  It only sends
+				 * the whole overview if it can't patch us up.
+				 */
+				if (jso.from !== ov_version) {
+					if (ov_version === -1 || ov_resync)
+						break; /* already asked */
+					ov_resync = 1;
+					sai.send("{\"schema\":" +
+						 "\"com.warmcat.sai.taskinfo\", \"js_api_version\": " +
+						 SAI_JS_API_VERSION + ", \"ov_from\": " + ov_version +
+						 ", \"ov_epoch\": " + ov_epoch +
+						 ", \"ov_auth\": " + (authd ? 1 : 0) + "}");
+					break;
+				}
+				ov_resync = 0;
+
+				for (n = 0; n < jso.p.length; n++) {
+					var pa = jso.p[n], tsi;
+
+					if (pa.t) {
+						refresh_state(pa.t, pa.s);
+						tsi = document.getElementById("taskstate_" + pa.t);
+						if (tsi) {
+							tsi.setAttribute("data-rebuildable", pa.r);
+							tsi.setAttribute("data-duration", pa.d);
+							if (pa.d)
+								tsi.title = "Dur: " +
+									(pa.d / 1000000).toFixed(1) + "s";
+						}
+						update_summary_and_progress(pa.t.substring(0, 32));
+					}
+
+					if (pa.e && document.getElementById("esr-" + pa.e.uuid)) {
+						document.getElementById("esr-" + pa.e.uuid).innerHTML =
+							sai_event_summary_render({ e: pa.e, t: [] }, now_ut, 1);
+						event_buttons_attach(pa.e.uuid);
+						update_summary_and_progress(pa.e.uuid);
+					}
 				}
+
+				ov_version = jso.v;
+				aging();
 				break;
 
 			case "com.warmcat.sai.taskinfo":
@@ -2112,7 +2343,8 @@ function ws_open_sai()
 
 			case "com-warmcat-sai-logs":
 				try {
-					var s1 = decodeURIComponent(escape(atob(jso.log))),
+					var s1 = (jso.log_text !== undefined) ? jso.log_text :
+						decodeURIComponent(escape(atob(jso.log))),
 					    ansiResult = ansiToHtml(s1, logAnsiState),
 					    s = ansiResult.html, li,
 					    en = "", yo, dh, ce, tn = "";
@@ -2293,6 +2525,20 @@ window.addEventListener("load", function() {
 	ws_open_sai();
 	aging();
 
+	/* fetch older events as we scroll towards the bottom */
+	window.addEventListener("scroll", function() {
+		if (!ov_more || ov_page_pending || !ov_oldest || !sai ||
+		    window.innerHeight + window.scrollY <
+					document.body.offsetHeight - 400)
+			return;
+
+		ov_page_pending = 1;
+		sai.send("{\"schema\":\"com.warmcat.sai.taskinfo\"," +
+			 "\"js_api_version\": " + SAI_JS_API_VERSION + "," +
+			 "\"before\": " + ov_oldest + "," +
+			 "\"before_uuid\": \"" + ov_oldest_uuid + "\"}");
+	}, false);
+
 	if (document.getElementById("login-button")) {
 		document.getElementById("login-button").addEventListener("click", post_login_form);
 		document.getElementById("logout-button").addEventListener("click", post_login_form);
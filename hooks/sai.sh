@@ -36,6 +36,7 @@ echo " }," >> $TF
 echo " \"nonce\":\"`dd if=/dev/urandom bs=32 count=1 | sha256sum | cut -d' ' -f1`\"," >> $TF
 echo " \"ref\":\"$1\"," >> $TF
 echo " \"hash\":\"$3\"," >> $TF
+echo " \"tree\":\"`git rev-parse $3^{tree}`\"," >> $TF
 echo " \"saifile_len\":$SJL," >> $TF
 echo -n " \"saifile\":\"" >> $TF
 # disallow any nested JSON monkey business by base64-encoding it
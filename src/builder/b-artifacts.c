@@ -20,6 +20,24 @@
  *
  * This deals with POSTing artifacts to the related sai-server, using a secret
  * that was passed to the builder as part of the task that was allocated
+ *
+ * Artifacts are queued from .sai-uploads independently of the task that made
+ * them, with at most SAIB_ARTIFACT_UPLOADS_MAX connections uploading at once.
+ *
+ * Each connection first sends the artifact JSON, and the server replies with
+ * the offset it already holds for it.  We then send the rest as chunks of a
+ * JSON header carrying the chunk sha256, followed by the chunk payload.  The
+ * server drops the connection on a bad chunk; either way if the connection
+ * fails, we come back later and resume from wherever the server got to.
+ *
+ * The artifact JSON carries the sha256 of the artifact content, if the server
+ * already stores that it just records the artifact and tells us it has all of
+ * it, without us uploading anything.  Otherwise, if we were built with zlib,
+ * compressible artifacts are sent gzipped with the encoding in the JSON.
+ *
+ * Once an artifact is ready to go, the server url and artifact JSON are kept
+ * in a ".meta" file next to it, so if we are restarted, the queue is picked
+ * up again from .sai-uploads and the uploads resume where the server got to.
  */
 
 #include <libwebsockets.h>
@@ -30,152 +48,448 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 
+#if defined(SAI_WITH_ZLIB)
+#include <zlib.h>
+#endif
+
 #ifdef _MSC_VER
 /* don't complain about our use of open */
 #pragma warning(disable:4996)
 #endif
 
+enum {
+	SAIB_UPS_JSON,
+	SAIB_UPS_AWAIT_RESUME,
+	SAIB_UPS_CHUNK_HDR,
+	SAIB_UPS_CHUNK_DATA,
+	SAIB_UPS_AWAIT_ACK,
+};
+
+static lws_sorted_usec_list_t sul_kick;
+static char queue_destroying;
+
+static void
+saib_upload_kick(lws_sorted_usec_list_t *sul);
+
+static int
+saib_upload_seek(int fd, uint64_t ofs)
+{
+#if defined(WIN32)
+	return _lseeki64(fd, (__int64)ofs, SEEK_SET) < 0;
+#else
+	return lseek(fd, (off_t)ofs, SEEK_SET) < 0;
+#endif
+}
+
 static lws_ss_state_return_t
 saib_artifact_rx(void *userobj, const uint8_t *buf, size_t len, int flags)
 {
-	// sai_artifact_t *ap = (sai_artifact_t *)userobj;
+	saib_upload_ss_t *us = (saib_upload_ss_t *)userobj;
+	saib_upload_t *up = us->up;
+	sai_artifact_chunk_t *ch;
+	struct lejp_ctx ctx;
+	lws_struct_args_t a;
+	int m;
 
-	return LWSSSSRET_OK;
+	memset(&a, 0, sizeof(a));
+	a.map_st[0]		= lsm_schema_json_map_artifact_resume;
+	a.map_entries_st[0]	= LWS_ARRAY_SIZE(lsm_schema_json_map_artifact_resume);
+	a.ac_block_size		= 256;
+
+	lws_struct_json_init_parse(&ctx, NULL, &a);
+	m = lejp_parse(&ctx, (uint8_t *)buf, (int)len);
+	if (m < 0 || !a.dest) {
+		lwsl_err("%s: bad resume JSON '%s'\n", __func__,
+			 lejp_error_to_string(m));
+		lwsac_free(&a.ac);
+		return LWSSSSRET_DESTROY_ME;
+	}
+
+	ch = (sai_artifact_chunk_t *)a.dest;
+
+	if (ch->ofs >= up->meta.enc_len) {
+		/*
+		 * Either the server already had all of it, or it is
+		 * acknowledging our last chunk... we're done
+		 */
+		lwsl_notice("%s: server has all of %s\n", __func__, up->path);
+		up->done = 1;
+		lwsac_free(&a.ac);
+
+		return LWSSSSRET_DESTROY_ME;
+	}
+
+	if (us->state != SAIB_UPS_AWAIT_RESUME) {
+		lwsac_free(&a.ac);
+		return LWSSSSRET_OK;
+	}
+
+	if (ch->ofs)
+		lwsl_notice("%s: resuming %s at %llu / %llu\n", __func__,
+			    up->path, (unsigned long long)ch->ofs,
+			    (unsigned long long)up->meta.enc_len);
+
+	us->ofs = ch->ofs;
+	us->state = SAIB_UPS_CHUNK_HDR;
+	lwsac_free(&a.ac);
+
+	lws_ss_cancel_timeout(us->ss);
+
+	return lws_ss_request_tx(us->ss);
 }
 
 static lws_ss_state_return_t
 saib_artifact_tx(void *userobj, lws_ss_tx_ordinal_t ord, uint8_t *buf,
 		 size_t *len, int *flags)
 {
-	sai_artifact_t *ap = (sai_artifact_t *)userobj;
-	lws_ss_state_return_t r;
+	saib_upload_ss_t *us = (saib_upload_ss_t *)userobj;
+	saib_upload_t *up = us->up;
+	struct lws_genhash_ctx hctx;
 	lws_struct_serialize_t *js;
+	sai_artifact_chunk_t ch;
+	uint8_t digest[32];
+	uint64_t cl, r;
 	size_t w;
 	int n;
 
 	*flags = 0;
 
-	if (!ap->sent_json) {
-		*flags |= LWSSS_FLAG_SOM;
+	switch (us->state) {
+	case SAIB_UPS_JSON:
+		if (us->fd == -1)
+			return LWSSSSRET_DESTROY_ME;
+
+		/*
+		 * Describe the artifact... the server tells us where to
+		 * resume from in response
+		 */
 
 		js = lws_struct_json_serialize_create(
 				lsm_schema_json_map_artifact,
 			        LWS_ARRAY_SIZE(lsm_schema_json_map_artifact),
-			        0, ap);
+			        0, &up->meta);
 		if (!js)
 			return LWSSSSRET_DESTROY_ME;
 
 		lws_struct_json_serialize(js, buf, *len, &w);
+		lws_struct_json_serialize_destroy(&js);
 		*len = w;
+		*flags = LWSSS_FLAG_SOM | LWSSS_FLAG_EOM;
 
-		ap->sent_json = 1;
-		r = lws_ss_request_tx(ap->ss);
-		if (r)
-			return r;
-		lwsl_notice("%s: sent JSON %s\n", __func__, (const char *)buf);
+		us->state = SAIB_UPS_AWAIT_RESUME;
+		lws_ss_start_timeout(us->ss, 30 * LWS_US_PER_SEC);
 
 		return LWSSSSRET_OK;
-	}
 
-	if (ap->fd == -1) {
-		lwsl_info("%s: completion with fd = -1\n", __func__);
-		lws_ss_start_timeout(ap->ss, 5 * LWS_US_PER_SEC);
+	case SAIB_UPS_CHUNK_HDR:
+
+		cl = up->meta.enc_len - us->ofs;
+		if (cl > SAIB_ARTIFACT_CHUNK)
+			cl = SAIB_ARTIFACT_CHUNK;
+
+		/*
+		 * Hash the chunk payload first, so we can send the hash in
+		 * the header ahead of it
+		 */
+
+		if (saib_upload_seek(us->fd, us->ofs) ||
+		    lws_genhash_init(&hctx, LWS_GENHASH_TYPE_SHA256))
+			return LWSSSSRET_DESTROY_ME;
+
+		r = cl;
+		while (r) {
+			n = (int)read(us->fd, buf,
+#if defined(WIN32)
+					(unsigned int)
+#endif
+					(r > *len ? *len : (size_t)r));
+			if (n <= 0 ||
+			    lws_genhash_update(&hctx, buf, (size_t)n)) {
+				lwsl_err("%s: artifact read failed: errno %d\n",
+					 __func__, errno);
+				lws_genhash_destroy(&hctx, NULL);
+				return LWSSSSRET_DESTROY_ME;
+			}
+			r -= (uint64_t)n;
+		}
+
+		if (lws_genhash_destroy(&hctx, digest) ||
+		    saib_upload_seek(us->fd, us->ofs))
+			return LWSSSSRET_DESTROY_ME;
+
+		memset(&ch, 0, sizeof(ch));
+		ch.ofs = us->ofs;
+		ch.len = cl;
+		lws_hex_from_byte_array(digest, sizeof(digest), ch.sha256,
+					sizeof(ch.sha256));
+
+		js = lws_struct_json_serialize_create(
+				lsm_schema_json_map_artifact_chunk,
+			        LWS_ARRAY_SIZE(lsm_schema_json_map_artifact_chunk),
+			        0, &ch);
+		if (!js)
+			return LWSSSSRET_DESTROY_ME;
+
+		lws_struct_json_serialize(js, buf, *len, &w);
+		lws_struct_json_serialize_destroy(&js);
+		*len = w;
+		*flags = LWSSS_FLAG_SOM;
+
+		us->chunk_end = us->ofs + cl;
+		us->state = SAIB_UPS_CHUNK_DATA;
+
+		return lws_ss_request_tx(us->ss);
+
+	case SAIB_UPS_CHUNK_DATA:
+
+		r = us->chunk_end - us->ofs;
+		if (r > *len)
+			r = *len;
+
+		n = (int)read(us->fd, buf,
+#if defined(WIN32)
+				(unsigned int)
+#endif
+				(size_t)r);
+		if (n <= 0) {
+			lwsl_err("%s: artifact read failed: fd: %d, errno: %d\n",
+					__func__, us->fd, errno);
+			*len = 0;
+			return LWSSSSRET_DESTROY_ME;
+		}
+
+		us->ofs = us->ofs + (unsigned int)n;
+		lwsl_info("%s: %p: writing %d at +%llu / %llu\n", __func__,
+			  us->ss, n, (unsigned long long)us->ofs,
+			  (unsigned long long)up->meta.enc_len);
+		*len = (size_t)n;
+
+		if (us->ofs != us->chunk_end)
+			return lws_ss_request_tx(us->ss);
+
+		*flags |= LWSSS_FLAG_EOM;
+
+		if (us->ofs != up->meta.enc_len) {
+			us->state = SAIB_UPS_CHUNK_HDR;
+			return lws_ss_request_tx(us->ss);
+		}
+
+		/* the server acks the last chunk with a resume at len */
+
+		lwsl_notice("%s: reached logical end of artifact\n", __func__);
+		us->state = SAIB_UPS_AWAIT_ACK;
+		lws_ss_start_timeout(us->ss, 30 * LWS_US_PER_SEC);
+
 		return LWSSSSRET_OK;
+
+	default:
+		break;
+	}
+
+	return LWSSSSRET_TX_DONT_SEND;
+}
+
+static void
+saib_upload_prep_cleanup(saib_upload_t *up)
+{
+	if (up->preparing) {
+		lws_genhash_destroy(&up->hash_ctx, NULL);
+		up->preparing = 0;
+	}
+
+#if defined(SAI_WITH_ZLIB)
+	if (up->zs) {
+		deflateEnd((z_stream *)up->zs);
+		free(up->zs);
+		up->zs = NULL;
+	}
+#endif
+
+	if (up->fd_in != -1) {
+		close(up->fd_in);
+		up->fd_in = -1;
+	}
+	if (up->fd_gz != -1) {
+		close(up->fd_gz);
+		up->fd_gz = -1;
+		unlink(up->path_gz);
+	}
+}
+
+static void
+saib_upload_meta_path(const char *path, char *meta, size_t len)
+{
+	lws_snprintf(meta, len, "%s.meta", path);
+}
+
+/*
+ * Record what we need to restart the upload of a prepared artifact after we
+ * were restarted
+ */
+
+static int
+saib_upload_persist(saib_upload_t *up)
+{
+	lws_struct_serialize_t *js;
+	char meta[300], buf[2048];
+	size_t w = 0;
+	int fd, n;
+
+	n = lws_snprintf(buf, sizeof(buf), "%s\n", up->url);
+
+	js = lws_struct_json_serialize_create(lsm_schema_json_map_artifact,
+			LWS_ARRAY_SIZE(lsm_schema_json_map_artifact), 0,
+			&up->meta);
+	if (!js)
+		return 1;
+
+	if (lws_struct_json_serialize(js, (uint8_t *)buf + n,
+				      sizeof(buf) - (size_t)n, &w) !=
+							LSJS_RESULT_FINISH) {
+		lws_struct_json_serialize_destroy(&js);
+		return 1;
 	}
+	lws_struct_json_serialize_destroy(&js);
+	n += (int)w;
 
-	n = (int)read(ap->fd, buf,
+	saib_upload_meta_path(up->path, meta, sizeof(meta));
+	fd = open(meta, O_CREAT | O_TRUNC | O_WRONLY
+#if defined(WIN32)
+				| _O_BINARY
+#endif
+				, 0600);
+	if (fd == -1)
+		return 1;
+
+	if (write(fd, buf,
 #if defined(WIN32)
 			(unsigned int)
 #endif
-			*len);
-	if (n < 0) {
-		lwsl_err("%s: artifact read failed: fd: %d, errno: %d\n",
-				__func__, ap->fd, errno);
-		*len = 0;
-		close(ap->fd);
-		ap->fd = -1;
-		return LWSSSSRET_DESTROY_ME;
-	}
-	if (!n) {
-		lwsl_notice("%s: file EOF\n", __func__);
-		return LWSSSSRET_TX_DONT_SEND; /* nothing to send */
+			(size_t)n) != (ssize_t)n) {
+		close(fd);
+		unlink(meta);
+		return 1;
 	}
 
-	ap->ofs = ap->ofs + (unsigned int)n;
-	lwsl_info("%s: %p: writing %d at +%llu / %llu (0x%02X)\n", __func__, ap->ss, n,
-			(unsigned long long)ap->ofs, (unsigned long long)ap->len, buf[0]);
-	*len = (size_t)n;
-	if (ap->ofs == ap->len) {
-		lwsl_notice("%s: reached logical end of artifact\n", __func__);
-		*flags |= LWSSS_FLAG_EOM;
-		close(ap->fd);
-		ap->fd = -1;
+	close(fd);
+
+	return 0;
+}
+
+static void
+saib_upload_free(saib_upload_t *up, int remove_files)
+{
+	char meta[300];
+
+	lws_sul_cancel(&up->sul_retry);
+	saib_upload_prep_cleanup(up);
+	lws_dll2_remove(&up->list);
+	if (remove_files) {
+		saib_upload_meta_path(up->path, meta, sizeof(meta));
+		unlink(meta);
+		unlink(up->path);
 	}
+	free(up);
+}
 
-	/* even if we finished, we want to come back to close */
-	return lws_ss_request_tx(ap->ss);
+static void
+saib_upload_destroy(saib_upload_t *up)
+{
+	saib_upload_free(up, 1);
 }
 
 static lws_ss_state_return_t
 saib_artifact_state(void *userobj, void *sh, lws_ss_constate_t state,
 		    lws_ss_tx_ordinal_t ack)
 {
-	sai_artifact_t *ap = (sai_artifact_t *)userobj;
-	struct stat s;
+	saib_upload_ss_t *us = (saib_upload_ss_t *)userobj;
+	saib_upload_t *up;
+	lws_usec_t us_retry;
 
 	lwsl_info("%s: %s, ord 0x%x\n", __func__, lws_ss_state_name(state),
 		  (unsigned int)ack);
 
 	switch (state) {
 	case LWSSSCS_CREATING:
-		// lwsl_notice("%s: CREATING '%s'\n", __func__, ap->path);
-		ap->fd = open((const char *)ap->opaque_data, O_RDONLY
+		us->up = (saib_upload_t *)us->opaque_data;
+		us->state = SAIB_UPS_JSON;
+		us->fd = open(us->up->path, O_RDONLY
 #if defined(WIN32)
 				/* ugh */
 				| _O_BINARY
 #endif
 				);
-		if (ap->fd == -1)
-			return -1;
-		if (fstat(ap->fd, &s)) {
-			close(ap->fd);
-			ap->fd = -1;
-			return -1;
+		if (us->fd == -1) {
+			lwsl_err("%s: unable to open %s\n", __func__,
+				 us->up->path);
+			/* no point retrying */
+			us->up->retries = SAIB_ARTIFACT_RETRIES_MAX;
 		}
-		ap->len = (size_t)s.st_size;
 		break;
 
 	case LWSSSCS_DESTROYING:
 
-		// lwsl_notice("%s: LWSSSCS_DESTROYING\n", __func__);
 		/*
-		 * We clean up everything about the upload here
+		 * This connection is finished, one way or the other... the
+		 * queue entry goes away if it completed, otherwise it gets
+		 * another try later
 		 */
-		lws_dll2_remove(&ap->list);
-		if (ap->fd != -1) {
-			close(ap->fd);
-			ap->fd = -1;
-		}
-		unlink(ap->path);
 
-		ap->ns->count_artifacts--;
-		if (!ap->ns->count_artifacts) {
-			lwsl_notice("%s: last artifact completed, destroying ns now\n", __func__);
-			saib_task_destroy(ap->ns);
+		if (us->fd != -1) {
+			close(us->fd);
+			us->fd = -1;
 		}
+
+		up = us->up;
+		up->ss = NULL;
+		if (!up->active)
+			/* we failed during creation */
+			break;
+		up->active = 0;
+		builder.uploads_active--;
+
+		if (queue_destroying)
+			break;
+
+		if (up->done) {
+			lwsl_notice("%s: artifact %s uploaded\n", __func__,
+				    up->meta.blob_filename);
+			saib_upload_destroy(up);
+		} else
+			if (++up->retries > SAIB_ARTIFACT_RETRIES_MAX) {
+				lwsl_err("%s: giving up on artifact %s\n",
+					 __func__, up->path);
+				saib_upload_destroy(up);
+			} else {
+				us_retry = 5 * LWS_US_PER_SEC <<
+					(up->retries > 6 ? 6 : up->retries);
+				lwsl_warn("%s: artifact %s interrupted, retry %d "
+					  "in %ds\n", __func__,
+					  up->meta.blob_filename, up->retries,
+					  (int)(us_retry / LWS_US_PER_SEC));
+				lws_sul_schedule(builder.context, 0,
+						 &up->sul_retry,
+						 saib_upload_kick, us_retry);
+			}
+
+		lws_sul_schedule(builder.context, 0, &sul_kick,
+				 saib_upload_kick, 1);
+
+		if (!builder.upload_owner.count)
+			saib_reassess_idle_situation();
 		break;
 
 	case LWSSSCS_CONNECTED:
-		// lwsl_user("%s: CONNECTED: %p\n", __func__, ap->ss);
-		return lws_ss_request_tx_len(ap->ss, (unsigned long)ap->len);
+		return lws_ss_request_tx(us->ss);
 
 	case LWSSSCS_TIMEOUT:
 		lwsl_info("%s: timeout\n", __func__);
 		return LWSSSSRET_DESTROY_ME;
 
 	case LWSSSCS_DISCONNECTED:
-		// lwsl_notice("%s: LWSSSCS_DISCONNECTED\n", __func__);
-		/* don't retry */
+	case LWSSSCS_UNREACHABLE:
+	case LWSSSCS_ALL_RETRIES_FAILED:
+		/* we do our own retry with resume */
 		return LWSSSSRET_DESTROY_ME;
 
 	default:
@@ -186,11 +500,442 @@ saib_artifact_state(void *userobj, void *sh, lws_ss_constate_t state,
 }
 
 const lws_ss_info_t ssi_sai_artifact = {
-	.handle_offset = offsetof(sai_artifact_t, ss),
-	.opaque_user_data_offset = offsetof(sai_artifact_t, opaque_data),
+	.handle_offset = offsetof(saib_upload_ss_t, ss),
+	.opaque_user_data_offset = offsetof(saib_upload_ss_t, opaque_data),
 	.rx = saib_artifact_rx,
 	.tx = saib_artifact_tx,
 	.state = saib_artifact_state,
-	.user_alloc = sizeof(sai_artifact_t),
+	.user_alloc = sizeof(saib_upload_ss_t),
 	.streamtype = "sai_artifact"
 };
+
+/*
+ * Start uploads on queued artifacts that aren't already uploading or waiting
+ * to retry, up to the concurrency limit
+ */
+
+static void
+saib_upload_kick(lws_sorted_usec_list_t *sul)
+{
+	lws_start_foreach_dll_safe(struct lws_dll2 *, d, d1,
+				   builder.upload_owner.head) {
+		saib_upload_t *up = lws_container_of(d, saib_upload_t, list);
+
+		if (builder.uploads_active >= SAIB_ARTIFACT_UPLOADS_MAX)
+			return;
+
+		if (up->ss || up->sul_retry.list.owner || up->preparing)
+			continue;
+
+		/* pass up in as the opaque data... we use it during CREATING */
+
+		if (lws_ss_create(builder.context, 0, &ssi_sai_artifact, up,
+				  &up->ss, NULL, NULL)) {
+			lwsl_err("%s: failed to create secure stream\n",
+				 __func__);
+			up->ss = NULL;
+			lws_sul_schedule(builder.context, 0, &up->sul_retry,
+					 saib_upload_kick, 30 * LWS_US_PER_SEC);
+			continue;
+		}
+
+		up->active = 1;
+		builder.uploads_active++;
+
+		/*
+		 * We need to set the metadata items for the post urlargs.
+		 * url is something like "wss://warmcat.com/sai/builder"
+		 */
+
+		if (lws_ss_set_metadata(up->ss, "url", up->url, strlen(up->url)))
+			lwsl_warn("%s: unable to set metadata\n", __func__);
+
+		if (lws_ss_client_connect(up->ss))
+			/* DESTROYING schedules the retry */
+			lws_ss_destroy(&up->ss);
+
+	} lws_end_foreach_dll_safe(d, d1);
+}
+
+#if defined(SAI_WITH_ZLIB)
+
+/*
+ * Things that are already compressed aren't worth trying to gzip
+ */
+
+static const char * const precompressed[] = {
+	".gz", ".tgz", ".xz", ".txz", ".bz2", ".zst", ".lz4", ".lzma", ".zip",
+	".7z", ".rpm", ".deb", ".apk", ".jar", ".whl", ".png", ".jpg", ".jpeg",
+	".webp", ".mp4", ".squashfs",
+};
+
+static int
+saib_artifact_worth_compressing(const saib_upload_t *up)
+{
+	size_t fl = strlen(up->meta.blob_filename), el;
+	unsigned int n;
+
+	if (up->meta.len < 4096)
+		return 0;
+
+	for (n = 0; n < LWS_ARRAY_SIZE(precompressed); n++) {
+		el = strlen(precompressed[n]);
+		if (fl > el && !strcmp(up->meta.blob_filename + fl - el,
+				       precompressed[n]))
+			return 0;
+	}
+
+	return 1;
+}
+
+static int
+saib_upload_deflate(saib_upload_t *up, const uint8_t *in, size_t len, int flush)
+{
+	z_stream *zs = (z_stream *)up->zs;
+	static uint8_t zb[65536];
+	size_t w;
+	int r;
+
+	zs->next_in = (Bytef *)in;
+	zs->avail_in = (uInt)len;
+
+	do {
+		zs->next_out = zb;
+		zs->avail_out = sizeof(zb);
+		r = deflate(zs, flush);
+		if (r == Z_STREAM_ERROR)
+			return 1;
+		w = sizeof(zb) - zs->avail_out;
+		if (w && write(up->fd_gz, zb,
+#if defined(WIN32)
+				(unsigned int)
+#endif
+				w) != (ssize_t)w)
+			return 1;
+	} while (!zs->avail_out || (flush == Z_FINISH && r != Z_STREAM_END));
+
+	return 0;
+}
+#endif
+
+/*
+ * Hash (and maybe compress) the next slice of the artifact, and when we reach
+ * the end, decide what we're going to upload and let it into the queue
+ */
+
+static void
+saib_upload_prep_cb(lws_sorted_usec_list_t *sul)
+{
+	saib_upload_t *up = lws_container_of(sul, saib_upload_t, sul_retry);
+	static uint8_t rb[65536];
+	uint8_t digest[32];
+	size_t done = 0;
+	struct stat s;
+	int n;
+
+	while (done < SAIB_ARTIFACT_PREP_SLICE) {
+		n = (int)read(up->fd_in, rb,
+#if defined(WIN32)
+				(unsigned int)
+#endif
+				sizeof(rb));
+		if (n < 0)
+			goto bail;
+		if (!n)
+			break;
+
+		if (lws_genhash_update(&up->hash_ctx, rb, (size_t)n))
+			goto bail;
+#if defined(SAI_WITH_ZLIB)
+		if (up->zs && saib_upload_deflate(up, rb, (size_t)n, Z_NO_FLUSH))
+			goto bail;
+#endif
+		done += (size_t)n;
+	}
+
+	if (done == SAIB_ARTIFACT_PREP_SLICE) {
+		/* let other things happen before the next slice */
+		lws_sul_schedule(builder.context, 0, &up->sul_retry,
+				 saib_upload_prep_cb, 1);
+		return;
+	}
+
+	up->preparing = 0;
+	if (lws_genhash_destroy(&up->hash_ctx, digest))
+		goto bail;
+	lws_hex_from_byte_array(digest, sizeof(digest), up->meta.hash,
+				sizeof(up->meta.hash));
+
+	up->meta.enc_len = up->meta.len;
+
+#if defined(SAI_WITH_ZLIB)
+	if (up->zs) {
+		if (saib_upload_deflate(up, NULL, 0, Z_FINISH) ||
+		    fstat(up->fd_gz, &s))
+			goto bail;
+
+		/* only use it if it saved at least 10% */
+
+		if ((uint64_t)s.st_size < (uint64_t)up->meta.len -
+					  (uint64_t)(up->meta.len / 10)) {
+			close(up->fd_gz);
+			up->fd_gz = -1;
+			unlink(up->path);
+			lws_strncpy(up->path, up->path_gz, sizeof(up->path));
+			lws_strncpy(up->meta.encoding, "gzip",
+				    sizeof(up->meta.encoding));
+			up->meta.enc_len = (size_t)s.st_size;
+		}
+	}
+#else
+	(void)s;
+#endif
+
+	/* discards the gzip copy if we didn't use it */
+	saib_upload_prep_cleanup(up);
+
+	if (saib_upload_persist(up))
+		/* we can still upload it, just not after a restart */
+		lwsl_warn("%s: unable to persist %s\n", __func__, up->path);
+
+	lwsl_notice("%s: %s: %s, %llu -> %llu %s\n", __func__,
+		    up->meta.blob_filename, up->meta.hash,
+		    (unsigned long long)up->meta.len,
+		    (unsigned long long)up->meta.enc_len,
+		    up->meta.encoding[0] ? up->meta.encoding : "identity");
+
+	lws_sul_schedule(builder.context, 0, &sul_kick, saib_upload_kick, 1);
+
+	return;
+
+bail:
+	lwsl_err("%s: failed to prepare %s\n", __func__, up->path);
+	saib_upload_destroy(up);
+
+	if (!builder.upload_owner.count)
+		saib_reassess_idle_situation();
+}
+
+/*
+ * The artifact at path has been moved out of the task dir... take ownership
+ * of it and upload it in the background
+ */
+
+int
+saib_artifact_queue(struct sai_nspawn *ns, const char *path,
+		    const char *filename)
+{
+	saib_upload_t *up;
+	struct stat s;
+
+	if (!ns->spm || !ns->task || stat(path, &s))
+		return 1;
+
+	up = calloc(1, sizeof(*up));
+	if (!up)
+		return 1;
+
+	up->fd_in = up->fd_gz = -1;
+
+	lws_strncpy(up->path, path, sizeof(up->path));
+	lws_strncpy(up->url, ns->spm->url, sizeof(up->url));
+
+	lws_strncpy(up->meta.task_uuid, ns->task->uuid,
+		    sizeof(up->meta.task_uuid));
+	lws_strncpy(up->meta.artifact_up_nonce, ns->task->art_up_nonce,
+		    sizeof(up->meta.artifact_up_nonce));
+	lws_strncpy(up->meta.blob_filename, filename,
+		    sizeof(up->meta.blob_filename));
+	/* with the nonce and name, identifies the upload for resume */
+	up->meta.timestamp = (uint64_t)lws_now_usecs();
+	up->meta.len = (size_t)s.st_size;
+
+	up->fd_in = open(up->path, O_RDONLY
+#if defined(WIN32)
+				| _O_BINARY
+#endif
+				);
+	if (up->fd_in == -1 ||
+	    lws_genhash_init(&up->hash_ctx, LWS_GENHASH_TYPE_SHA256)) {
+		if (up->fd_in != -1)
+			close(up->fd_in);
+		free(up);
+		return 1;
+	}
+	up->preparing = 1;
+
+#if defined(SAI_WITH_ZLIB)
+	if (saib_artifact_worth_compressing(up)) {
+		lws_snprintf(up->path_gz, sizeof(up->path_gz), "%s.gz",
+			     up->path);
+
+		up->zs = calloc(1, sizeof(z_stream));
+		if (up->zs && deflateInit2((z_stream *)up->zs, 6, Z_DEFLATED,
+					   15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+			free(up->zs);
+			up->zs = NULL;
+		}
+
+		if (up->zs) {
+			up->fd_gz = open(up->path_gz, O_CREAT | O_TRUNC |
+							O_WRONLY
+#if defined(WIN32)
+							| _O_BINARY
+#endif
+							, 0600);
+			if (up->fd_gz == -1) {
+				deflateEnd((z_stream *)up->zs);
+				free(up->zs);
+				up->zs = NULL;
+			}
+		}
+	}
+#endif
+
+	lws_dll2_add_tail(&up->list, &builder.upload_owner);
+
+	lwsl_notice("%s: queued %s (%llu), %d queued\n", __func__, path,
+		    (unsigned long long)up->meta.len,
+		    (int)builder.upload_owner.count);
+
+	lws_sul_schedule(builder.context, 0, &up->sul_retry,
+			 saib_upload_prep_cb, 1);
+
+	return 0;
+}
+
+void
+saib_artifact_queue_destroy(void)
+{
+	queue_destroying = 1;
+	lws_sul_cancel(&sul_kick);
+
+	lws_start_foreach_dll_safe(struct lws_dll2 *, d, d1,
+				   builder.upload_owner.head) {
+		saib_upload_t *up = lws_container_of(d, saib_upload_t, list);
+
+		if (up->ss)
+			lws_ss_destroy(&up->ss);
+
+		/*
+		 * Prepared artifacts stay in .sai-uploads with their .meta, for
+		 * saib_artifact_queue_restore() to pick up next time.  Ones we
+		 * were still preparing can't be restored, since they have none.
+		 */
+		saib_upload_free(up, up->preparing);
+
+	} lws_end_foreach_dll_safe(d, d1);
+}
+
+static int
+saib_artifact_restore_cb(const char *dirpath, void *user,
+			 struct lws_dir_entry *lde)
+{
+	char path[300], meta[300], buf[2048];
+	struct lejp_ctx ctx;
+	lws_struct_args_t a;
+	saib_upload_t *up;
+	struct stat s;
+	size_t nl;
+	int fd, n;
+
+	if (lde->type != LDOT_FILE)
+		return 0;
+
+	nl = strlen(lde->name);
+	lws_snprintf(path, sizeof(path), "%s/%s", dirpath, lde->name);
+
+	if (nl > 5 && !strcmp(lde->name + nl - 5, ".meta"))
+		/* we look at these via the file they belong to */
+		return 0;
+
+	saib_upload_meta_path(path, meta, sizeof(meta));
+	fd = open(meta, O_RDONLY
+#if defined(WIN32)
+				| _O_BINARY
+#endif
+				);
+	if (fd == -1) {
+		/* we were still preparing it when we stopped */
+		lwsl_notice("%s: removing unprepared %s\n", __func__, path);
+		unlink(path);
+		return 0;
+	}
+
+	n = (int)read(fd, buf,
+#if defined(WIN32)
+			(unsigned int)
+#endif
+			sizeof(buf) - 1);
+	close(fd);
+	if (n <= 0)
+		goto bail;
+	buf[n] = '\0';
+
+	up = calloc(1, sizeof(*up));
+	if (!up)
+		return 0;
+
+	up->fd_in = up->fd_gz = -1;
+	lws_strncpy(up->path, path, sizeof(up->path));
+
+	/* the first line is the server url, then the artifact JSON */
+
+	nl = (size_t)(strchr(buf, '\n') ? strchr(buf, '\n') - buf : 0);
+	if (!nl || nl >= sizeof(up->url))
+		goto bail1;
+	lws_strncpy(up->url, buf, nl + 1);
+
+	memset(&a, 0, sizeof(a));
+	a.map_st[0]		= lsm_schema_json_map_artifact;
+	a.map_entries_st[0]	= LWS_ARRAY_SIZE(lsm_schema_json_map_artifact);
+	a.ac_block_size		= 512;
+
+	lws_struct_json_init_parse(&ctx, NULL, &a);
+	if (lejp_parse(&ctx, (uint8_t *)buf + nl + 1, n - (int)nl - 1) < 0 ||
+	    !a.dest) {
+		lwsac_free(&a.ac);
+		goto bail1;
+	}
+
+	up->meta = *(sai_artifact_t *)a.dest;
+	up->meta.blob = NULL;
+	memset(&up->meta.list, 0, sizeof(up->meta.list));
+	lwsac_free(&a.ac);
+
+	if (stat(path, &s) || (uint64_t)s.st_size != (uint64_t)up->meta.enc_len)
+		goto bail1;
+
+	lws_dll2_add_tail(&up->list, &builder.upload_owner);
+
+	lwsl_notice("%s: requeued %s\n", __func__, path);
+
+	return 0;
+
+bail1:
+	free(up);
+bail:
+	lwsl_warn("%s: unable to restore %s\n", __func__, path);
+	unlink(meta);
+	unlink(path);
+
+	return 0;
+}
+
+/*
+ * At startup, queue up the prepared artifacts we didn't get to upload before
+ * we were stopped
+ */
+
+void
+saib_artifact_queue_restore(void)
+{
+	char dir[256];
+
+	lws_snprintf(dir, sizeof(dir), "%s/jobs/.sai-uploads", builder.home);
+	lws_dir(dir, NULL, saib_artifact_restore_cb);
+
+	if (builder.upload_owner.count)
+		lws_sul_schedule(builder.context, 0, &sul_kick,
+				 saib_upload_kick, 1);
+}
@@ -0,0 +1,263 @@
+/*
+ * sai-builder
+ *
+ * Copyright (C) 2019 - 2025 Andy Green <andy@warmcat.com>
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation:
+ *  version 2.1 of the License.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *  MA  02110-1301  USA
+ *
+ * Every task builds from a clean checkout, so without help the same
+ * translation units get compiled over and over, for each push, each instance
+ * and each variant of a platform on the box.
+ *
+ * If "compiler_cache_mib" is set in the builder conf, the build steps get
+ * ccache and sccache pointed at a size-capped cache dir per platform, under
+ * ~/ccache/, and CMake is told to use whichever of them is installed as the
+ * compiler launcher.  The cache base dir is set to the job's src dir, or its
+ * warm dir if it has one, so hits work across job dirs.
+ *
+ * ccache logs the result of each compile of a step to a stats file in the job
+ * dir, which we count up into the step's build metric as hits and misses.
+ *
+ * ccache keeps each cache under the size cap by itself, but if the disk as a
+ * whole gets short, we drop the least recently used platform caches that no
+ * task is using right now, by moving them into jobs/ and having the deletion
+ * worker remove them.
+ */
+
+#include <libwebsockets.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+
+#if !defined(WIN32)
+#include <unistd.h>
+#include <utime.h>
+#include <sys/stat.h>
+#endif
+
+#include "b-private.h"
+
+/*
+ * A name for sp's platform that is usable as a dir name, for the things we
+ * keep per platform under home, like the compiler caches and warm dirs
+ */
+
+void
+saib_plat_dirname(const sai_plat_t *sp, char *name, size_t len)
+{
+	char *q;
+
+	lws_strncpy(name, sp->platform, len);
+	lws_filename_purify_inplace(name);
+
+	for (q = name; *q; q++)
+		if (*q == '/' || *q == '.' || *q == ' ')
+			*q = '_';
+}
+
+/*
+ * The runscript lines setting up the compiler cache for a build step of ns,
+ * into buf.  buf is left empty if it's not enabled.
+ */
+
+void
+saib_ccache_env(struct sai_nspawn *ns, char *buf, size_t len)
+{
+#if !defined(WIN32)
+	char name[128], dir[384];
+
+	buf[0] = '\0';
+
+	if (!builder.compiler_cache_mib || !ns->sp || !ns->sp->platform)
+		return;
+
+	saib_plat_dirname(ns->sp, name, sizeof(name));
+	lws_snprintf(dir, sizeof(dir), "%s/ccache", builder.home);
+	if (mkdir(dir, 0755) && errno != EEXIST)
+		return;
+
+	lws_snprintf(dir, sizeof(dir), "%s/ccache/%s", builder.home, name);
+	if (mkdir(dir, 0755) && errno != EEXIST)
+		return;
+
+	/* the mtime of the dir tells eviction when it was last used */
+
+	utime(dir, NULL);
+
+	lws_snprintf(buf, len,
+		"export CCACHE_DIR=%s/ccache\n"
+		"export CCACHE_MAXSIZE=%uM\n"
+		"export CCACHE_BASEDIR=${SAI_WARM:-%s/jobs/$SAI_VN/src}\n"
+		"export CCACHE_NOHASHDIR=1\n"
+		"export CCACHE_STATSLOG=%s/jobs/$SAI_VN/" SAIB_CCACHE_STATSLOG "\n"
+		"export SCCACHE_DIR=%s/sccache\n"
+		"export SCCACHE_CACHE_SIZE=%uM\n"
+		"if command -v ccache > /dev/null; then\n"
+		"  export CMAKE_C_COMPILER_LAUNCHER=ccache\n"
+		"  export CMAKE_CXX_COMPILER_LAUNCHER=ccache\n"
+		"elif command -v sccache > /dev/null; then\n"
+		"  export CMAKE_C_COMPILER_LAUNCHER=sccache\n"
+		"  export CMAKE_CXX_COMPILER_LAUNCHER=sccache\n"
+		"fi\n",
+		dir, builder.compiler_cache_mib, builder.home, builder.home,
+		dir, builder.compiler_cache_mib);
+#else
+	buf[0] = '\0';
+#endif
+}
+
+/*
+ * Count up the ccache results for the step that just finished into its
+ * metric, and remove the log so the next step starts from nothing
+ */
+
+void
+saib_ccache_to_metric(struct sai_nspawn *ns, sai_build_metric_t *m)
+{
+#if !defined(WIN32)
+	char path[600], buf[1024], *p, *nl;
+	size_t used = 0;
+	ssize_t n;
+	int fd;
+
+	if (!builder.compiler_cache_mib)
+		return;
+
+	lws_snprintf(path, sizeof(path), "%s/" SAIB_CCACHE_STATSLOG, ns->inp);
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		/* nothing was compiled via ccache */
+		return;
+
+	/*
+	 * Each compile is a "# <source>" line followed by a line for each
+	 * counter it bumped, eg, "direct_cache_hit" or "cache_miss"
+	 */
+
+	while ((n = read(fd, buf + used, sizeof(buf) - 1 - used)) > 0) {
+		used += (size_t)n;
+		buf[used] = '\0';
+
+		p = buf;
+		while ((nl = strchr(p, '\n'))) {
+			*nl = '\0';
+			if (p[0] != '#') {
+				size_t l = strlen(p);
+
+				if (l >= 10 && !strcmp(p + l - 10, "_cache_hit"))
+					m->cc_hits++;
+				else
+					if (!strcmp(p, "cache_miss"))
+						m->cc_misses++;
+			}
+			p = nl + 1;
+		}
+
+		used = lws_ptr_diff_size_t(&buf[used], p);
+		if (used == sizeof(buf) - 1)
+			/* silly long line, drop it */
+			used = 0;
+		memmove(buf, p, used);
+	}
+
+	close(fd);
+	unlink(path);
+#endif
+}
+
+#if !defined(WIN32)
+
+struct saib_ccache_lru {
+	char			name[128];
+	time_t			mtime;
+};
+
+static int
+saib_ccache_in_use(const char *name)
+{
+	char n1[128];
+
+	lws_start_foreach_dll(struct lws_dll2 *, d, builder.sai_plat_owner.head) {
+		sai_plat_t *sp = lws_container_of(d, sai_plat_t, sai_plat_list);
+
+		if (sp->platform && sp->nspawn_owner.count) {
+			saib_plat_dirname(sp, n1, sizeof(n1));
+			if (!strcmp(n1, name))
+				return 1;
+		}
+	} lws_end_foreach_dll(d);
+
+	return 0;
+}
+
+static int
+saib_ccache_lru_cb(const char *dirpath, void *user, struct lws_dir_entry *lde)
+{
+	struct saib_ccache_lru *lru = (struct saib_ccache_lru *)user;
+	char path[512];
+	struct stat sb;
+
+	if (lde->type != LDOT_DIR || lde->name[0] == '.')
+		return 0;
+
+	lws_snprintf(path, sizeof(path), "%s/%s", dirpath, lde->name);
+	if (stat(path, &sb) || saib_ccache_in_use(lde->name))
+		return 0;
+
+	if (!lru->name[0] || sb.st_mtime < lru->mtime) {
+		lws_strncpy(lru->name, lde->name, sizeof(lru->name));
+		lru->mtime = sb.st_mtime;
+	}
+
+	return 0;
+}
+
+#endif
+
+/*
+ * If the disk is getting short, drop the least recently used compiler cache
+ * that isn't in use.  Since the deletion happens in the background, we only
+ * drop one per call and look again next time.
+ */
+
+void
+saib_ccache_check_pressure(void)
+{
+#if !defined(WIN32)
+	struct saib_ccache_lru lru;
+	char path[512];
+
+	if (!builder.compiler_cache_mib || !saib_disk_pressure())
+		return;
+
+	memset(&lru, 0, sizeof(lru));
+	lws_snprintf(path, sizeof(path), "%s/ccache", builder.home);
+	lws_dir(path, &lru, saib_ccache_lru_cb);
+	if (!lru.name[0]) {
+		lwsl_notice("%s: disk low but no idle compiler cache to drop\n",
+			    __func__);
+		return;
+	}
+
+	lwsl_notice("%s: disk low, dropping compiler cache %s\n", __func__,
+		    lru.name);
+
+	lws_snprintf(path, sizeof(path), "%s/ccache/%s", builder.home, lru.name);
+	saib_evict_dir(path, "ccache-evict");
+#endif
+}
@@ -36,6 +36,9 @@ static const char * const paths_global[] = {
 	"metrics_uri",
 	"metrics_path",
 	"metrics_secret",
+	"metrics_sample_ms",
+	"compiler_cache_mib",
+	"checkout_snapshots",
 	"sai-power",
 	"power_controller",
 	"power-on.type",
@@ -54,6 +57,9 @@ enum enum_paths_global {
 	LEJPM_METRICS_URI,
 	LEJPM_METRICS_PATH,
 	LEJPM_METRICS_SECRET,
+	LEJPM_METRICS_SAMPLE_MS,
+	LEJPM_COMPILER_CACHE_MIB,
+	LEJPM_CHECKOUT_SNAPSHOTS,
 	LEJPM_SAI_POWER,
 	LEJPM_POWER_CONTROLLER,
 	LEJPM_POWER_ON_TYPE,
@@ -255,6 +261,22 @@ saib_conf_global_cb(struct lejp_ctx *ctx, char reason)
 	if (!(reason & LEJP_FLAG_CB_IS_VALUE) || !ctx->path_match)
 		return 0;
 
+	if (ctx->path_match - 1 == LEJPM_METRICS_SAMPLE_MS) {
+		a->builder->metrics_sample_ms = (unsigned int)atoi(ctx->buf);
+		return 0;
+	}
+
+	if (ctx->path_match - 1 == LEJPM_COMPILER_CACHE_MIB) {
+		a->builder->compiler_cache_mib = (unsigned int)atoi(ctx->buf);
+		return 0;
+	}
+
+	if (ctx->path_match - 1 == LEJPM_CHECKOUT_SNAPSHOTS) {
+		a->builder->checkout_snapshots =
+				(unsigned int)(reason == LEJPCB_VAL_TRUE);
+		return 0;
+	}
+
 	if (reason != LEJPCB_VAL_STR_END)
 		return 0;
 
@@ -340,6 +362,8 @@ saib_config_global(struct sai_builder *builder, const char *d)
 	memset(&a, 0, sizeof(a));
 	a.builder = builder;
 
+	builder->metrics_sample_ms = SAIB_SERIES_DEFAULT_MS;
+
 #if defined(WIN32)
 	lws_snprintf((char *)buf, sizeof(buf) - 1, "%s\\conf", d);
 #else
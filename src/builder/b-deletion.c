@@ -36,6 +36,11 @@
 #include <unistd.h>
 #endif
 
+#if defined(__linux__)
+#include <sys/stat.h>
+#include <sys/wait.h>
+#endif
+
 #if defined(__APPLE__)
 #include <sys/stat.h>	/* for mkdir() */
 #endif
@@ -55,6 +60,45 @@
 
 #include "b-private.h"
 
+#if defined(__linux__)
+/*
+ * A build step that was killed may have left its snapshot overlay mounted on
+ * the job's src (see b-snap.c), which we must get rid of before deleting
+ */
+
+static void
+sai_deletion_unmount_snap(const char *job_dir)
+{
+	const char *fm[] = { "fusermount3", "fusermount" };
+	char path[PATH_MAX];
+	struct stat sb;
+	size_t n;
+	int st;
+
+	lws_snprintf(path, sizeof(path), "%s/.snap", job_dir);
+	if (stat(path, &sb))
+		return;
+
+	lws_snprintf(path, sizeof(path), "%s/src", job_dir);
+
+	for (n = 0; n < LWS_ARRAY_SIZE(fm); n++) {
+		pid_t pid = fork();
+
+		if (pid < 0)
+			return;
+
+		if (!pid) {
+			execlp(fm[n], fm[n], "-uz", path, (char *)NULL);
+			_exit(127);
+		}
+
+		if (waitpid(pid, &st, 0) == pid && WIFEXITED(st) &&
+		    WEXITSTATUS(st) != 127)
+			return;
+	}
+}
+#endif
+
 int
 sai_deletion_worker(const char *home_dir)
 {
@@ -112,6 +156,9 @@ sai_deletion_worker(const char *home_dir)
 				memset(&di, 0, sizeof(di));
 				lws_snprintf(full_path, sizeof(full_path),
 					     "%s/jobs/%s", home_dir, line);
+#if defined(__linux__)
+				sai_deletion_unmount_snap(full_path);
+#endif
 
 				di.dirpath = full_path;
 				di.cb = lws_dir_rm_rf_cb;
@@ -195,6 +242,61 @@ scan_jobs_dir_cb(const char *dirpath, void *user, struct lws_dir_entry *lde)
 	return 0;
 }
 
+/*
+ * Is the disk holding home short enough that we should drop things we are
+ * only keeping to go faster, like compiler caches and warm dirs?
+ */
+
+int
+saib_disk_pressure(void)
+{
+#if !defined(WIN32)
+	unsigned int total = saib_get_total_disk_kib(builder.home),
+		     avail = saib_get_free_disk_kib(builder.home);
+
+	return total && (uint64_t)avail * 100 <
+			(uint64_t)total * SAIB_DISK_FREE_MIN_PCT;
+#else
+	return 0;
+#endif
+}
+
+/*
+ * Move the dir at path, which must be on the same fs as home, into jobs/
+ * under a unique name starting with prefix, and have the deletion worker
+ * remove it from there in the background
+ */
+
+int
+saib_evict_dir(const char *path, const char *prefix)
+{
+#if !defined(WIN32)
+	static unsigned int seq;
+	char temp[64], to[512];
+	size_t len;
+
+	/* the deletion worker only accepts names without . / or \ */
+
+	len = (size_t)lws_snprintf(temp, sizeof(temp), "%s-%llu-%u", prefix,
+				   (unsigned long long)lws_now_usecs(), seq++);
+
+	lws_snprintf(to, sizeof(to), "%s/jobs/%s", builder.home, temp);
+
+	if (rename(path, to)) {
+		lwsl_err("%s: unable to move %s aside\n", __func__, path);
+		return 1;
+	}
+
+	temp[len++] = '\n';
+	if (write(builder.pipe_master_wr, temp, len) != (ssize_t)len) {
+		lwsl_err("%s: failed to write to deletion worker\n", __func__);
+		return 1;
+	}
+#endif
+
+	return 0;
+}
+
 void
 sul_cleanup_jobs_cb(lws_sorted_usec_list_t *sul)
 {
@@ -242,6 +344,10 @@ sul_cleanup_jobs_cb(lws_sorted_usec_list_t *sul)
 
 	lwsac_free(&ac);
 
+	saib_ccache_check_pressure();
+	saib_warm_check();
+	saib_snap_check();
+
 	lws_sul_schedule(b->context, 0, &b->sul_cleanup_jobs,
 			 sul_cleanup_jobs_cb, SAI_CLEANUP_JOBS_INTERVAL_US);
 }
@@ -21,6 +21,7 @@
  */
 
 #include <libwebsockets.h>
+#include <string.h>
 #include "b-private.h"
 
 #if defined(__APPLE__)
@@ -33,6 +34,11 @@
 #include <unistd.h>
 #endif
 
+#if defined(__linux__)
+#include <fcntl.h>
+#include <sys/statvfs.h>
+#endif
+
 int
 saib_get_cpu_count(void)
 {
@@ -112,6 +118,35 @@ saib_get_cgroup_cpu(struct sai_nspawn *ns)
 	return ret;
 }
 
+/*
+ * Reread a /proc file from the start on an fd we keep open, opening it the
+ * first time.  We only want the first few lines of these files, so len can be
+ * short.
+ */
+
+static int
+saib_proc_pread(int *pfd, const char *path, char *buf, size_t len)
+{
+	ssize_t n;
+
+	if (*pfd < 0) {
+		*pfd = open(path, O_RDONLY | O_CLOEXEC);
+		if (*pfd < 0)
+			return 1;
+	}
+
+	n = pread(*pfd, buf, len - 1, 0);
+	if (n <= 0) {
+		close(*pfd);
+		*pfd = -1;
+		return 1;
+	}
+
+	buf[n] = '\0';
+
+	return 0;
+}
+
 int
 saib_get_system_cpu(struct sai_builder *b)
 {
@@ -119,18 +154,10 @@ saib_get_system_cpu(struct sai_builder *b)
 	uint64_t total, idle_all, total_delta, idle_delta;
 	int n, ret = 0;
 	char buf[256];
-	FILE *f;
 
-	f = fopen("/proc/stat", "r");
-	if (!f)
+	if (saib_proc_pread(&b->fd_proc_stat, "/proc/stat", buf, sizeof(buf)))
 		return 0;
 
-	if (!fgets(buf, sizeof(buf) -1, f)) {
-		fclose(f);
-		return 0;
-	}
-	fclose(f);
-
 	n = sscanf(buf, "cpu  %llu %llu %llu %llu %llu %llu %llu %llu",
 		   &user, &nice, &system, &idle, &iowait, &irq, &softirq, &steal);
 	if (n < 4)
@@ -244,3 +271,62 @@ int saib_get_system_cpu(struct sai_builder *b)
 	return 10; /* Return a dummy 1% for unsupported platforms */
 }
 #endif
+
+/*
+ * Everything in the load report that describes the machine rather than the
+ * platform is the same for every platform and every server connection, so
+ * it's sampled at most once per report tick and shared.
+ */
+
+const saib_load_sample_t *
+saib_load_sample(struct sai_builder *b)
+{
+	saib_load_sample_t *ls = &b->lsample;
+	lws_usec_t now = lws_now_usecs();
+#if defined(__linux__)
+	unsigned int u;
+	struct statvfs s;
+	char buf[256], *p;
+#endif
+
+	if (ls->taken && now - ls->taken < SAI_LOAD_REPORT_US / 2)
+		return ls;
+
+	if (!ls->taken)
+		ls->core_count = saib_get_cpu_count();
+
+	ls->taken	= now;
+	ls->cpu_percent	= (unsigned int)saib_get_system_cpu(b);
+
+#if defined(__linux__)
+	/* MemTotal is the first line */
+	if (!saib_proc_pread(&b->fd_proc_meminfo, "/proc/meminfo", buf,
+			     sizeof(buf))) {
+		p = strstr(buf, "MemTotal:");
+		if (p && sscanf(p, "MemTotal: %u kB", &u) == 1)
+			ls->total_ram_kib = u;
+	}
+
+	if (!statvfs(b->home, &s))
+		ls->total_disk_kib = (unsigned int)
+				((uint64_t)s.f_blocks * s.f_frsize / 1024);
+#else
+	ls->total_ram_kib	= saib_get_total_ram_kib();
+	ls->total_disk_kib	= saib_get_total_disk_kib(b->home);
+#endif
+
+	return ls;
+}
+
+void
+saib_load_sample_destroy(struct sai_builder *b)
+{
+#if defined(__linux__)
+	if (b->fd_proc_stat >= 0)
+		close(b->fd_proc_stat);
+	if (b->fd_proc_meminfo >= 0)
+		close(b->fd_proc_meminfo);
+	b->fd_proc_stat = b->fd_proc_meminfo = -1;
+#endif
+	memset(&b->lsample, 0, sizeof(b->lsample));
+}
@@ -24,6 +24,10 @@
 
 #if defined(__linux__)
 #include <sys/statvfs.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
 #elif defined(__APPLE__)
 #include <sys/mount.h>
 #include <sys/param.h>
@@ -170,3 +174,247 @@ saib_get_free_disk_kib(const char *path)
 	return 0;
 #endif
 }
+
+/*
+ * Per-step resource time series
+ *
+ * While a step runs, we sample its cgroup every builder.metrics_sample_ms and
+ * keep a downsampled series that goes to the server with the step's build
+ * metric.  It shows whether the step was cpu, io or memory bound, which the
+ * step totals can't.
+ */
+
+#if defined(__linux__)
+
+static int
+saib_series_read(const sai_step_series_t *se, const char *leaf, char *buf,
+		 size_t len)
+{
+	char path[320];
+	ssize_t n;
+	int fd;
+
+	lws_snprintf(path, sizeof(path), "%s/%s", se->cgdir, leaf);
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return 1;
+
+	n = read(fd, buf, len - 1);
+	close(fd);
+	if (n <= 0)
+		return 1;
+
+	buf[n] = '\0';
+
+	return 0;
+}
+
+/*
+ * The spawn put the step in its own cgroup, find out where from the kernel
+ * rather than guessing how lws named it
+ */
+
+static int
+saib_series_find_cgroup(sai_step_series_t *se)
+{
+	char path[64], buf[512], *p, *e;
+	ssize_t n;
+	int fd;
+
+	lws_snprintf(path, sizeof(path), "/proc/%d/cgroup", se->pid);
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return 1;
+
+	n = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (n <= 0)
+		return 1;
+	buf[n] = '\0';
+
+	/* cgroup v2 only has the unified "0::/path" line */
+
+	p = strncmp(buf, "0::", 3) ? strstr(buf, "\n0::") : buf;
+	if (!p)
+		return 1;
+	p += *p == '\n' ? 4 : 3;
+	e = strchr(p, '\n');
+	if (e)
+		*e = '\0';
+
+	lws_snprintf(se->cgdir, sizeof(se->cgdir), "/sys/fs/cgroup%s", p);
+
+	return 0;
+}
+
+static void
+saib_series_push(sai_step_series_t *se)
+{
+	sai_step_series_pt_t *pt;
+	unsigned int n;
+
+	if (!se->acc_n)
+		return;
+
+	if (se->count == SAI_STEP_SERIES_MAX) {
+		/*
+		 * We're full, halve the resolution: merge pairs of points and
+		 * make each point cover twice as many samples from now on
+		 */
+		for (n = 0; n < SAI_STEP_SERIES_MAX / 2; n++) {
+			sai_step_series_pt_t *a = &se->pt[n * 2],
+					     *b = &se->pt[(n * 2) + 1];
+
+			se->pt[n].cpu_cc	= (a->cpu_cc + b->cpu_cc) / 2;
+			se->pt[n].mem_mib	= a->mem_mib > b->mem_mib ?
+						  a->mem_mib : b->mem_mib;
+			se->pt[n].io_kibps	= (a->io_kibps + b->io_kibps) / 2;
+			se->pt[n].psi		= (a->psi + b->psi) / 2;
+		}
+		se->count	= SAI_STEP_SERIES_MAX / 2;
+		se->stride	*= 2;
+	}
+
+	pt		= &se->pt[se->count++];
+	pt->cpu_cc	= se->acc.cpu_cc / se->acc_n;
+	pt->mem_mib	= se->acc.mem_mib;
+	pt->io_kibps	= se->acc.io_kibps / se->acc_n;
+	pt->psi		= se->acc.psi / se->acc_n;
+
+	memset(&se->acc, 0, sizeof(se->acc));
+	se->acc_n	= 0;
+}
+
+static void
+saib_series_sample(sai_step_series_t *se)
+{
+	uint64_t cpu = 0, io = 0, mem = 0, v, dt;
+	unsigned int a = 0, b = 0;
+	lws_usec_t now;
+	char buf[2048];
+	const char *p;
+
+	if (!se->cgdir[0] && saib_series_find_cgroup(se))
+		return;
+
+	if (!saib_series_read(se, "cpu.stat", buf, sizeof(buf))) {
+		p = strstr(buf, "usage_usec ");
+		if (p)
+			cpu = strtoull(p + 11, NULL, 10);
+	}
+
+	if (!saib_series_read(se, "memory.current", buf, sizeof(buf)))
+		mem = strtoull(buf, NULL, 10);
+
+	/* one line per device, "8:0 rbytes=N wbytes=N rios=N ..." */
+
+	if (!saib_series_read(se, "io.stat", buf, sizeof(buf))) {
+		p = buf;
+		while ((p = strstr(p, "bytes="))) {
+			if (p > buf && (p[-1] == 'r' || p[-1] == 'w')) {
+				v = strtoull(p + 6, NULL, 10);
+				io += v;
+			}
+			p += 6;
+		}
+	}
+
+	if (!saib_series_read(se, "memory.pressure", buf, sizeof(buf)))
+		if (sscanf(buf, "some avg10=%u.%u", &a, &b) != 2)
+			a = b = 0;
+
+	now = lws_now_usecs();
+
+	if (se->last_us && now > se->last_us) {
+		dt = (uint64_t)(now - se->last_us);
+
+		if (cpu >= se->last_cpu_usec)
+			se->acc.cpu_cc += (uint32_t)
+				(((cpu - se->last_cpu_usec) * 100) / dt);
+		if (io >= se->last_io_bytes)
+			se->acc.io_kibps += (uint32_t)
+				(((io - se->last_io_bytes) * LWS_US_PER_SEC) /
+								(dt * 1024));
+		if ((uint32_t)(mem >> 20) > se->acc.mem_mib)
+			se->acc.mem_mib = (uint32_t)(mem >> 20);
+		se->acc.psi += (a * 10) + (b / 10);
+
+		if (++se->acc_n == se->stride)
+			saib_series_push(se);
+	}
+
+	se->last_cpu_usec	= cpu;
+	se->last_io_bytes	= io;
+	se->last_us		= now;
+}
+
+static void
+saib_series_cb(lws_sorted_usec_list_t *sul)
+{
+	struct sai_nspawn *ns = lws_container_of(sul, struct sai_nspawn,
+						 sul_series);
+
+	if (!ns->op || !ns->op->lsp)
+		return;
+
+	saib_series_sample(&ns->series);
+
+	lws_sul_schedule(builder.context, 0, &ns->sul_series, saib_series_cb,
+			 (lws_usec_t)builder.metrics_sample_ms * LWS_US_PER_MS);
+}
+#endif
+
+void
+saib_series_start(struct sai_nspawn *ns, int pid)
+{
+	memset(&ns->series, 0, sizeof(ns->series));
+	ns->series.stride	= 1;
+	ns->series.pid		= pid;
+
+#if defined(__linux__)
+	if (!builder.metrics_sample_ms || pid <= 0)
+		return;
+
+	/* take the baseline now */
+	saib_series_sample(&ns->series);
+
+	lws_sul_schedule(builder.context, 0, &ns->sul_series, saib_series_cb,
+			 (lws_usec_t)builder.metrics_sample_ms * LWS_US_PER_MS);
+#endif
+}
+
+void
+saib_series_stop(struct sai_nspawn *ns)
+{
+	lws_sul_cancel(&ns->sul_series);
+}
+
+/*
+ * Flush whatever we collected for the step into the metric as
+ * "cpu,mem,io,psi;..." with series_ms per point
+ */
+
+void
+saib_series_to_metric(struct sai_nspawn *ns, sai_build_metric_t *m)
+{
+	sai_step_series_t *se = &ns->series;
+	size_t o = 0;
+	unsigned int n;
+
+	saib_series_stop(ns);
+
+#if defined(__linux__)
+	saib_series_push(se);
+#endif
+
+	m->series[0]	= '\0';
+	m->series_ms	= builder.metrics_sample_ms * se->stride;
+
+	for (n = 0; n < se->count && sizeof(m->series) - o > 48; n++)
+		o += (size_t)lws_snprintf(m->series + o, sizeof(m->series) - o,
+				"%s%u,%u,%u,%u", n ? ";" : "",
+				se->pt[n].cpu_cc, se->pt[n].mem_mib,
+				se->pt[n].io_kibps, se->pt[n].psi);
+}
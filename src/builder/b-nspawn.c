@@ -85,7 +85,8 @@ saib_log_chunk_create(struct sai_nspawn *ns, void *buf, size_t len, int channel)
 	lj[LWS_PRE + n++] = '}';
 	lj[LWS_PRE + n] = '\0';
 
-	return saib_srv_queue_tx(ns->spm->ss, lj + LWS_PRE, (size_t)n, LWSSS_FLAG_SOM | LWSSS_FLAG_EOM);
+	return saib_srv_queue_tx(ns->spm->ss, lj + LWS_PRE, (size_t)n,
+				 LWSSS_FLAG_SOM | LWSSS_FLAG_EOM, SAIB_TXQ_LOGS);
 }
 
 static int
@@ -172,6 +173,9 @@ sai_lsp_reap_cb(void *opaque, const lws_spawn_resource_us_t *res, siginfo_t *si,
 	char s[256];
 	int n;
 
+	if (ns)
+		saib_series_stop(ns);
+
 	saib_log_chunk_create(ns, ">saib> <=== Reaping build process\n", 34, 3);
 
 #if !defined(WIN32)
@@ -286,10 +290,20 @@ sai_lsp_reap_cb(void *opaque, const lws_spawn_resource_us_t *res, siginfo_t *si,
 	m.stg_bytes	= du.size_in_bytes;
 	m.parallel	= ns->task->parallel;
 	m.step		= ns->task->build_step + 1;
+	saib_series_to_metric(ns, &m);
+	saib_ccache_to_metric(ns, &m);
+
+	if (m.cc_hits || m.cc_misses) {
+		n = lws_snprintf(s, sizeof(s),
+			 ">saib> Step %d: compiler cache %u hits, %u misses\n",
+			 m.step, m.cc_hits, m.cc_misses);
+		saib_log_chunk_create(ns, s, (size_t)n, 3);
+	}
 
 	if (saib_srv_queue_json_fragments_helper(ns->spm->ss,
 					lsm_schema_map_build_metric,
-					LWS_ARRAY_SIZE(lsm_schema_build_metric), &m))
+					LWS_ARRAY_SIZE(lsm_schema_build_metric), &m,
+					SAIB_TXQ_STATUS))
 		return;
 
 skip:
@@ -421,9 +435,12 @@ static const char * const runscript_first =
 	"export SAI_LOGPROXY=%s\n"
 	"export SAI_LOGPROXY_TTY0=%s\n"
 	"export SAI_LOGPROXY_TTY1=%s\n"
+	"%s" /* warm dir and compiler cache setup, if any */
 	"set -e\n"
 	"cd %s/jobs/$SAI_VN\n"
-	"rm -rf src\n"
+	/* src may be a snapshot overlay left from an earlier run, see b-snap.c */
+	"(fusermount3 -uz src || fusermount -uz src) > /dev/null 2>&1 || true\n"
+	"rm -rf src .snap\n"
 	"%s < /dev/null\n"
 	"exit $?\n"
 ;
@@ -446,6 +463,7 @@ static const char * const runscript_next =
 	"export SAI_LOGPROXY=%s\n"
 	"export SAI_LOGPROXY_TTY0=%s\n"
 	"export SAI_LOGPROXY_TTY1=%s\n"
+	"%s"
 	"set -e\n"
 	"cd %s/jobs/$SAI_VN\n"
 	"%s < /dev/null\n"
@@ -470,6 +488,7 @@ static const char * const runscript_build =
 	"export SAI_LOGPROXY=%s\n"
 	"export SAI_LOGPROXY_TTY0=%s\n"
 	"export SAI_LOGPROXY_TTY1=%s\n"
+	"%s"
 	"set -e\n"
 	"cd %s/jobs/$SAI_VN/src\n"
 	"%s < /dev/null\n"
@@ -497,7 +516,11 @@ saib_spawn_script(struct sai_nspawn *ns)
 		NULL
 	};
 	char one_step[4096];
-	char st[2048];
+	char st[6144];
+#if !defined(WIN32)
+	char step_env[2048];
+	size_t sl;
+#endif
 	int fd, n;
 #if defined(__linux__)
 	int in_cgroup = 1;
@@ -559,12 +582,22 @@ saib_spawn_script(struct sai_nspawn *ns)
 		break;
 	}
 
+	saib_warm_env(ns, step_env, sizeof(step_env));
+	sl = strlen(step_env);
+	saib_snap_env(ns, step_env + sl, sizeof(step_env) - sl);
+	if (ns->task->build_step >= 2) {
+		sl = strlen(step_env);
+		if (ns->task->build_step == 2)
+			saib_ccache_check_pressure();
+		saib_ccache_env(ns, step_env + sl, sizeof(step_env) - sl);
+	}
+
 	n = lws_snprintf(st, sizeof(st), script_template,
 			 builder.home, ns->fsm.ovname, ns->inp_vn,
 			 ns->project_name, ns->ref, ns->instance_ordinal + 1,
 			 ns->task->parallel ? ns->task->parallel : 1,
 			 respath, ns->slp_control.sockpath,
-			 ns->slp[0].sockpath, ns->slp[1].sockpath,
+			 ns->slp[0].sockpath, ns->slp[1].sockpath, step_env,
 			 builder.home, one_step);
 #endif
 
@@ -629,6 +662,13 @@ saib_spawn_script(struct sai_nspawn *ns)
 		return 1;
 	}
 
+#if defined(__linux__)
+	if (in_cgroup)
+		saib_series_start(ns, (int)lws_spawn_get_pid(op->lsp));
+	else
+#endif
+		saib_series_start(ns, 0);
+
 	return 0;
 }
 
@@ -170,6 +170,13 @@ saib_reassess_idle_situation()
 
 	} lws_end_foreach_dll_safe(mp, mp1);
 
+	/* artifacts still waiting to get to the server count too */
+
+	if (builder.upload_owner.count) {
+		lws_sul_cancel(&builder.sul_idle);
+		in_use = 1;
+	}
+
 	if (in_use) {
 		lwsl_warn("%s: cancelling idle grace time as ongoing task steps\n", __func__);
 
@@ -420,7 +427,7 @@ sul_idle_cb(lws_sorted_usec_list_t *sul)
 			if (saib_srv_queue_json_fragments_helper(spm->ss,
 					lsm_schema_map_plat,
 					LWS_ARRAY_SIZE(lsm_schema_map_plat),
-					&builder.sai_plat_owner))
+					&builder.sai_plat_owner, SAIB_TXQ_CONTROL))
 				return;
 
 		} lws_end_foreach_dll(d);
@@ -537,6 +544,9 @@ saib_need_wakelock(void)
 
 	} lws_end_foreach_dll(d);
 
+	if (builder.upload_owner.count) /* artifacts still uploading */
+		r = 1;
+
 	if (builder.stay) /* there's a manual stay */
 		r = 1;
 
@@ -0,0 +1,272 @@
+/*
+ * sai-builder
+ *
+ * Copyright (C) 2019 - 2025 Andy Green <andy@warmcat.com>
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation:
+ *  version 2.1 of the License.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *  MA  02110-1301  USA
+ *
+ * When sai-server ingests a new event, it hints the builders offering its
+ * platforms that repo@hash is coming.  We warm our git mirror with it in the
+ * background using the git helper's prefetch op, one at a time, so when the
+ * task arrives its mirror step finds the ref already there and is a no-op,
+ * instead of every builder hitting the remote at the moment the builds start.
+ *
+ * The helper drops its own cpu and io priority before fetching.  It doesn't
+ * take the mirror lock the mirror step uses, since a task that arrives while
+ * we are still fetching at idle priority would be stuck behind us.  Instead
+ * it fetches into its own refs/sai-prefetch/<hash>, which the mirror step
+ * also accepts as having the hash.  Until we finish, the task just does its
+ * own fetch as it would have without us.
+ */
+
+#include <libwebsockets.h>
+#include <string.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <fcntl.h>
+
+#if defined(__linux__) || defined(__APPLE__)
+#include <unistd.h>
+#endif
+
+#include "b-private.h"
+
+extern const char *git_helper_sh;
+
+#if !defined(WIN32)
+
+static int
+callback_sai_prefetch_stdwsi(struct lws *wsi, enum lws_callback_reasons reason,
+			     void *user, void *in, size_t len)
+{
+	uint8_t buf[256];
+	int ilen;
+
+	switch (reason) {
+
+	case LWS_CALLBACK_RAW_CLOSE_FILE:
+		if (builder.lsp_prefetch)
+			lws_spawn_stdwsi_closed(builder.lsp_prefetch, wsi);
+		break;
+
+	case LWS_CALLBACK_RAW_RX_FILE:
+		ilen = (int)read((int)(intptr_t)lws_get_socket_fd(wsi), buf,
+				 sizeof(buf));
+		if (ilen < 1)
+			return -1;
+
+		lwsl_debug("%s: %.*s\n", __func__, ilen, buf);
+		break;
+
+	default:
+		break;
+	}
+
+	return 0;
+}
+
+#endif
+
+struct lws_protocols protocol_prefetch_stdxxx =
+#if !defined(WIN32)
+		{ "sai-prefetch-stdxxx", callback_sai_prefetch_stdwsi, 0, 0 };
+#else
+		{ "sai-prefetch-stdxxx", lws_callback_http_dummy, 0, 0 };
+#endif
+
+#if !defined(WIN32)
+
+static void
+saib_prefetch_reap_cb(void *opaque, const lws_spawn_resource_us_t *res,
+		      siginfo_t *si, int we_killed_him)
+{
+	sai_prefetch_t *pf = (sai_prefetch_t *)opaque;
+
+	if (we_killed_him)
+		lwsl_notice("%s: prefetch of %s %s timed out\n", __func__,
+			    pf->mirror, pf->hash);
+	else
+		if (si->si_code == CLD_EXITED && !si->si_status)
+			lwsl_info("%s: mirror %s has %s\n", __func__,
+				  pf->mirror, pf->hash);
+		else
+			lwsl_notice("%s: prefetch of %s %s failed\n", __func__,
+				    pf->mirror, pf->hash);
+
+	free(pf);
+	builder.prefetch_running = NULL;
+
+	/* don't start the next one from inside the reap */
+
+	lws_sul_schedule(builder.context, 0, &builder.sul_prefetch,
+			 saib_prefetch_cb, 1);
+}
+
+/*
+ * Takes ownership of pf
+ */
+
+static int
+saib_prefetch_spawn(sai_prefetch_t *pf)
+{
+	struct lws_spawn_piped_info info;
+	char path[256], home[280];
+	const char *cmd[] = {
+		"/bin/bash", path, "prefetch", pf->repo_url, pf->ref,
+		pf->hash, pf->mirror, NULL
+	};
+	const char *env[] = {
+		"PATH=/usr/local/bin:/usr/bin:/bin",
+		"LANG=en_US.UTF-8",
+		home,
+		NULL
+	};
+	size_t l = strlen(git_helper_sh);
+	int fd;
+
+	/* keep the helper in home up to date with the one we'd use in jobs */
+
+	lws_snprintf(path, sizeof(path), "%s/git_helper.sh", builder.home);
+	lws_snprintf(home, sizeof(home), "HOME=%s", builder.home);
+
+	fd = open(path, O_CREAT | O_TRUNC | O_WRONLY, 0755);
+	if (fd < 0) {
+		lwsl_warn("%s: unable to open %s\n", __func__, path);
+		goto bail;
+	}
+	if ((size_t)write(fd, git_helper_sh, l) != l) {
+		lwsl_warn("%s: failed to write %s\n", __func__, path);
+		close(fd);
+		goto bail;
+	}
+	close(fd);
+
+	memset(&info, 0, sizeof(info));
+	info.vh			= builder.vhost;
+	info.env_array		= env;
+	info.exec_array		= cmd;
+	info.protocol_name	= "sai-prefetch-stdxxx";
+	info.max_log_lines	= 1000;
+	info.timeout_us		= SAIB_PREFETCH_TIMEOUT_US;
+	info.reap_cb		= saib_prefetch_reap_cb;
+	info.opaque		= pf;
+	info.owner		= &builder.lsp_owner;
+	info.plsp		= &builder.lsp_prefetch;
+
+	builder.prefetch_running = pf;
+
+	if (!lws_spawn_piped(&info)) {
+		/*
+		 * pf may already have gone with the reap cb, we can't free it
+		 * here
+		 */
+		builder.prefetch_running = NULL;
+		lwsl_warn("%s: spawn failed\n", __func__);
+
+		return 1;
+	}
+
+	lwsl_info("%s: warming %s with %s\n", __func__, pf->mirror, pf->hash);
+
+	return 0;
+
+bail:
+	free(pf);
+
+	return 1;
+}
+
+#endif
+
+void
+saib_prefetch_cb(lws_sorted_usec_list_t *sul)
+{
+#if !defined(WIN32)
+	sai_prefetch_t *pf;
+
+	while (!builder.prefetch_running && builder.prefetch_owner.head) {
+		pf = lws_container_of(builder.prefetch_owner.head,
+				      sai_prefetch_t, list);
+		lws_dll2_remove(&pf->list);
+
+		saib_prefetch_spawn(pf);
+	}
+#endif
+}
+
+/*
+ * A prefetch hint arrived from a server.  We take a copy, since the
+ * deserialization ac won't outlive the rx
+ */
+
+void
+saib_prefetch_hint(const sai_prefetch_t *hint)
+{
+#if !defined(WIN32)
+	sai_prefetch_t *pf;
+
+	if (!hint->repo_url[0] || !hint->hash[0] || !hint->mirror[0] ||
+	    strchr(hint->mirror, '/') || hint->mirror[0] == '.')
+		return;
+
+	if (builder.prefetch_running &&
+	    !strcmp(builder.prefetch_running->hash, hint->hash) &&
+	    !strcmp(builder.prefetch_running->mirror, hint->mirror))
+		return;
+
+	lws_start_foreach_dll(struct lws_dll2 *, p, builder.prefetch_owner.head) {
+		pf = lws_container_of(p, sai_prefetch_t, list);
+
+		if (!strcmp(pf->hash, hint->hash) &&
+		    !strcmp(pf->mirror, hint->mirror))
+			return;
+	} lws_end_foreach_dll(p);
+
+	if (builder.prefetch_owner.count >= SAIB_PREFETCH_MAX_QUEUED) {
+		lwsl_notice("%s: dropping hint for %s, queue full\n", __func__,
+			    hint->hash);
+		return;
+	}
+
+	pf = malloc(sizeof(*pf));
+	if (!pf)
+		return;
+
+	*pf = *hint;
+	memset(&pf->list, 0, sizeof(pf->list));
+	lws_dll2_add_tail(&pf->list, &builder.prefetch_owner);
+
+	lws_sul_schedule(builder.context, 0, &builder.sul_prefetch,
+			 saib_prefetch_cb, 1);
+#endif
+}
+
+/*
+ * At exit, drop any hints we didn't get to.  A prefetch that is still running
+ * is reaped with the other spawns, its reap cb frees it.
+ */
+
+void
+saib_prefetch_destroy(void)
+{
+	lws_sul_cancel(&builder.sul_prefetch);
+
+	lws_start_foreach_dll_safe(struct lws_dll2 *, p, p1,
+				   builder.prefetch_owner.head) {
+		lws_dll2_remove(p);
+		free(lws_container_of(p, sai_prefetch_t, list));
+	} lws_end_foreach_dll_safe(p, p1);
+}
@@ -76,14 +76,40 @@ struct saib_opaque_spawn {
 };
 
 #define SAI_LOAD_REPORT_US			(1 * LWS_US_PER_SEC)
+#define SAI_LOAD_REPORT_MAX_US			(8 * LWS_US_PER_SEC)
+#define SAI_LOAD_REPORT_FULL_US			(30 * LWS_US_PER_SEC)
+#define SAI_LOAD_REPORT_CPU_HYST		20 /* 2.0% */
+#define SAIB_SERIES_DEFAULT_MS			1000
 #define SAI_IDLE_GRACE_US			(30 * LWS_US_PER_SEC)
 #define SAI_STAY_POLL_US			(20 * LWS_US_PER_SEC)
 #define SAI_CLEANUP_JOBS_INTERVAL_US		(60 * 60 * LWS_US_PER_SEC)
 #define SAI_CLEANUP_JOB_DIR_MIN_AGE_SECS	(24ull * 3600u)
+#define SAIB_TXQ_MEM_LIMIT			(4u * 1024u * 1024u)
+#define SAIB_TXQ_UNSPILL_BUDGET			(256u * 1024u)
+#define SAIB_PREFETCH_MAX_QUEUED		16
+#define SAIB_PREFETCH_TIMEOUT_US		(20 * 60 * LWS_US_PER_SEC)
+#define SAIB_DISK_FREE_MIN_PCT			10 /* evict caches below this */
+#define SAIB_CCACHE_STATSLOG			".ccache-stats"
+#define SAIB_WARM_IDLE_SECS			(3 * 24 * 3600)
+#define SAIB_WARM_CLAIM_LAPSE_SECS		(6 * 3600) /* task lost midway */
+#define SAIB_SNAP_IDLE_SECS			(2 * SAI_CLEANUP_JOB_DIR_MIN_AGE_SECS)
 
 
 struct saib_ws_pss;
 
+/*
+ * Machine-level numbers for the load reports, sampled at most once per report
+ * tick and shared by every platform and server connection
+ */
+
+typedef struct saib_load_sample {
+	lws_usec_t		taken;
+	int			core_count;
+	unsigned int		total_ram_kib;
+	unsigned int		total_disk_kib;
+	unsigned int		cpu_percent;
+} saib_load_sample_t;
+
 enum nsstate {
 	NSSTATE_INIT,
 	NSSTATE_MOUNTING,
@@ -93,6 +119,59 @@ enum nsstate {
 	NSSTATE_FAILED,
 };
 
+/*
+ * Artifacts are moved out of the task dir into .sai-uploads and queued here,
+ * so the task can be destroyed (and the slot reused) without waiting for the
+ * upload.  The queue entry outlives any one upload connection, so we can
+ * resume from where the server says it got to if the connection fails.
+ */
+
+#define SAIB_ARTIFACT_UPLOADS_MAX	2	/* concurrent uploads */
+#define SAIB_ARTIFACT_CHUNK		(1024u * 1024u)
+#define SAIB_ARTIFACT_RETRIES_MAX	30
+#define SAIB_ARTIFACT_PREP_SLICE	(1024u * 1024u) /* per event loop turn */
+
+/*
+ * Before uploading, we hash the artifact so the server can tell us if it
+ * already has it, and gzip it alongside if that's worth doing.  That's done a
+ * slice at a time from the event loop, so big artifacts don't stall it.
+ */
+
+typedef struct saib_upload {
+	lws_dll2_t		list; /* builder.upload_owner */
+	lws_sorted_usec_list_t	sul_retry; /* also steps the preparation */
+
+	struct lws_ss_handle	*ss; /* NULL if not connected */
+	sai_artifact_t		meta; /* sent as the artifact JSON */
+
+	struct lws_genhash_ctx	hash_ctx; /* while preparing */
+	void			*zs; /* z_stream, while compressing */
+
+	char			url[256];
+	char			path[256];
+	char			path_gz[264];
+
+	int			fd_in;
+	int			fd_gz;
+	int			retries;
+	unsigned int		active:1;
+	unsigned int		done:1;
+	unsigned int		preparing:1;
+} saib_upload_t;
+
+/* user object for the SS doing one connection's worth of upload */
+
+typedef struct {
+	struct lws_ss_handle	*ss;
+	void			*opaque_data; /* saib_upload_t */
+
+	saib_upload_t		*up;
+	uint64_t		ofs; /* next file offset to send */
+	uint64_t		chunk_end;
+	int			fd;
+	uint8_t			state; /* SAIB_UPS_ */
+} saib_upload_ss_t;
+
 /*
  * This represents this builder process as a whole
  */
@@ -102,6 +181,12 @@ struct sai_builder {
 	lws_dll2_owner_t	sai_plat_server_owner; /* servers we connect to */
 	lws_dll2_owner_t	devices_owner; /* sai_serial_t */
 	lws_dll2_owner_t	lsp_owner; /* list of lws_spawn_piped */
+	lws_dll2_owner_t	upload_owner; /* saib_upload_t */
+	lws_dll2_owner_t	prefetch_owner; /* sai_prefetch_t waiting */
+	lws_dll2_owner_t	warm_claim_owner; /* saib_warm_claim_t */
+
+	struct lws_spawn_piped	*lsp_prefetch;
+	sai_prefetch_t		*prefetch_running;
 
 	struct lws_ss_handle	*ss_stay;
 	struct lws_ss_handle	*ss_power_off;
@@ -118,6 +203,7 @@ struct sai_builder {
 	lws_sorted_usec_list_t	sul_do_shutdown;
 	lws_sorted_usec_list_t	sul_stay;
 	lws_sorted_usec_list_t	sul_cleanup_jobs;
+	lws_sorted_usec_list_t	sul_prefetch;
 
 #if defined(__APPLE__)
 	lws_sorted_usec_list_t	sul_release_wakelock;
@@ -127,6 +213,9 @@ struct sai_builder {
 	const char		*metrics_uri;
 	const char		*metrics_path;
 	const char		*metrics_secret;
+	unsigned int		metrics_sample_ms; /* step series, 0 = off */
+	unsigned int		compiler_cache_mib; /* per platform, 0 = off */
+	unsigned int		checkout_snapshots; /* overlays over snap/ */
 
 	const char		*url_sai_power;
 	const char		*power_controller_name;
@@ -146,6 +235,14 @@ struct sai_builder {
 
 	char			path[256];
 
+	saib_load_sample_t	lsample;
+
+#if defined(__linux__)
+	/* kept open and reread with pread() for load sampling */
+	int			fd_proc_stat;
+	int			fd_proc_meminfo;
+#endif
+
 #if defined(__linux__) || defined(__APPLE__)
 	/* For system-wide load calculation */
 	uint64_t		last_sys_total;
@@ -158,6 +255,8 @@ struct sai_builder {
 #endif
 	char			stay;
 
+	int			uploads_active;
+
 	/* resource management */
 
 	uint64_t		ram_limit_kib;
@@ -237,6 +336,16 @@ saib_task_destroy(struct sai_nspawn *ns);
 void
 saib_task_grace(struct sai_nspawn *ns);
 
+int
+saib_artifact_queue(struct sai_nspawn *ns, const char *path,
+		    const char *filename);
+
+void
+saib_artifact_queue_destroy(void);
+
+void
+saib_artifact_queue_restore(void);
+
 int
 saib_log_chunk_create(struct sai_nspawn *ns, void *buf, size_t len, int channel);
 
@@ -259,12 +368,21 @@ saib_handle_resource_result(struct sai_plat_server *spm, const char *in, size_t
 void
 saib_sul_load_report_cb(struct lws_sorted_usec_list *sul);
 
+void
+saib_load_report_force_full(struct sai_plat_server *spm);
+
 int
 saib_get_cgroup_cpu(struct sai_nspawn *ns);
 
 int
 saib_get_system_cpu(struct sai_builder *b);
 
+const saib_load_sample_t *
+saib_load_sample(struct sai_builder *b);
+
+void
+saib_load_sample_destroy(struct sai_builder *b);
+
 int saib_get_cpu_count(void);
 
 unsigned int
@@ -279,16 +397,71 @@ saib_get_free_disk_kib(const char *path);
 unsigned int
 saib_get_total_disk_kib(const char *path);
 
+void
+saib_series_start(struct sai_nspawn *ns, int pid);
+
+void
+saib_series_stop(struct sai_nspawn *ns);
+
+void
+saib_series_to_metric(struct sai_nspawn *ns, sai_build_metric_t *m);
+
+void
+saib_ccache_env(struct sai_nspawn *ns, char *buf, size_t len);
+
+void
+saib_ccache_to_metric(struct sai_nspawn *ns, sai_build_metric_t *m);
+
+void
+saib_ccache_check_pressure(void);
+
+void
+saib_plat_dirname(const sai_plat_t *sp, char *name, size_t len);
+
+int
+saib_disk_pressure(void);
+
+int
+saib_evict_dir(const char *path, const char *prefix);
+
+void
+saib_warm_env(struct sai_nspawn *ns, char *buf, size_t len);
+
+void
+saib_warm_refresh(void);
+
+void
+saib_warm_step_end(struct sai_nspawn *ns);
+
+void
+saib_warm_check(void);
+
+void
+saib_snap_env(struct sai_nspawn *ns, char *buf, size_t len);
+
+void
+saib_snap_check(void);
+
+void
+saib_prefetch_hint(const sai_prefetch_t *hint);
+
+void
+saib_prefetch_cb(lws_sorted_usec_list_t *sul);
+
+void
+saib_prefetch_destroy(void);
+
 int
 saib_create_listen_uds(struct lws_context *context, struct saib_logproxy *lp, struct lws_vhost **);
 
 int
-saib_srv_queue_tx(struct lws_ss_handle *h, void *buf, size_t len, unsigned int ss_flags);
+saib_srv_queue_tx(struct lws_ss_handle *h, void *buf, size_t len,
+		  unsigned int ss_flags, int cls);
 
 int
 saib_srv_queue_json_fragments_helper(struct lws_ss_handle *h,
 				     const lws_struct_map_t *map,
-                                     size_t map_entries, void *object);
+                                     size_t map_entries, void *object, int cls);
 
 int
 saib_queue_task_status_update(sai_plat_t *sp, struct sai_plat_server *spm,
@@ -97,6 +97,7 @@ struct sai_builder builder;
 
 extern struct lws_protocols protocol_stdxxx;
 extern struct lws_protocols protocol_suspender_stdxxx;
+extern struct lws_protocols protocol_prefetch_stdxxx;
  
 static const char * const default_ss_policy =
 	"{"
@@ -189,6 +190,7 @@ static const struct lws_protocols *pprotocols[] = {
 	&protocol_logproxy,
 	&protocol_resproxy,
 	&protocol_suspender_stdxxx,
+	&protocol_prefetch_stdxxx,
 #if defined(LWS_WITH_SYS_METRICS) && defined(LWS_WITH_PLUGINS_BUILTIN)
 	&lws_openmetrics_export_protocols[LWSOMPROIDX_PROX_WS_CLIENT],
 #else
@@ -420,6 +422,7 @@ void sigint_handler(int sig)
 void
 sai_ns_destroy(struct sai_nspawn *ns)
 {
+	saib_series_stop(ns);
 	lws_dll2_remove(&ns->list);
 	free(ns);
 }
@@ -544,6 +547,12 @@ saib_app_run(int argc, const char **argv)
 	chown(UDS_PATHNAME_RESPROXY, sb.st_uid, sb.st_gid);
 #endif
 
+#if defined(__linux__)
+	/* opened on first use by the load sampling */
+	builder.fd_proc_stat	= -1;
+	builder.fd_proc_meminfo	= -1;
+#endif
+
 	/* if we don't do this, libgit2 looks in /root/.gitconfig */
 #if defined(WIN32)
 	_putenv_s("HOME", builder.home);
@@ -613,6 +622,7 @@ saib_app_run(int argc, const char **argv)
 	}
 
 	saib_power_init();
+	saib_artifact_queue_restore();
 
 #if defined(__linux__)
 	if (//builder.power_off_type &&
@@ -662,9 +672,12 @@ bail:
 
 	} lws_end_foreach_dll_safe(mp, mp1);
 
+	saib_artifact_queue_destroy();
 	saib_config_destroy(&builder);
 
 	lws_sul_cancel(&builder.sul_idle);
+	saib_load_sample_destroy(&builder);
+	saib_prefetch_destroy();
 
 	lws_context_destroy(builder.context);
 
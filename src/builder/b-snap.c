@@ -0,0 +1,203 @@
+/*
+ * sai-builder
+ *
+ * Copyright (C) 2019 - 2025 Andy Green <andy@warmcat.com>
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation:
+ *  version 2.1 of the License.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *  MA  02110-1301  USA
+ *
+ * The same commit is usually built by many tasks on one builder, one for
+ * each configuration x platform variant, and each checks it out for itself.
+ *
+ * If "checkout_snapshots" is set in the builder conf, on Linux the checkout
+ * step makes a pristine checkout of the commit once, under
+ * ~/snap/<mirror>/<hash>, and the job's src is a fuse-overlayfs mount over
+ * it, with the job's changes going to .snap/upper in the job dir.  The
+ * builder runs unprivileged, so the kernel overlayfs isn't available to us.
+ * If fuse-overlayfs isn't installed, or can't mount, the git helper falls
+ * back to a normal checkout.
+ *
+ * The overlay is only mounted while a build step runs, the step's script
+ * mounts it at the start and unmounts it when it exits, so there's nothing
+ * left mounted for the deletion worker to trip over, or fuse daemons hanging
+ * around for finished tasks.
+ *
+ * Snapshots nothing used for SAIB_SNAP_IDLE_SECS are dropped, and if the disk
+ * is getting short, the least recently used one older than a day.
+ */
+
+#include <libwebsockets.h>
+#include <string.h>
+#include <stdlib.h>
+
+#if !defined(WIN32)
+#include <unistd.h>
+#include <sys/stat.h>
+#endif
+
+#include "b-private.h"
+
+/*
+ * The runscript lines for ns' step to do with snapshots, into buf.  At the
+ * checkout step, that's telling the git helper where they live, and at the
+ * build steps, mounting the overlay if the checkout made one.  This runs
+ * before the script's set -e, so a snapshot evicted from under us or a
+ * failed mount has to fail the step explicitly.  buf is left empty if we're
+ * not using them.
+ */
+
+void
+saib_snap_env(struct sai_nspawn *ns, char *buf, size_t len)
+{
+	buf[0] = '\0';
+
+#if defined(__linux__)
+	if (!builder.checkout_snapshots || !ns->task || !ns->task->build_step)
+		return;
+
+	if (ns->task->build_step == 1) {
+		lws_snprintf(buf, len, "export SAI_SNAP=%s/snap\n",
+			     builder.home);
+		return;
+	}
+
+	lws_snprintf(buf, len,
+		"SAI_JOB=%s/jobs/$SAI_VN\n"
+		"if [ -f $SAI_JOB/.snap/lower ]; then\n"
+		"  SAI_LOWER=\"$(cat $SAI_JOB/.snap/lower)\"\n"
+		"  if [ ! -d \"$SAI_LOWER\" ]; then\n"
+		"    echo \"checkout snapshot $SAI_LOWER is gone, rebuild\"\n"
+		"    exit 1\n"
+		"  fi\n"
+		"  touch \"$SAI_LOWER\"\n"
+		"  if ! fuse-overlayfs -o \"lowerdir=$SAI_LOWER,"
+			"upperdir=$SAI_JOB/.snap/upper,"
+			"workdir=$SAI_JOB/.snap/work\" $SAI_JOB/src; then\n"
+		"    echo \"unable to mount checkout snapshot on $SAI_JOB/src\"\n"
+		"    exit 1\n"
+		"  fi\n"
+		"  trap 'cd /; (fusermount3 -uz $SAI_JOB/src || "
+			"fusermount -uz $SAI_JOB/src) > /dev/null 2>&1' EXIT\n"
+		"fi\n", builder.home);
+#endif
+}
+
+#if defined(__linux__)
+
+static int
+saib_snap_in_use(const char *hash)
+{
+	lws_start_foreach_dll(struct lws_dll2 *, d, builder.sai_plat_owner.head) {
+		sai_plat_t *sp = lws_container_of(d, sai_plat_t, sai_plat_list);
+
+		lws_start_foreach_dll(struct lws_dll2 *, p,
+				      sp->nspawn_owner.head) {
+			struct sai_nspawn *ns = lws_container_of(p,
+						struct sai_nspawn, list);
+
+			if (ns->hash && !strcmp(ns->hash, hash))
+				return 1;
+		} lws_end_foreach_dll(p);
+	} lws_end_foreach_dll(d);
+
+	return 0;
+}
+
+struct saib_snap_check {
+	char			lru[384];
+	time_t			lru_mtime;
+};
+
+static int
+saib_snap_hash_cb(const char *dirpath, void *user, struct lws_dir_entry *lde)
+{
+	struct saib_snap_check *sc = (struct saib_snap_check *)user;
+	char path[512];
+	struct stat sb;
+
+	/* .tmp and .lock are snapshots still being made */
+
+	if (lde->type != LDOT_DIR || strchr(lde->name, '.') ||
+	    saib_snap_in_use(lde->name))
+		return 0;
+
+	lws_snprintf(path, sizeof(path), "%s/%s", dirpath, lde->name);
+	if (stat(path, &sb))
+		return 0;
+
+	if ((uint64_t)(lws_now_secs() - (unsigned long)sb.st_mtime) >
+							SAIB_SNAP_IDLE_SECS) {
+		lwsl_notice("%s: dropping snapshot %s\n", __func__, path);
+		saib_evict_dir(path, "snap-evict");
+
+		return 0;
+	}
+
+	/*
+	 * A task's later steps can come some time after its checkout, so we
+	 * leave alone ones that might still have tasks coming back to them
+	 */
+
+	if ((uint64_t)(lws_now_secs() - (unsigned long)sb.st_mtime) <
+					SAI_CLEANUP_JOB_DIR_MIN_AGE_SECS)
+		return 0;
+
+	if (!sc->lru[0] || sb.st_mtime < sc->lru_mtime) {
+		lws_strncpy(sc->lru, path, sizeof(sc->lru));
+		sc->lru_mtime = sb.st_mtime;
+	}
+
+	return 0;
+}
+
+static int
+saib_snap_mirror_cb(const char *dirpath, void *user, struct lws_dir_entry *lde)
+{
+	char path[384];
+
+	if (lde->type != LDOT_DIR || lde->name[0] == '.')
+		return 0;
+
+	lws_snprintf(path, sizeof(path), "%s/%s", dirpath, lde->name);
+	lws_dir(path, user, saib_snap_hash_cb);
+
+	return 0;
+}
+
+#endif
+
+/*
+ * Called periodically to drop snapshots that nothing used for a while, or if
+ * the disk is short, the least recently used one that no task is using
+ */
+
+void
+saib_snap_check(void)
+{
+#if defined(__linux__)
+	struct saib_snap_check sc;
+	char path[256];
+
+	memset(&sc, 0, sizeof(sc));
+	lws_snprintf(path, sizeof(path), "%s/snap", builder.home);
+	lws_dir(path, &sc, saib_snap_mirror_cb);
+
+	if (sc.lru[0] && saib_disk_pressure()) {
+		lwsl_notice("%s: disk low, dropping snapshot %s\n", __func__,
+			    sc.lru);
+		saib_evict_dir(sc.lru, "snap-evict");
+	}
+#endif
+}
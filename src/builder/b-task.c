@@ -35,6 +35,40 @@ const char *git_helper_sh =
 	"echo \"git_helper_sh: starting\"\n"
 	"OPERATION=$1\n"
 	"shift\n"
+	/* the mirror has the hash if a mirror step or a prefetch fetched it */
+	"have_hash() {\n"
+	"    git -C \"$MIRROR_PATH\" rev-parse -q --verify \"ref-$HASH\" > /dev/null ||\n"
+	"    git -C \"$MIRROR_PATH\" rev-parse -q --verify \"refs/sai-prefetch/$HASH\" > /dev/null\n"
+	"}\n"
+	/*
+	 * A background warm of the mirror at low priority.  It must never hold
+	 * up a task, so it doesn't take the mirror lock to fetch: it fetches
+	 * into its own ref, and only takes the lock briefly if it has to make
+	 * the mirror.  If a task has the lock for that, we leave it to the task.
+	 */
+	"if [ \"$OPERATION\" == \"prefetch\" ]; then\n"
+	"    renice -n 19 -p $$ > /dev/null 2>&1 || true\n"
+	"    ionice -c 3 -p $$ > /dev/null 2>&1 || true\n"
+	"    REMOTE_URL=$1\n"
+	"    REF=$2\n"
+	"    HASH=$3\n"
+	"    MIRROR_PATH=\"$HOME/git-mirror/$4\"\n"
+	"    mkdir -p \"$HOME/git-mirror\"\n"
+	"    if [ ! -f \"$MIRROR_PATH/HEAD\" ]; then\n"
+	"        mkdir \"$MIRROR_PATH.lock\" 2>/dev/null || exit 0\n"
+	"        trap 'rm -rf \"$MIRROR_PATH.lock\"' EXIT\n"
+	"        if [ ! -f \"$MIRROR_PATH/HEAD\" ]; then\n"
+	"            mkdir -p \"$MIRROR_PATH\"\n"
+	"            git init --bare \"$MIRROR_PATH\"\n"
+	"        fi\n"
+	"        rm -rf \"$MIRROR_PATH.lock\"\n"
+	"        trap - EXIT\n"
+	"    fi\n"
+	"    if have_hash; then\n"
+	"        exit 0\n"
+	"    fi\n"
+	"    exec git -C \"$MIRROR_PATH\" -c gc.auto=0 fetch \"$REMOTE_URL\" \"+$REF:refs/sai-prefetch/$HASH\"\n"
+	"fi\n"
 	"if [ \"$OPERATION\" == \"mirror\" ]; then\n"
 	"    REMOTE_URL=$1\n"
 	"    REF=$2\n"
@@ -42,20 +76,20 @@ const char *git_helper_sh =
 	"    MIRROR_PATH=\"$HOME/git-mirror/$4\"\n"
 	"    mkdir -p \"$HOME/git-mirror\"\n"
 	"    for i in $(seq 1 60); do\n"
-	"        if [ -d \"$MIRROR_PATH/.git\" ]; then\n"
-	"            if git -C \"$MIRROR_PATH\" rev-parse -q --verify \"ref-$HASH\" > /dev/null; then\n"
+	"        if [ -f \"$MIRROR_PATH/HEAD\" ]; then\n"
+	"            if have_hash; then\n"
 	"                exit 0\n"
 	"            fi\n"
 	"        fi\n"
 	"        if mkdir \"$MIRROR_PATH.lock\" 2>/dev/null; then\n"
 	"            trap 'rm -rf \"$MIRROR_PATH.lock\"' EXIT\n"
-	"            if [ -d \"$MIRROR_PATH/.git\" ]; then\n"
-	"                if git -C \"$MIRROR_PATH\" rev-parse -q --verify \"ref-$HASH\" > /dev/null; then\n"
+	"            if [ -f \"$MIRROR_PATH/HEAD\" ]; then\n"
+	"                if have_hash; then\n"
 	"                    exit 0\n"
 	"                fi\n"
 	"            fi\n"
 	"            mkdir -p \"$MIRROR_PATH\"\n"
-	"            if [ ! -d \"$MIRROR_PATH/.git\" ]; then\n"
+	"            if [ ! -f \"$MIRROR_PATH/HEAD\" ]; then\n"
 	"                git init --bare \"$MIRROR_PATH\"\n"
 	"            fi\n"
 	"            REFSPEC=\"$REF:ref-$HASH\"\n"
@@ -70,16 +104,88 @@ const char *git_helper_sh =
 	"    MIRROR_PATH=\"$HOME/git-mirror/$1\"\n"
 	"    BUILD_DIR=$2\n"
 	"    HASH=$3\n"
-	"    if [ ! -d \"$BUILD_DIR/.git\" ]; then\n"
+	/*
+	 * src is a worktree of the mirror, sharing its objects, so checking
+	 * out copies nothing but the files themselves.  Worktrees whose job
+	 * dir has since been deleted are pruned each time.  If git is too old
+	 * for worktrees, fall back to a clone borrowing the mirror's objects.
+	 */
+	"    git -C \"$MIRROR_PATH\" worktree prune || true\n"
+	/*
+	 * A warm dir is a worktree kept from the last build of the task here.
+	 * It moves to the new hash without cleaning, so the build outputs are
+	 * still there, and src links to it.  If it can't be had, build cold.
+	 */
+	"    if [ -n \"$SAI_WARM\" ]; then\n"
+	"        if [ ! -e \"$SAI_WARM/.git\" ] ||\n"
+	"           ! git -C \"$SAI_WARM\" checkout -f --detach \"$HASH\"; then\n"
+	"            rm -rf \"$SAI_WARM\"\n"
+	"            git -C \"$MIRROR_PATH\" worktree prune || true\n"
+	"            git -C \"$MIRROR_PATH\" worktree add --detach --force \"$SAI_WARM\" \"$HASH\" || SAI_WARM=\n"
+	"        fi\n"
+	"        if [ -n \"$SAI_WARM\" ]; then\n"
+	"            rm -rf \"$BUILD_DIR\"\n"
+	"            ln -s \"$SAI_WARM\" \"$BUILD_DIR\"\n"
+	"            echo \">>> Git helper script finished, warm.\"\n"
+	"            exit 0\n"
+	"        fi\n"
+	"    fi\n"
+	/*
+	 * With SAI_SNAP, the commit is checked out once per builder under
+	 * there, and the build steps mount src as an overlay over it with
+	 * their changes going to .snap/upper, see b-snap.c.  We check we can
+	 * mount it before committing to that.
+	 */
+	"    rm -rf .snap\n"
+	"    if [ -n \"$SAI_SNAP\" ] && command -v fuse-overlayfs > /dev/null; then\n"
+	"        SNAP=\"$SAI_SNAP/$1/$HASH\"\n"
+	"        mkdir -p \"$SAI_SNAP/$1\"\n"
+	"        for i in $(seq 1 300); do\n"
+	"            if [ -e \"$SNAP/.git\" ]; then\n"
+	"                break\n"
+	"            fi\n"
+	"            if mkdir \"$SNAP.lock\" 2>/dev/null; then\n"
+	"                trap 'rm -rf \"$SNAP.lock\" \"$SNAP.tmp\"' EXIT\n"
+	"                if [ ! -e \"$SNAP/.git\" ]; then\n"
+	"                    rm -rf \"$SNAP.tmp\"\n"
+	"                    git clone --shared --no-checkout \"$MIRROR_PATH\" \"$SNAP.tmp\" &&\n"
+	"                    git -C \"$SNAP.tmp\" checkout -q -f \"$HASH\" &&\n"
+	"                    mv \"$SNAP.tmp\" \"$SNAP\" || true\n"
+	"                fi\n"
+	"                rm -rf \"$SNAP.lock\" \"$SNAP.tmp\"\n"
+	"                trap - EXIT\n"
+	"                break\n"
+	"            fi\n"
+	"            echo \"snapshot being made, waiting...\"\n"
+	"            sleep 1\n"
+	"        done\n"
+	"        if [ -e \"$SNAP/.git\" ]; then\n"
+	"            touch \"$SNAP\"\n"
+	"            rm -rf \"$BUILD_DIR\"\n"
+	"            mkdir -p \"$BUILD_DIR\" .snap/upper .snap/work\n"
+	"            if fuse-overlayfs -o \"lowerdir=$SNAP,upperdir=$PWD/.snap/upper,workdir=$PWD/.snap/work\" \"$PWD/$BUILD_DIR\"; then\n"
+	"                (fusermount3 -u \"$PWD/$BUILD_DIR\" || fusermount -u \"$PWD/$BUILD_DIR\") > /dev/null 2>&1\n"
+	"                echo \"$SNAP\" > .snap/lower\n"
+	"                echo \">>> Git helper script finished, snapshot.\"\n"
+	"                exit 0\n"
+	"            fi\n"
+	"            rm -rf \"$BUILD_DIR\" .snap\n"
+	"        fi\n"
+	"    fi\n"
+	"    if [ -d \"$BUILD_DIR/.git\" ]; then\n"
 	"        rm -rf \"$BUILD_DIR\"\n"
-	"        mkdir -p \"$BUILD_DIR\"\n"
-	"        git -C \"$BUILD_DIR\" init\n"
 	"    fi\n"
-	"    if ! git -C \"$BUILD_DIR\" fetch \"$MIRROR_PATH\" \"ref-$HASH\"; then\n"
-	"        exit 2\n"
+	"    if [ -e \"$BUILD_DIR/.git\" ]; then\n"
+	"        git -C \"$BUILD_DIR\" checkout -f --detach \"$HASH\" || exit 2\n"
+	"        git -C \"$BUILD_DIR\" clean -fdx\n"
+	"    else\n"
+	"        rm -rf \"$BUILD_DIR\"\n"
+	"        if ! git -C \"$MIRROR_PATH\" worktree add --detach --force \"$PWD/$BUILD_DIR\" \"$HASH\"; then\n"
+	"            rm -rf \"$BUILD_DIR\"\n"
+	"            git clone --shared --no-checkout \"$MIRROR_PATH\" \"$BUILD_DIR\" || exit 2\n"
+	"            git -C \"$BUILD_DIR\" checkout -f \"$HASH\" || exit 2\n"
+	"        fi\n"
 	"    fi\n"
-	"    git -C \"$BUILD_DIR\" checkout -f \"$HASH\"\n"
-	"    git -C \"$BUILD_DIR\" clean -fdx\n"
 	"else\n"
 	"    exit 1\n"
 	"fi\n"
@@ -110,9 +216,9 @@ const char *git_helper_bat =
 	"        ping -n 2 127.0.0.1 >nul\n"
 	"        goto :lock_wait\n"
 	"    )\n"
-	"    if exist \"!MIRROR_PATH!\\\\.git\" (\n"
+	"    if exist \"!MIRROR_PATH!\\\\HEAD\" (\n"
 	"        git -C \"!MIRROR_PATH!\" rev-parse -q --verify \"ref-!HASH!\" > nul 2> nul\n"
-	"        if exist !MIRROR_PATH!\\\\.git if not errorlevel 1 (\n"
+	"        if not errorlevel 1 (\n"
 	"            rmdir \"!MIRROR_PATH!.lock\"\n"
 	"            exit /b 0\n"
 	"        )\n"
@@ -120,7 +226,7 @@ const char *git_helper_bat =
 	"    if not exist \"!MIRROR_PATH!\\\\.\" (\n"
 	"    mkdir \"!MIRROR_PATH!\"\n"
 	"    )\n"
-	"    if not exist \"!MIRROR_PATH!\\\\.git\" (\n"
+	"    if not exist \"!MIRROR_PATH!\\\\HEAD\" (\n"
 	"        git init --bare \"!MIRROR_PATH!\"\n"
 	"        if errorlevel 1 (\n"
 	"            rmdir \"!MIRROR_PATH!.lock\"\n"
@@ -145,16 +251,17 @@ const char *git_helper_bat =
 	"    echo \"MIRROR_PATH: !MIRROR_PATH!\"\n"
 	"    echo \"BUILD_DIR: !BUILD_DIR!\"\n"
 	"    echo \"HASH: !HASH!\"\n"
-	"    if not exist \"!BUILD_DIR!\\\\.git\" (\n"
+	"    git -C \"!MIRROR_PATH!\" worktree prune\n"
+	"    if exist \"!BUILD_DIR!\\\\.git\\\\\" rmdir /s /q \"!BUILD_DIR!\"\n"
+	"    if exist \"!BUILD_DIR!\\\\.git\" (\n"
+	"        git -C \"!BUILD_DIR!\" checkout -f --detach \"!HASH!\"\n"
+	"        if errorlevel 1 exit /b 2\n"
+	"        git -C \"!BUILD_DIR!\" clean -fdx\n"
+	"    ) else (\n"
 	"        if exist \"!BUILD_DIR!\\\\\" rmdir /s /q \"!BUILD_DIR!\"\n"
-	"        mkdir \"!BUILD_DIR!\"\n"
-	"        git -C \"!BUILD_DIR!\" init\n"
-	"        if errorlevel 1 exit /b 1\n"
+	"        git -C \"!MIRROR_PATH!\" worktree add --detach --force \"!CD!\\\\!BUILD_DIR!\" \"!HASH!\"\n"
+	"        if errorlevel 1 exit /b 2\n"
 	"    )\n"
-	"    git -C \"!BUILD_DIR!\" fetch \"!MIRROR_PATH!\" \"ref-!HASH!\"\n"
-	"    if errorlevel 1 exit /b 2\n"
-	"    git -C \"!BUILD_DIR!\" checkout -f \"!HASH!\"\n"
-	"    if errorlevel 1 exit /b 1\n"
 	"    echo \">>> Git helper script finished.\"\n"
 	"    exit /b 0\n"
 	")\n"
@@ -269,8 +376,16 @@ saib_queue_task_status_update(sai_plat_t *sp, struct sai_plat_server *spm,
 	rej.ecode		= ecode;
 	rej.reason		= (uint8_t)reason;
 
+	/*
+	 * The server finalizes the task when it sees it destroyed, so that
+	 * must follow the task's last logs through the logs queue, including
+	 * any still in the journal, rather than overtake them
+	 */
+
 	if (saib_srv_queue_json_fragments_helper(spm->ss, lsm_schema_json_task_rej,
-				LWS_ARRAY_SIZE(lsm_schema_json_task_rej), &rej))
+				LWS_ARRAY_SIZE(lsm_schema_json_task_rej), &rej,
+				reason == SAI_TASK_REASON_DESTROYED ?
+					SAIB_TXQ_LOGS : SAIB_TXQ_CONTROL))
 		return -1;
 
 	return 0;
@@ -286,6 +401,8 @@ saib_task_destroy(struct sai_nspawn *ns)
 
 	lws_sul_cancel(&ns->sul_cleaner);
 	lws_sul_cancel(&ns->sul_task_cancel);
+	saib_series_stop(ns);
+	saib_warm_step_end(ns);
 
 	/*
 	 * If able, builder should reintroduce himself to get
@@ -294,10 +411,12 @@ saib_task_destroy(struct sai_nspawn *ns)
 
 	if (ns->spm) {
 
+		saib_warm_refresh();
+
 		if (saib_srv_queue_json_fragments_helper(ns->spm->ss,
 				lsm_schema_map_plat,
 				LWS_ARRAY_SIZE(lsm_schema_map_plat),
-				&builder.sai_plat_owner))
+				&builder.sai_plat_owner, SAIB_TXQ_CONTROL))
 			return;
 
                /*
@@ -330,7 +449,7 @@ saib_task_destroy(struct sai_nspawn *ns)
 		 * Schedule informing all the servers we're connected to
 		 */
 
-		if (!m) {
+		if (!m && !builder.upload_owner.count) {
 #if defined(__APPLE__)
 			if (!saib_need_wakelock()) {
 				lwsl_notice("%s: last task finished, scheduling wakelock release\n", __func__);
@@ -431,9 +550,7 @@ artifact_glob_cb(void *data, const char *path)
 {
 	struct sai_nspawn *ns = (struct sai_nspawn *)data;
 	const char *p, *ph = NULL;
-	struct lws_ss_handle *h;
 	char upp[256], s[384];
-	sai_artifact_t *ap = NULL;
 	int n;
 
 	/*
@@ -473,39 +590,17 @@ artifact_glob_cb(void *data, const char *path)
 		return 1;
 	}
 
-	/* pass upp in as the opaque data... we use it during CREATING */
-
-	if (lws_ss_create(builder.context, 0, &ssi_sai_artifact, upp, &h,
-			  NULL, NULL)) {
-		lwsl_err("%s: failed to create secure stream\n",
-			 __func__);
-		return -1;
-	}
-
-	ap = lws_ss_to_user_object(h);
-	/* take a copy so we can unlink the path later */
-	lws_strncpy(ap->path, upp, sizeof(ap->path));
-
-	lwsl_notice("%s: artifact ss created '%s'\n", __func__, ap->path);
-	ns->count_artifacts++;
-
-	lws_strncpy(ap->task_uuid, ns->task->uuid, sizeof(ap->task_uuid));
-	lws_strncpy(ap->artifact_up_nonce, ns->task->art_up_nonce,
-		    sizeof(ap->artifact_up_nonce));
-	lws_strncpy(ap->blob_filename, ph, sizeof(ap->blob_filename));
-	ap->timestamp = (uint64_t)lws_now_usecs();
-
 	/*
-	 * We need to set the metadata items for the post urlargs.  spm->url is
-	 * something like "wss://warmcat.com/sai/builder"... we will send JSON
-	 * on this connection first and that will be understood by the server
-	 * as meaning the bulk data follows.
+	 * It's in the upload queue now, which takes care of it from here
+	 * independent of the task
 	 */
 
-	if (lws_ss_set_metadata(h, "url", ns->spm->url, strlen(ns->spm->url)))
-		lwsl_warn("%s: unable to set metadata\n", __func__);
+	if (saib_artifact_queue(ns, upp, ph)) {
+		unlink(upp);
+		return 1;
+	}
 
-	return lws_ss_client_connect(h) ? -1 : 0;
+	return 0;
 }
 
 /*
@@ -616,14 +711,15 @@ scan:
 			break;
 	}
 
-	if (!ns->count_artifacts) {
-		lwsl_notice("%s: no artifacts, destroying ns now\n", __func__);
-		/* no artifacts to hang around for... nuke the ns now */
-        	lws_sul_schedule(builder.context, 0, &ns->sul_cleaner,
-                         saib_sub_cleaner_cb, 1);
-	} else
-		lwsl_notice("%s: created / waiting on %d artifact uploads\n",
-				__func__, ns->count_artifacts);
+	/*
+	 * Any artifacts are in the upload queue and no longer need the ns,
+	 * so we can nuke it and free up the slot now
+	 */
+
+	lwsl_notice("%s: %d artifacts queued, destroying ns now\n", __func__,
+		    (int)builder.upload_owner.count);
+	lws_sul_schedule(builder.context, 0, &ns->sul_cleaner,
+			 saib_sub_cleaner_cb, 1);
 }
 
 void
@@ -0,0 +1,432 @@
+/*
+ * sai-builder
+ *
+ * Copyright (C) 2019 - 2025 Andy Green <andy@warmcat.com>
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation:
+ *  version 2.1 of the License.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *  MA  02110-1301  USA
+ *
+ * Tasks from .sai.json configurations that set "warm": true come with a
+ * warm_key, which is the same for that repo, platform and taskname on every
+ * event.  Instead of a fresh checkout in the job dir, we keep a worktree for
+ * each warm key under ~/warm/<platform>/<key>, move it to the new hash at
+ * the checkout step without cleaning it, and point the job's src at it, so
+ * the build steps find the last build's outputs and only rebuild what the
+ * push changed.
+ *
+ * Only one task at a time can use a warm dir, if another task with the same
+ * key is already using it, the later one just builds cold in its job dir.
+ * Each step of a task is a separate nspawn, so the task's claim on the warm
+ * dir is kept in a list on the builder.  It goes when the task's last step
+ * ends, or any step fails or is cancelled.  If we never see the rest of the
+ * task, eg, because the server lost us mid-task, it lapses after
+ * SAIB_WARM_CLAIM_LAPSE_SECS with no step running.
+ *
+ * The keys we hold for each platform go to the servers in our platform
+ * advertisement, so they can try to send the next event's task back here.
+ *
+ * Warm dirs that weren't used for SAIB_WARM_IDLE_SECS, and the least recently
+ * used ones beyond SAI_WARM_MAX per platform, are removed by the deletion
+ * worker, along with the oldest idle one if the disk is getting short.
+ */
+
+#include <libwebsockets.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+
+#if !defined(WIN32)
+#include <unistd.h>
+#include <utime.h>
+#include <sys/stat.h>
+#endif
+
+#include "b-private.h"
+
+#if !defined(WIN32)
+
+/* the key becomes part of a path, so it must be exactly what we expect */
+
+static int
+saib_warm_key_valid(const char *key)
+{
+	int n;
+
+	for (n = 0; n < 16; n++)
+		if (!((key[n] >= '0' && key[n] <= '9') ||
+		      (key[n] >= 'a' && key[n] <= 'f')))
+			return 0;
+
+	return !key[16];
+}
+
+typedef struct saib_warm_claim {
+	lws_dll2_t		list;
+	char			task_uuid[65];
+	char			platdir[128];
+	char			key[17];
+	time_t			idle_since; /* 0 while one of its steps runs */
+} saib_warm_claim_t;
+
+static saib_warm_claim_t *
+saib_warm_claim_find(const char *task_uuid)
+{
+	lws_start_foreach_dll(struct lws_dll2 *, p,
+			      builder.warm_claim_owner.head) {
+		saib_warm_claim_t *wc = lws_container_of(p, saib_warm_claim_t,
+							  list);
+
+		if (!strcmp(wc->task_uuid, task_uuid))
+			return wc;
+	} lws_end_foreach_dll(p);
+
+	return NULL;
+}
+
+static int
+saib_warm_claim_stale(const saib_warm_claim_t *wc)
+{
+	return wc->idle_since && (time_t)lws_now_secs() - wc->idle_since >
+						SAIB_WARM_CLAIM_LAPSE_SECS;
+}
+
+static void
+saib_warm_claim_drop(saib_warm_claim_t *wc)
+{
+	lws_dll2_remove(&wc->list);
+	free(wc);
+}
+
+/* Is some task holding the warm dir for key, on platform dir platdir? */
+
+static int
+saib_warm_in_use(const char *platdir, const char *key)
+{
+	lws_start_foreach_dll(struct lws_dll2 *, p,
+			      builder.warm_claim_owner.head) {
+		saib_warm_claim_t *wc = lws_container_of(p, saib_warm_claim_t,
+							  list);
+
+		if (!saib_warm_claim_stale(wc) && !strcmp(wc->key, key) &&
+		    !strcmp(wc->platdir, platdir))
+			return 1;
+	} lws_end_foreach_dll(p);
+
+	return 0;
+}
+
+#endif
+
+/*
+ * The runscript line pointing the git helper and the build steps at the warm
+ * dir for ns, into buf.  buf is left empty if the task isn't warm, or its
+ * warm dir is busy with another task.  We only take the warm dir at the
+ * checkout step, so src is always the checkout the later steps expect.
+ */
+
+void
+saib_warm_env(struct sai_nspawn *ns, char *buf, size_t len)
+{
+#if !defined(WIN32)
+	char name[128], dir[384];
+	saib_warm_claim_t *wc;
+
+	buf[0] = '\0';
+
+	if (!ns->task || !ns->sp || !ns->sp->platform ||
+	    !saib_warm_key_valid(ns->task->warm_key))
+		return;
+
+	saib_plat_dirname(ns->sp, name, sizeof(name));
+
+	wc = saib_warm_claim_find(ns->task->uuid);
+	if (wc && saib_warm_claim_stale(wc)) {
+		saib_warm_claim_drop(wc);
+		wc = NULL;
+	}
+
+	if (!wc) {
+		if (ns->task->build_step != 1)
+			return;
+
+		if (saib_warm_in_use(name, ns->task->warm_key)) {
+			lwsl_notice("%s: warm dir %s busy, %s builds cold\n",
+				    __func__, ns->task->warm_key,
+				    ns->task->uuid);
+			return;
+		}
+
+		lws_snprintf(dir, sizeof(dir), "%s/warm", builder.home);
+		if (mkdir(dir, 0755) && errno != EEXIST)
+			return;
+
+		lws_snprintf(dir, sizeof(dir), "%s/warm/%s", builder.home,
+			     name);
+		if (mkdir(dir, 0755) && errno != EEXIST)
+			return;
+
+		wc = malloc(sizeof(*wc));
+		if (!wc)
+			return;
+
+		memset(wc, 0, sizeof(*wc));
+		lws_strncpy(wc->task_uuid, ns->task->uuid, sizeof(wc->task_uuid));
+		lws_strncpy(wc->platdir, name, sizeof(wc->platdir));
+		lws_strncpy(wc->key, ns->task->warm_key, sizeof(wc->key));
+		lws_dll2_add_tail(&wc->list, &builder.warm_claim_owner);
+	}
+
+	wc->idle_since = 0;
+	ns->warm = 1;
+
+	if (ns->task->build_step >= 2) {
+		struct stat sb;
+
+		/* the git helper may have fallen back to a cold checkout */
+
+		lws_snprintf(dir, sizeof(dir), "%s/src", ns->inp);
+		if (lstat(dir, &sb) || !S_ISLNK(sb.st_mode))
+			return;
+	}
+
+	lws_snprintf(dir, sizeof(dir), "%s/warm/%s/%s", builder.home, name,
+		     ns->task->warm_key);
+
+	/* the mtime of the dir tells eviction when it was last used */
+
+	utime(dir, NULL);
+
+	lws_snprintf(buf, len, "export SAI_WARM=%s\n", dir);
+#else
+	buf[0] = '\0';
+#endif
+}
+
+/*
+ * A step of ns' task ended.  If it was the last one, or it failed or was
+ * cancelled, the task is over and lets go of its warm dir, otherwise the
+ * claim is kept for its next step.  Steps 0 and 1 are the git mirror and
+ * checkout, so build_step_count is the index of the last step.
+ */
+
+void
+saib_warm_step_end(struct sai_nspawn *ns)
+{
+#if !defined(WIN32)
+	saib_warm_claim_t *wc;
+
+	if (!ns->warm || !ns->task)
+		return;
+
+	wc = saib_warm_claim_find(ns->task->uuid);
+	if (!wc)
+		return;
+
+	if ((ns->retcode & SAISPRF_EXIT) && !(ns->retcode & 0xff) &&
+	    ns->task->build_step < ns->task->build_step_count)
+		wc->idle_since = (time_t)lws_now_secs();
+	else
+		saib_warm_claim_drop(wc);
+#endif
+}
+
+#if !defined(WIN32)
+
+static int
+saib_warm_list_cb(const char *dirpath, void *user, struct lws_dir_entry *lde)
+{
+	sai_plat_t *sp = (sai_plat_t *)user;
+	size_t n = strlen(sp->warm);
+
+	if (lde->type != LDOT_DIR || !saib_warm_key_valid(lde->name) ||
+	    n + 18 > sizeof(sp->warm))
+		return 0;
+
+	lws_snprintf(sp->warm + n, sizeof(sp->warm) - n, "%s%s",
+		     n ? "," : "", lde->name);
+
+	return 0;
+}
+
+#endif
+
+/*
+ * Update the list of warm keys we hold for each platform, before they are
+ * advertised to the servers
+ */
+
+void
+saib_warm_refresh(void)
+{
+#if !defined(WIN32)
+	char name[128], dir[384];
+
+	lws_start_foreach_dll(struct lws_dll2 *, d, builder.sai_plat_owner.head) {
+		sai_plat_t *sp = lws_container_of(d, sai_plat_t, sai_plat_list);
+
+		sp->warm[0] = '\0';
+		if (sp->platform) {
+			saib_plat_dirname(sp, name, sizeof(name));
+			lws_snprintf(dir, sizeof(dir), "%s/warm/%s",
+				     builder.home, name);
+			lws_dir(dir, sp, saib_warm_list_cb);
+		}
+	} lws_end_foreach_dll(d);
+#endif
+}
+
+#if !defined(WIN32)
+
+typedef struct saib_warm_dir {
+	char			key[17];
+	time_t			mtime;
+} saib_warm_dir_t;
+
+struct saib_warm_scan {
+	saib_warm_dir_t		d[SAI_WARM_MAX * 2];
+	int			count;
+};
+
+static int
+saib_warm_scan_cb(const char *dirpath, void *user, struct lws_dir_entry *lde)
+{
+	struct saib_warm_scan *sc = (struct saib_warm_scan *)user;
+	char path[512];
+	struct stat sb;
+
+	if (lde->type != LDOT_DIR || !saib_warm_key_valid(lde->name) ||
+	    sc->count == (int)LWS_ARRAY_SIZE(sc->d))
+		return 0;
+
+	lws_snprintf(path, sizeof(path), "%s/%s", dirpath, lde->name);
+	if (stat(path, &sb))
+		return 0;
+
+	lws_strncpy(sc->d[sc->count].key, lde->name, sizeof(sc->d[0].key));
+	sc->d[sc->count++].mtime = sb.st_mtime;
+
+	return 0;
+}
+
+static int
+saib_warm_sort_cb(const void *a, const void *b)
+{
+	const saib_warm_dir_t *wa = (const saib_warm_dir_t *)a,
+			      *wb = (const saib_warm_dir_t *)b;
+
+	/* most recently used first */
+
+	return wa->mtime < wb->mtime ? 1 : (wa->mtime > wb->mtime ? -1 : 0);
+}
+
+struct saib_warm_check {
+	char			lru_plat[128];
+	char			lru_key[17];
+	time_t			lru_mtime;
+};
+
+static int
+saib_warm_plat_cb(const char *dirpath, void *user, struct lws_dir_entry *lde)
+{
+	struct saib_warm_check *wc = (struct saib_warm_check *)user;
+	time_t now = (time_t)lws_now_secs();
+	struct saib_warm_scan *sc;
+	char path[512];
+	int n, kept = 0;
+
+	if (lde->type != LDOT_DIR || lde->name[0] == '.')
+		return 0;
+
+	sc = malloc(sizeof(*sc));
+	if (!sc)
+		return 0;
+
+	memset(sc, 0, sizeof(*sc));
+	lws_snprintf(path, sizeof(path), "%s/%s", dirpath, lde->name);
+	lws_dir(path, sc, saib_warm_scan_cb);
+
+	qsort(sc->d, (size_t)sc->count, sizeof(sc->d[0]), saib_warm_sort_cb);
+
+	for (n = 0; n < sc->count; n++) {
+		saib_warm_dir_t *w = &sc->d[n];
+
+		if (saib_warm_in_use(lde->name, w->key)) {
+			kept++;
+			continue;
+		}
+
+		if (now - w->mtime > SAIB_WARM_IDLE_SECS || kept >= SAI_WARM_MAX) {
+			lwsl_notice("%s: dropping warm dir %s/%s\n", __func__,
+				    lde->name, w->key);
+			lws_snprintf(path, sizeof(path), "%s/%s/%s", dirpath,
+				     lde->name, w->key);
+			saib_evict_dir(path, "warm-evict");
+			continue;
+		}
+
+		kept++;
+
+		/* candidate for going if the disk is short */
+
+		if (!wc->lru_key[0] || w->mtime < wc->lru_mtime) {
+			lws_strncpy(wc->lru_plat, lde->name,
+				    sizeof(wc->lru_plat));
+			lws_strncpy(wc->lru_key, w->key, sizeof(wc->lru_key));
+			wc->lru_mtime = w->mtime;
+		}
+	}
+
+	free(sc);
+
+	return 0;
+}
+
+#endif
+
+/*
+ * Called periodically to drop warm dirs that are stale, or over the limit
+ * for their platform, or if the disk is short, the least recently used one.
+ * The servers find out with our next advertisement.
+ */
+
+void
+saib_warm_check(void)
+{
+#if !defined(WIN32)
+	struct saib_warm_check wc;
+	char path[512];
+
+	lws_start_foreach_dll_safe(struct lws_dll2 *, p, p1,
+				   builder.warm_claim_owner.head) {
+		saib_warm_claim_t *c = lws_container_of(p, saib_warm_claim_t,
+							 list);
+
+		if (saib_warm_claim_stale(c))
+			saib_warm_claim_drop(c);
+	} lws_end_foreach_dll_safe(p, p1);
+
+	memset(&wc, 0, sizeof(wc));
+	lws_snprintf(path, sizeof(path), "%s/warm", builder.home);
+	lws_dir(path, &wc, saib_warm_plat_cb);
+
+	if (wc.lru_key[0] && saib_disk_pressure()) {
+		lwsl_notice("%s: disk low, dropping warm dir %s/%s\n", __func__,
+			    wc.lru_plat, wc.lru_key);
+		lws_snprintf(path, sizeof(path), "%s/warm/%s/%s", builder.home,
+			     wc.lru_plat, wc.lru_key);
+		saib_evict_dir(path, "warm-evict");
+	}
+#endif
+}
@@ -29,6 +29,7 @@
 #include <libwebsockets.h>
 #include <string.h>
 #include <signal.h>
+#include <fcntl.h>
 
 #include "b-private.h"
 
@@ -48,7 +49,8 @@ const lws_struct_map_t lsm_schema_map_m_to_b[] = {
 	LSM_SCHEMA	(sai_viewer_state_t, NULL, lsm_viewerstate_members,
 						 "com.warmcat.sai.viewerstate"),
 	LSM_SCHEMA	(sai_resource_t, NULL, lsm_resource, "com-warmcat-sai-resource"),
-	LSM_SCHEMA	(sai_rebuild_t, NULL, lsm_rebuild, "com.warmcat.sai.rebuild")
+	LSM_SCHEMA	(sai_rebuild_t, NULL, lsm_rebuild, "com.warmcat.sai.rebuild"),
+	LSM_SCHEMA	(sai_prefetch_t, NULL, lsm_prefetch, "com.warmcat.sai.prefetch")
 };
 
 enum {
@@ -56,36 +58,195 @@ enum {
 	SAIB_RX_TASK_CANCEL,
 	SAIB_RX_VIEWERSTATE,
 	SAIB_RX_RESOURCE_REPLY,
-	SAIB_RX_REBUILD
+	SAIB_RX_REBUILD,
+	SAIB_RX_PREFETCH
 };
 
+/*
+ * Logs that arrive while we are over SAIB_TXQ_MEM_LIMIT are journalled to a
+ * file in the builder home dir, one per server connection.  Each record is a
+ * uint32_t length and uint32_t ss_flags header followed by the payload.
+ *
+ * Once we start journalling, all later logs also go in the journal until it
+ * has been fully replayed, so the server sees them in the original order.
+ */
+
+static void
+saib_txq_spill_path(struct sai_plat_server *spm, char *path, size_t len)
+{
+	lws_snprintf(path, len, "%s/.sai-txq-%s", builder.home, spm->name);
+}
+
+static void
+saib_txq_spill_close(struct sai_plat_server *spm)
+{
+	char path[256];
+
+	if (spm->txq_spill_fd < 0)
+		return;
+
+	close(spm->txq_spill_fd);
+	spm->txq_spill_fd = -1;
+	spm->txq_spill_wr = spm->txq_spill_rd = 0;
+
+	saib_txq_spill_path(spm, path, sizeof(path));
+	unlink(path);
+}
+
+static int
+saib_txq_spill(struct sai_plat_server *spm, const void *buf, size_t len,
+	       unsigned int ss_flags)
+{
+	uint32_t hdr[2];
+	char path[256];
+
+	if (spm->txq_spill_fd < 0) {
+		saib_txq_spill_path(spm, path, sizeof(path));
+		spm->txq_spill_fd = lws_open(path, O_RDWR | O_CREAT | O_TRUNC,
+					     0600);
+		if (spm->txq_spill_fd < 0) {
+			lwsl_ss_err(spm->ss, "unable to open %s", path);
+			return -1;
+		}
+
+		lwsl_ss_warn(spm->ss, "tx queue at %u bytes, journalling logs",
+			     (unsigned int)spm->txq_bytes);
+	}
+
+	hdr[0] = (uint32_t)len;
+	hdr[1] = (uint32_t)ss_flags;
+
+	/* a failed write leaves _wr alone, so the next one overwrites it */
+
+	if (lseek(spm->txq_spill_fd, (off_t)spm->txq_spill_wr, SEEK_SET) < 0 ||
+	    write(spm->txq_spill_fd, hdr, sizeof(hdr)) != (ssize_t)sizeof(hdr) ||
+	    write(spm->txq_spill_fd, buf, (unsigned int)len) != (ssize_t)len) {
+		lwsl_ss_err(spm->ss, "journal write failed");
+		return -1;
+	}
+
+	spm->txq_spill_wr += sizeof(hdr) + len;
+
+	return 0;
+}
+
+/*
+ * When the in-memory logs have drained, pull the next part of the journal
+ * back onto the logs buflist, up to SAIB_TXQ_UNSPILL_BUDGET at a time.  A
+ * record bigger than the budget still goes, on its own in that pass.
+ */
+
+static void
+saib_txq_unspill(struct sai_plat_server *spm)
+{
+	size_t budget = 0;
+	uint32_t hdr[2];
+	uint8_t *p;
+
+	if (lseek(spm->txq_spill_fd, (off_t)spm->txq_spill_rd, SEEK_SET) < 0)
+		goto bail;
+
+	while (spm->txq_spill_rd < spm->txq_spill_wr &&
+	       budget < SAIB_TXQ_UNSPILL_BUDGET) {
+
+		/* a length running past what we wrote means it's corrupt */
+
+		if (read(spm->txq_spill_fd, hdr, sizeof(hdr)) !=
+							(ssize_t)sizeof(hdr) ||
+		    hdr[0] > spm->txq_spill_wr - spm->txq_spill_rd - sizeof(hdr))
+			goto bail;
+
+		p = malloc(sizeof(int) + hdr[0]);
+		if (!p)
+			return; /* try again next time */
+
+		*(unsigned int *)p = hdr[1];
+
+		if (read(spm->txq_spill_fd, p + sizeof(int), hdr[0]) !=
+							(ssize_t)hdr[0] ||
+		    lws_buflist_append_segment(&spm->bl_to_srv[SAIB_TXQ_LOGS], p,
+					       sizeof(int) + hdr[0]) < 0) {
+			free(p);
+			goto bail;
+		}
+
+		free(p);
+
+		spm->txq_bytes		+= sizeof(int) + hdr[0];
+		spm->txq_spill_rd	+= sizeof(hdr) + hdr[0];
+		budget			+= hdr[0];
+	}
+
+	if (spm->txq_spill_rd == spm->txq_spill_wr)
+		saib_txq_spill_close(spm);
+
+	return;
+
+bail:
+	lwsl_ss_err(spm->ss, "journal read failed, losing %llu bytes of logs",
+		    (unsigned long long)(spm->txq_spill_wr - spm->txq_spill_rd));
+	saib_txq_spill_close(spm);
+}
+
+static void
+saib_srv_queue_destroy(struct sai_plat_server *spm)
+{
+	int n;
+
+	for (n = 0; n < SAIB_TXQ_COUNT; n++)
+		lws_buflist_destroy_all_segments(&spm->bl_to_srv[n]);
+
+	spm->txq_bytes = 0;
+	spm->txq_cur = -1;
+	saib_txq_spill_close(spm);
+}
+
 /*
  * This is the only path to send things from builder->server.
  *
- * It will copy the incoming buffer fragment into a buflist in order.  So you
- * should dump all your fragments for a message in here one after the other
- * and the message will go out uninterrupted.  Having this as the only tx path
- * allows us to guarantee we won't interrupt the fragment sequencing.
+ * It will copy the incoming buffer fragment into the buflist for its priority
+ * class (SAIB_TXQ_*) in order.  So you should dump all your fragments for a
+ * message in here one after the other and the message will go out
+ * uninterrupted.  Having this as the only tx path allows us to guarantee we
+ * won't interrupt the fragment sequencing.
+ *
+ * Classes drain strictly in priority order, but only between messages, so a
+ * task acceptance doesn't have to wait behind a backlog of logs.  Logs over
+ * the memory limit go to the journal; the other classes are small and are
+ * always kept in memory.
  *
  * The fragment sizing does not have to be related to ss usage sizing, it can
  * be larger and it will be used from the buflist according to what SS wants.
  */
 
 int
-saib_srv_queue_tx(struct lws_ss_handle *h, void *buf, size_t len, unsigned int ss_flags)
+saib_srv_queue_tx(struct lws_ss_handle *h, void *buf, size_t len,
+		  unsigned int ss_flags, int cls)
 {
 	struct sai_plat_server *spm = (struct sai_plat_server *)lws_ss_to_user_object(h);
 	unsigned int *pi = (unsigned int *)((const char *)buf - sizeof(int));
 
+	if (cls == SAIB_TXQ_LOGS &&
+	    (spm->txq_spill_fd >= 0 ||
+	     spm->txq_bytes + len > SAIB_TXQ_MEM_LIMIT) &&
+	    !saib_txq_spill(spm, buf, len, ss_flags))
+		goto drain;
+
+	/* if we couldn't journal it, better to hold it in memory than lose it */
+
 	*pi = ss_flags;
 	
 	// lwsl_ss_notice(h, "Queuing builder -> sai-server");
 	// lwsl_hexdump_notice(buf, len);
 
-	if (lws_buflist_append_segment(&spm->bl_to_srv, (uint8_t *)buf - sizeof(int),
+	if (lws_buflist_append_segment(&spm->bl_to_srv[cls],
+				       (uint8_t *)buf - sizeof(int),
 				       len + sizeof(int)) < 0)
 		lwsl_ss_err(h, "failed to append"); /* still ask to drain */
+	else
+		spm->txq_bytes += len + sizeof(int);
 
+drain:
 	if (lws_ss_request_tx(h))
 		lwsl_ss_err(h, "failed to request tx");
 
@@ -95,7 +256,7 @@ saib_srv_queue_tx(struct lws_ss_handle *h, void *buf, size_t len, unsigned int s
 int
 saib_srv_queue_json_fragments_helper(struct lws_ss_handle *h,
 				     const lws_struct_map_t *map,
-                                     size_t map_entries, void *object)
+                                     size_t map_entries, void *object, int cls)
 {
 	unsigned int ssf = LWSSS_FLAG_SOM;
 	uint8_t buf[1024 + LWS_PRE];
@@ -123,7 +284,7 @@ saib_srv_queue_json_fragments_helper(struct lws_ss_handle *h,
 
 		sai_dump_stderr(buf + LWS_PRE, w);
 
-		if (saib_srv_queue_tx(h, buf + LWS_PRE, w, ssf))
+		if (saib_srv_queue_tx(h, buf + LWS_PRE, w, ssf, cls))
 			return -1;
 
 		ssf &= ~((unsigned int)LWSSS_FLAG_SOM);
@@ -260,6 +421,7 @@ saib_m_rx(void *userobj, const uint8_t *in, size_t len, int flags)
 			/* At least one viewer, start reporting */
 		       lwsl_notice("%s: VIEWERSTATE: viewers + busy instances -> load reports\n", __func__);
 
+			saib_load_report_force_full(spm);
 			lws_sul_schedule(builder.context, 0, &spm->sul_load_report,
 					 saib_sul_load_report_cb, 1);
 		}
@@ -289,6 +451,10 @@ saib_m_rx(void *userobj, const uint8_t *in, size_t len, int flags)
 		}
 		break;
 
+	case SAIB_RX_PREFETCH:
+		saib_prefetch_hint((sai_prefetch_t *)a.dest);
+		break;
+
 	default:
 		break;
 	}
@@ -307,12 +473,32 @@ saib_m_tx(void *userobj, lws_ss_tx_ordinal_t ord, uint8_t *buf, size_t *len,
 	  int *flags)
 {
 	struct sai_plat_server *spm = (struct sai_plat_server *)userobj;
-	int *pi = (int *)lws_buflist_get_frag_start_or_NULL(&spm->bl_to_srv), depi;
 	char som, som1, eom, final = 1;
+	struct lws_buflist **bl;
 	size_t fsl, used;
+	int *pi, depi, cls;
 
-	if (!spm->bl_to_srv)
-		return LWSSSSRET_TX_DONT_SEND;
+	/*
+	 * If we are partway through a message, we must finish it from the same
+	 * class before anything else can go out.  Otherwise take the next
+	 * message from the highest priority class that has one.
+	 */
+
+	cls = spm->txq_cur;
+	if (cls < 0 || !spm->bl_to_srv[cls]) {
+		if (!spm->bl_to_srv[SAIB_TXQ_LOGS] && spm->txq_spill_fd >= 0)
+			saib_txq_unspill(spm);
+
+		for (cls = 0; cls < SAIB_TXQ_COUNT; cls++)
+			if (spm->bl_to_srv[cls])
+				break;
+
+		if (cls == SAIB_TXQ_COUNT)
+			return LWSSSSRET_TX_DONT_SEND;
+	}
+
+	bl = &spm->bl_to_srv[cls];
+	pi = (int *)lws_buflist_get_frag_start_or_NULL(bl);
 
 	depi = *pi;
 	*pi = (*pi) & (~(LWSSS_FLAG_SOM)); /* no SOM twice even on partial */
@@ -329,30 +515,39 @@ saib_m_tx(void *userobj, lws_ss_tx_ordinal_t ord, uint8_t *buf, size_t *len,
 	 * destroyed.  So we also dereference *pi into depi for use below.
 	 */
 
-	fsl = lws_buflist_next_segment_len(&spm->bl_to_srv, NULL);
+	fsl = lws_buflist_next_segment_len(bl, NULL);
 
-	lws_buflist_fragment_use(&spm->bl_to_srv, NULL, 0, &som, &eom);
+	lws_buflist_fragment_use(bl, NULL, 0, &som, &eom);
 	if (som) {
 		fsl -= sizeof(int);
-		lws_buflist_fragment_use(&spm->bl_to_srv, buf, sizeof(int), &som1, &eom);
+		lws_buflist_fragment_use(bl, buf, sizeof(int), &som1, &eom);
+		spm->txq_bytes -= sizeof(int);
 	}
 	if (!(depi & LWSSS_FLAG_SOM))
 		som = 0;
 
-	used = (size_t)lws_buflist_fragment_use(&spm->bl_to_srv, (uint8_t *)buf, *len, &som1, &eom);
+	used = (size_t)lws_buflist_fragment_use(bl, (uint8_t *)buf, *len, &som1, &eom);
 	if (!used)
 		return LWSSSSRET_TX_DONT_SEND;
 
+	spm->txq_bytes -= used;
+
 	if (used < fsl || !(depi & LWSSS_FLAG_EOM))
 		final = 0;
 
+	spm->txq_cur = (signed char)(final ? -1 : cls);
+
 	*len = used;
 	*flags = (som ? LWSSS_FLAG_SOM : 0) | (final ? LWSSS_FLAG_EOM : 0);
 
 //	lwsl_ss_notice(spm->ss, "Sending %d builder->srv: ssflags %d", (int)*len, (int)*flags);
 //	lwsl_hexdump_notice(buf, *len);
 
-	if (spm->bl_to_srv)
+	for (cls = 0; cls < SAIB_TXQ_COUNT; cls++)
+		if (spm->bl_to_srv[cls])
+			return lws_ss_request_tx(spm->ss);
+
+	if (spm->txq_spill_fd >= 0)
 		return lws_ss_request_tx(spm->ss);
 
 	return 0;
@@ -410,13 +605,92 @@ cleanup_on_ss_disconnect(struct lws_dll2 *d, void *user)
 	return 0;
 }
 
+/*
+ * Next time we report on any platform for this server connection, send
+ * everything, eg, because the server just started caring again
+ */
+
+void
+saib_load_report_force_full(struct sai_plat_server *spm)
+{
+	spm->lr_interval = 0;
+
+	lws_start_foreach_dll(struct lws_dll2 *, p, builder.sai_plat_owner.head) {
+		struct sai_plat *sp = lws_container_of(p, sai_plat_t, sai_plat_list);
+
+		lws_start_foreach_dll(struct lws_dll2 *, s, sp->servers.head) {
+			sai_plat_server_ref_t *r = lws_container_of(s,
+						sai_plat_server_ref_t, list);
+			if (r->spm == spm)
+				r->last_full = 0;
+		} lws_end_foreach_dll(s);
+	} lws_end_foreach_dll(p);
+}
+
+static uint32_t
+saib_load_report_hash(uint32_t h, const void *d, size_t len)
+{
+	const uint8_t *p = (const uint8_t *)d;
+
+	while (len--)
+		h = (h ^ *p++) * 16777619u; /* FNV-1a */
+
+	return h;
+}
+
+/*
+ * Which members differ from what we last sent for this platform.  CPU load
+ * jitters, so it has to move by SAI_LOAD_REPORT_CPU_HYST before it counts,
+ * and until then we keep reporting the old value.
+ */
+
+static unsigned int
+saib_load_report_changes(const sai_load_report_t *o, sai_load_report_t *lr,
+			 int tasks_changed)
+{
+	unsigned int chg = 0;
+
+	if (lr->core_count != o->core_count)
+		chg |= SAI_LR_CHG_CORE_COUNT;
+	if (lr->initial_free_ram_kib != o->initial_free_ram_kib)
+		chg |= SAI_LR_CHG_RAM;
+	if (lr->reserved_ram_kib != o->reserved_ram_kib)
+		chg |= SAI_LR_CHG_RESERVED_RAM;
+	if (lr->initial_free_disk_kib != o->initial_free_disk_kib)
+		chg |= SAI_LR_CHG_DISK;
+	if (lr->reserved_disk_kib != o->reserved_disk_kib)
+		chg |= SAI_LR_CHG_RESERVED_DISK;
+	if (lr->active_steps != o->active_steps)
+		chg |= SAI_LR_CHG_ACTIVE_STEPS;
+	if (lr->cpu_percent + SAI_LOAD_REPORT_CPU_HYST <= o->cpu_percent ||
+	    o->cpu_percent + SAI_LOAD_REPORT_CPU_HYST <= lr->cpu_percent)
+		chg |= SAI_LR_CHG_CPU;
+	else
+		lr->cpu_percent = o->cpu_percent;
+	if (lr->txq_mem_kib != o->txq_mem_kib)
+		chg |= SAI_LR_CHG_TXQ_MEM;
+	if (lr->txq_spill_kib != o->txq_spill_kib)
+		chg |= SAI_LR_CHG_TXQ_SPILL;
+	if (lr->txq_dropped != o->txq_dropped)
+		chg |= SAI_LR_CHG_TXQ_DROPPED;
+	if (tasks_changed)
+		chg |= SAI_LR_CHG_ACTIVE_TASKS;
+
+	return chg;
+}
+
 void
 saib_sul_load_report_cb(struct lws_sorted_usec_list *sul)
 {
 	struct sai_plat_server *spm = lws_container_of(sul,
 				       struct sai_plat_server, sul_load_report);
-	char any_platform_on_this_spm_active = 0;
-	int n;
+	lws_struct_map_t members[LWS_ARRAY_SIZE(lsm_load_report_members)],
+			 schema[1];
+	char any_platform_on_this_spm_active = 0, any_change = 0;
+	const saib_load_sample_t *ls = saib_load_sample(&builder);
+	lws_usec_t now = lws_now_usecs();
+	size_t m, n;
+	int r;
 
 	/*
 	 * This builder process may have multiple platforms, each with
@@ -430,14 +704,22 @@ saib_sul_load_report_cb(struct lws_sorted_usec_list *sul)
 	 * is active for this server, OR if it was active the last time we
 	 * checked (ie, it has just become idle, so we need to send one last
 	 * report with no active tasks to clear the UI).
+	 *
+	 * The machine-level numbers come from one shared sample per tick, and
+	 * we only send the members that changed since the last report for
+	 * the platform, or nothing at all if nothing changed.  Every
+	 * SAI_LOAD_REPORT_FULL_US we send everything anyway, so the server
+	 * can't stay wrong for long.
 	 */
 
 	lws_start_foreach_dll(struct lws_dll2 *, p, builder.sai_plat_owner.head) {
 		struct sai_plat *sp = lws_container_of(p, sai_plat_t, sai_plat_list);
 		sai_plat_server_ref_t *ref = NULL;
 		struct lwsac *ac = NULL;
+		uint32_t thash = 2166136261u;
 		sai_load_report_t lr;
 		char is_active = 0;
+		unsigned int chg;
 
 		/*
 		 * Find the specific ref for this platform and this server
@@ -453,7 +735,7 @@ saib_sul_load_report_cb(struct lws_sorted_usec_list *sul)
 		} lws_end_foreach_dll(s);
 
 		if (!ref) /* This platform doesn't use this server connection */
-			continue;
+			goto around;
 
 		/*
 		 * Check for active tasks on this platform for this server conn
@@ -474,18 +756,31 @@ saib_sul_load_report_cb(struct lws_sorted_usec_list *sul)
 		if (!is_active && !ref->was_active)
 			goto around;
 
+		if (spm->txq_bytes > SAIB_TXQ_MEM_LIMIT) {
+			/*
+			 * The link is backed up, there's no point adding to
+			 * it with reports that will be stale when they arrive
+			 */
+			spm->txq_dropped++;
+			goto around;
+		}
+
 		/* This platform is active for this spm, or just became idle */
 
 		memset(&lr, 0, sizeof(lr));
 
 		lws_strncpy(lr.builder_name, sp->name, sizeof(lr.builder_name));
-		lr.core_count			= saib_get_cpu_count();
-		lr.initial_free_ram_kib		= saib_get_total_ram_kib();
-		lr.initial_free_disk_kib	= saib_get_total_disk_kib(builder.home);
+		lr.core_count			= ls->core_count;
+		lr.initial_free_ram_kib		= ls->total_ram_kib;
+		lr.initial_free_disk_kib	= ls->total_disk_kib;
 		lr.reserved_ram_kib		= 0;
 		lr.reserved_disk_kib		= 0;
-		lr.cpu_percent			= (unsigned int)saib_get_system_cpu(&builder);
+		lr.cpu_percent			= ls->cpu_percent;
 		lr.active_steps			= 0;
+		lr.txq_mem_kib			= (unsigned int)(spm->txq_bytes / 1024);
+		lr.txq_spill_kib		= (unsigned int)
+				((spm->txq_spill_wr - spm->txq_spill_rd) / 1024);
+		lr.txq_dropped			= spm->txq_dropped;
 		lws_dll2_owner_clear(&lr.active_tasks);
 
 		if (is_active) {
@@ -509,19 +804,66 @@ saib_sul_load_report_cb(struct lws_sorted_usec_list *sul)
 
 						lr.reserved_ram_kib	+= ns->task->est_peak_mem_kib;
 						lr.reserved_disk_kib	+= ns->task->est_disk_kib;
+
+						thash = saib_load_report_hash(thash,
+							ati->task_uuid, strlen(ati->task_uuid));
+						thash = saib_load_report_hash(thash,
+							&ati->build_step, sizeof(ati->build_step));
 					}
 				}
 			} lws_end_foreach_dll(d);
 		}
 
-		n = saib_srv_queue_json_fragments_helper(spm->ss,
-				lsm_schema_json_loadreport,
-				LWS_ARRAY_SIZE(lsm_schema_json_loadreport), &lr);
+		chg = saib_load_report_changes(&ref->last_lr, &lr,
+					       thash != ref->last_tasks_hash);
+		if (chg)
+			any_change = 1;
+
+		if (ref->last_full &&
+		    now - ref->last_full < SAI_LOAD_REPORT_FULL_US) {
+			if (!chg) {
+				/* nothing to tell the server */
+				lwsac_free(&ac);
+				ref->was_active = is_active;
+				goto around;
+			}
+
+			lr.changed = chg;
+		} else
+			chg = SAI_LR_CHG_ALL;
+
+		/*
+		 * builder_name and changed are always there, the rest only if
+		 * they're in chg
+		 */
+
+		m = 0;
+		members[m++] = lsm_load_report_members[0];
+		for (n = 1; n < LWS_ARRAY_SIZE(lsm_load_report_members) - 1; n++)
+			if (chg & (1u << (n - 1)))
+				members[m++] = lsm_load_report_members[n];
+		members[m++] = lsm_load_report_members[
+				LWS_ARRAY_SIZE(lsm_load_report_members) - 1];
+
+		schema[0]		 = lsm_schema_json_loadreport[0];
+		schema[0].child_map	 = members;
+		schema[0].child_map_size = m;
+
+		r = saib_srv_queue_json_fragments_helper(spm->ss, schema,
+				LWS_ARRAY_SIZE(schema), &lr, SAIB_TXQ_STATUS);
 
 		lwsac_free(&ac);
 
-		if (n)
+		if (r) {
 			lwsl_warn("%s: failed to queue fragments\n", __func__);
+			goto around;
+		}
+
+		ref->last_lr = lr;
+		lws_dll2_owner_clear(&ref->last_lr.active_tasks);
+		ref->last_tasks_hash = thash;
+		if (!lr.changed)
+			ref->last_full = now;
 
 		ref->was_active = is_active;
 
@@ -529,10 +871,22 @@ around:
 		;
 	} lws_end_foreach_dll(p);
 
-	if (any_platform_on_this_spm_active)
-		/* Reschedule the timer only if at least one active instance */
-		lws_sul_schedule(builder.context, 0, &spm->sul_load_report,
-			saib_sul_load_report_cb, SAI_LOAD_REPORT_US);
+	if (!any_platform_on_this_spm_active)
+		return;
+
+	/*
+	 * Reschedule the timer only if at least one active instance.  While
+	 * nothing is changing we back off, and come back to the normal rate as
+	 * soon as something does.
+	 */
+
+	if (any_change || !spm->lr_interval)
+		spm->lr_interval = SAI_LOAD_REPORT_US;
+	else if (spm->lr_interval < SAI_LOAD_REPORT_MAX_US)
+		spm->lr_interval *= 2;
+
+	lws_sul_schedule(builder.context, 0, &spm->sul_load_report,
+			 saib_sul_load_report_cb, spm->lr_interval);
 }
 
 static lws_ss_state_return_t
@@ -561,6 +915,8 @@ saib_m_state(void *userobj, void *sh, lws_ss_constate_t state,
 		 */
 
 		spm->index = a->next_server_index++;
+		spm->txq_spill_fd = -1;
+		spm->txq_cur = -1;
 
 		/* hook the ss up to the server url */
 
@@ -596,6 +952,14 @@ saib_m_state(void *userobj, void *sh, lws_ss_constate_t state,
 		while (strchr(spm->name, '/'))
 			*strchr(spm->name, '/') = '_';
 
+		/* any journal left from a previous run is for dead tasks */
+		{
+			char path[256];
+
+			saib_txq_spill_path(spm, path, sizeof(path));
+			unlink(path);
+		}
+
 		/* add us to the builder list of unique servers */
 		lws_dll2_add_head(&spm->list, &a->builder->sai_plat_server_owner);
 
@@ -615,19 +979,23 @@ saib_m_state(void *userobj, void *sh, lws_ss_constate_t state,
 		 */
 		lws_dll2_foreach_safe(&builder.sai_plat_owner, spm,
 				      cleanup_on_ss_destroy);
+		saib_srv_queue_destroy(spm);
 
 		break;
 
 	case LWSSSCS_CONNECTED:
 		lwsl_ss_user(spm->ss, "CONNECTED");
 		/* Initialize the load report SUL timer for this server connection */
+		saib_load_report_force_full(spm);
 		lws_sul_schedule(builder.context, 0, &spm->sul_load_report,
 				 saib_sul_load_report_cb, 1);
 
+		saib_warm_refresh();
+
 		if (saib_srv_queue_json_fragments_helper(spm->ss,
 				lsm_schema_map_plat,
 				LWS_ARRAY_SIZE(lsm_schema_map_plat),
-				&builder.sai_plat_owner))
+				&builder.sai_plat_owner, SAIB_TXQ_CONTROL))
 			return -1;
 
 		return 0;
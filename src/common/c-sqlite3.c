@@ -25,33 +25,50 @@
 
 #include "include/private.h"
 
-int
-sai_event_db_ensure_open(struct lws_context *cx, lws_dll2_owner_t *sqlite3_cache,
-			 const char *sqlite3_path_lhs, const char *event_uuid,
-			 char create_if_needed, sqlite3 **ppdb)
-{
-	char filepath[256], saf[33];
-	sais_sqlite_cache_t *sc;
+/* how much of a read-only db we let sqlite mmap */
+#define SAI_SQLITE3_RO_MMAP_SIZE	"268435456"
 
-	// lwsl_notice("%s: (sai-server) entry\n", __func__);
+/*
+ * Open an existing db only for reading, eg, from sai-web which never writes.
+ * In WAL mode these readers never block sai-server writing, and we let sqlite
+ * mmap the db so reads come straight out of the page cache.
+ */
 
-	if (*ppdb)
-		return 0;
+int
+sai_sqlite3_open_ro(const char *filepath, sqlite3 **ppdb)
+{
+	if (sqlite3_open_v2(filepath, ppdb, SQLITE_OPEN_READONLY, NULL) !=
+								SQLITE_OK) {
+		lwsl_err("%s: Unable to open %s: %s\n", __func__, filepath,
+			 *ppdb ? sqlite3_errmsg(*ppdb) : "OOM");
+		if (*ppdb)
+			sqlite3_close(*ppdb);
+		*ppdb = NULL;
 
-	/* do we have this guy cached? */
+		return 1;
+	}
 
-	lws_start_foreach_dll(struct lws_dll2 *, p, sqlite3_cache->head) {
-		sc = lws_container_of(p, sais_sqlite_cache_t, list);
+	sqlite3_busy_timeout(*ppdb, 2000);
+	sqlite3_exec(*ppdb, "PRAGMA mmap_size=" SAI_SQLITE3_RO_MMAP_SIZE ";",
+		     NULL, NULL, NULL);
+	sqlite3_exec(*ppdb, "PRAGMA query_only=1;", NULL, NULL, NULL);
 
-		if (!strcmp(event_uuid, sc->uuid)) {
-			sc->refcount++;
-			*ppdb = sc->pdb;
-			return 0;
-		}
+	return 0;
+}
 
-	} lws_end_foreach_dll(p);
+/*
+ * Open an event db read-write without involving any cache, creating it and
+ * its tables if allowed.  This is also safe to call from a thread other than
+ * the event loop.
+ */
 
-	/* ... nope, well, let's open and cache him then... */
+int
+sai_event_db_open_uncached(struct lws_context *cx, const char *sqlite3_path_lhs,
+			   const char *event_uuid, char create_if_needed,
+			   sqlite3 **ppdb)
+{
+	char filepath[256], saf[33];
+	int r = 0;
 
 	lws_strncpy(saf, event_uuid, sizeof(saf));
 	lws_filename_purify_inplace(saf);
@@ -66,29 +83,93 @@ sai_event_db_ensure_open(struct lws_context *cx, lws_dll2_owner_t *sqlite3_cache
 		return 2;
 	}
 
+	/*
+	 * sai-server's db writer thread may be committing to this db on its
+	 * own connection, wait a little for it rather than failing
+	 */
+	sqlite3_busy_timeout(*ppdb, 1000);
+
 	/* create / add to the schema for the tables we will have in here */
 
 	if (lws_struct_sq3_create_table(*ppdb, lsm_schema_sq3_map_task)) {
 		lwsl_err("%s: unable to create task table in %s\n", __func__, filepath);
-		return 3;
+		r = 3;
+		goto bail;
 	}
 
 	sai_sqlite3_statement(*ppdb, "PRAGMA journal_mode=WAL;", "set WAL");
 
 	if (lws_struct_sq3_create_table(*ppdb, lsm_schema_sq3_map_log)) {
 		lwsl_err("%s: unable to create log table in %s\n", __func__, filepath);
-
-		return 4;
+		r = 4;
+		goto bail;
 	}
 
 	if (lws_struct_sq3_create_table(*ppdb, lsm_schema_sq3_map_artifact)) {
 		lwsl_err("%s: unable to create artifact table in %s\n", __func__, filepath);
+		r = 5;
+		goto bail;
+	}
 
-		return 5;
+	return 0;
+
+bail:
+	lws_struct_sq3_close(ppdb);
+	*ppdb = NULL;
+
+	return r;
+}
+
+int
+sai_event_db_ensure_open(struct lws_context *cx, lws_dll2_owner_t *sqlite3_cache,
+			 const char *sqlite3_path_lhs, const char *event_uuid,
+			 char create_if_needed, sqlite3 **ppdb)
+{
+	char filepath[256], saf[33];
+	sais_sqlite_cache_t *sc;
+	int m;
+
+	// lwsl_notice("%s: (sai-server) entry\n", __func__);
+
+	if (*ppdb)
+		return 0;
+
+	/* do we have this guy cached? */
+
+	lws_start_foreach_dll(struct lws_dll2 *, p, sqlite3_cache->head) {
+		sc = lws_container_of(p, sais_sqlite_cache_t, list);
+
+		if (!strcmp(event_uuid, sc->uuid)) {
+			sc->refcount++;
+			*ppdb = sc->pdb;
+			return 0;
+		}
+
+	} lws_end_foreach_dll(p);
+
+	/* ... nope, well, let's open and cache him then... */
+
+	lws_strncpy(saf, event_uuid, sizeof(saf));
+	lws_filename_purify_inplace(saf);
+
+	lws_snprintf(filepath, sizeof(filepath), "%s-event-%s.sqlite3",
+		     sqlite3_path_lhs, saf);
+
+	if (create_if_needed == SAI_DB_OPEN_RO) {
+		/* the writer already made the schema, we can't anyway */
+		if (sai_sqlite3_open_ro(filepath, ppdb))
+			return 2;
+
+		goto cache;
 	}
 
+	m = sai_event_db_open_uncached(cx, sqlite3_path_lhs, event_uuid,
+				       create_if_needed, ppdb);
+	if (m)
+		return m;
+
+cache:
 	sc = malloc(sizeof(*sc));
-	memset(sc, 0, sizeof(*sc));
 	if (!sc) {
 		lwsl_err("%s: unable to alloc sc for %s\n", __func__, filepath);
 
@@ -96,6 +177,7 @@ sai_event_db_ensure_open(struct lws_context *cx, lws_dll2_owner_t *sqlite3_cache
 		*ppdb = NULL;
 		return 6;
 	}
+	memset(sc, 0, sizeof(*sc));
 
 	lws_strncpy(sc->uuid, event_uuid, sizeof(sc->uuid));
 	sc->refcount = 1;
@@ -160,6 +242,29 @@ sai_event_db_close_all_now(lws_dll2_owner_t *sqlite3_cache)
 	return 0;
 }
 
+/*
+ * Drop any cached connection to one event db, whatever its refcount, eg,
+ * because the event is going away
+ */
+
+void
+sai_event_db_close_now(lws_dll2_owner_t *sqlite3_cache, const char *event_uuid)
+{
+	sais_sqlite_cache_t *sc;
+
+	lws_start_foreach_dll(struct lws_dll2 *, p, sqlite3_cache->head) {
+		sc = lws_container_of(p, sais_sqlite_cache_t, list);
+
+		if (!strcmp(event_uuid, sc->uuid)) {
+			lws_struct_sq3_close(&sc->pdb);
+			lws_dll2_remove(&sc->list);
+			free(sc);
+			return;
+		}
+
+	} lws_end_foreach_dll(p);
+}
+
 int
 sai_event_db_delete_database(const char *sqlite3_path_lhs, const char *event_uuid)
 {
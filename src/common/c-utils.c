@@ -90,6 +90,34 @@ sai_task_describe(sai_task_t *task, char *buf, size_t len)
 	return buf;
 }
 
+/*
+ * Artifact content is stored in a dir named by the hex sha256 of the content,
+ * fanned out by the first two hex chars, eg, <store>/3f/3fa9...
+ *
+ * Since the hash may have come from a db or a URL, reject anything that isn't
+ * exactly 64 hex chars rather than let it near a filepath.
+ */
+
+int
+sai_artifact_store_path(char *path, size_t len, const char *store,
+			const char *hash)
+{
+	int n;
+
+	for (n = 0; n < 64; n++)
+		if (!((hash[n] >= '0' && hash[n] <= '9') ||
+		      (hash[n] >= 'a' && hash[n] <= 'f') ||
+		      (hash[n] >= 'A' && hash[n] <= 'F')))
+			return 1;
+
+	if (hash[64])
+		return 1;
+
+	lws_snprintf(path, len, "%s/%c%c/%s", store, hash[0], hash[1], hash);
+
+	return 0;
+}
+
 void
 sai_dump_stderr(const uint8_t *buf, size_t w)
 {
@@ -37,6 +37,12 @@
 
 #define SAI_BUILDER_INSTANCE_LIMIT 256
 
+/*
+ * Tasks whose .sai.json configuration sets "warm" may keep their build dir
+ * on a builder between events, see b-warm.c.  This many per platform.
+ */
+#define SAI_WARM_MAX 32
+
 struct sai_plat;
 struct sai_builder;
 struct saib_opaque_spawn;
@@ -53,6 +59,7 @@ typedef enum {
 
 	SAIES_NOT_READY_FOR_BUILD		= 8,
 	SAIES_STEP_SUCCESS			= 9,
+	SAIES_CACHED_SUCCESS			= 10, /* same task passed before */
 } sai_event_state_t;
 
 enum {
@@ -92,9 +99,36 @@ typedef struct sai_load_report {
 	unsigned int			reserved_disk_kib;
 	unsigned int			active_steps;
 	unsigned int			cpu_percent;
+	unsigned int			txq_mem_kib;	/* queued to srv in memory */
+	unsigned int			txq_spill_kib;	/* queued to srv on disk */
+	unsigned int			txq_dropped;	/* load reports skipped */
 	lws_dll2_owner_t		active_tasks;
+	unsigned int			changed; /* SAI_LR_CHG_, 0 = full */
 } sai_load_report_t;
 
+/*
+ * A load report may only carry the members that changed since the last one
+ * for the same platform, these bits in .changed say which ones it has.  The
+ * bits follow the order of lsm_load_report_members[] after builder_name,
+ * which is always present.
+ */
+
+enum {
+	SAI_LR_CHG_CORE_COUNT		= (1 << 0),
+	SAI_LR_CHG_RAM			= (1 << 1),
+	SAI_LR_CHG_RESERVED_RAM		= (1 << 2),
+	SAI_LR_CHG_DISK			= (1 << 3),
+	SAI_LR_CHG_RESERVED_DISK	= (1 << 4),
+	SAI_LR_CHG_ACTIVE_STEPS		= (1 << 5),
+	SAI_LR_CHG_CPU			= (1 << 6),
+	SAI_LR_CHG_TXQ_MEM		= (1 << 7),
+	SAI_LR_CHG_TXQ_SPILL		= (1 << 8),
+	SAI_LR_CHG_TXQ_DROPPED		= (1 << 9),
+	SAI_LR_CHG_ACTIVE_TASKS		= (1 << 10),
+
+	SAI_LR_CHG_ALL			= (1 << 11) - 1
+};
+
 /*
  * viewer state.
  * Sent from server -> builder.
@@ -137,6 +171,9 @@ typedef struct {
 	char				cpack[512];
 	char				script[4096];
 	char				branches[256];
+	char				cache_key[65]; /* result cache */
+	char				cached_from[65]; /* task uuid we reuse */
+	char				warm_key[17]; /* keep a warm build dir */
 
 	struct lwsac			*ac_task_container;
 
@@ -163,6 +200,7 @@ typedef struct {
 	char				told_ongoing;
 
 	char				rebuildable;
+	char				warm; /* .sai.json parsing only */
 } sai_task_t;
 
 struct saib_logproxy {
@@ -176,6 +214,35 @@ struct saib_resproxy {
 	struct sai_nspawn		*ns;
 };
 
+/*
+ * Resource usage of one build step's cgroup over time, downsampled so it fits
+ * in SAI_STEP_SERIES_MAX points however long the step runs.  Each point
+ * covers .stride raw samples, with the averages of cpu, io and pressure and
+ * the peak memory over them.
+ */
+
+#define SAI_STEP_SERIES_MAX		48
+
+typedef struct sai_step_series_pt {
+	uint32_t			cpu_cc;		/* 1/100ths of a core */
+	uint32_t			mem_mib;	/* memory.current */
+	uint32_t			io_kibps;	/* io.stat r + w */
+	uint32_t			psi;		/* memory some avg10, 0.1% */
+} sai_step_series_pt_t;
+
+typedef struct sai_step_series {
+	sai_step_series_pt_t		pt[SAI_STEP_SERIES_MAX];
+	sai_step_series_pt_t		acc;	/* point being built */
+	char				cgdir[256];
+	uint64_t			last_cpu_usec;
+	uint64_t			last_io_bytes;
+	lws_usec_t			last_us;
+	unsigned int			count;
+	unsigned int			stride;	/* raw samples per point */
+	unsigned int			acc_n;
+	int				pid;
+} sai_step_series_t;
+
 struct sai_nspawn {
 	char				inp[512];
 	char				inp_vn[16];
@@ -197,6 +264,9 @@ struct sai_nspawn {
 	lws_sorted_usec_list_t		sul_cleaner;
 	lws_sorted_usec_list_t		sul_mirror;
 	lws_sorted_usec_list_t		sul_task_cancel;
+	lws_sorted_usec_list_t		sul_series;
+
+	sai_step_series_t		series; /* current step */
 
 	sai_plat_t			*sp; /* the sai_plat */
 	struct sai_plat_server		*spm; /* the sai plat / server with the ss / wsi */
@@ -218,7 +288,6 @@ struct sai_nspawn {
 
 	int				retcode;
 	int				instance_ordinal;
-	int				count_artifacts;
 
 	uint8_t				spins;
 	uint8_t				state;		/* NSSTATE_ */
@@ -229,6 +298,7 @@ struct sai_nspawn {
 	uint8_t				state_changed:1;
 	uint8_t				user_cancel:1;
 	uint8_t				reap_cb_called:1;
+	uint8_t				warm:1; /* using the task's warm dir */
 };
 
 /*
@@ -274,6 +344,19 @@ typedef struct sai_rebuild {
 	char				builder_name[96];
 } sai_rebuild_t;
 
+/*
+ * Server is hinting to builders that a task for repo@hash is probably coming,
+ * so they can warm their git mirror for it ahead of time
+ */
+
+typedef struct sai_prefetch {
+	lws_dll2_t			list;
+	char				repo_url[96];
+	char				ref[65];
+	char				hash[65];
+	char				mirror[96]; /* mirror name under git-mirror/ */
+} sai_prefetch_t;
+
 typedef struct sai_platreset {
 	lws_dll2_t			list;
 	char				event_uuid[65];
@@ -316,24 +399,36 @@ typedef struct {
 typedef struct {
 	struct lws_dll2			list;
 
-	struct lws_ss_handle 		*ss;
-	void				*opaque_data;
-
-	struct sai_nspawn		*ns;
 	char				task_uuid[65];
 	char				artifact_up_nonce[33];
 	char				artifact_down_nonce[33];
 	char				blob_filename[65];
-	char				path[256]; /* for unlink on completion */
-	void				*blob;
-	uint64_t			ofs;
+	char				hash[65]; /* sha256 name in artifact store */
+	char				encoding[16]; /* "" or "gzip" */
+	void				*blob; /* legacy, before artifact store */
 	uint64_t			timestamp;
-	size_t				len;
+	size_t				len; /* decoded length */
+	size_t				enc_len; /* length as uploaded / stored */
 	int				uid;
-	int				fd;
-	char				sent_json;
 } sai_artifact_t;
 
+/*
+ * Artifacts are uploaded as a series of chunks, each introduced by one of
+ * these carrying the sha256 of the chunk payload that follows it.
+ *
+ * The server also sends one back after it sees the artifact JSON, with ofs
+ * set to how much of the artifact it already holds, so interrupted uploads
+ * can resume from there.  ofs == len means the server has all of it.
+ */
+
+typedef struct {
+	uint64_t			ofs;
+	uint64_t			len;
+	char				sha256[65];
+} sai_artifact_chunk_t;
+
+#define SAI_ARTIFACT_CHUNK_MAX		(16u * 1024u * 1024u)
+
 /* communication part of resource allocation requests */
 
 typedef struct {
@@ -388,6 +483,18 @@ typedef struct {
 
 struct sai_plat;
 
+/*
+ * Builder -> server tx queue priority classes, lowest index drains first
+ */
+
+enum {
+	SAIB_TXQ_CONTROL,	/* plat list, task rej / status, resources */
+	SAIB_TXQ_STATUS,	/* load reports, build metrics */
+	SAIB_TXQ_LOGS,		/* task log chunks, may spill to disk */
+
+	SAIB_TXQ_COUNT
+};
+
 /*
  * One SS per unique server the builder connects to; one of these as the SS
  * userdata object
@@ -400,12 +507,20 @@ typedef struct sai_plat_server {
 
 	lws_dll2_owner_t		resource_pss_list; /* so we can find the cookie */
 
-	struct lws_buflist		*bl_to_srv;
+	struct lws_buflist		*bl_to_srv[SAIB_TXQ_COUNT];
+	size_t				txq_bytes; /* sum in bl_to_srv[] */
+
+	/* logs journal on disk, used when over the memory limit */
+	int				txq_spill_fd;
+	uint64_t			txq_spill_wr;
+	uint64_t			txq_spill_rd;
+	unsigned int			txq_dropped;
 
 	char				resproxy_path[128];
 
 	/* for load reporting */
 	lws_sorted_usec_list_t		sul_load_report;
+	lws_usec_t			lr_interval; /* backs off while quiet */
 	unsigned int			viewer_count;
 
 	const char			*url;
@@ -422,6 +537,8 @@ typedef struct sai_plat_server {
 	int				index;  /* used to create unique build dir path */
 
 	uint16_t			retries;
+
+	signed char			txq_cur; /* class mid-message, or -1 */
 } sai_plat_server_t;
 
 struct sai_env {
@@ -434,6 +551,12 @@ struct sai_env {
 typedef struct sai_plat_server_ref {
 	lws_dll2_t			list;
 	sai_plat_server_t		*spm;
+
+	/* what we last told this server about this platform */
+	sai_load_report_t		last_lr; /* scalars only */
+	uint32_t			last_tasks_hash;
+	lws_usec_t			last_full;
+
 	char				was_active;
 } sai_plat_server_ref_t;
 
@@ -512,6 +635,7 @@ typedef struct sai_plat {
 	lws_dll2_owner_t		env_head;
 	char				sai_hash[41];
 	char				lws_hash[41];
+	char				warm[SAI_WARM_MAX * 17]; /* warm_keys held */
 	uint64_t			uid;
 	lws_dll2_owner_t		loads;
 	int				online; /* 1 = connected, 0 = offline */
@@ -556,10 +680,17 @@ typedef struct sai_browse_rx_evinfo {
 
 typedef struct sai_browse_rx_taskinfo {
 	char				task_hash[65];
+	char				before_uuid[65]; /* ...tiebreak */
 	uint64_t			last_log_ts;
+	uint64_t			before; /* overview page cursor */
+	uint64_t			ov_from; /* overview version we have */
+	unsigned int			ov_epoch; /* ...in this epoch, or 0 */
+	unsigned int			ov_auth; /* ...and our auth state then */
+	unsigned int			limit; /* overview page size */
 	unsigned int			log_start;
 	unsigned int			js_api_version;
 	uint8_t				logs;
+	uint8_t				bin; /* browser takes binary log frames */
 } sai_browse_rx_taskinfo_t;
 
 /* sai-power -> sai-server, tells it that a platform is being powered up */
@@ -586,6 +717,10 @@ typedef struct sai_build_metric {
 	uint64_t			stg_bytes;
 	int				parallel;
 	int				step;
+	unsigned int			series_ms; /* per point in series */
+	char				series[1536]; /* "cpu,mem,io,psi;..." */
+	unsigned int			cc_hits; /* compiler cache */
+	unsigned int			cc_misses;
 } sai_build_metric_t;
 
 /*
@@ -677,9 +812,12 @@ extern const lws_struct_map_t
 	lsm_schema_map_ta[1],
 	lsm_schema_map_plat_simple[1],
 	lsm_event[11],
-	lsm_task[30],
+	lsm_task[33],
 	lsm_log[7],
-	lsm_artifact[8],
+	lsm_artifact[11],
+	lsm_artifact_chunk[3],
+	lsm_schema_json_map_artifact_chunk[1],
+	lsm_schema_json_map_artifact_resume[1],
 	lsm_plat_list[1],
 	lsm_schema_map_plat[1],
 	lsm_task_rej[4],
@@ -691,15 +829,17 @@ extern const lws_struct_map_t
 	lsm_power_state[3],
 	lsm_rebuild[1],
 	lsm_schema_rebuild[1],
+	lsm_prefetch[4],
+	lsm_schema_prefetch[1],
 	lsm_schema_build_metric[1],
 	lsm_schema_map_build_metric[1],
 	lsm_schema_sq3_map_build_metric[1],
-	lsm_load_report_members[9],
+	lsm_load_report_members[13],
 	lsm_schema_json_task_rej[5],
 	lsm_stay_state_update[2],
 	lsm_schema_stay_state_update[1],
-	lsm_build_metric[14],
-	lsm_plat[14], /* +1 for pcon */
+	lsm_build_metric[18],
+	lsm_plat[15], /* +1 for pcon */
 	lsm_builder_platform[1],
 	lsm_builder_registration[3],
 	lsm_schema_sq3_map_power_controller[1],
@@ -729,6 +869,10 @@ sai_uuid16_create(struct lws_context *context, char *dest33);
 const char *
 sai_task_describe(sai_task_t *task, char *buf, size_t len);
 
+int
+sai_artifact_store_path(char *path, size_t len, const char *store,
+			const char *hash);
+
 int
 sai_metrics_hash(uint8_t *key, size_t key_len, const char *sp_name,
 		 const char *spawn, const char *project_name,
@@ -756,16 +900,32 @@ lws_ss_state_return_t
 sai_ss_tx_from_buflist_helper(struct lws_ss_handle *ss, struct lws_buflist **buflist,
 			      uint8_t *buf, size_t *len, int *flags);
 
+/* create_if_needed for sai_event_db_ensure_open() */
+enum {
+	SAI_DB_OPEN_EXISTING,
+	SAI_DB_OPEN_CREATE,
+	SAI_DB_OPEN_RO,		/* existing, read-only (sai-web) */
+};
+
 int
 sai_event_db_ensure_open(struct lws_context *cx, lws_dll2_owner_t *sqlite3_cache,
 			 const char *sqlite3_path_lhs, const char *event_uuid,
 			  char create_if_needed, sqlite3 **ppdb);
+int
+sai_event_db_open_uncached(struct lws_context *cx, const char *sqlite3_path_lhs,
+			   const char *event_uuid, char create_if_needed,
+			   sqlite3 **ppdb);
+int
+sai_sqlite3_open_ro(const char *filepath, sqlite3 **ppdb);
 void
 sai_event_db_close(lws_dll2_owner_t *sqlite3_cache, sqlite3 **ppdb);
 
 int
 sai_event_db_close_all_now(lws_dll2_owner_t *sqlite3_cache);
 
+void
+sai_event_db_close_now(lws_dll2_owner_t *sqlite3_cache, const char *event_uuid);
+
 int
 sai_event_db_delete_database(const char *sqlite3_path_lhs, const char *event_uuid);
 
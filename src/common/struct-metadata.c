@@ -47,8 +47,12 @@ const lws_struct_map_t lsm_load_report_members[] = {
 	LSM_UNSIGNED	(sai_load_report_t, reserved_disk_kib,		"reserved_disk_kib"),
 	LSM_UNSIGNED	(sai_load_report_t, active_steps,		"active_steps"),
 	LSM_UNSIGNED	(sai_load_report_t, cpu_percent,		"cpu_percent"),
+	LSM_UNSIGNED	(sai_load_report_t, txq_mem_kib,		"txq_mem_kib"),
+	LSM_UNSIGNED	(sai_load_report_t, txq_spill_kib,		"txq_spill_kib"),
+	LSM_UNSIGNED	(sai_load_report_t, txq_dropped,		"txq_dropped"),
 	LSM_LIST	(sai_load_report_t, active_tasks, sai_active_task_info_t, list,
 			 NULL, lsm_active_task_info,			"active_tasks"),
+	LSM_UNSIGNED	(sai_load_report_t, changed,			"changed"),
 };
 
 const lws_struct_map_t lsm_build_metric[] = {
@@ -66,6 +70,10 @@ const lws_struct_map_t lsm_build_metric[] = {
 	LSM_UNSIGNED	(sai_build_metric_t, stg_bytes,		"stg_bytes"),
 	LSM_SIGNED	(sai_build_metric_t, parallel,		"parallel"),
 	LSM_UNSIGNED	(sai_build_metric_t, step,		"step"),
+	LSM_UNSIGNED	(sai_build_metric_t, series_ms,		"series_ms"),
+	LSM_CARRAY	(sai_build_metric_t, series,		"series"),
+	LSM_UNSIGNED	(sai_build_metric_t, cc_hits,		"cc_hits"),
+	LSM_UNSIGNED	(sai_build_metric_t, cc_misses,		"cc_misses"),
 };
 
 const lws_struct_map_t lsm_schema_map_build_metric[] = {
@@ -92,6 +100,7 @@ const lws_struct_map_t lsm_plat[] = {
 	LSM_UNSIGNED	(sai_plat_t, windows,		"windows"),
 	LSM_UNSIGNED	(sai_plat_t, power_managed,	"power_managed"),
 	LSM_UNSIGNED	(sai_plat_t, stay_on,		"stay_on"),
+	LSM_CARRAY	(sai_plat_t, warm,		"warm"),
 };
 
 const lws_struct_map_t lsm_schema_map_plat_simple[] = {
@@ -174,6 +183,9 @@ const lws_struct_map_t lsm_task[] = {
 	LSM_UNSIGNED	(sai_task_t, est_compute_ms,	"est_compute_ms"),
 	LSM_SIGNED	(sai_task_t, parallel,		"parallel"),
 	LSM_SIGNED	(sai_task_t, rebuildable,	"rebuildable"),
+	LSM_CARRAY	(sai_task_t, cache_key,		"cache_key"),
+	LSM_CARRAY	(sai_task_t, cached_from,	"cached_from"),
+	LSM_CARRAY	(sai_task_t, warm_key,		"warm_key"),
 };
 
 const lws_struct_map_t lsm_schema_json_map_task[] = {
@@ -214,6 +226,18 @@ const lws_struct_map_t lsm_schema_rebuild[] = {
 						     "com.warmcat.sai.rebuild")
 };
 
+const lws_struct_map_t lsm_prefetch[] = {
+	LSM_CARRAY	(sai_prefetch_t, repo_url,	"repo_url"),
+	LSM_CARRAY	(sai_prefetch_t, ref,		"ref"),
+	LSM_CARRAY	(sai_prefetch_t, hash,		"hash"),
+	LSM_CARRAY	(sai_prefetch_t, mirror,	"mirror"),
+};
+
+const lws_struct_map_t lsm_schema_prefetch[] = {
+	LSM_SCHEMA	(sai_prefetch_t, NULL, lsm_prefetch,
+						     "com.warmcat.sai.prefetch")
+};
+
 const lws_struct_map_t lsm_schema_json_map_can[] = {
 	LSM_SCHEMA	(sai_cancel_t, NULL, lsm_task_cancel,
 						     "com.warmcat.sai.taskcan")
@@ -281,8 +305,13 @@ const lws_struct_map_t lsm_artifact[] = {
 	/* created server-side (not sent to builder), used in artifact links we generate */
 	LSM_CARRAY	(sai_artifact_t, artifact_down_nonce,	"artifact_down_nonce"),
 	LSM_BLOB_PTR	(sai_artifact_t, blob,			"blob"),
+	/* sha256 naming the content in the server artifact store */
+	LSM_CARRAY	(sai_artifact_t, hash,			"hash"),
+	/* content-encoding of the stored content, if any */
+	LSM_CARRAY	(sai_artifact_t, encoding,		"encoding"),
 	LSM_UNSIGNED	(sai_artifact_t, timestamp,		"timestamp"),
 	LSM_UNSIGNED	(sai_artifact_t, len,			"len"),
+	LSM_UNSIGNED	(sai_artifact_t, enc_len,		"enc_len"),
 };
 
 const lws_struct_map_t lsm_schema_json_map_artifact[] = {
@@ -300,6 +329,24 @@ const lws_struct_map_t lsm_schema_sq3_map_artifact[] = {
 	LSM_SCHEMA_DLL2	(sai_artifact_t, list, NULL, lsm_artifact, "artifacts"),
 };
 
+const lws_struct_map_t lsm_artifact_chunk[] = {
+	LSM_UNSIGNED	(sai_artifact_chunk_t, ofs,		"ofs"),
+	LSM_UNSIGNED	(sai_artifact_chunk_t, len,		"len"),
+	LSM_CARRAY	(sai_artifact_chunk_t, sha256,		"sha256"),
+};
+
+/* builder -> server, followed by len bytes of artifact payload */
+const lws_struct_map_t lsm_schema_json_map_artifact_chunk[] = {
+	LSM_SCHEMA	(sai_artifact_chunk_t, NULL, lsm_artifact_chunk,
+			 "com-warmcat-sai-artifact-chunk"),
+};
+
+/* server -> builder, where to resume the upload from */
+const lws_struct_map_t lsm_schema_json_map_artifact_resume[] = {
+	LSM_SCHEMA	(sai_artifact_chunk_t, NULL, lsm_artifact_chunk,
+			 "com-warmcat-sai-artifact-resume"),
+};
+
 const lws_struct_map_t lsm_stay[] = {
 	LSM_CARRAY(sai_stay_t, builder_name,			"builder_name"),
 	LSM_UNSIGNED(sai_stay_t, stay_on,			"stay_on"),
@@ -0,0 +1,817 @@
+/*
+ * Sai server - content-addressed artifact store
+ *
+ * Copyright (C) 2019 - 2025 Andy Green <andy@warmcat.com>
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation:
+ *  version 2.1 of the License.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *  MA  02110-1301  USA
+ *
+ * Artifact content is not kept in the event databases, instead it lives in
+ * files named by the SHA-256 of the content under the artifact store dir, so
+ * identical artifacts from rebuilds or other platforms are only stored once.
+ * sai-web serves them directly from there.
+ *
+ * The artifacts table in the event db just records the metadata and the hash.
+ * The artifact_store table in the events db keeps a refcount for each stored
+ * hash, so we know when the last event referencing it has gone away.
+ *
+ * A builder can skip uploading content we already store by telling us its
+ * hash, but since we can't check it has the content, we only allow that for
+ * content somebody uploaded for an event of the same repo.  The repos that
+ * uploaded each hash are listed in the artifact_store_repos table.
+ *
+ * While it's being uploaded, the content is spooled into a "part-" file named
+ * from the upload nonce, builder timestamp and filename of the artifact, so a
+ * builder that lost its connection can come back and resume the upload from
+ * the last chunk we verified.  How far that is, is kept in a ".ofs" file next
+ * to it.  The content hash of what we already have is caught up a slice at a
+ * time from the event loop before we tell the builder where to resume, so a
+ * big resume doesn't stall everything else.  Partials nobody resumed get
+ * cleaned at startup.
+ *
+ * Content that lost its last reference may be renamed to a "dead-" file for
+ * the db writer thread to unlink later, so big files don't stall the loop.
+ * Any still around at startup are removed then.
+ *
+ * Builders may send the content gzip-encoded, in which case it's stored that
+ * way and the encoding recorded alongside.  The store name is still the hash
+ * of the decoded content, which we compute ourselves by inflating it as it
+ * arrives, so the same artifact dedupes however it was sent.
+ */
+
+#include <libwebsockets.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "s-private.h"
+
+typedef struct {
+	char		encoding[16];
+	uint64_t	len;
+	int		rows;
+} sais_store_row_t;
+
+static int
+sais_store_row_cb(void *user, int cols, char **values, char **name)
+{
+	sais_store_row_t *r = (sais_store_row_t *)user;
+
+	if (cols < 2)
+		return 0;
+
+	lws_strncpy(r->encoding, values[0] ? values[0] : "",
+		    sizeof(r->encoding));
+	r->len = values[1] ? (uint64_t)atoll(values[1]) : 0;
+	r->rows++;
+
+	return 0;
+}
+
+/*
+ * Hash the decoded content, inflating it first if it's gzip-encoded
+ */
+
+static int
+sais_artifact_hash_update(struct pss *pss, const uint8_t *buf, size_t len)
+{
+	z_stream *zs = (z_stream *)pss->artifact_zs;
+	uint8_t ob[4096];
+	int r;
+
+	if (!zs)
+		return lws_genhash_update(&pss->artifact_hash_ctx, buf, len);
+
+	zs->next_in = (Bytef *)buf;
+	zs->avail_in = (uInt)len;
+
+	while (zs->avail_in) {
+		zs->next_out = ob;
+		zs->avail_out = sizeof(ob);
+
+		r = inflate(zs, Z_NO_FLUSH);
+		if (r != Z_OK && r != Z_STREAM_END)
+			return 1;
+
+		if (lws_genhash_update(&pss->artifact_hash_ctx, ob,
+				       sizeof(ob) - zs->avail_out))
+			return 1;
+
+		if (r == Z_STREAM_END)
+			/* trailing junk is not tolerated */
+			return !!zs->avail_in;
+	}
+
+	return 0;
+}
+
+static void
+sais_artifact_inflate_destroy(struct pss *pss)
+{
+	if (!pss->artifact_zs)
+		return;
+
+	inflateEnd((z_stream *)pss->artifact_zs);
+	free(pss->artifact_zs);
+	pss->artifact_zs = NULL;
+}
+
+static int
+sais_artifact_sweep_cb(const char *dirpath, void *user, struct lws_dir_entry *lde)
+{
+	char path[384];
+	struct stat st;
+
+	if (lde->type != LDOT_FILE)
+		return 0;
+
+	lws_snprintf(path, sizeof(path), "%s/%s", dirpath, lde->name);
+
+	if (!strncmp(lde->name, "dead-", 5)) {
+		/* the writer didn't get to it before we stopped */
+		unlink(path);
+		return 0;
+	}
+
+	if (strncmp(lde->name, "part-", 5))
+		return 0;
+
+	if (!stat(path, &st) &&
+	    (uint64_t)st.st_mtime + SAIS_ARTIFACT_PARTIAL_AGE_SECS <
+						(uint64_t)lws_now_secs()) {
+		lwsl_notice("%s: removing stale partial %s\n", __func__, path);
+		unlink(path);
+	}
+
+	return 0;
+}
+
+int
+sais_artifact_store_init(struct vhd *vhd, void *pvo)
+{
+	const char *cp;
+
+	if (!lws_pvo_get_str(pvo, "artifact-store", &cp))
+		lws_strncpy(vhd->artifact_store, cp, sizeof(vhd->artifact_store));
+	else
+		lws_snprintf(vhd->artifact_store, sizeof(vhd->artifact_store),
+			     "%s-artifacts", vhd->sqlite3_path_lhs);
+
+	if (mkdir(vhd->artifact_store, 0700) && errno != EEXIST) {
+		lwsl_err("%s: unable to create %s\n", __func__,
+			 vhd->artifact_store);
+		return 1;
+	}
+
+	lws_dir(vhd->artifact_store, NULL, sais_artifact_sweep_cb);
+
+	sai_sqlite3_statement(vhd->server.pdb,
+		"CREATE TABLE IF NOT EXISTS artifact_store ("
+		" hash varchar(65) primary key,"
+		" len integer,"
+		" refs integer,"
+		" encoding varchar(16)"
+		");", "create artifact_store table");
+
+	sai_sqlite3_statement(vhd->server.pdb,
+		"CREATE TABLE IF NOT EXISTS artifact_store_repos ("
+		" hash varchar(65),"
+		" repo_name varchar(65),"
+		" primary key (hash, repo_name)"
+		");", "create artifact_store_repos table");
+
+	return 0;
+}
+
+/*
+ * Open (or reopen, if the builder is resuming) the partial file for
+ * pss->artifact.  We leave pss->artifact_offset set to how much we already
+ * have, and the whole-content hash caught up to there.
+ */
+
+static void
+sais_artifact_ofs_path(struct pss *pss, char *path, size_t len)
+{
+	lws_snprintf(path, len, "%s.ofs", pss->artifact_temp);
+}
+
+/* how much of the part file is made of chunks we verified */
+
+static uint64_t
+sais_artifact_ofs_read(struct pss *pss)
+{
+	char path[300], buf[24];
+	ssize_t r;
+	int fd;
+
+	sais_artifact_ofs_path(pss, path, sizeof(path));
+	fd = lws_open(path, O_RDONLY);
+	if (fd < 0)
+		return 0;
+
+	r = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (r <= 0)
+		return 0;
+
+	buf[r] = '\0';
+
+	return (uint64_t)strtoull(buf, NULL, 10);
+}
+
+static int
+sais_artifact_ofs_write(struct pss *pss, uint64_t ofs)
+{
+	char path[300], buf[24];
+	int fd, n;
+
+	sais_artifact_ofs_path(pss, path, sizeof(path));
+	fd = lws_open(path, O_CREAT | O_TRUNC | O_WRONLY, 0600);
+	if (fd < 0)
+		return 1;
+
+	n = lws_snprintf(buf, sizeof(buf), "%llu", (unsigned long long)ofs);
+	if (write(fd, buf, (unsigned int)n) != n) {
+		close(fd);
+		return 1;
+	}
+
+	close(fd);
+
+	return 0;
+}
+
+static void
+sais_artifact_ofs_remove(struct pss *pss)
+{
+	char path[300];
+
+	sais_artifact_ofs_path(pss, path, sizeof(path));
+	unlink(path);
+}
+
+/*
+ * Rehash the next slice of the partial we're resuming, and come back for the
+ * next one after the loop had a chance to do other things
+ */
+
+static void
+sais_artifact_catchup_cb(lws_sorted_usec_list_t *sul)
+{
+	struct pss *pss = lws_container_of(sul, struct pss,
+					   sul_artifact_catchup);
+	uint64_t done = 0;
+	uint8_t rb[4096];
+	ssize_t r = 0;
+
+	while (pss->artifact_catchup_ofs < pss->artifact_offset &&
+	       done < SAIS_ARTIFACT_CATCHUP_SLICE) {
+		uint64_t want = pss->artifact_offset - pss->artifact_catchup_ofs;
+
+		if (want > sizeof(rb))
+			want = sizeof(rb);
+
+		r = pread(pss->artifact_fd, rb, (size_t)want,
+			  (off_t)pss->artifact_catchup_ofs);
+		if (r <= 0 || sais_artifact_hash_update(pss, rb, (size_t)r)) {
+			r = -1;
+			break;
+		}
+
+		pss->artifact_catchup_ofs += (uint64_t)r;
+		done += (uint64_t)r;
+	}
+
+	if (r < 0) {
+		lwsl_err("%s: unable to rehash %s, dropping it\n", __func__,
+			 pss->artifact_temp);
+		pss->artifact_catching_up = 0;
+		/* the partial is no good to us, abandon truncates it */
+		pss->artifact_chunk_start = 0;
+		sais_artifact_ofs_remove(pss);
+		lws_set_timeout(pss->wsi, PENDING_TIMEOUT_HTTP_CONTENT,
+				LWS_TO_KILL_ASYNC);
+		return;
+	}
+
+	lws_set_timeout(pss->wsi, PENDING_TIMEOUT_HTTP_CONTENT,
+			SAIS_ARTIFACT_IDLE_SECS);
+
+	if (pss->artifact_catchup_ofs < pss->artifact_offset) {
+		lws_sul_schedule(pss->vhd->context, 0, &pss->sul_artifact_catchup,
+				 sais_artifact_catchup_cb, 1);
+		return;
+	}
+
+	pss->artifact_catching_up = 0;
+	lwsl_notice("%s: resuming %s at %llu\n", __func__,
+		    pss->artifact.blob_filename,
+		    (unsigned long long)pss->artifact_offset);
+
+	sais_artifact_caught_up(pss);
+}
+
+/*
+ * Open (or reopen, if the builder is resuming) the partial file for
+ * pss->artifact.  We leave pss->artifact_offset set to how much we already
+ * have.  If that's not zero, pss->artifact_catching_up is set until the
+ * whole-content hash has been caught up to there, and then
+ * sais_artifact_caught_up() is called.
+ */
+
+int
+sais_artifact_store_open(struct vhd *vhd, struct pss *pss)
+{
+	struct lws_genhash_ctx kctx;
+	uint8_t digest[32];
+	char key[65], kin[192];
+	uint64_t verified;
+	struct stat st;
+	int n;
+
+	/*
+	 * The part file name is derived from the secret upload nonce, so it
+	 * can't be guessed (or clobbered) by anyone who doesn't know it
+	 */
+
+	n = lws_snprintf(kin, sizeof(kin), "%s/%llu/%s",
+			 pss->artifact.artifact_up_nonce,
+			 (unsigned long long)pss->artifact.timestamp,
+			 pss->artifact.blob_filename);
+
+	if (lws_genhash_init(&kctx, LWS_GENHASH_TYPE_SHA256) ||
+	    lws_genhash_update(&kctx, kin, (size_t)n) ||
+	    lws_genhash_destroy(&kctx, digest))
+		return 1;
+
+	lws_hex_from_byte_array(digest, sizeof(digest), key, sizeof(key));
+
+	lws_snprintf(pss->artifact_temp, sizeof(pss->artifact_temp),
+		     "%s/part-%s", vhd->artifact_store, key);
+
+	pss->artifact_fd = lws_open(pss->artifact_temp, O_CREAT | O_RDWR, 0600);
+	if (pss->artifact_fd < 0) {
+		lwsl_err("%s: unable to create %s\n", __func__,
+			 pss->artifact_temp);
+		return 1;
+	}
+
+	if (fstat(pss->artifact_fd, &st))
+		goto bail;
+
+	/*
+	 * Only the chunks we verified count, anything after that may be
+	 * from a chunk we were still receiving when we went down
+	 */
+
+	verified = sais_artifact_ofs_read(pss);
+	if (verified > (uint64_t)st.st_size ||
+	    verified > pss->artifact_length)
+		/* can't be ours, start again */
+		verified = 0;
+
+	if ((uint64_t)st.st_size != verified &&
+	    ftruncate(pss->artifact_fd, (off_t)verified))
+		goto bail;
+
+	if (lseek(pss->artifact_fd, (off_t)verified, SEEK_SET) < 0)
+		goto bail;
+
+	if (pss->artifact.encoding[0]) {
+		pss->artifact_zs = calloc(1, sizeof(z_stream));
+		if (!pss->artifact_zs)
+			goto bail;
+		if (inflateInit2((z_stream *)pss->artifact_zs,
+				 15 + 16) != Z_OK) {
+			free(pss->artifact_zs);
+			pss->artifact_zs = NULL;
+			goto bail;
+		}
+	}
+
+	if (lws_genhash_init(&pss->artifact_hash_ctx, LWS_GENHASH_TYPE_SHA256)) {
+		sais_artifact_inflate_destroy(pss);
+		goto bail;
+	}
+
+	pss->artifact_offset = verified;
+	pss->artifact_chunk_start = pss->artifact_offset;
+	pss->artifact_open = 1;
+
+	if (pss->artifact_offset) {
+		/* catch the hash up with what we already have */
+
+		pss->artifact_catchup_ofs = 0;
+		pss->artifact_catching_up = 1;
+		lws_sul_schedule(vhd->context, 0, &pss->sul_artifact_catchup,
+				 sais_artifact_catchup_cb, 1);
+	}
+
+	return 0;
+
+bail:
+	close(pss->artifact_fd);
+
+	return 1;
+}
+
+/*
+ * Find the repo of the event the artifact being uploaded belongs to, into
+ * pss->artifact_repo
+ */
+
+static int
+sais_artifact_repo(struct vhd *vhd, struct pss *pss)
+{
+	char event_uuid[33];
+	sqlite3_stmt *sm;
+	int r = 1;
+
+	pss->artifact_repo[0] = '\0';
+	sai_task_uuid_to_event_uuid(event_uuid, pss->artifact.task_uuid);
+
+	if (sqlite3_prepare_v2(vhd->server.pdb,
+			       "select repo_name from events where uuid=?",
+			       -1, &sm, NULL) != SQLITE_OK)
+		return 1;
+
+	sqlite3_bind_text(sm, 1, event_uuid, -1, SQLITE_TRANSIENT);
+	if (sqlite3_step(sm) == SQLITE_ROW && sqlite3_column_text(sm, 0)) {
+		lws_strncpy(pss->artifact_repo,
+			    (const char *)sqlite3_column_text(sm, 0),
+			    sizeof(pss->artifact_repo));
+		r = !pss->artifact_repo[0];
+	}
+
+	sqlite3_finalize(sm);
+
+	return r;
+}
+
+/*
+ * The builder told us the hash of the decoded artifact content... if we
+ * already store that for the same repo, take a reference on it instead of
+ * having it uploaded again.  Returns 0 if we did that.
+ */
+
+int
+sais_artifact_store_ref(struct vhd *vhd, struct pss *pss)
+{
+	char path[384], q[384], esc[132];
+	sais_store_row_t row;
+	struct stat st;
+	int n = 0;
+
+	/* the path is only made if the hash is all hex */
+
+	if (sai_artifact_store_path(path, sizeof(path), vhd->artifact_store,
+				    pss->artifact.hash) || stat(path, &st) ||
+	    sais_artifact_repo(vhd, pss))
+		return 1;
+
+	/*
+	 * We only have the builder's word for the hash, so the content must
+	 * have been uploaded for this repo before
+	 */
+
+	lws_sql_purify(esc, pss->artifact_repo, sizeof(esc));
+	lws_snprintf(q, sizeof(q), "select count(*) from artifact_store_repos "
+		     "where hash='%s' and repo_name='%s'", pss->artifact.hash,
+		     esc);
+	if (sqlite3_exec(vhd->server.pdb, q, sql3_get_integer_cb, &n,
+			 NULL) != SQLITE_OK || !n)
+		return 1;
+
+	memset(&row, 0, sizeof(row));
+	lws_snprintf(q, sizeof(q), "select encoding, len from artifact_store "
+		     "where hash='%s'", pss->artifact.hash);
+	if (sqlite3_exec(vhd->server.pdb, q, sais_store_row_cb, &row,
+			 NULL) != SQLITE_OK || !row.rows)
+		return 1;
+
+	lws_snprintf(q, sizeof(q), "update artifact_store set refs = refs + 1 "
+		     "where hash='%s'", pss->artifact.hash);
+	if (sai_sqlite3_statement(vhd->server.pdb, q, "artifact store ref"))
+		return 1;
+
+	lws_strncpy(pss->artifact.encoding, row.encoding,
+		    sizeof(pss->artifact.encoding));
+	pss->artifact.enc_len = (size_t)row.len;
+
+	lwsl_notice("%s: already have %s, skipping upload\n", __func__,
+		    pss->artifact.hash);
+
+	return 0;
+}
+
+/*
+ * The builder told us about the next chunk it will send, and its hash
+ */
+
+int
+sais_artifact_store_chunk_begin(struct pss *pss, const sai_artifact_chunk_t *ch)
+{
+	if (!pss->artifact_open || pss->artifact_in_chunk ||
+	    pss->artifact_catching_up ||
+	    ch->ofs != pss->artifact_offset || !ch->len ||
+	    ch->len > SAI_ARTIFACT_CHUNK_MAX ||
+	    ch->ofs + ch->len > pss->artifact_length ||
+	    strlen(ch->sha256) != 64)
+		return 1;
+
+	if (lws_genhash_init(&pss->artifact_chunk_hash_ctx,
+			     LWS_GENHASH_TYPE_SHA256))
+		return 1;
+
+	lws_strncpy(pss->artifact_chunk_sha256, ch->sha256,
+		    sizeof(pss->artifact_chunk_sha256));
+	pss->artifact_chunk_end = ch->ofs + ch->len;
+	pss->artifact_in_chunk = 1;
+
+	return 0;
+}
+
+int
+sais_artifact_store_write(struct pss *pss, const uint8_t *buf, size_t len)
+{
+	if (!pss->artifact_open || !pss->artifact_in_chunk)
+		return 1;
+
+	if (write(pss->artifact_fd, buf, len) != (ssize_t)len)
+		return 1;
+
+	if (lws_genhash_update(&pss->artifact_chunk_hash_ctx, buf, len))
+		return 1;
+
+	return sais_artifact_hash_update(pss, buf, len);
+}
+
+/*
+ * The chunk payload is all here, confirm it's what the builder hashed.  If
+ * not, we throw it away.
+ */
+
+int
+sais_artifact_store_chunk_end(struct pss *pss)
+{
+	uint8_t digest[32];
+	char hex[65];
+
+	pss->artifact_in_chunk = 0;
+
+	if (lws_genhash_destroy(&pss->artifact_chunk_hash_ctx, digest))
+		return 1;
+
+	lws_hex_from_byte_array(digest, sizeof(digest), hex, sizeof(hex));
+
+	if (strcmp(hex, pss->artifact_chunk_sha256)) {
+		lwsl_warn("%s: %s: chunk at %llu failed hash check\n", __func__,
+			  pss->artifact.blob_filename,
+			  (unsigned long long)pss->artifact_chunk_start);
+		if (ftruncate(pss->artifact_fd,
+			      (off_t)pss->artifact_chunk_start))
+			lwsl_err("%s: truncate failed\n", __func__);
+
+		return 1;
+	}
+
+	pss->artifact_chunk_start = pss->artifact_offset;
+
+	if (sais_artifact_ofs_write(pss, pss->artifact_chunk_start))
+		/* we just won't be able to resume from here */
+		lwsl_warn("%s: unable to record offset for %s\n", __func__,
+			  pss->artifact_temp);
+
+	return 0;
+}
+
+/*
+ * Upload was interrupted or failed... we keep whatever chunks we verified in
+ * the part file, so the builder can resume from there
+ */
+
+void
+sais_artifact_store_abandon(struct pss *pss)
+{
+	if (!pss->artifact_open)
+		return;
+
+	lws_sul_cancel(&pss->sul_artifact_catchup);
+	pss->artifact_catching_up = 0;
+	pss->artifact_open = 0;
+	if (pss->artifact_in_chunk) {
+		pss->artifact_in_chunk = 0;
+		lws_genhash_destroy(&pss->artifact_chunk_hash_ctx, NULL);
+	}
+	lws_genhash_destroy(&pss->artifact_hash_ctx, NULL);
+	sais_artifact_inflate_destroy(pss);
+
+	if (ftruncate(pss->artifact_fd, (off_t)pss->artifact_chunk_start))
+		lwsl_err("%s: truncate failed\n", __func__);
+	close(pss->artifact_fd);
+}
+
+/*
+ * Upload completed... move the temp file to its content-addressed name, or
+ * if we already have that content, just drop the temp file and take another
+ * reference on the existing one
+ */
+
+int
+sais_artifact_store_commit(struct vhd *vhd, struct pss *pss, char *hash,
+			   size_t hash_len)
+{
+	char path[384], q[384];
+	sais_store_row_t row;
+	uint8_t digest[32];
+	struct stat st;
+	char *p;
+
+	if (!pss->artifact_open)
+		return 1;
+
+	pss->artifact_open = 0;
+	close(pss->artifact_fd);
+	sais_artifact_ofs_remove(pss);
+
+	if (pss->artifact_zs &&
+	    (uint64_t)((z_stream *)pss->artifact_zs)->total_out !=
+						(uint64_t)pss->artifact.len) {
+		lwsl_err("%s: decoded length mismatch\n", __func__);
+		lws_genhash_destroy(&pss->artifact_hash_ctx, NULL);
+		sais_artifact_inflate_destroy(pss);
+		goto bail;
+	}
+	sais_artifact_inflate_destroy(pss);
+
+	if (lws_genhash_destroy(&pss->artifact_hash_ctx, digest))
+		goto bail;
+
+	lws_hex_from_byte_array(digest, sizeof(digest), hash, hash_len);
+
+	if (sai_artifact_store_path(path, sizeof(path), vhd->artifact_store,
+				    hash))
+		goto bail;
+
+	/* create the fanout dir if needed */
+
+	p = strrchr(path, '/');
+	*p = '\0';
+	if (mkdir(path, 0700) && errno != EEXIST)
+		goto bail;
+	*p = '/';
+
+	if (!stat(path, &st)) {
+		lwsl_notice("%s: already have %s\n", __func__, hash);
+		unlink(pss->artifact_temp);
+	} else
+		if (rename(pss->artifact_temp, path)) {
+			lwsl_err("%s: unable to rename to %s\n", __func__, path);
+			goto bail;
+		}
+
+	lws_snprintf(q, sizeof(q), "insert into artifact_store "
+		     "(hash, len, refs, encoding) values ('%s', %llu, 1, '%s') "
+		     "on conflict(hash) do update set refs = refs + 1", hash,
+		     (unsigned long long)pss->artifact_length,
+		     pss->artifact.encoding[0] ? "gzip" : "");
+
+	if (sai_sqlite3_statement(vhd->server.pdb, q, "artifact store ref"))
+		return 1;
+
+	/* the content was really uploaded, so its repo may dedupe on it */
+
+	if (!sais_artifact_repo(vhd, pss)) {
+		char esc[132];
+
+		lws_sql_purify(esc, pss->artifact_repo, sizeof(esc));
+		lws_snprintf(q, sizeof(q), "insert or ignore into "
+			     "artifact_store_repos (hash, repo_name) values "
+			     "('%s', '%s')", hash, esc);
+		sai_sqlite3_statement(vhd->server.pdb, q, "artifact store repo");
+	}
+
+	/*
+	 * If we already had it, it's stored however it was sent the first
+	 * time, which is what we have to record for this one
+	 */
+
+	memset(&row, 0, sizeof(row));
+	lws_snprintf(q, sizeof(q), "select encoding, len from artifact_store "
+		     "where hash='%s'", hash);
+	if (sqlite3_exec(vhd->server.pdb, q, sais_store_row_cb, &row,
+			 NULL) == SQLITE_OK && row.rows) {
+		lws_strncpy(pss->artifact.encoding, row.encoding,
+			    sizeof(pss->artifact.encoding));
+		pss->artifact.enc_len = (size_t)row.len;
+	}
+
+	return 0;
+
+bail:
+	unlink(pss->artifact_temp);
+
+	return 1;
+}
+
+/*
+ * Drop the store references held by artifacts in an event db, either for
+ * one task, or for every task if task_uuid is NULL.  Stored content with no
+ * remaining references is deleted, or if unlinks is given, renamed out of the
+ * way and its new path added there for the db writer thread to unlink.
+ *
+ * The caller deletes the artifact rows themselves.
+ */
+
+int
+sais_artifact_store_release(struct vhd *vhd, sqlite3 *pdb,
+			    const char *task_uuid, lws_dll2_owner_t *unlinks)
+{
+	char q[256], esc[96], path[384], dead[384];
+	sqlite3_stmt *sm;
+	int refs;
+
+	if (task_uuid) {
+		lws_sql_purify(esc, task_uuid, sizeof(esc));
+		lws_snprintf(q, sizeof(q), "select hash from artifacts where "
+			     "hash != '' and task_uuid='%s'", esc);
+	} else
+		lws_snprintf(q, sizeof(q),
+			     "select hash from artifacts where hash != ''");
+
+	if (sqlite3_prepare_v2(pdb, q, -1, &sm, NULL) != SQLITE_OK) {
+		lwsl_err("%s: %s: %s\n", __func__, q, sqlite3_errmsg(pdb));
+		return 1;
+	}
+
+	while (sqlite3_step(sm) == SQLITE_ROW) {
+		const char *h = (const char *)sqlite3_column_text(sm, 0);
+
+		if (!h || sai_artifact_store_path(path, sizeof(path),
+						  vhd->artifact_store, h))
+			continue;
+
+		/* the hash is all hex if it made a path */
+
+		lws_snprintf(q, sizeof(q), "update artifact_store set "
+			     "refs = refs - 1 where hash='%s'", h);
+		sai_sqlite3_statement(vhd->server.pdb, q, "artifact unref");
+
+		refs = 0;
+		lws_snprintf(q, sizeof(q), "select refs from artifact_store "
+			     "where hash='%s'", h);
+		if (sqlite3_exec(vhd->server.pdb, q, sql3_get_integer_cb,
+				 &refs, NULL) != SQLITE_OK || refs > 0)
+			continue;
+
+		lwsl_notice("%s: removing unreferenced %s\n", __func__, h);
+
+		lws_snprintf(q, sizeof(q), "delete from artifact_store "
+			     "where hash='%s'", h);
+		sai_sqlite3_statement(vhd->server.pdb, q, "artifact delete");
+		lws_snprintf(q, sizeof(q), "delete from artifact_store_repos "
+			     "where hash='%s'", h);
+		sai_sqlite3_statement(vhd->server.pdb, q, "artifact repos delete");
+
+		if (!unlinks) {
+			unlink(path);
+			continue;
+		}
+
+		/*
+		 * The rename is cheap and means a new upload of the same
+		 * content can't be caught by the deferred unlink
+		 */
+
+		lws_snprintf(dead, sizeof(dead), "%s/dead-%s",
+			     vhd->artifact_store, h);
+		if (rename(path, dead)) {
+			unlink(path);
+			continue;
+		}
+
+		if (sais_dbw_path_add(unlinks, dead))
+			/* OOM, just do it now then */
+			unlink(dead);
+	}
+
+	sqlite3_finalize(sm);
+
+	return 0;
+}
@@ -57,29 +57,6 @@ static const char *hmac_names[] = {
 	"sai sha512="
 };
 
-int
-sai_get_head_status(struct vhd *vhd, const char *projname)
-{
-	struct lwsac *ac = NULL;
-	lws_dll2_owner_t o;
-	sai_event_t *e;
-	int state;
-
-	if (lws_struct_sq3_deserialize(vhd->server.pdb, NULL, "created ",
-			lsm_schema_sq3_map_event, &o, &ac, 0, -1))
-		return -1;
-
-	if (!o.head)
-		return -1;
-
-	e = lws_container_of(o.head, sai_event_t, list);
-	state = (int)e->state;
-
-	lwsac_free(&ac);
-
-	return state;
-}
-
 static int
 s_callback_ws(struct lws *wsi, enum lws_callback_reasons reason, void *user,
 	    void *in, size_t len)
@@ -91,7 +68,6 @@ s_callback_ws(struct lws *wsi, enum lws_callback_reasons reason, void *user,
 	struct pss *pss = (struct pss *)user;
 	sai_http_murl_t mu = SHMUT_NONE;
 	const char *pvo_resources, *num;
-	lws_wsmsg_info_t info;
 	unsigned int ssf;
 	int n;
 
@@ -188,6 +164,8 @@ s_callback_ws(struct lws *wsi, enum lws_callback_reasons reason, void *user,
 
 		sai_sqlite3_statement(vhd->server.pdb,
 				      "PRAGMA journal_mode=WAL;", "set WAL");
+		/* the db writer thread also removes tombstones in here */
+		sqlite3_busy_timeout(vhd->server.pdb, 1000);
 
 		if (lws_struct_sq3_create_table(vhd->server.pdb,
 						lsm_schema_sq3_map_event)) {
@@ -195,6 +173,13 @@ s_callback_ws(struct lws *wsi, enum lws_callback_reasons reason, void *user,
 			return -1;
 		}
 
+		/* for paging back through a project's event history */
+
+		sai_sqlite3_statement(vhd->server.pdb,
+				"CREATE INDEX IF NOT EXISTS events_repo_created_idx "
+				"ON events (repo_name, created)",
+				"create events repo / created index");
+
 		if (lws_struct_sq3_create_table(vhd->server.pdb,
 						lsm_schema_sq3_map_plat)) {
 			lwsl_err("%s: unable to create builders table\n", __func__);
@@ -205,6 +190,21 @@ s_callback_ws(struct lws *wsi, enum lws_callback_reasons reason, void *user,
 				"CREATE UNIQUE INDEX IF NOT EXISTS name_idx ON builders (name)",
 				"create builder name index");
 
+		if (sais_artifact_store_init(vhd, in))
+			return -1;
+
+		if (sais_dbw_init(vhd))
+			return -1;
+
+		if (sais_event_tombstones_resume(vhd))
+			return -1;
+
+		if (sais_result_cache_init(vhd))
+			return -1;
+
+		if (sais_ingest_init(vhd))
+			return -1;
+
 		lwsl_notice("%s: creating server stream\n", __func__);
 
 		if (lws_ss_create(vhd->context, 0, &ssi_server, vhd,
@@ -226,6 +226,14 @@ s_callback_ws(struct lws *wsi, enum lws_callback_reasons reason, void *user,
 		sais_server_destroy(vhd, &vhd->server);
 		goto passthru;
 
+	case LWS_CALLBACK_EVENT_WAIT_CANCELLED:
+		/* the db writer or ingest threads may have finished jobs */
+		if (vhd) {
+			sais_dbw_completions(vhd);
+			sais_ingest_completions(vhd);
+		}
+		break;
+
 	/*
 	 * receive http hook notifications
 	 */
@@ -357,21 +365,9 @@ s_callback_ws(struct lws *wsi, enum lws_callback_reasons reason, void *user,
 		}
 
 		/*
-		 * Inform sai-webs about notification processing, so
-		 * they can update connected browsers to show the new
-		 * event
+		 * sai-webs are told about the new event when the ingest
+		 * thread has finished adding it, in sais_ingest_completions()
 		 */
-		n = lws_snprintf((char *)start, sizeof(buf) - LWS_PRE,
-				 "{\"schema\":\"sai-overview\"}");
-
-		memset(&info, 0, sizeof(info));
-		info.private_source_idx		= SAI_WEBSRV_PB__GENERATED;
-		info.buf			= start;
-		info.len			= (size_t)n;
-		info.ss_flags			= LWSSS_FLAG_SOM | LWSSS_FLAG_EOM;
-
-		if (sais_websrv_broadcast_REQUIRES_LWS_PRE(vhd->h_ss_websrv, &info) < 0)
-			lwsl_warn("%s: buflist append failed\n", __func__);
 
 		if (lws_return_http_status(wsi,
 					pss->spa_failed ? HTTP_STATUS_FORBIDDEN :
@@ -458,10 +454,8 @@ s_callback_ws(struct lws *wsi, enum lws_callback_reasons reason, void *user,
 
 		sais_resource_wellknown_remove_pss(&pss->vhd->server, pss);
 
-		if (pss->blob_artifact) {
-			sqlite3_blob_close(pss->blob_artifact);
-			pss->blob_artifact = NULL;
-		}
+		sais_artifact_store_abandon(pss);
+		sais_prefetch_destroy(pss);
 
 		if (pss->pdb_artifact) {
 			sai_event_db_close(&pss->vhd->sqlite3_cache, &pss->pdb_artifact);
@@ -0,0 +1,739 @@
+/*
+ * Sai server - ./src/server/s-dbwriter.c
+ *
+ * Copyright (C) 2019 - 2025 Andy Green <andy@warmcat.com>
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation:
+ *  version 2.1 of the License.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *  MA  02110-1301  USA
+ *
+ * The bulk of sai-server's db writes are builder logs being flushed into the
+ * per-event dbs.  If the disk is slow, doing those on the event loop stalls
+ * everything else, so they are handed to a writer thread instead.
+ *
+ * The loop queues jobs on dbw.pending and the writer takes everything that is
+ * waiting as one batch, so while a slow commit is in progress the next batch
+ * just grows.  Jobs in the batch for the same event db are applied inside one
+ * transaction (group commit), with a single fsync for the lot.  Completed jobs
+ * go on dbw.done and the writer wakes the loop with lws_cancel_service(); the
+ * loop then calls each job's completion callback in
+ * LWS_CALLBACK_EVENT_WAIT_CANCELLED.
+ *
+ * Event and task resets and event deletes also come here, so a bulk delete
+ * from the UI doesn't freeze the loop.  The loop does the quick parts, like tombstoning
+ * the event and dropping artifact refs, and the writer deletes the logs and
+ * unlinks the files, posting progress on dbw.progress as it goes.  Jobs are
+ * applied in the order they were queued, so logs queued before a reset are
+ * cleared by it, and logs queued after it are not lost to it.
+ *
+ * Changes to the task rows, like binding a task to a builder or moving its
+ * state, come here too.  Otherwise the loop would have to wait for the lock
+ * on the event db while a group commit is in progress.  Anything on the loop
+ * that depends on the change, like offering the next step, is done from the
+ * job's completion callback.
+ *
+ * The writer uses its own sqlite3 connections, so it never touches the loop's
+ * db cache, and it doesn't call any lws apis apart from pure helpers.
+ */
+
+#include <libwebsockets.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "s-private.h"
+
+static void
+sais_dbw_free_logs(lws_dll2_owner_t *logs)
+{
+	lws_start_foreach_dll_safe(struct lws_dll2 *, p, p1, logs->head) {
+		sai_log_t *hlog = lws_container_of(p, sai_log_t, list);
+
+		lws_dll2_remove(&hlog->list);
+		free(hlog);
+	} lws_end_foreach_dll_safe(p, p1);
+}
+
+static void
+sais_dbw_free_paths(lws_dll2_owner_t *owner)
+{
+	lws_start_foreach_dll_safe(struct lws_dll2 *, p, p1, owner->head) {
+		lws_dll2_remove(p);
+		free(lws_container_of(p, sais_dbw_path_t, list));
+	} lws_end_foreach_dll_safe(p, p1);
+}
+
+int
+sais_dbw_path_add(lws_dll2_owner_t *owner, const char *path)
+{
+	size_t len = strlen(path) + 1;
+	sais_dbw_path_t *dp = malloc(sizeof(*dp) + len);
+
+	if (!dp)
+		return 1;
+
+	memset(dp, 0, sizeof(*dp));
+	memcpy(&dp[1], path, len);
+	lws_dll2_add_tail(&dp->list, owner);
+
+	return 0;
+}
+
+/*
+ * Writer thread: tell the loop how far we got with an event job
+ */
+
+static void
+sais_dbw_post_progress(sais_dbw_t *dbw, sais_dbw_job_t *j, unsigned int done,
+		       unsigned int total)
+{
+	sais_dbw_progress_t *pr = malloc(sizeof(*pr));
+
+	if (!pr)
+		return;
+
+	memset(pr, 0, sizeof(*pr));
+	lws_strncpy(pr->event_uuid, j->event_uuid, sizeof(pr->event_uuid));
+	pr->op		= j->op;
+	pr->done	= done;
+	pr->total	= total;
+
+	pthread_mutex_lock(&dbw->lock);
+	lws_dll2_add_tail(&pr->list, &dbw->progress);
+	pthread_mutex_unlock(&dbw->lock);
+
+	lws_cancel_service(dbw->cx);
+}
+
+/*
+ * Writer thread: unlink the files listed in the job, reporting progress every
+ * so often.  done is the number of steps already finished before the files.
+ */
+
+static void
+sais_dbw_unlink_files(sais_dbw_t *dbw, sais_dbw_job_t *j, unsigned int done,
+		      unsigned int total)
+{
+	lws_start_foreach_dll_safe(struct lws_dll2 *, p, p1, j->unlinks.head) {
+		unlink((const char *)&lws_container_of(p, sais_dbw_path_t,
+						       list)[1]);
+		lws_dll2_remove(p);
+		free(lws_container_of(p, sais_dbw_path_t, list));
+
+		if (!(++done % SAIS_DBW_PROGRESS_EVERY))
+			sais_dbw_post_progress(dbw, j, done, total);
+	} lws_end_foreach_dll_safe(p, p1);
+}
+
+/*
+ * Writer thread: the event was already tombstoned and its artifact refs
+ * dropped by the loop, remove its files and finally the tombstone
+ */
+
+static int
+sais_dbw_event_delete(sais_dbw_t *dbw, sais_dbw_job_t *j)
+{
+	unsigned int total = j->unlinks.count + 2;
+	char filepath[256], q[128], esc[96];
+	sqlite3 *pdb = NULL;
+	int r = 0;
+
+	sais_dbw_post_progress(dbw, j, 0, total);
+	sais_dbw_unlink_files(dbw, j, 0, total);
+
+	sai_event_db_delete_database(dbw->sqlite3_path_lhs, j->event_uuid);
+	sais_dbw_post_progress(dbw, j, total - 1, total);
+
+	lws_snprintf(filepath, sizeof(filepath), "%s-events.sqlite3",
+		     dbw->sqlite3_path_lhs);
+	if (sqlite3_open_v2(filepath, &pdb, SQLITE_OPEN_READWRITE, NULL) !=
+								SQLITE_OK) {
+		if (pdb)
+			sqlite3_close(pdb);
+
+		return 1;
+	}
+
+	sqlite3_busy_timeout(pdb, 5000);
+	lws_sql_purify(esc, j->event_uuid, sizeof(esc));
+	lws_snprintf(q, sizeof(q), "delete from event_tombstones "
+		     "where uuid='%s'", esc);
+	if (sqlite3_exec(pdb, q, NULL, NULL, NULL) != SQLITE_OK)
+		r = 1;
+
+	sqlite3_close(pdb);
+
+	return r;
+}
+
+/*
+ * Writer thread: change a task's state.  The loop needs to know what state it
+ * was in before, and if it changed, how the event's tasks stand now, so it can
+ * work out the event state.
+ */
+
+static int
+sais_dbw_task_state(sqlite3 *pdb, sais_dbw_job_t *j)
+{
+	char q[128], esc[96];
+
+	lws_sql_purify(esc, j->task_uuid, sizeof(esc));
+	lws_snprintf(q, sizeof(q), "select state from tasks where uuid='%s'",
+		     esc);
+
+	if (sqlite3_exec(pdb, q, sql3_get_integer_cb, &j->ostate, NULL) !=
+								SQLITE_OK ||
+	    sqlite3_exec(pdb, j->sql, NULL, NULL, NULL) != SQLITE_OK)
+		return 1;
+
+	if (j->ostate == j->state)
+		return 0;
+
+	if (sqlite3_exec(pdb, "select count(state) from tasks",
+			 sql3_get_integer_cb, &j->count, NULL) != SQLITE_OK ||
+	    sqlite3_exec(pdb, "select count(state) from tasks "
+			      "where state == 3 or state == 10",
+			 sql3_get_integer_cb, &j->count_good, NULL) !=
+								SQLITE_OK ||
+	    sqlite3_exec(pdb, "select count(state) from tasks "
+			      "where state == 4",
+			 sql3_get_integer_cb, &j->count_bad, NULL) != SQLITE_OK)
+		return 1;
+
+	return 0;
+}
+
+/*
+ * Apply every job in the batch that is for the same event db as j, in batch
+ * order, inside one transaction.  Runs on the writer thread, without the lock.
+ */
+
+static void
+sais_dbw_apply_group(sais_dbw_t *dbw, lws_dll2_owner_t *batch, sais_dbw_job_t *j)
+{
+	sais_dbw_job_t *del = NULL;
+	char filepath[256], saf[33], q1[192], esc[96];
+	lws_usec_t us = lws_now_usecs();
+	sqlite3 *pdb = NULL;
+	int r = 0, ntx = 0;
+
+	/*
+	 * Mark the jobs that go in the transaction with 2... anything after
+	 * a delete for the same event has nowhere to go
+	 */
+
+	lws_start_foreach_dll(struct lws_dll2 *, p, batch->head) {
+		sais_dbw_job_t *q = lws_container_of(p, sais_dbw_job_t, list);
+
+		if (!q->applied && !strcmp(q->event_uuid, j->event_uuid)) {
+			if (del) {
+				q->applied = 1;
+				q->result = 1;
+				sais_dbw_free_logs(&q->logs);
+				sais_dbw_free_paths(&q->unlinks);
+			} else
+				if (q->op == SAIS_DBW_OP_EVENT_DELETE)
+					del = q;
+				else {
+					q->applied = 2;
+					ntx++;
+				}
+		}
+	} lws_end_foreach_dll(p);
+
+	if (!ntx)
+		goto deletion;
+
+	lws_strncpy(saf, j->event_uuid, sizeof(saf));
+	lws_filename_purify_inplace(saf);
+	lws_snprintf(filepath, sizeof(filepath), "%s-event-%s.sqlite3",
+		     dbw->sqlite3_path_lhs, saf);
+
+	/* the loop created the event db and its schema when the event came */
+
+	if (sqlite3_open_v2(filepath, &pdb, SQLITE_OPEN_READWRITE, NULL) !=
+								SQLITE_OK) {
+		r = 1;
+		goto bail;
+	}
+
+	sqlite3_busy_timeout(pdb, 5000);
+	sqlite3_exec(pdb, "PRAGMA synchronous=NORMAL;", NULL, NULL, NULL);
+
+	if (sqlite3_exec(pdb, "BEGIN TRANSACTION", NULL, NULL, NULL) !=
+								SQLITE_OK) {
+		r = 1;
+		goto bail;
+	}
+
+	lws_start_foreach_dll(struct lws_dll2 *, p, batch->head) {
+		sais_dbw_job_t *q = lws_container_of(p, sais_dbw_job_t, list);
+
+		if (q->applied == 2) {
+			switch (q->op) {
+			case SAIS_DBW_OP_LOGS:
+				if (lws_struct_sq3_serialize(pdb,
+						lsm_schema_sq3_map_log,
+						&q->logs, 0))
+					r = 1;
+				break;
+			case SAIS_DBW_OP_EVENT_RESET:
+				sais_dbw_post_progress(dbw, q, 0,
+						       q->unlinks.count + 1);
+				if (sqlite3_exec(pdb, "delete from logs", NULL,
+						 NULL, NULL) != SQLITE_OK)
+					r = 1;
+				break;
+			case SAIS_DBW_OP_TASK_RESET:
+				lws_sql_purify(esc, q->task_uuid, sizeof(esc));
+				lws_snprintf(q1, sizeof(q1), "delete from logs "
+					     "where task_uuid='%s'", esc);
+				if (sqlite3_exec(pdb, q1, NULL, NULL, NULL) !=
+								SQLITE_OK)
+					r = 1;
+				break;
+			case SAIS_DBW_OP_TASK_UPDATE:
+				if (sqlite3_exec(pdb, q->sql, NULL, NULL,
+						 NULL) != SQLITE_OK)
+					r = 1;
+				break;
+			case SAIS_DBW_OP_TASK_STATE:
+				if (sais_dbw_task_state(pdb, q))
+					r = 1;
+				break;
+			default:
+				break;
+			}
+		}
+	} lws_end_foreach_dll(p);
+
+	if (sqlite3_exec(pdb, "END TRANSACTION", NULL, NULL, NULL) !=
+								SQLITE_OK) {
+		sqlite3_exec(pdb, "ROLLBACK", NULL, NULL, NULL);
+		r = 1;
+	}
+
+bail:
+	if (pdb)
+		sqlite3_close(pdb);
+
+	us = lws_now_usecs() - us;
+
+	lws_start_foreach_dll(struct lws_dll2 *, p, batch->head) {
+		sais_dbw_job_t *q = lws_container_of(p, sais_dbw_job_t, list);
+
+		if (q->applied == 2) {
+			q->applied = 1;
+			q->result = r;
+			q->us_commit = us;
+			sais_dbw_free_logs(&q->logs);
+
+			if (q->op == SAIS_DBW_OP_EVENT_RESET)
+				/* the logs are gone, now the old artifacts */
+				sais_dbw_unlink_files(dbw, q, 1,
+						      q->unlinks.count + 1);
+		}
+	} lws_end_foreach_dll(p);
+
+deletion:
+	if (!del)
+		return;
+
+	us = lws_now_usecs();
+	del->result = sais_dbw_event_delete(dbw, del);
+	del->us_commit = lws_now_usecs() - us;
+	del->applied = 1;
+}
+
+static void *
+sais_dbw_thread(void *d)
+{
+	sais_dbw_t *dbw = (sais_dbw_t *)d;
+	lws_dll2_owner_t batch;
+
+	pthread_mutex_lock(&dbw->lock);
+
+	while (1) {
+		while (!dbw->exiting && !dbw->pending.count)
+			pthread_cond_wait(&dbw->cond_work, &dbw->lock);
+
+		if (dbw->exiting)
+			break;
+
+		/* take everything that is waiting as one batch */
+
+		memset(&batch, 0, sizeof(batch));
+		lws_start_foreach_dll_safe(struct lws_dll2 *, p, p1,
+					   dbw->pending.head) {
+			lws_dll2_remove(p);
+			lws_dll2_add_tail(p, &batch);
+		} lws_end_foreach_dll_safe(p, p1);
+		dbw->busy = 1;
+
+		pthread_mutex_unlock(&dbw->lock);
+
+		lws_start_foreach_dll(struct lws_dll2 *, p, batch.head) {
+			sais_dbw_job_t *j = lws_container_of(p,
+						sais_dbw_job_t, list);
+
+			if (!j->applied)
+				sais_dbw_apply_group(dbw, &batch, j);
+		} lws_end_foreach_dll(p);
+
+		pthread_mutex_lock(&dbw->lock);
+
+		lws_start_foreach_dll_safe(struct lws_dll2 *, p, p1,
+					   batch.head) {
+			lws_dll2_remove(p);
+			lws_dll2_add_tail(p, &dbw->done);
+		} lws_end_foreach_dll_safe(p, p1);
+		dbw->busy = 0;
+
+		pthread_cond_broadcast(&dbw->cond_idle);
+
+		/* get the loop to come and collect the completions */
+		lws_cancel_service(dbw->cx);
+	}
+
+	pthread_mutex_unlock(&dbw->lock);
+
+	return NULL;
+}
+
+int
+sais_dbw_init(struct vhd *vhd)
+{
+	sais_dbw_t *dbw = &vhd->dbw;
+
+	dbw->cx = vhd->context;
+	dbw->sqlite3_path_lhs = vhd->sqlite3_path_lhs;
+	dbw->artifact_store = vhd->artifact_store;
+
+	pthread_mutex_init(&dbw->lock, NULL);
+	pthread_cond_init(&dbw->cond_work, NULL);
+	pthread_cond_init(&dbw->cond_idle, NULL);
+
+#if defined(LWS_WITH_SYS_METRICS)
+	dbw->mt_depth = lws_metric_create(vhd->context, LWSMTFL_REPORT_MEAN,
+					  "sai_dbw_queue_depth");
+	dbw->mt_commit = lws_metric_create(vhd->context,
+				LWSMTFL_REPORT_MEAN | LWSMTFL_REPORT_DUTY_WALLCLOCK_US,
+				"sai_dbw_commit_us");
+#endif
+
+	if (pthread_create(&dbw->thread, NULL, sais_dbw_thread, dbw)) {
+		lwsl_err("%s: unable to create db writer thread\n", __func__);
+		pthread_cond_destroy(&dbw->cond_idle);
+		pthread_cond_destroy(&dbw->cond_work);
+		pthread_mutex_destroy(&dbw->lock);
+
+		return 1;
+	}
+
+	dbw->running = 1;
+
+	return 0;
+}
+
+static void
+sais_dbw_free_jobs(lws_dll2_owner_t *owner)
+{
+	lws_start_foreach_dll_safe(struct lws_dll2 *, p, p1, owner->head) {
+		sais_dbw_job_t *j = lws_container_of(p, sais_dbw_job_t, list);
+
+		lws_dll2_remove(&j->list);
+		sais_dbw_free_logs(&j->logs);
+		sais_dbw_free_paths(&j->unlinks);
+		free(j);
+	} lws_end_foreach_dll_safe(p, p1);
+}
+
+/*
+ * Block until everything queued so far has been written.  This is only for
+ * shutdown, anything on the loop that depends on earlier writes queues a job
+ * of its own behind them instead.
+ */
+
+static void
+sais_dbw_sync(struct vhd *vhd)
+{
+	sais_dbw_t *dbw = &vhd->dbw;
+
+	if (!dbw->running)
+		return;
+
+	pthread_mutex_lock(&dbw->lock);
+	while (dbw->pending.count || dbw->busy)
+		pthread_cond_wait(&dbw->cond_idle, &dbw->lock);
+	pthread_mutex_unlock(&dbw->lock);
+}
+
+void
+sais_dbw_destroy(struct vhd *vhd)
+{
+	sais_dbw_t *dbw = &vhd->dbw;
+
+	if (!dbw->running)
+		return;
+
+	/* let the writer finish what it has, and anything already queued */
+
+	sais_dbw_sync(vhd);
+
+	pthread_mutex_lock(&dbw->lock);
+	dbw->exiting = 1;
+	pthread_cond_signal(&dbw->cond_work);
+	pthread_mutex_unlock(&dbw->lock);
+
+	pthread_join(dbw->thread, NULL);
+	dbw->running = 0;
+
+	/* nobody is left to care about completions at this point */
+
+	sais_dbw_free_jobs(&dbw->pending);
+	sais_dbw_free_jobs(&dbw->done);
+
+	lws_start_foreach_dll_safe(struct lws_dll2 *, p, p1,
+				   dbw->progress.head) {
+		lws_dll2_remove(p);
+		free(lws_container_of(p, sais_dbw_progress_t, list));
+	} lws_end_foreach_dll_safe(p, p1);
+
+	pthread_cond_destroy(&dbw->cond_idle);
+	pthread_cond_destroy(&dbw->cond_work);
+	pthread_mutex_destroy(&dbw->lock);
+
+#if defined(LWS_WITH_SYS_METRICS)
+	lws_metric_destroy(&dbw->mt_depth, 0);
+	lws_metric_destroy(&dbw->mt_commit, 0);
+#endif
+}
+
+static void
+sais_dbw_queue(sais_dbw_t *dbw, sais_dbw_job_t *j)
+{
+	uint32_t depth;
+
+	pthread_mutex_lock(&dbw->lock);
+	lws_dll2_add_tail(&j->list, &dbw->pending);
+	depth = dbw->pending.count;
+	pthread_cond_signal(&dbw->cond_work);
+	pthread_mutex_unlock(&dbw->lock);
+
+#if defined(LWS_WITH_SYS_METRICS)
+	lws_metric_event(dbw->mt_depth, METRES_GO, (u_mt_t)depth);
+#endif
+
+	if (depth == SAIS_DBW_DEPTH_WARN)
+		lwsl_warn("%s: db writer is falling behind, %u jobs queued\n",
+			  __func__, (unsigned int)depth);
+}
+
+/*
+ * Hand a task's logs over to the writer thread, the logs are moved out of the
+ * caller's owner.  cb is called later on the loop when they were committed.
+ */
+
+int
+sais_dbw_queue_logs(struct vhd *vhd, const char *task_uuid,
+		    lws_dll2_owner_t *logs, sais_dbw_cb_t cb)
+{
+	sais_dbw_t *dbw = &vhd->dbw;
+	sais_dbw_job_t *j;
+
+	if (!dbw->running)
+		return 1;
+
+	j = malloc(sizeof(*j));
+	if (!j)
+		return 1;
+
+	memset(j, 0, sizeof(*j));
+	j->op = SAIS_DBW_OP_LOGS;
+	lws_strncpy(j->task_uuid, task_uuid, sizeof(j->task_uuid));
+	sai_task_uuid_to_event_uuid(j->event_uuid, task_uuid);
+	j->cb = cb;
+
+	lws_start_foreach_dll_safe(struct lws_dll2 *, p, p1, logs->head) {
+		lws_dll2_remove(p);
+		lws_dll2_add_tail(p, &j->logs);
+	} lws_end_foreach_dll_safe(p, p1);
+
+	sais_dbw_queue(dbw, j);
+
+	return 0;
+}
+
+/*
+ * Queue a background reset or delete for an event, along with any files the
+ * writer should unlink for it, which are moved out of the caller's owner.
+ */
+
+int
+sais_dbw_queue_event_op(struct vhd *vhd, const char *event_uuid,
+			sais_dbw_op_t op, lws_dll2_owner_t *unlinks,
+			sais_dbw_cb_t cb)
+{
+	sais_dbw_t *dbw = &vhd->dbw;
+	sais_dbw_job_t *j;
+
+	if (!dbw->running)
+		return 1;
+
+	j = malloc(sizeof(*j));
+	if (!j)
+		return 1;
+
+	memset(j, 0, sizeof(*j));
+	j->op = op;
+	lws_strncpy(j->event_uuid, event_uuid, sizeof(j->event_uuid));
+	j->cb = cb;
+
+	if (unlinks)
+		lws_start_foreach_dll_safe(struct lws_dll2 *, p, p1,
+					   unlinks->head) {
+			lws_dll2_remove(p);
+			lws_dll2_add_tail(p, &j->unlinks);
+		} lws_end_foreach_dll_safe(p, p1);
+
+	sais_dbw_queue(dbw, j);
+
+	return 0;
+}
+
+/*
+ * Queue deleting a task's logs, behind any of its logs already queued
+ */
+
+int
+sais_dbw_queue_task_reset(struct vhd *vhd, const char *task_uuid,
+			  sais_dbw_cb_t cb)
+{
+	sais_dbw_t *dbw = &vhd->dbw;
+	sais_dbw_job_t *j;
+
+	if (!dbw->running)
+		return 1;
+
+	j = malloc(sizeof(*j));
+	if (!j)
+		return 1;
+
+	memset(j, 0, sizeof(*j));
+	j->op = SAIS_DBW_OP_TASK_RESET;
+	lws_strncpy(j->task_uuid, task_uuid, sizeof(j->task_uuid));
+	sai_task_uuid_to_event_uuid(j->event_uuid, task_uuid);
+	j->cb = cb;
+
+	sais_dbw_queue(dbw, j);
+
+	return 0;
+}
+
+/*
+ * Queue a change to a task's row, behind anything already queued for its
+ * event.  For SAIS_DBW_OP_TASK_STATE, state is the state sql moves it to.
+ */
+
+int
+sais_dbw_queue_task_update(struct vhd *vhd, sais_dbw_op_t op,
+			   const char *task_uuid, const char *sql, int state,
+			   sais_dbw_cb_t cb)
+{
+	sais_dbw_t *dbw = &vhd->dbw;
+	sais_dbw_job_t *j;
+
+	if (!dbw->running || strlen(sql) >= sizeof(j->sql))
+		return 1;
+
+	j = malloc(sizeof(*j));
+	if (!j)
+		return 1;
+
+	memset(j, 0, sizeof(*j));
+	j->op = op;
+	lws_strncpy(j->task_uuid, task_uuid, sizeof(j->task_uuid));
+	sai_task_uuid_to_event_uuid(j->event_uuid, task_uuid);
+	lws_strncpy(j->sql, sql, sizeof(j->sql));
+	j->state = state;
+	j->cb = cb;
+
+	sais_dbw_queue(dbw, j);
+
+	return 0;
+}
+
+/*
+ * On the loop, from LWS_CALLBACK_EVENT_WAIT_CANCELLED: collect the finished
+ * jobs and call their completion callbacks
+ */
+
+void
+sais_dbw_completions(struct vhd *vhd)
+{
+	lws_dll2_owner_t done, progress;
+	sais_dbw_t *dbw = &vhd->dbw;
+
+	if (!dbw->running)
+		return;
+
+	memset(&done, 0, sizeof(done));
+	memset(&progress, 0, sizeof(progress));
+
+	pthread_mutex_lock(&dbw->lock);
+	lws_start_foreach_dll_safe(struct lws_dll2 *, p, p1, dbw->done.head) {
+		lws_dll2_remove(p);
+		lws_dll2_add_tail(p, &done);
+	} lws_end_foreach_dll_safe(p, p1);
+	lws_start_foreach_dll_safe(struct lws_dll2 *, p, p1,
+				   dbw->progress.head) {
+		lws_dll2_remove(p);
+		lws_dll2_add_tail(p, &progress);
+	} lws_end_foreach_dll_safe(p, p1);
+	pthread_mutex_unlock(&dbw->lock);
+
+	lws_start_foreach_dll_safe(struct lws_dll2 *, p, p1, progress.head) {
+		sais_dbw_progress_t *pr = lws_container_of(p,
+						sais_dbw_progress_t, list);
+
+		sais_event_progress(vhd, pr->event_uuid, pr->op, "running",
+				    pr->done, pr->total);
+		lws_dll2_remove(p);
+		free(pr);
+	} lws_end_foreach_dll_safe(p, p1);
+
+	lws_start_foreach_dll_safe(struct lws_dll2 *, p, p1, done.head) {
+		sais_dbw_job_t *j = lws_container_of(p, sais_dbw_job_t, list);
+
+#if defined(LWS_WITH_SYS_METRICS)
+		lws_metric_event(dbw->mt_commit, METRES_GO,
+				 (u_mt_t)j->us_commit);
+#endif
+		if (j->result)
+			lwsl_err("%s: job %d failed for %s\n", __func__,
+				 (int)j->op, j->task_uuid[0] ? j->task_uuid :
+							       j->event_uuid);
+		else
+			if (j->us_commit > SAIS_DBW_SLOW_COMMIT_US)
+				lwsl_warn("%s: slow commit for %s: %dms\n",
+					  __func__, j->event_uuid,
+					  (int)(j->us_commit / LWS_US_PER_MS));
+
+		if (j->cb)
+			j->cb(vhd, j);
+
+		lws_dll2_remove(&j->list);
+		free(j);
+	} lws_end_foreach_dll_safe(p, p1);
+}
@@ -142,7 +142,11 @@ sais_server_destroy(struct vhd *vhd, sais_t *server)
 		lws_dll2_foreach_safe(&server->builder_owner, NULL,
 				      sai_detach_builder);
 
+	sais_ingest_destroy(vhd);
+	sais_dbw_destroy(vhd);
 	sai_event_db_close_all_now(&vhd->sqlite3_cache);
+	sais_builder_snap_destroy(vhd);
+	sais_loadreport_destroy(vhd);
 
 	lws_struct_sq3_close(&server->pdb);
 
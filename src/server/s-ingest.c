@@ -0,0 +1,651 @@
+/*
+ * Sai server - ./src/server/s-ingest.c
+ *
+ * Copyright (C) 2019 - 2025 Andy Green <andy@warmcat.com>
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation:
+ *  version 2.1 of the License.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *  MA  02110-1301  USA
+ *
+ * A push notification carries the project's .sai.json, which can expand to
+ * hundreds of tasks for a big platform x configuration matrix.  Parsing that
+ * and writing it all into a fresh event db used to happen inside the POST
+ * handling on the event loop, which stalls everything during a push storm.
+ *
+ * Instead, once the notification itself was checked and deduped on the loop,
+ * it's queued on ingest.pending and the POST is answered straight away.  The
+ * ingest thread parses the .sai.json into task templates, or reuses the
+ * templates from last time if it saw the same .sai.json recently, makes the
+ * event's tasks from them in memory, and only if that all went well writes
+ * them to the new event db in a single transaction.  After that commits, the
+ * event row is added to the main events db, so the dispatcher can never see
+ * an event that has only some of its tasks.  Finished jobs go on ingest.done
+ * and the loop is woken with lws_cancel_service() to recompute the pending
+ * platforms and tell sai-web.
+ *
+ * Like the db writer, the thread uses its own sqlite3 connections and doesn't
+ * touch the vhd.
+ */
+
+#include <libwebsockets.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "s-private.h"
+
+static void
+sais_ingest_job_free(sais_ingest_job_t *j)
+{
+	lws_start_foreach_dll_safe(struct lws_dll2 *, p, p1, j->tasks.head) {
+		lws_dll2_remove(p);
+		free(lws_container_of(p, sai_task_t, list));
+	} lws_end_foreach_dll_safe(p, p1);
+
+	lws_start_foreach_dll_safe(struct lws_dll2 *, p, p1,
+				   j->platform_owner.head) {
+		lws_dll2_remove(p);
+		free(lws_container_of(p, sai_platform_t, list));
+	} lws_end_foreach_dll_safe(p, p1);
+
+	free(j->sn.saifile);
+	free(j);
+}
+
+static void
+sais_ingest_tmpl_free(sais_saifile_tmpl_t *st)
+{
+	lws_start_foreach_dll_safe(struct lws_dll2 *, p, p1, st->tasks.head) {
+		lws_dll2_remove(p);
+		free(lws_container_of(p, sais_task_tmpl_t, list));
+	} lws_end_foreach_dll_safe(p, p1);
+
+	free(st);
+}
+
+/*
+ * Most pushes to a repo carry the same .sai.json.  So we keep what the last
+ * few different ones expanded to, by hash of the .sai.json content, and only
+ * parse it if we didn't see it recently.  The cache owns what we return.
+ */
+
+static sais_saifile_tmpl_t *
+sais_ingest_tmpl_get(sais_ingest_job_t *j)
+{
+	struct lws_genhash_ctx hctx;
+	sais_saifile_tmpl_t *st;
+	uint8_t digest[32];
+
+	if (lws_genhash_init(&hctx, LWS_GENHASH_TYPE_SHA256) ||
+	    lws_genhash_update(&hctx, j->sn.saifile, j->sn.saifile_out_pos) ||
+	    lws_genhash_destroy(&hctx, digest))
+		return NULL;
+
+	lws_hex_from_byte_array(digest, sizeof(digest), j->saifile_hash,
+				sizeof(j->saifile_hash));
+
+	lws_start_foreach_dll(struct lws_dll2 *, p, j->tmpl_cache->head) {
+		st = lws_container_of(p, sais_saifile_tmpl_t, list);
+		if (!strcmp(st->key, j->saifile_hash)) {
+			lws_dll2_remove(&st->list);
+			lws_dll2_add_head(&st->list, j->tmpl_cache);
+
+			return st;
+		}
+	} lws_end_foreach_dll(p);
+
+	st = malloc(sizeof(*st));
+	if (!st)
+		return NULL;
+
+	memset(st, 0, sizeof(*st));
+	lws_strncpy(st->key, j->saifile_hash, sizeof(st->key));
+
+	j->tmpl = st;
+	if (sais_ingest_parse(j)) {
+		j->tmpl = NULL;
+		sais_ingest_tmpl_free(st);
+
+		return NULL;
+	}
+	j->tmpl = NULL;
+
+	lws_dll2_add_head(&st->list, j->tmpl_cache);
+	if (j->tmpl_cache->count > SAIS_INGEST_TMPL_CACHE_MAX) {
+		sais_saifile_tmpl_t *old = lws_container_of(j->tmpl_cache->tail,
+						sais_saifile_tmpl_t, list);
+
+		lws_dll2_remove(&old->list);
+		sais_ingest_tmpl_free(old);
+	}
+
+	return st;
+}
+
+/*
+ * Make the event's tasks from the templates, skipping configurations that
+ * only apply to other branches
+ */
+
+static int
+sais_ingest_instantiate(sais_ingest_job_t *j, const sais_saifile_tmpl_t *st)
+{
+	sai_notification_t *sn = &j->sn;
+	char ref[256];
+	sai_task_t *t;
+	int uid = 0;
+
+	lws_start_foreach_dll(struct lws_dll2 *, p, st->tasks.head) {
+		const sais_task_tmpl_t *tt = lws_container_of(p,
+						sais_task_tmpl_t, list);
+
+		int skip = 0;
+
+		if (tt->branches[0]) {
+			lws_snprintf(ref, sizeof(ref), "refs/heads/%s",
+				     tt->branches);
+			skip = !!strcmp(ref, sn->e.ref);
+			if (skip)
+				lwsl_info("%s: %s on %s skipped as only "
+					  "applies to %s not %s\n", __func__,
+					  tt->taskname, tt->platform, ref,
+					  sn->e.ref);
+		}
+
+		if (!skip) {
+			t = malloc(sizeof(*t));
+			if (!t)
+				return 1;
+
+			memset(t, 0, sizeof(*t));
+			lws_strncpy(t->platform, tt->platform,
+				    sizeof(t->platform));
+			lws_strncpy(t->taskname, tt->taskname,
+				    sizeof(t->taskname));
+			lws_strncpy(t->build, tt->build, sizeof(t->build));
+			lws_strncpy(t->packages, tt->packages,
+				    sizeof(t->packages));
+			lws_strncpy(t->artifacts, tt->artifacts,
+				    sizeof(t->artifacts));
+			lws_strncpy(t->branches, tt->branches,
+				    sizeof(t->branches));
+			t->build_step_count = tt->build_step_count;
+
+			/*
+			 * Task uuid is the event uuid and another random 32
+			 * chars, so you can always recover the related event
+			 * uuid from the task uuid
+			 */
+
+			memcpy(t->uuid, sn->e.uuid, 32);
+			sai_uuid16_create(j->cx, t->uuid + 32);
+			lws_strncpy(t->event_uuid, sn->e.uuid,
+				    sizeof(t->event_uuid));
+			t->uid = uid++;
+
+			/*
+			 * This is basically a secret that anything trying to
+			 * upload an artifact for the task must provide to
+			 * authenticate.
+			 */
+			sai_uuid16_create(j->cx, t->art_up_nonce);
+			/*
+			 * An unrelated secret that anything trying to
+			 * download an artifact for the task must provide to
+			 * identify it.
+			 */
+			sai_uuid16_create(j->cx, t->art_down_nonce);
+
+			/* these point into j->sn.e */
+
+			t->git_repo_url	= sn->e.repo_fetchurl;
+			t->repo_name	= sn->e.repo_name;
+			t->git_ref	= sn->e.ref;
+			t->git_hash	= sn->e.hash;
+
+			/*
+			 * The same tree and task definition may have passed
+			 * before, see s-result-cache.c
+			 */
+
+			sais_result_cache_key(sn->e.repo_name, sn->tree[0] ?
+						sn->tree : sn->e.hash, t,
+					      t->cache_key);
+
+			/* builders may keep its build dir, see s-warm.c */
+
+			if (tt->warm)
+				sais_warm_key(sn->e.repo_name, t, t->warm_key);
+
+			lws_dll2_add_tail(&t->list, &j->tasks);
+		}
+	} lws_end_foreach_dll(p);
+
+	if (j->tasks.count)
+		sn->e.last_updated = (unsigned long long)lws_now_secs();
+
+	return 0;
+}
+
+/*
+ * Write the collected tasks into the new event db in one go.  Runs on the
+ * ingest thread.
+ */
+
+static int
+sais_ingest_write_tasks(sais_ingest_job_t *j)
+{
+	sai_task_t *t;
+	sqlite3 *pdb;
+	int r = 0;
+
+	if (sai_event_db_open_uncached(j->cx, j->sqlite3_path_lhs,
+				       j->sn.e.uuid, 1, &pdb)) {
+		lwsl_err("%s: unable to create event db\n", __func__);
+
+		return 1;
+	}
+
+	sqlite3_exec(pdb, "PRAGMA synchronous=NORMAL;", NULL, NULL, NULL);
+
+	if (sqlite3_exec(pdb, "BEGIN TRANSACTION", NULL, NULL, NULL) !=
+								SQLITE_OK) {
+		sqlite3_close(pdb);
+
+		return 1;
+	}
+
+	/* the task uids were given out in list order */
+
+	if (j->tasks.head) {
+		t = lws_container_of(j->tasks.head, sai_task_t, list);
+		if (lws_struct_sq3_serialize(pdb, lsm_schema_sq3_map_task,
+					     &j->tasks, (uint32_t)t->uid))
+			r = 1;
+	}
+
+	if (sqlite3_exec(pdb, r ? "ROLLBACK" : "END TRANSACTION", NULL, NULL,
+			 NULL) != SQLITE_OK)
+		r = 1;
+
+	sqlite3_close(pdb);
+
+	return r;
+}
+
+/*
+ * Tasks we have a cached pass for are created already done, pointing at the
+ * task that passed.  Runs on the ingest thread, on its connection to the main
+ * events db.
+ */
+
+static void
+sais_ingest_apply_cache(sais_ingest_job_t *j, sqlite3 *pdb)
+{
+	char from[65];
+	int cached = 0;
+
+	lws_start_foreach_dll(struct lws_dll2 *, p, j->tasks.head) {
+		sai_task_t *t = lws_container_of(p, sai_task_t, list);
+
+		if (!sais_result_cache_lookup(pdb, t->cache_key, from)) {
+			t->state = SAIES_CACHED_SUCCESS;
+			t->build_step = t->build_step_count;
+			lws_strncpy(t->cached_from, from, sizeof(t->cached_from));
+			cached++;
+		}
+	} lws_end_foreach_dll(p);
+
+	if (!cached)
+		return;
+
+	lwsl_notice("%s: %d / %d tasks for %s already passed\n", __func__,
+		    cached, (int)j->tasks.count, j->sn.e.hash);
+
+	if (cached == (int)j->tasks.count)
+		j->sn.e.state = SAIES_SUCCESS;
+}
+
+/*
+ * With the tasks safely in, publish the event in the main events db.  Runs
+ * on the ingest thread.
+ */
+
+static int
+sais_ingest_publish_event(sais_ingest_job_t *j, sqlite3 *pdb)
+{
+	lws_dll2_owner_t owner;
+
+	memset(&j->sn.e.list, 0, sizeof(j->sn.e.list));
+	lws_dll2_owner_clear(&owner);
+	lws_dll2_add_head(&j->sn.e.list, &owner);
+
+	return !!lws_struct_sq3_serialize(pdb, lsm_schema_sq3_map_event,
+					  &owner, 0);
+}
+
+static void
+sais_ingest_do(sais_ingest_job_t *j)
+{
+	sais_saifile_tmpl_t *st;
+	char filepath[256];
+	sqlite3 *pdb = NULL;
+
+	st = sais_ingest_tmpl_get(j);
+	if (!st || sais_ingest_instantiate(j, st)) {
+		j->result = 1;
+		return;
+	}
+
+	j->task_count = (int)j->tasks.count;
+
+	lws_snprintf(filepath, sizeof(filepath), "%s-events.sqlite3",
+		     j->sqlite3_path_lhs);
+	if (sqlite3_open_v2(filepath, &pdb, SQLITE_OPEN_READWRITE, NULL) !=
+								SQLITE_OK) {
+		if (pdb)
+			sqlite3_close(pdb);
+		j->result = 1;
+		return;
+	}
+
+	sqlite3_busy_timeout(pdb, 5000);
+
+	sais_ingest_apply_cache(j, pdb);
+
+	if (sais_ingest_write_tasks(j) || sais_ingest_publish_event(j, pdb)) {
+		lwsl_err("%s: failed to add event %s\n", __func__, j->sn.e.uuid);
+		sai_event_db_delete_database(j->sqlite3_path_lhs, j->sn.e.uuid);
+		j->result = 1;
+	}
+
+	sqlite3_close(pdb);
+}
+
+static void *
+sais_ingest_thread(void *d)
+{
+	sais_ingest_t *ing = (sais_ingest_t *)d;
+	sais_ingest_job_t *j;
+
+	pthread_mutex_lock(&ing->lock);
+
+	while (1) {
+		while (!ing->exiting && !ing->pending.count)
+			pthread_cond_wait(&ing->cond_work, &ing->lock);
+
+		if (ing->exiting)
+			break;
+
+		j = lws_container_of(ing->pending.head, sais_ingest_job_t, list);
+		lws_dll2_remove(&j->list);
+		ing->current = j;
+
+		pthread_mutex_unlock(&ing->lock);
+
+		sais_ingest_do(j);
+
+		/* the worker is done with these, the loop doesn't need them */
+
+		free(j->sn.saifile);
+		j->sn.saifile = NULL;
+
+		pthread_mutex_lock(&ing->lock);
+		ing->current = NULL;
+		lws_dll2_add_tail(&j->list, &ing->done);
+
+		/* get the loop to come and collect the completion */
+		lws_cancel_service(ing->cx);
+	}
+
+	pthread_mutex_unlock(&ing->lock);
+
+	return NULL;
+}
+
+int
+sais_ingest_init(struct vhd *vhd)
+{
+	sais_ingest_t *ing = &vhd->ingest;
+
+	ing->cx = vhd->context;
+	ing->sqlite3_path_lhs = vhd->sqlite3_path_lhs;
+
+	pthread_mutex_init(&ing->lock, NULL);
+	pthread_cond_init(&ing->cond_work, NULL);
+
+	if (pthread_create(&ing->thread, NULL, sais_ingest_thread, ing)) {
+		lwsl_err("%s: unable to create ingest thread\n", __func__);
+		pthread_cond_destroy(&ing->cond_work);
+		pthread_mutex_destroy(&ing->lock);
+
+		return 1;
+	}
+
+	ing->running = 1;
+
+	return 0;
+}
+
+void
+sais_ingest_destroy(struct vhd *vhd)
+{
+	sais_ingest_t *ing = &vhd->ingest;
+
+	if (!ing->running)
+		return;
+
+	/*
+	 * The one in hand gets finished, but anything still pending is
+	 * dropped... it never got an events row, so nothing refers to it
+	 */
+
+	pthread_mutex_lock(&ing->lock);
+	ing->exiting = 1;
+	pthread_cond_signal(&ing->cond_work);
+	pthread_mutex_unlock(&ing->lock);
+
+	pthread_join(ing->thread, NULL);
+	ing->running = 0;
+
+	sais_platmatch_cache_destroy(&ing->pm_cache);
+
+	lws_start_foreach_dll_safe(struct lws_dll2 *, p, p1,
+				   ing->tmpl_cache.head) {
+		lws_dll2_remove(p);
+		sais_ingest_tmpl_free(lws_container_of(p,
+					sais_saifile_tmpl_t, list));
+	} lws_end_foreach_dll_safe(p, p1);
+
+	lws_start_foreach_dll_safe(struct lws_dll2 *, p, p1,
+				   ing->pending.head) {
+		lws_dll2_remove(p);
+		sais_ingest_job_free(lws_container_of(p, sais_ingest_job_t,
+						      list));
+	} lws_end_foreach_dll_safe(p, p1);
+
+	lws_start_foreach_dll_safe(struct lws_dll2 *, p, p1, ing->done.head) {
+		lws_dll2_remove(p);
+		sais_ingest_job_free(lws_container_of(p, sais_ingest_job_t,
+						      list));
+	} lws_end_foreach_dll_safe(p, p1);
+
+	pthread_cond_destroy(&ing->cond_work);
+	pthread_mutex_destroy(&ing->lock);
+}
+
+/*
+ * Hand a checked notification over to the ingest thread.  It takes over
+ * sn->saifile if this succeeds.
+ */
+
+int
+sais_ingest_queue(struct vhd *vhd, const sai_notification_t *sn)
+{
+	sais_ingest_t *ing = &vhd->ingest;
+	sais_ingest_job_t *j;
+
+	if (!ing->running)
+		return 1;
+
+	j = malloc(sizeof(*j));
+	if (!j)
+		return 1;
+
+	memset(j, 0, sizeof(*j));
+	j->sn = *sn;
+	j->cx = ing->cx;
+	j->sqlite3_path_lhs = ing->sqlite3_path_lhs;
+	j->tmpl_cache = &ing->tmpl_cache;
+	j->pm_cache = &ing->pm_cache;
+
+	pthread_mutex_lock(&ing->lock);
+	if (ing->pending.count >= SAIS_INGEST_MAX_PENDING) {
+		pthread_mutex_unlock(&ing->lock);
+		lwsl_warn("%s: too many notifications waiting\n", __func__);
+		free(j);
+
+		return 1;
+	}
+	lws_dll2_add_tail(&j->list, &ing->pending);
+	pthread_cond_signal(&ing->cond_work);
+	pthread_mutex_unlock(&ing->lock);
+
+	return 0;
+}
+
+/*
+ * Is there a notification for this tree hash that the loop hasn't seen
+ * published yet?  Used to dedupe notifications on the loop, after looking in
+ * the events db.
+ *
+ * The thread publishes the event row while the job is still current, and the
+ * job stays on ingest.done until the loop collects it.  So if the loop's look
+ * in the events db missed the row, the job is still somewhere we look here.
+ */
+
+int
+sais_ingest_hash_pending(struct vhd *vhd, const char *hash)
+{
+	sais_ingest_t *ing = &vhd->ingest;
+	int r = 0;
+
+	if (!ing->running)
+		return 0;
+
+	pthread_mutex_lock(&ing->lock);
+
+	if (ing->current && !strcmp(ing->current->sn.e.hash, hash))
+		r = 1;
+
+	lws_start_foreach_dll(struct lws_dll2 *, p, ing->pending.head) {
+		sais_ingest_job_t *j = lws_container_of(p, sais_ingest_job_t,
+							list);
+
+		if (!strcmp(j->sn.e.hash, hash)) {
+			r = 1;
+			break;
+		}
+	} lws_end_foreach_dll(p);
+
+	/* ones that failed left no event behind, they don't count */
+
+	lws_start_foreach_dll(struct lws_dll2 *, p, ing->done.head) {
+		sais_ingest_job_t *j = lws_container_of(p, sais_ingest_job_t,
+							list);
+
+		if (!j->result && !strcmp(j->sn.e.hash, hash)) {
+			r = 1;
+			break;
+		}
+	} lws_end_foreach_dll(p);
+
+	pthread_mutex_unlock(&ing->lock);
+
+	return r;
+}
+
+/*
+ * On the loop, from LWS_CALLBACK_EVENT_WAIT_CANCELLED: collect the finished
+ * ingests and let everyone know about the new events
+ */
+
+void
+sais_ingest_completions(struct vhd *vhd)
+{
+	sais_ingest_t *ing = &vhd->ingest;
+	char buf[LWS_PRE + 64], *start = buf + LWS_PRE;
+	lws_wsmsg_info_t info;
+	lws_dll2_owner_t done;
+	int added = 0, n;
+
+	if (!ing->running)
+		return;
+
+	memset(&done, 0, sizeof(done));
+
+	pthread_mutex_lock(&ing->lock);
+	lws_start_foreach_dll_safe(struct lws_dll2 *, p, p1, ing->done.head) {
+		lws_dll2_remove(p);
+		lws_dll2_add_tail(p, &done);
+	} lws_end_foreach_dll_safe(p, p1);
+	pthread_mutex_unlock(&ing->lock);
+
+	lws_start_foreach_dll_safe(struct lws_dll2 *, p, p1, done.head) {
+		sais_ingest_job_t *j = lws_container_of(p, sais_ingest_job_t,
+							list);
+
+		if (!j->result) {
+			lwsl_notice("%s: event %s added with %d tasks\n",
+				    __func__, j->sn.e.uuid, j->task_count);
+			sais_prefetch_hint(vhd, &j->sn.e, &j->tasks);
+			added++;
+		}
+
+		lws_dll2_remove(&j->list);
+		sais_ingest_job_free(j);
+	} lws_end_foreach_dll_safe(p, p1);
+
+	if (!added)
+		return;
+
+	/*
+	 * Recompute startable task platforms and broadcast to all sai-power,
+	 * after there has been a change in tasks
+	 */
+	sais_platforms_with_tasks_pending(vhd);
+
+	/*
+	 * The tasks are all in there but set to state NOT_READY_FOR_BUILD,
+	 * the periodic central scan switches them over to WAITING when they
+	 * have been like that for a short grace time
+	 */
+	lws_sul_schedule(vhd->context, 0, &vhd->sul_central,
+			 sais_central_cb, 1 * LWS_US_PER_SEC);
+
+	/*
+	 * Inform sai-webs about the new events, so they can update connected
+	 * browsers to show them
+	 */
+	n = lws_snprintf(start, sizeof(buf) - LWS_PRE,
+			 "{\"schema\":\"sai-overview\"}");
+
+	memset(&info, 0, sizeof(info));
+	info.private_source_idx		= SAI_WEBSRV_PB__GENERATED;
+	info.buf			= (uint8_t *)start;
+	info.len			= (size_t)n;
+	info.ss_flags			= LWSSS_FLAG_SOM | LWSSS_FLAG_EOM;
+
+	if (sais_websrv_broadcast_REQUIRES_LWS_PRE(vhd->h_ss_websrv, &info) < 0)
+		lwsl_warn("%s: buflist append failed\n", __func__);
+}
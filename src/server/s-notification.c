@@ -42,6 +42,7 @@ static const char * const paths[] = {
 	"saifile_len",
 	"saifile",
 	"sec",
+	"tree",
 };
 
 enum enum_paths {
@@ -55,6 +56,7 @@ enum enum_paths {
 	LEJPN_SAIFILE_LEN,
 	LEJPN_SAIFILE,
 	LEJPN_SEC,
+	LEJPN_TREE,
 };
 
 /*
@@ -75,6 +77,7 @@ static const char * const saifile_paths[] = {
 	"configurations.*.artifacts",
 	"configurations.*.cpack",
 	"configurations.*.branches",
+	"configurations.*.warm",
 	"configurations.*",
 };
 
@@ -92,6 +95,7 @@ enum enum_saifile_paths {
 	LEJPNSAIF_CONFIGURATIONS_ARTIFACTS,
 	LEJPNSAIF_CONFIGURATIONS_CPACK,
 	LEJPNSAIF_CONFIGURATIONS_BRANCHES,
+	LEJPNSAIF_CONFIGURATIONS_WARM,
 	LEJPNSAIF_CONFIGURATIONS_NAME,
 };
 
@@ -157,109 +161,35 @@ arg_to_bool(const char *s)
 	return 0;
 }
 
-static int
-sai_tuple_element_compare(const char *e1, const char *e2)
-{
-	char *p;
-
-	// lwsl_notice("%s: comp '%s' '%s'\n", __func__, e1, e2);
-
-	if (strlen(e1) > strlen(e2))
-		/* can't match if req is longer than plat */
-		return -1;
-
-	p = strchr(e2, '/');
-	if (p && lws_ptr_diff(p, e2) < (int)strlen(e1))
-		/* e2 contains a / section terminal inside e1 scope */
-		return 1;
-
-	return strncmp(e1, e2, strlen(e1));
-}
-
-static int
-sai_tuple_compare(const char *req, size_t req_len, const char *plat)
-{
-	const char *pos = req;
-	char e1[96];
-	int n;
-
-	do {
-		n = 0;
-		while (n < (int)sizeof(e1) - 1 && req_len && *pos != '/') {
-			e1[n++] = *pos++;
-			req_len--;
-		}
-		e1[n] = '\0';
-		if (*pos == '/' && req_len) {
-			req_len--;
-			pos++;
-		}
-
-		if (n == sizeof(e1) - 1) {
-			// lwsl_notice("%s: NOMATCH 3 '%s' '%s'\n", __func__, req, plat);
-			/* element too long */
-			return 1;
-		}
-
-		if (n && /* let it pass if empty match section, eg, linux//gcc */
-		    sai_tuple_element_compare(e1, plat)) {
-			// lwsl_notice("%s: NOMATCH 2 '%s' '%s'\n", __func__, req, plat);
-			/* section does not match */
-			return 1;
-		}
-
-		while (*plat && *plat != '/')
-			plat++;
-		if (*plat == '/')
-			plat++;
-
-		if (!*plat && req_len) {
-			// lwsl_notice("%s: NOMATCH 1 '%s' '%s'\n", __func__, req, plat);
-			/* FAIL: req had more than we had */
-			return 1;
-		}
-
-		if (!req_len) {
-			// lwsl_notice("%s: MATCH '%s' '%s'\n", __func__, req, plat);
-			/* MATCH: we matched at least as far as we had */
-			return 0;
-		}
-
-	} while (1);
-
-	return 1;
-}
-
 /*
  * We parse the saifile JSON
  *
+ * This runs on the ingest thread (see s-ingest.c), so it mustn't touch the
+ * vhd or anything else belonging to the event loop.  We don't write anything
+ * here, but collect templates for the tasks each configuration expands to on
+ * j->tmpl, so the tasks can go in the db in one go once we know the whole
+ * thing parsed OK.
+ *
  * The backdrop of this is the remote's hook that's letting us know all this
  * won't update his refs to the push described here until he's finished
  * uploading the saifile POST.
  *
- * So although we are going to add the tasks as we parse them, in fact we
- * can't hand any of them out to builders until a short time after we got to
- * the end of the POST, otherwise the builders are not going to find the
- * right refs in the repo yet.
+ * So we can't hand any of the tasks out to builders until a short time after
+ * we got to the end of the POST, otherwise the builders are not going to find
+ * the right refs in the repo yet.
  */
 
 static signed char
 sai_saifile_lejp_cb(struct lejp_ctx *ctx, char reason)
 {
-	struct pss *pss = (struct pss *)ctx->user;
-	sai_notification_t *sn = (sai_notification_t *)&pss->sn;
-	sqlite3 *pdb = NULL;
+	sais_ingest_job_t *j = (sais_ingest_job_t *)ctx->user;
+	sai_notification_t *sn = &j->sn;
 	size_t n;
 
 	// lwsl_notice("%s: reason %d, %s\n", __func__, reason, ctx->path);
 
-	if (reason == LEJPCB_COMPLETE) {
-
-		if (!pss->dry)
-			lwsl_notice("%s: saifile decode completed\n", __func__);
-
+	if (reason == LEJPCB_COMPLETE)
 		return 0;
-	}
 
 	if (reason == LEJPCB_OBJECT_START &&
 	    ctx->path_match - 1 == LEJPNSAIF_CONFIGURATIONS_NAME) {
@@ -274,6 +204,7 @@ sai_saifile_lejp_cb(struct lejp_ctx *ctx, char reason)
 		sn->t.cpack[0]			= '\0';
 		sn->t.artifacts[0]		= '\0';
 		sn->t.branches[0]		= '\0';
+		sn->t.warm			= 0;
 		sn->explicit_platforms[0]	= '\0';
 		return 0;
 	}
@@ -281,233 +212,44 @@ sai_saifile_lejp_cb(struct lejp_ctx *ctx, char reason)
 	if (reason == LEJPCB_OBJECT_END &&
 	    ctx->path_match - 1 == LEJPNSAIF_CONFIGURATIONS_NAME &&
 	    sn->t.taskname[0]) {
-		lws_dll2_owner_t owner;
-		char *err;
-
-		/*
-		 * We're at the testname part of "testname" : { }
-		 */
-		if (pss->dry) {
-			sn->t.taskname[0] = '\0';
-
-			return 0;
+		const uint8_t *filt;
+		int pi = 0;
+
+		if (!j->pm || j->pm_nplat != j->platform_owner.count) {
+			j->pm = sais_platmatch_get(j->pm_cache, j->saifile_hash,
+						   &j->platform_owner);
+			if (!j->pm)
+				return -1;
+			j->pm_nplat = j->platform_owner.count;
 		}
 
 		/*
-		 * Iterate through each platform creating task entries for this
-		 * configuration customized for each platform... first time just
-		 * check the string subst for all of them is OK...
+		 * If the configuration gives explicit platforms, we have to
+		 * filter the platforms against the list, see s-platmatch.c
 		 */
 
-		lwsl_notice("%s: Creating task entries for notification\n", __func__);
-
-		lws_start_foreach_dll(struct lws_dll2 *, p,
-					   pss->platform_owner.head) {
-			sai_platform_t *pl =
-				lws_container_of(p, sai_platform_t, list);
-			size_t used_in, used_out;
-			struct lws_tokenize ts;
-			int n, match = 0;
-			lws_strexp_t sx;
-
-			if (!pl->nondefault)
-				/*
-				 * If it's a default platform, then match
-				 * by default
-				 */
-				match = 1;
-
-			/*
-			 * The configuration restricts itself to only
-			 * existing on certain branches?
-			 */
-
-			if (sn->t.branches[0]) {
-				char ref[256];
-
-				lws_snprintf(ref, sizeof(ref), "refs/heads/%s", sn->t.branches);
-
-				if (strcmp(ref, sn->e.ref)) {
-					lwsl_notice("%s: config %s skipped as only applies to %s not %s\n",
-							__func__, sn->t.taskname, ref, sn->e.ref);
-					goto next_plat;
-				}
-			}
-
-			if (sn->explicit_platforms[0]) {
-				char not = 0;
-
-				/*
-				 * If the configuration gives explicit
-				 * platforms, we have to filter the platform
-				 * against the comma-separated list.
-				 *
-				 * "none" - don't match any plats just because
-				 *	    they are default
-				 *
-				 * "not plat" - disallow specific plat "plat",
-				 *		implies you're not using "none"
-				 *
-				 * "plat" - allow specific plat "plat"
-				 */
-				memset(&ts, 0, sizeof(ts));
-				ts.start = (char *)sn->explicit_platforms;
-				ts.len = strlen(ts.start);
-				ts.flags = LWS_TOKENIZE_F_DOT_NONTERM |
-					   LWS_TOKENIZE_F_SLASH_NONTERM |
-					   LWS_TOKENIZE_F_MINUS_NONTERM;
-				do {
-					ts.e = (int8_t)lws_tokenize(&ts);
-					if (ts.e != LWS_TOKZE_TOKEN)
-						continue;
-
-			//		lwsl_notice("%s: check %.*s\n", __func__,
-			//			    (int)ts.token_len, ts.token);
-
-					if (!strncmp(ts.token, "none",
-						     ts.token_len)) {
-						not = 0;
-						match = 0;
-						continue;
-					}
-					if (!strncmp(ts.token, "not",
-						     ts.token_len)) {
-						not = 1;
-						continue;
-					}
-					/*
-					 * We need to check with per-slash
-					 * minimal matching, ie, "linux"
-					 * matches "linux-ubuntu/x86_64/gcc"
-					 */
-					if (!sai_tuple_compare(ts.token,
-						     ts.token_len, pl->name)) {
-						match = !not;
-						if (match)
-							break;
-					}
-					not = 0;
-				} while (ts.e > 0);
-			}
-
-			if (match) {
-
-				/*
-				 * The platform build string (pl->build) is the
-				 * base, with optional entries like ${cmake}
-				 * that are filled in with the corresponding
-				 * info from the specific configuration's
-				 * "cmake" entry (sn->t.cmake)...
-				 *
-				 * sn->t.build becomes the string-substituted
-				 * copy that is serialized
-				 */
-
-				lws_strexp_init(&sx, sn, exp_cmake, sn->t.build,
-						sizeof(sn->t.build));
-
-				n = lws_strexp_expand(&sx, pl->build,
-						      strlen(pl->build),
-						      &used_in, &used_out);
-				if (n != LSTRX_DONE) {
-					lwsl_notice("%s: strsubst fail n=%d %s %s\n",
-						    __func__, n, pl->build,
-						    sn->t.cmake);
-					return -1;
-				}
-			}
-
-next_plat: ;
-
-		} lws_end_foreach_dll(p);
+		filt = sais_platmatch_filter(j->pm, sn->explicit_platforms);
+		if (!filt)
+			return -1;
 
 		/*
-		 * ...now we know the string handling will go well, create the
-		 * event database file and create task entries in there for this
-		 * configuration's tasks for each platform
+		 * Iterate through each platform creating task entries for this
+		 * configuration customized for each platform
 		 */
 
-		if (sai_event_db_ensure_open(pss->vhd->context, &pss->vhd->sqlite3_cache,
-				      pss->vhd->sqlite3_path_lhs, pss->sn.e.uuid, 1, &pdb)) {
-			lwsl_err("%s: unable to open event-specific db\n", __func__);
-			return -1;
-		}
-
-		sqlite3_exec(pdb, "BEGIN TRANSACTION", NULL, NULL, &err);
-		if (err)
-			sqlite3_free(err);
-
 		lws_start_foreach_dll(struct lws_dll2 *, p,
-					   pss->platform_owner.head) {
+					   j->platform_owner.head) {
 			sai_platform_t *pl =
 				lws_container_of(p, sai_platform_t, list);
 			size_t used_in, used_out;
-			struct lws_tokenize ts;
-			int n, match = 0;
+			int n, match = filt[pi++];
 			lws_strexp_t sx;
 
-			if (!pl->nondefault)
-				/*
-				 * If it's a nondefault platform, then match
-				 * by default
-				 */
-				match = 1;
-
-			if (sn->explicit_platforms[0]) {
-				char not = 0;
-
-				/*
-				 * If the configuration gives explicit
-				 * platforms, we have to filter the platform
-				 * against the comma-separated list.
-				 *
-				 * "none" - don't match any plats just because
-				 *	    they are default
-				 *
-				 * "not plat" - disallow specific plat "plat",
-				 *		implies you're not using "none"
-				 *
-				 * "plat" - allow specific plat "plat"
-				 */
-
-				memset(&ts, 0, sizeof(ts));
-				ts.start = (char *)sn->explicit_platforms;
-				ts.len = strlen(ts.start);
-				ts.flags = LWS_TOKENIZE_F_DOT_NONTERM |
-					   LWS_TOKENIZE_F_SLASH_NONTERM |
-					   LWS_TOKENIZE_F_MINUS_NONTERM;
-
-				do {
-					ts.e = (int8_t)lws_tokenize(&ts);
-					if (ts.e != LWS_TOKZE_TOKEN)
-						continue;
-
-			//		lwsl_notice("%s: check %.*s\n", __func__,
-			//			    (int)ts.token_len, ts.token);
-
-					if (!strncmp(ts.token, "none",
-						     ts.token_len)) {
-						not = 0;
-						match = 0;
-						continue;
-					}
-					if (!strncmp(ts.token, "not",
-						     ts.token_len)) {
-						not = 1;
-						continue;
-					}
-					if (!sai_tuple_compare(ts.token,
-						     ts.token_len, pl->name)) {
-						match = !not;
-						if (match)
-							break;
-					}
-					not = 0;
-				} while (ts.e > 0);
-			}
-
 			if (match) {
+				sais_task_tmpl_t *tt;
 				const char *p;
+				size_t l[6];
+				char *q;
 				int c;
 
 				/*
@@ -523,7 +265,16 @@ next_plat: ;
 					if (*p++ == '\n')
 						c++;
 
-				pss->sn.t.build_step_count = c;
+				/*
+				 * The platform build string (pl->build) is the
+				 * base, with optional entries like ${cmake}
+				 * that are filled in with the corresponding
+				 * info from the specific configuration's
+				 * "cmake" entry (sn->t.cmake)...
+				 *
+				 * sn->t.build becomes the string-substituted
+				 * copy that is serialized
+				 */
 
 				lws_strexp_init(&sx, sn, exp_cmake, sn->t.build,
 						sizeof(sn->t.build));
@@ -535,85 +286,54 @@ next_plat: ;
 					lwsl_notice("%s: strsubst failed %s %s\n",
 						    __func__, pl->build,
 						    sn->t.cmake);
-					sqlite3_exec(pdb, "END TRANSACTION", NULL, NULL, &err);
-					if (err)
-						sqlite3_free(err);
-					sai_event_db_close(&pss->vhd->sqlite3_cache, &pdb);
 					return -1;
 				}
 
-
 				/*
-				 * Prepare a struct of the task object...
-				 * task uuid is the event uuid and another
-				 * random 32 chars, so you can always recover
-				 * the related event uuid from the task uuid
+				 * Keep what we worked out as a template, the
+				 * tasks for the event are made from those, see
+				 * s-ingest.c.  The strings follow the struct.
 				 */
 
-				memcpy(pss->sn.t.uuid, pss->sn.e.uuid, 32);
-				sai_uuid16_create(lws_get_context(pss->wsi),
-						  pss->sn.t.uuid + 32);
-				strcpy(pss->sn.t.event_uuid, pss->sn.e.uuid);
-				pss->sn.t.uid = pss->sn.event_task_index++;
+				l[0] = strlen(pl->name) + 1;
+				l[1] = strlen(sn->t.taskname) + 1;
+				l[2] = strlen(sn->t.build) + 1;
+				l[3] = strlen(sn->t.packages) + 1;
+				l[4] = strlen(sn->t.artifacts) + 1;
+				l[5] = strlen(sn->t.branches) + 1;
 
-				/*
-				 * This is basically a secret that anything
-				 * trying to upload an artifact for the task
-				 * must provide to authenticate.
-				 */
-				sai_uuid16_create(lws_get_context(pss->wsi),
-						  pss->sn.t.art_up_nonce);
-				/*
-				 * An unrelated secret that anything
-				 * trying to download an artifact for the task
-				 * must provide to identify it.
-				 */
-				sai_uuid16_create(lws_get_context(pss->wsi),
-						  pss->sn.t.art_down_nonce);
-
-				pss->sn.t.git_repo_url =
-						pss->sn.e.repo_fetchurl;
-				pss->sn.e.last_updated =
-					(unsigned long long)lws_now_secs();
-				pss->sn.e.state = SAIES_WAITING;
-				lws_strncpy(pss->sn.t.platform, pl->name,
-					    sizeof(pss->sn.t.platform));
-
-				// pss->sn.t.server_name	= ;
-				pss->sn.t.repo_name	= pss->sn.e.repo_name;
-				pss->sn.t.git_ref	= sn->e.ref;
-				pss->sn.t.git_hash	= sn->e.hash;
-
-				lws_dll2_clear(&pss->sn.t.list);
-				lws_dll2_owner_clear(&owner);
-				lws_dll2_add_head(&pss->sn.t.list, &owner);
-
-				/*
-				 * Create the task in event-specific database
-				 */
+				tt = malloc(sizeof(*tt) + l[0] + l[1] + l[2] +
+					    l[3] + l[4] + l[5]);
+				if (!tt)
+					return -1;
 
-				lws_struct_sq3_serialize(pdb,
-							 lsm_schema_sq3_map_task,
-							 &owner, (uint32_t)pss->sn.t.uid);
+				memset(tt, 0, sizeof(*tt));
+				tt->build_step_count = c;
+				tt->warm = sn->t.warm;
+				q = (char *)&tt[1];
+				tt->platform = q;
+				memcpy(q, pl->name, l[0]);
+				q += l[0];
+				tt->taskname = q;
+				memcpy(q, sn->t.taskname, l[1]);
+				q += l[1];
+				tt->build = q;
+				memcpy(q, sn->t.build, l[2]);
+				q += l[2];
+				tt->packages = q;
+				memcpy(q, sn->t.packages, l[3]);
+				q += l[3];
+				tt->artifacts = q;
+				memcpy(q, sn->t.artifacts, l[4]);
+				q += l[4];
+				tt->branches = q;
+				memcpy(q, sn->t.branches, l[5]);
+
+				lws_dll2_add_tail(&tt->list, &j->tmpl->tasks);
 			}
 
 		} lws_end_foreach_dll(p);
 
-		sqlite3_exec(pdb, "END TRANSACTION", NULL, NULL, &err);
-		if (err)
-			sqlite3_free(err);
-
-		sai_event_db_close(&pss->vhd->sqlite3_cache, &pdb);
-
-		/*
-		 * Recompute startable task platforms and broadcast to all sai-power,
-		 * after there has been a change in tasks
-		 */
-		sais_platforms_with_tasks_pending(pss->vhd);
-
-//		lwsl_notice("%s: New test '%s', '%s', '%s'\n", __func__,
-//			    sn->t.taskname, sn->t.cmake, sn->t.packages);
-
 		sn->t.taskname[0] = '\0';
 		return 0;
 	}
@@ -639,11 +359,6 @@ next_plat: ;
 		uint8_t *plb;
 		size_t pnl;
 
-		if (pss->dry) {
-			sn->t.platform[0] = '\0';
-			return 0;
-		}
-
 		/*
 		 * We create a platform object with space for its strings after
 		 */
@@ -658,8 +373,7 @@ next_plat: ;
 		plb = (uint8_t *)&pl[1];
 
 		/*
-		 * Platforms are malloc'd up and added to pss
-		 * .platform_owner
+		 * Platforms are malloc'd up and added to j->platform_owner
 		 */
 
 		pl->name = (const char *)plb;
@@ -671,7 +385,7 @@ next_plat: ;
 
 		pl->nondefault = sn->nondefault;
 
-		lws_dll2_add_head(&pl->list, &pss->platform_owner);
+		lws_dll2_add_head(&pl->list, &j->platform_owner);
 
 //		lwsl_notice("%s: New platform '%s', build '%s', notdefault %d\n",
 //			    __func__, pl->name, pl->build, pl->nondefault);
@@ -755,6 +469,11 @@ next_plat: ;
 		lws_strncpy(sn->t.branches, ctx->buf, sizeof(sn->t.branches));
 		break;
 
+	case LEJPNSAIF_CONFIGURATIONS_WARM:
+		/* builders may keep the build dir for the next event */
+		sn->t.warm = (char)(reason == LEJPCB_VAL_TRUE);
+		break;
+
 	case LEJPNSAIF_PLAT_BUILD:
 	case LEJPNSAIF_PLAT_BUILD_STAGE:
 		/*
@@ -849,6 +568,10 @@ sai_notification_lejp_cb(struct lejp_ctx *ctx, char reason)
 		lws_strncpy(sn->e.hash, ctx->buf, sizeof(sn->e.hash));
 		break;
 
+	case LEJPN_TREE:
+		lws_strncpy(sn->tree, ctx->buf, sizeof(sn->tree));
+		break;
+
 	case LEJPN_NONCE:
 		break;
 
@@ -909,14 +632,46 @@ sai_notification_lejp_cb(struct lejp_ctx *ctx, char reason)
 	return 0;
 }
 
+/*
+ * On the ingest thread: parse the .sai.json, collecting the platforms on
+ * j->platform_owner and the task templates they expand to on j->tmpl
+ */
+
+int
+sais_ingest_parse(sais_ingest_job_t *j)
+{
+	struct lejp_ctx saictx;
+	int m;
+
+	/*
+	 * We don't trust it since it's controlled by the guy who pushed
+	 * the commit, there can be anything at all in there.  We made
+	 * sure he can't attack us until now by base64-ing it at the
+	 * server hook, so he's just dumb payload.  Nothing is written until
+	 * it all parsed OK.
+	 */
+
+	lejp_construct(&saictx, sai_saifile_lejp_cb, j, saifile_paths,
+		       LWS_ARRAY_SIZE(saifile_paths));
+	m = lejp_parse(&saictx, (uint8_t *)j->sn.saifile,
+		       (int)j->sn.saifile_out_pos);
+	lejp_destruct(&saictx);
+	if (m < 0) {
+		lwsl_notice("%s: saifile JSON decode failed '%s' (%d)\n",
+			    __func__, lejp_error_to_string(m), m);
+
+		return m;
+	}
+
+	return 0;
+}
+
 int
 sai_notification_file_upload_cb(void *data, const char *name,
 				const char *filename, char *buf, int len,
 				enum lws_spa_fileupload_states state)
 {
 	struct pss *pss = (struct pss *)data;
-	struct lejp_ctx saictx;
-	lws_dll2_owner_t owner;
 	uint8_t result[64];
 	int m;
 
@@ -974,19 +729,22 @@ sai_notification_file_upload_cb(void *data, const char *name,
 
 		{
 			uint64_t rid = 0;
-			char qu[192];
+			char qu[192], esc[96];
 
+			lws_sql_purify(esc, pss->sn.e.hash, sizeof(esc));
 			lws_snprintf(qu, sizeof(qu), "select rowid from events "
-						     "where hash='%s'",
-						     pss->sn.e.hash);
+						     "where hash='%s'", esc);
 
-			if (sqlite3_exec(pss->vhd->server.pdb, qu,
+			if ((sqlite3_exec(pss->vhd->server.pdb, qu,
 					 sai_sql3_get_uint64_cb,
-					 &rid, NULL) == SQLITE_OK && rid) {
+					 &rid, NULL) == SQLITE_OK && rid) ||
+			    sais_ingest_hash_pending(pss->vhd, pss->sn.e.hash)) {
 				/* it already exists */
 				lwsl_notice("%s: ignoring notification as "
 					    "tree hash event exists\n",
 					    __func__);
+				free(pss->sn.saifile);
+				pss->sn.saifile = NULL;
 
 				return 0;
 			}
@@ -997,97 +755,27 @@ sai_notification_file_upload_cb(void *data, const char *name,
 
 		/*
 		 * We processed the notification JSON, but we only decoded the
-		 * base64'd copy of the .sai.json so far... now's the time we
-		 * want to process that and break it down into tasks.
-		 *
-		 * We don't trust it since it's controlled by the guy who pushed
-		 * the commit, there can be anything at all in there.  We made
-		 * sure he can't attack us until now by base64-ing it at the
-		 * server hook, so he's just dumb payload.
-		 *
-		 * Let's try to parse it in two passes, first without acting on
-		 * the content to confirm it's going to succeed...
+		 * base64'd copy of the .sai.json so far... breaking it down
+		 * into tasks and adding them to the db can take a while for a
+		 * big matrix, so that happens on the ingest thread and we can
+		 * answer the POST straight away.  The ingest thread takes over
+		 * the saifile allocation.
 		 */
 
 		sai_uuid16_create(lws_get_context(pss->wsi), pss->sn.e.uuid);
-		m = sai_event_db_ensure_open(pss->vhd->context, &pss->vhd->sqlite3_cache,
-				      pss->vhd->sqlite3_path_lhs, pss->sn.e.uuid, 1,
-					      (sqlite3 **)&pss->sn.e.pdb);
-		if (m) {
-			lwsl_err("%s: XX %d unable to open event-specific database\n",
-					__func__, m);
-
-			goto saifile_bail;
-		}
-
-		pss->dry = 1;
-		lejp_construct(&saictx, sai_saifile_lejp_cb, pss, saifile_paths,
-			       LWS_ARRAY_SIZE(saifile_paths));
-		m = lejp_parse(&saictx, (uint8_t *)pss->sn.saifile,
-			       (int)pss->sn.saifile_out_pos);
-		sai_event_db_close(&pss->vhd->sqlite3_cache, (sqlite3 **)&pss->sn.e.pdb);
-		if (m < 0) {
-			lwsl_notice("%s: saifile JSON 1 decode failed '%s' (%d)\n",
-				    __func__, lejp_error_to_string(m), m);
-			puts(pss->sn.saifile);
-			goto saifile_bail;
-		}
-
-		/* ... then add the 32-char event object in the database ... */
-
 		pss->sn.e.created = (unsigned long long)lws_now_secs();
 		pss->sn.e.state = SAIES_WAITING;
 
-		memset(&pss->sn.e.list, 0, sizeof(pss->sn.e.list));
-		lws_dll2_owner_clear(&owner);
-		lws_dll2_add_head(&pss->sn.e.list, &owner);
-
-		/*
-		 * This is our new event going into the event database...
-		 */
-
-		lws_struct_sq3_serialize(pss->vhd->server.pdb,
-					 lsm_schema_sq3_map_event, &owner, 0);
-
-		/*
-		 * ... process the saifile JSON again creating tasks for each
-		 * entry in the saifile, for each platform, against that event
-		 * object...
-		 */
+		if (sais_ingest_queue(pss->vhd, &pss->sn)) {
+			free(pss->sn.saifile);
+			pss->sn.saifile = NULL;
 
-		pss->dry = 0;
-		lejp_construct(&saictx, sai_saifile_lejp_cb, pss, saifile_paths,
-			       LWS_ARRAY_SIZE(saifile_paths));
-		m = lejp_parse(&saictx, (uint8_t *)pss->sn.saifile,
-			       (int)pss->sn.saifile_out_pos);
-		free(pss->sn.saifile);
-		pss->sn.saifile = NULL;
-		if (m < 0) {
-			lwsl_notice("%s: saifile JSON 2 decode failed '%s' (%d)\n",
-				    __func__, lejp_error_to_string(m), m);
-			puts(pss->sn.saifile);
-			return m;
+			return -1;
 		}
 
-		lwsl_notice("%s: notification inserted into db\n", __func__);
-
-		/*
-		 * The tasks are all in there but set to state
-		 * NOT_READY_FOR_BUILD, the periodic central scan
-		 * switch them over to WAITING when they have been like that
-		 * for a short grace time (eg, 10s)
-		 */
-
-		lws_sul_schedule(pss->vhd->context, 0, &pss->vhd->sul_central,
-				 sais_central_cb, 1 * LWS_US_PER_SEC);
-
-		return 0;
-
-saifile_bail:
-		free(pss->sn.saifile);
 		pss->sn.saifile = NULL;
 
-		return -1;
+		return 0;
 
 	case LWS_UFS_CLOSE:
 		// lwsl_info("%s: LWS_UFS_CLOSE\n", __func__);
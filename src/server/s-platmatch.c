@@ -0,0 +1,409 @@
+/*
+ * Sai server - ./src/server/s-platmatch.c
+ *
+ * Copyright (C) 2019 - 2025 Andy Green <andy@warmcat.com>
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation:
+ *  version 2.1 of the License.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *  MA  02110-1301  USA
+ *
+ * Each configuration in a .sai.json may restrict which platforms it builds on
+ * with a "platforms" filter like "none linux/x86_64 not linux-centos".  Each
+ * filter token matches platforms per '/'-separated section, where each token
+ * section has to be a prefix of the platform's section, so "linux" matches
+ * "linux-ubuntu/x86_64/gcc".
+ *
+ * Rather than compare every token against every platform for every
+ * configuration, the platform names are compiled into a trie of their
+ * sections once, with each node knowing which platforms are below it.  A
+ * token is then one walk down the trie, and the result of a whole filter
+ * string is remembered, since most configurations in a big matrix repeat the
+ * same few filters.  Compiled matchers are kept per .sai.json hash on the
+ * ingest thread, so the usual case of the same .sai.json being pushed again
+ * reuses everything.
+ *
+ * This is all only used from the ingest thread.
+ */
+
+#include <libwebsockets.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "s-private.h"
+
+#define SAIS_PLATMATCH_CACHE_MAX	8
+#define SAIS_PLATMATCH_MEMO_MAX		128
+#define SAIS_PLATMATCH_SEG_MAX		96
+
+typedef struct sais_pm_node {
+	lws_dll2_t		list; /* parent's children */
+	lws_dll2_owner_t	children;
+	size_t			seg_len;
+	uint8_t			*below; /* [nplat]: platform is in this subtree */
+	/* below[], then seg (not NUL-terminated) follow */
+} sais_pm_node_t;
+
+typedef struct sais_pm_memo {
+	lws_dll2_t		list; /* pm->memo, most recent first */
+	/* result[nplat], then the NUL-terminated filter string follow */
+} sais_pm_memo_t;
+
+struct sais_platmatch {
+	lws_dll2_t		list; /* the ingest thread's cache */
+	char			key[65]; /* sha256 of the .sai.json */
+
+	sais_pm_node_t		root;
+	lws_dll2_owner_t	memo;
+
+	const char		**names; /* [nplat], for checking reuse */
+	uint8_t			*defaults; /* [nplat] */
+	uint8_t			*scratch; /* [nplat * 2] */
+	int			nplat;
+};
+
+#define pm_seg(_n) ((const char *)&(_n)->below[0] + nplat)
+
+static sais_pm_node_t *
+sais_pm_child(sais_pm_node_t *parent, const char *seg, size_t len, int nplat)
+{
+	sais_pm_node_t *n;
+
+	lws_start_foreach_dll(struct lws_dll2 *, p, parent->children.head) {
+		n = lws_container_of(p, sais_pm_node_t, list);
+
+		if (n->seg_len == len && !memcmp(pm_seg(n), seg, len))
+			return n;
+	} lws_end_foreach_dll(p);
+
+	n = malloc(sizeof(*n) + (size_t)nplat + len);
+	if (!n)
+		return NULL;
+
+	memset(n, 0, sizeof(*n));
+	n->below = (uint8_t *)&n[1];
+	memset(n->below, 0, (size_t)nplat);
+	n->seg_len = len;
+	memcpy(n->below + nplat, seg, len);
+	lws_dll2_add_tail(&n->list, &parent->children);
+
+	return n;
+}
+
+static void
+sais_pm_node_free(sais_pm_node_t *node)
+{
+	lws_start_foreach_dll_safe(struct lws_dll2 *, p, p1,
+				   node->children.head) {
+		sais_pm_node_t *n = lws_container_of(p, sais_pm_node_t, list);
+
+		sais_pm_node_free(n);
+		lws_dll2_remove(&n->list);
+		free(n);
+	} lws_end_foreach_dll_safe(p, p1);
+}
+
+void
+sais_platmatch_destroy(sais_platmatch_t **ppm)
+{
+	sais_platmatch_t *pm = *ppm;
+
+	if (!pm)
+		return;
+
+	sais_pm_node_free(&pm->root);
+
+	lws_start_foreach_dll_safe(struct lws_dll2 *, p, p1, pm->memo.head) {
+		lws_dll2_remove(p);
+		free(lws_container_of(p, sais_pm_memo_t, list));
+	} lws_end_foreach_dll_safe(p, p1);
+
+	free(pm);
+	*ppm = NULL;
+}
+
+static sais_platmatch_t *
+sais_platmatch_create(const char *key, const lws_dll2_owner_t *platforms)
+{
+	int nplat = (int)platforms->count, i = 0;
+	sais_platmatch_t *pm;
+	size_t nl = 0;
+	char *np;
+
+	lws_start_foreach_dll(struct lws_dll2 *, p, platforms->head) {
+		nl += strlen(lws_container_of(p, sai_platform_t, list)->name) + 1;
+	} lws_end_foreach_dll(p);
+
+	pm = malloc(sizeof(*pm) + (sizeof(const char *) * (size_t)nplat) +
+		    ((size_t)nplat * 3) + nl);
+	if (!pm)
+		return NULL;
+
+	memset(pm, 0, sizeof(*pm));
+	lws_strncpy(pm->key, key, sizeof(pm->key));
+	pm->nplat = nplat;
+	pm->names = (const char **)&pm[1];
+	pm->defaults = (uint8_t *)&pm->names[nplat];
+	pm->scratch = pm->defaults + nplat;
+	np = (char *)pm->scratch + (nplat * 2);
+
+	lws_start_foreach_dll(struct lws_dll2 *, p, platforms->head) {
+		sai_platform_t *pl = lws_container_of(p, sai_platform_t, list);
+		sais_pm_node_t *n = &pm->root;
+		const char *s = pl->name, *e;
+		size_t l = strlen(pl->name) + 1;
+
+		memcpy(np, pl->name, l);
+		pm->names[i] = np;
+		np += l;
+		pm->defaults[i] = !pl->nondefault;
+
+		while (*s) {
+			e = strchr(s, '/');
+			if (!e)
+				e = s + strlen(s);
+
+			n = sais_pm_child(n, s, (size_t)(e - s),
+					  nplat);
+			if (!n) {
+				sais_platmatch_destroy(&pm);
+				return NULL;
+			}
+			n->below[i] = 1;
+
+			s = *e ? e + 1 : e;
+		}
+
+		i++;
+	} lws_end_foreach_dll(p);
+
+	return pm;
+}
+
+/*
+ * The platform list must be the same, in the same order, as the one the
+ * matcher was compiled from
+ */
+
+static int
+sais_platmatch_fits(const sais_platmatch_t *pm, const lws_dll2_owner_t *platforms)
+{
+	int i = 0;
+
+	if (pm->nplat != (int)platforms->count)
+		return 0;
+
+	lws_start_foreach_dll(struct lws_dll2 *, p, platforms->head) {
+		sai_platform_t *pl = lws_container_of(p, sai_platform_t, list);
+
+		if (strcmp(pm->names[i], pl->name) ||
+		    pm->defaults[i] != !pl->nondefault)
+			return 0;
+
+		i++;
+	} lws_end_foreach_dll(p);
+
+	return 1;
+}
+
+/*
+ * Get a matcher for the platforms parsed from the .sai.json with the given
+ * hash, from the cache or compiling a new one.  The cache owns it.
+ */
+
+sais_platmatch_t *
+sais_platmatch_get(lws_dll2_owner_t *cache, const char *key,
+		   const lws_dll2_owner_t *platforms)
+{
+	sais_platmatch_t *pm;
+
+	lws_start_foreach_dll(struct lws_dll2 *, p, cache->head) {
+		pm = lws_container_of(p, sais_platmatch_t, list);
+
+		if (!strcmp(pm->key, key)) {
+			if (sais_platmatch_fits(pm, platforms)) {
+				/* most recently used first */
+				lws_dll2_remove(&pm->list);
+				lws_dll2_add_head(&pm->list, cache);
+
+				return pm;
+			}
+
+			/*
+			 * Same .sai.json but we're asked at a different point
+			 * in the parse, eg, platforms after configurations
+			 */
+			lws_dll2_remove(&pm->list);
+			sais_platmatch_destroy(&pm);
+			break;
+		}
+	} lws_end_foreach_dll(p);
+
+	pm = sais_platmatch_create(key, platforms);
+	if (!pm)
+		return NULL;
+
+	lws_dll2_add_head(&pm->list, cache);
+
+	if (cache->count > SAIS_PLATMATCH_CACHE_MAX) {
+		sais_platmatch_t *old = lws_container_of(cache->tail,
+						sais_platmatch_t, list);
+
+		lws_dll2_remove(&old->list);
+		sais_platmatch_destroy(&old);
+	}
+
+	return pm;
+}
+
+void
+sais_platmatch_cache_destroy(lws_dll2_owner_t *cache)
+{
+	lws_start_foreach_dll_safe(struct lws_dll2 *, p, p1, cache->head) {
+		sais_platmatch_t *pm = lws_container_of(p, sais_platmatch_t,
+							list);
+
+		lws_dll2_remove(&pm->list);
+		sais_platmatch_destroy(&pm);
+	} lws_end_foreach_dll_safe(p, p1);
+}
+
+/*
+ * Walk one '/' section of the request token at a time down the trie, marking
+ * every platform below where the token runs out.  An empty section, eg, in
+ * linux//gcc, matches any section.
+ */
+
+static void
+sais_pm_walk(const sais_platmatch_t *pm, const sais_pm_node_t *node,
+	     const char *req, size_t req_len, uint8_t *set)
+{
+	int nplat = pm->nplat, i;
+	size_t n = 0;
+
+	while (n < req_len && req[n] != '/')
+		n++;
+
+	if (n >= SAIS_PLATMATCH_SEG_MAX - 1)
+		/* element too long */
+		return;
+
+	lws_start_foreach_dll(struct lws_dll2 *, p, node->children.head) {
+		const sais_pm_node_t *c = lws_container_of(p,
+						sais_pm_node_t, list);
+
+		if (!n || (c->seg_len >= n && !memcmp(req, pm_seg(c), n))) {
+			if (n == req_len || n + 1 == req_len) {
+				/* we matched at least as far as we had */
+				for (i = 0; i < nplat; i++)
+					set[i] |= c->below[i];
+			} else
+				sais_pm_walk(pm, c, req + n + 1,
+					     req_len - n - 1, set);
+		}
+	} lws_end_foreach_dll(p);
+}
+
+/*
+ * Returns an array with one entry per platform, in platform list order, that
+ * is nonzero if a configuration with this "platforms" filter should build on
+ * it.  The result is valid until the next call.
+ *
+ *  "none" - don't match any plats just because they are default
+ *
+ *  "not plat" - disallow specific plat "plat", implies you're not using "none"
+ *
+ *  "plat" - allow specific plat "plat"
+ */
+
+const uint8_t *
+sais_platmatch_filter(sais_platmatch_t *pm, const char *filter)
+{
+	uint8_t *match, *done = pm->scratch + pm->nplat, *set;
+	size_t flen = strlen(filter);
+	struct lws_tokenize ts;
+	sais_pm_memo_t *m;
+	char not = 0;
+	int i;
+
+	lws_start_foreach_dll(struct lws_dll2 *, p, pm->memo.head) {
+		m = lws_container_of(p, sais_pm_memo_t, list);
+		if (!strcmp((const char *)&m[1] + pm->nplat, filter)) {
+			lws_dll2_remove(&m->list);
+			lws_dll2_add_head(&m->list, &pm->memo);
+
+			return (const uint8_t *)&m[1];
+		}
+	} lws_end_foreach_dll(p);
+
+	m = malloc(sizeof(*m) + (size_t)pm->nplat + flen + 1);
+	if (!m)
+		return NULL;
+
+	memset(m, 0, sizeof(*m));
+	match = (uint8_t *)&m[1];
+	memcpy(match + pm->nplat, filter, flen + 1);
+	memcpy(match, pm->defaults, (size_t)pm->nplat);
+	memset(done, 0, (size_t)pm->nplat);
+	set = pm->scratch;
+
+	memset(&ts, 0, sizeof(ts));
+	ts.start = filter;
+	ts.len = flen;
+	ts.flags = LWS_TOKENIZE_F_DOT_NONTERM |
+		   LWS_TOKENIZE_F_SLASH_NONTERM |
+		   LWS_TOKENIZE_F_MINUS_NONTERM;
+
+	while (flen) {
+		ts.e = (int8_t)lws_tokenize(&ts);
+		if (ts.e <= 0)
+			break;
+		if (ts.e != LWS_TOKZE_TOKEN)
+			continue;
+
+		if (!strncmp(ts.token, "none", ts.token_len)) {
+			not = 0;
+			for (i = 0; i < pm->nplat; i++)
+				if (!done[i])
+					match[i] = 0;
+			continue;
+		}
+		if (!strncmp(ts.token, "not", ts.token_len)) {
+			not = 1;
+			continue;
+		}
+
+		/* a platform that got allowed stays allowed */
+
+		memset(set, 0, (size_t)pm->nplat);
+		sais_pm_walk(pm, &pm->root, ts.token, ts.token_len, set);
+		for (i = 0; i < pm->nplat; i++)
+			if (set[i] && !done[i]) {
+				match[i] = !not;
+				done[i] = !not;
+			}
+
+		not = 0;
+	}
+
+	lws_dll2_add_head(&m->list, &pm->memo);
+	if (pm->memo.count > SAIS_PLATMATCH_MEMO_MAX) {
+		sais_pm_memo_t *old = lws_container_of(pm->memo.tail,
+						sais_pm_memo_t, list);
+
+		lws_dll2_remove(&old->list);
+		free(old);
+	}
+
+	return match;
+}
@@ -22,10 +22,30 @@
 #include "../common/include/private.h"
 #include <sqlite3.h>
 #include <sys/stat.h>
+#include <pthread.h>
 
 #define SAI_EVENTID_LEN 32
 #define SAI_TASKID_LEN 64
 
+/* artifact upload connection dropped if it goes quiet this long */
+#define SAIS_ARTIFACT_IDLE_SECS		30
+/* partial uploads nobody came back to resume are deleted after this */
+#define SAIS_ARTIFACT_PARTIAL_AGE_SECS	(2 * 24 * 3600)
+/* a resumed partial is rehashed this much per event loop pass */
+#define SAIS_ARTIFACT_CATCHUP_SLICE	(256 * 1024)
+/* db writer group commits slower than this get a warning */
+#define SAIS_DBW_SLOW_COMMIT_US		(500 * LWS_US_PER_MS)
+/* warn if this many jobs are waiting for the db writer */
+#define SAIS_DBW_DEPTH_WARN		256
+/* background event jobs report progress every this many files */
+#define SAIS_DBW_PROGRESS_EVERY		32
+/* git prefetch hints waiting to go to one builder beyond this are dropped */
+#define SAIS_PREFETCH_MAX_QUEUED	16
+/* a warm task waits this long for the builder holding its warm dir */
+#define SAIS_WARM_AFFINITY_SECS		90
+/* candidate tasks considered from one event when picking for warm dirs */
+#define SAIS_WARM_CANDIDATES		16
+
 struct sai_plat;
 
 /* lws_wsmsg_ array for different sources */
@@ -102,6 +122,7 @@ typedef struct {
 	char				platbuild[4096];
 	char				platname[96];
 	char				explicit_platforms[2048];
+	char				tree[65]; /* git tree hash, if given */
 
 	int				event_task_index;
 
@@ -133,14 +154,21 @@ struct pss {
 	sai_notification_t	sn;
 	struct lws_dll2		same; /* owner: vhd.builders */
 
-	struct lws_buflist	*onward_reassembly;
-
 	sqlite3			*pdb_artifact;
-	sqlite3_blob		*blob_artifact;
+	sai_artifact_t		artifact; /* the artifact being uploaded */
+	struct lws_genhash_ctx	artifact_hash_ctx;
+	struct lws_genhash_ctx	artifact_chunk_hash_ctx;
+	void			*artifact_zs; /* z_stream if gzip encoded */
+	char			artifact_chunk_sha256[65];
+	char			artifact_temp[256];
+	char			artifact_repo[65]; /* repo of the artifact's event */
+	int			artifact_fd;
+	lws_sorted_usec_list_t	sul_artifact_catchup;
 
 	lws_dll2_owner_t	platform_owner; /* sai_platform_t builder offers */
 	lws_dll2_owner_t	task_cancel_owner; /* sai_platform_t builder offers */
 	lws_dll2_owner_t	rebuild_owner;
+	lws_dll2_owner_t	prefetch_owner; /* sai_prefetch_t hints */
 	lws_dll2_owner_t	stay_owner;
 	lws_dll2_owner_t	aft_owner; /* for statefully spooling artifact info */
 	lws_dll2_owner_t	res_owner; /* sai_resource_requisition_t
@@ -184,31 +212,224 @@ struct pss {
 	uint64_t		first_log_timestamp;
 	uint64_t		artifact_offset;
 	uint64_t		artifact_length;
+	uint64_t		artifact_chunk_start; /* verified up to here */
+	uint64_t		artifact_chunk_end;
+	uint64_t		artifact_catchup_ofs; /* rehashed up to here */
 
 	unsigned int		spa_failed:1;
 	unsigned int		subsequent:1; /* for individual JSON */
-	unsigned int		dry:1;
 	unsigned int		frag:1;
 	unsigned int		mark_started:1;
 	unsigned int		wants_event_updates:1;
 	unsigned int		announced:1;
 	unsigned int		bulk_binary_data:1;
+	unsigned int		artifact_open:1;
+	unsigned int		artifact_in_chunk:1;
+	unsigned int		artifact_resume_pending:1;
+	unsigned int		artifact_catching_up:1;
 	unsigned int		is_power:1;
 
 	uint8_t			ovstate; /* SOS_ substate when doing overview */
 };
 
+struct vhd;
+struct sais_dbw_job;
+
+typedef void (*sais_dbw_cb_t)(struct vhd *vhd, struct sais_dbw_job *j);
+
+typedef enum {
+	SAIS_DBW_OP_LOGS,		/* commit a task's logs */
+	SAIS_DBW_OP_EVENT_RESET,	/* delete all an event's logs */
+	SAIS_DBW_OP_EVENT_DELETE,	/* remove a tombstoned event's db */
+	SAIS_DBW_OP_TASK_RESET,		/* delete one task's logs */
+	SAIS_DBW_OP_TASK_UPDATE,	/* change one task's row */
+	SAIS_DBW_OP_TASK_STATE,		/* change a task's state, tally event */
+} sais_dbw_op_t;
+
+/* a file for the writer to unlink, the path follows the struct */
+
+typedef struct sais_dbw_path {
+	lws_dll2_t		list;
+} sais_dbw_path_t;
+
+/*
+ * Progress of a background event job, passed from the writer to the loop to
+ * be reported to sai-web
+ */
+
+typedef struct sais_dbw_progress {
+	lws_dll2_t		list; /* dbw.progress */
+	char			event_uuid[33];
+	sais_dbw_op_t		op;
+	unsigned int		done;
+	unsigned int		total;
+} sais_dbw_progress_t;
+
+/*
+ * A write for the db writer thread to do.  When it was done, it comes back to
+ * the event loop and cb is called there.
+ */
+
+typedef struct sais_dbw_job {
+	lws_dll2_t		list; /* dbw.pending, then dbw.done */
+	sais_dbw_op_t		op;
+	char			event_uuid[33];
+	char			task_uuid[65];
+	lws_dll2_owner_t	logs; /* sai_log_t, freed by the writer */
+	lws_dll2_owner_t	unlinks; /* sais_dbw_path_t, freed by writer */
+	sais_dbw_cb_t		cb; /* called on the loop when done, or NULL */
+	lws_usec_t		us_commit; /* how long its group commit took */
+	char			sql[384]; /* TASK_UPDATE, TASK_STATE */
+	int			state; /* TASK_STATE: the new state */
+	int			ostate; /* TASK_STATE: state it had, by writer */
+	unsigned int		count; /* TASK_STATE: event tasks, by writer */
+	unsigned int		count_good; /* ...of which passed */
+	unsigned int		count_bad; /* ...of which failed */
+	int			result; /* 0 = written */
+	char			applied; /* writer private */
+} sais_dbw_job_t;
+
+typedef struct sais_dbw {
+	pthread_t		thread;
+	pthread_mutex_t		lock; /* protects everything below */
+	pthread_cond_t		cond_work; /* writer waits for work */
+	pthread_cond_t		cond_idle; /* shutdown waits for idle */
+
+	lws_dll2_owner_t	pending; /* sais_dbw_job_t, loop -> writer */
+	lws_dll2_owner_t	done; /* sais_dbw_job_t, writer -> loop */
+	lws_dll2_owner_t	progress; /* sais_dbw_progress_t, writer -> loop */
+
+	struct lws_context	*cx;
+	const char		*sqlite3_path_lhs;
+	const char		*artifact_store;
+
+#if defined(LWS_WITH_SYS_METRICS)
+	lws_metric_t		*mt_depth; /* jobs waiting when we queue */
+	lws_metric_t		*mt_commit; /* group commit latency, us */
+#endif
+
+	char			busy; /* writer has a batch in hand */
+	char			exiting;
+	char			running;
+} sais_dbw_t;
+
+/* compiled platform filter matcher, see s-platmatch.c */
+
+typedef struct sais_platmatch sais_platmatch_t;
+
+/*
+ * What a configuration x platform in a .sai.json expands to, before it is
+ * made into a task for a particular event.  The strings follow the struct.
+ */
+
+typedef struct sais_task_tmpl {
+	lws_dll2_t		list; /* sais_saifile_tmpl_t.tasks */
+	const char		*platform;
+	const char		*taskname;
+	const char		*build; /* after string substitution */
+	const char		*packages;
+	const char		*artifacts;
+	const char		*branches;
+	int			build_step_count;
+	int			warm; /* "warm": true */
+} sais_task_tmpl_t;
+
+/* all the task templates from one .sai.json */
+
+typedef struct sais_saifile_tmpl {
+	lws_dll2_t		list; /* ingest.tmpl_cache, most recent first */
+	char			key[65]; /* sha256 of the .sai.json */
+	lws_dll2_owner_t	tasks; /* sais_task_tmpl_t */
+} sais_saifile_tmpl_t;
+
+/*
+ * A .sai.json notification for the ingest thread to parse, expand into tasks
+ * and add to the dbs.  The loop fills in sn (it owns sn.saifile from then on)
+ * and the worker fills in the rest.
+ */
+
+typedef struct sais_ingest_job {
+	lws_dll2_t		list; /* ingest.pending, then ingest.done */
+	sai_notification_t	sn;
+	lws_dll2_owner_t	platform_owner; /* sai_platform_t, worker */
+	lws_dll2_owner_t	tasks; /* sai_task_t, worker */
+	sais_saifile_tmpl_t	*tmpl; /* being parsed, worker */
+	lws_dll2_owner_t	*tmpl_cache; /* worker's sais_saifile_tmpl_t */
+	lws_dll2_owner_t	*pm_cache; /* worker's sais_platmatch_t cache */
+	sais_platmatch_t	*pm; /* borrowed from pm_cache */
+	uint32_t		pm_nplat; /* platforms when pm was got */
+	struct lws_context	*cx;
+	const char		*sqlite3_path_lhs;
+	char			saifile_hash[65];
+	int			task_count;
+	int			result; /* 0 = event and tasks are in the db */
+} sais_ingest_job_t;
+
+typedef struct sais_ingest {
+	pthread_t		thread;
+	pthread_mutex_t		lock; /* protects everything below */
+	pthread_cond_t		cond_work; /* worker waits for work */
+
+	lws_dll2_owner_t	pending; /* sais_ingest_job_t, loop -> worker */
+	lws_dll2_owner_t	done; /* sais_ingest_job_t, worker -> loop */
+	sais_ingest_job_t	*current; /* the one the worker has in hand */
+	lws_dll2_owner_t	tmpl_cache; /* sais_saifile_tmpl_t, worker only */
+	lws_dll2_owner_t	pm_cache; /* sais_platmatch_t, worker only */
+
+	struct lws_context	*cx;
+	const char		*sqlite3_path_lhs;
+
+	char			exiting;
+	char			running;
+} sais_ingest_t;
+
+#define SAIS_INGEST_MAX_PENDING		256
+#define SAIS_INGEST_TMPL_CACHE_MAX	8
+
 typedef struct sais_plat {
 	lws_dll2_t	list;
 	const char	*plat;
 	char		busy;
 } sais_plat_t;
 
+/*
+ * What we know about the load on each builder platform, merged from the full
+ * reports and deltas it sends us.  Changed ones are forwarded to sai-web as
+ * full reports, no more often than SAIS_LOADREPORT_FWD_US.
+ */
+
+typedef struct sais_loadreport {
+	lws_dll2_t		list; /* vhd->loadreports */
+	sai_load_report_t	lr;
+	struct lwsac		*ac; /* lr.active_tasks */
+	lws_usec_t		updated;
+	char			dirty;
+} sais_loadreport_t;
+
+#define SAIS_LOADREPORT_FWD_US		(1 * LWS_US_PER_SEC)
+#define SAIS_LOADREPORT_STALE_US	(10 * 60 * LWS_US_PER_SEC)
+
+/*
+ * The last builder list we sent to sai-web, one serialized JSON object per
+ * builder.  We diff against it so only builders that actually changed get
+ * broadcast.
+ */
+
+typedef struct sais_builder_snap {
+	lws_dll2_t	list; /* vhd->builder_snap */
+	char		ident[256]; /* name, platform and pcon */
+	size_t		len;
+	char		changed;
+	/* serialized builder JSON follows */
+} sais_builder_snap_t;
+
 struct vhd {
 	struct lws_context	*context;
 	struct lws_vhost	*vhost;
 
 	sais_t			server;
+	sais_dbw_t		dbw; /* off-loop db writer */
+	sais_ingest_t		ingest; /* off-loop .sai.json ingest */
 
 	struct lws_ss_handle	*h_ss_websrv; /* server */
 
@@ -223,11 +444,21 @@ struct vhd {
 	const char		*sqlite3_path_lhs;
 	sqlite3			*pdb_metrics;
 
+	char			artifact_store[256];
+
 	lws_dll2_owner_t	sqlite3_cache; /* sais_sqlite_cache_t */
 	lws_dll2_owner_t	tasklog_cache;
 	lws_sorted_usec_list_t	sul_logcache;
 	lws_sorted_usec_list_t	sul_central; /* background task allocation sul */
 	lws_sorted_usec_list_t	sul_activity; /* activity broadcast sul */
+	lws_sorted_usec_list_t	sul_builders; /* coalesced builder list update */
+
+	lws_dll2_owner_t	builder_snap; /* sais_builder_snap_t */
+	lws_dll2_owner_t	loadreports; /* sais_loadreport_t */
+	lws_sorted_usec_list_t	sul_loadreports; /* rate-limited forwarding */
+	lws_usec_t		last_loadreport_fwd;
+	uint8_t			*pcon_snap; /* last PCON JSON sent, after LWS_PRE */
+	size_t			pcon_snap_len;
 
 	lws_usec_t		last_check_abandoned_tasks;
 
@@ -236,6 +467,7 @@ struct vhd {
 
 	unsigned int		browser_viewer_count; 
 	unsigned int		viewers_are_present:1;
+	unsigned int		builders_snap_force:1; /* next list sent in full */
 };
 
 extern struct lws_context *
@@ -265,6 +497,103 @@ sais_ws_json_rx_builder(struct vhd *vhd, struct pss *pss, uint8_t *buf, size_t b
 int
 sais_list_builders(struct vhd *vhd);
 
+void
+sais_list_builders_snapshot(struct vhd *vhd);
+
+void
+sais_builder_snap_destroy(struct vhd *vhd);
+
+int
+sais_loadreport_rx(struct vhd *vhd, const sai_load_report_t *lr);
+
+void
+sais_loadreport_destroy(struct vhd *vhd);
+
+int
+sais_dbw_init(struct vhd *vhd);
+
+void
+sais_dbw_destroy(struct vhd *vhd);
+
+int
+sais_dbw_queue_logs(struct vhd *vhd, const char *task_uuid,
+		    lws_dll2_owner_t *logs, sais_dbw_cb_t cb);
+
+int
+sais_dbw_queue_event_op(struct vhd *vhd, const char *event_uuid,
+			sais_dbw_op_t op, lws_dll2_owner_t *unlinks,
+			sais_dbw_cb_t cb);
+
+int
+sais_dbw_queue_task_reset(struct vhd *vhd, const char *task_uuid,
+			  sais_dbw_cb_t cb);
+
+int
+sais_dbw_queue_task_update(struct vhd *vhd, sais_dbw_op_t op,
+			   const char *task_uuid, const char *sql, int state,
+			   sais_dbw_cb_t cb);
+
+int
+sais_dbw_path_add(lws_dll2_owner_t *owner, const char *path);
+
+void
+sais_dbw_completions(struct vhd *vhd);
+
+sais_platmatch_t *
+sais_platmatch_get(lws_dll2_owner_t *cache, const char *key,
+		   const lws_dll2_owner_t *platforms);
+
+const uint8_t *
+sais_platmatch_filter(sais_platmatch_t *pm, const char *filter);
+
+void
+sais_platmatch_destroy(sais_platmatch_t **ppm);
+
+void
+sais_platmatch_cache_destroy(lws_dll2_owner_t *cache);
+
+int
+sais_result_cache_init(struct vhd *vhd);
+
+int
+sais_result_cache_key(const char *repo_name, const char *tree,
+		      const sai_task_t *t, char *key65);
+
+int
+sais_result_cache_lookup(sqlite3 *pdb, const char *key, char *task_uuid65);
+
+void
+sais_result_cache_task_state(struct vhd *vhd, sqlite3 *pdb_event,
+			     const char *task_uuid, int ostate, int state);
+
+void
+sais_result_cache_forget(struct vhd *vhd, const char *uuid);
+
+void
+sais_warm_key(const char *repo_name, const sai_task_t *t, char *key17);
+
+const sai_task_t *
+sais_warm_pick(struct vhd *vhd, sai_plat_t *cb, const sai_event_t *e,
+	       const lws_dll2_owner_t *tasks);
+
+int
+sais_ingest_init(struct vhd *vhd);
+
+void
+sais_ingest_destroy(struct vhd *vhd);
+
+int
+sais_ingest_queue(struct vhd *vhd, const sai_notification_t *sn);
+
+int
+sais_ingest_hash_pending(struct vhd *vhd, const char *hash);
+
+int
+sais_ingest_parse(sais_ingest_job_t *j);
+
+void
+sais_ingest_completions(struct vhd *vhd);
+
 void
 sais_eventchange(struct lws_ss_handle *h, const char *event_uuid, int state);
 
@@ -310,7 +639,8 @@ sais_set_task_state(struct vhd *vhd, const char *task_uuid, sai_event_state_t st
 
 int
 sais_bind_task_to_builder(struct vhd *vhd, const char *builder_name,
-			  const char *builder_uuid, const char *task_uuid);
+			  const char *builder_uuid, const char *task_uuid,
+			  sais_dbw_cb_t cb);
 
 int
 sais_websrv_broadcast_REQUIRES_LWS_PRE(struct lws_ss_handle *hsrv,
@@ -375,6 +705,16 @@ sais_event_delete(struct vhd *vhd, const char *event_uuid);
 sai_db_result_t
 sais_event_reset(struct vhd *vhd, const char *event_uuid);
 
+int
+sais_event_tombstones_resume(struct vhd *vhd);
+
+void
+sais_event_progress(struct vhd *vhd, const char *event_uuid, sais_dbw_op_t op,
+		    const char *phase, unsigned int done, unsigned int total);
+
+void
+sais_logcache_flush(struct vhd *vhd);
+
 int
 sai_detach_builder(struct lws_dll2 *d, void *user);
 
@@ -399,9 +739,22 @@ sais_task_cancel(struct vhd *vhd, const char *task_uuid);
 int
 sais_task_stop_on_builders(struct vhd *vhd, const char *task_uuid);
 
+void
+sais_git_mirror_name(const char *url, char *name, size_t len);
+
+void
+sais_prefetch_hint(struct vhd *vhd, const sai_event_t *e,
+		   const lws_dll2_owner_t *tasks);
+
+void
+sais_prefetch_destroy(struct pss *pss);
+
 sai_db_result_t
 sais_task_clear_build_and_logs(struct vhd *vhd, const char *task_uuid, int from_rejection);
 
+void
+sais_task_reset_state(struct vhd *vhd, const char *task_uuid);
+
 sai_db_result_t
 sais_task_rebuild_last_step(struct vhd *vhd, const char *task_uuid);
 
@@ -426,3 +779,35 @@ sais_metrics_db_prune(struct vhd *vhd, const char *key);
 
 int
 sais_power_tx(struct vhd *vhd, struct pss *pss, uint8_t *buf, size_t bl);
+
+int
+sais_artifact_store_init(struct vhd *vhd, void *pvo);
+
+int
+sais_artifact_store_open(struct vhd *vhd, struct pss *pss);
+
+int
+sais_artifact_store_ref(struct vhd *vhd, struct pss *pss);
+
+int
+sais_artifact_store_chunk_begin(struct pss *pss, const sai_artifact_chunk_t *ch);
+
+int
+sais_artifact_store_chunk_end(struct pss *pss);
+
+int
+sais_artifact_store_write(struct pss *pss, const uint8_t *buf, size_t len);
+
+void
+sais_artifact_store_abandon(struct pss *pss);
+
+void
+sais_artifact_caught_up(struct pss *pss);
+
+int
+sais_artifact_store_commit(struct vhd *vhd, struct pss *pss, char *hash,
+			   size_t hash_len);
+
+int
+sais_artifact_store_release(struct vhd *vhd, sqlite3 *pdb,
+			    const char *task_uuid, lws_dll2_owner_t *unlinks);
@@ -0,0 +1,198 @@
+/*
+ * Sai server - ./src/server/s-result-cache.c
+ *
+ * Copyright (C) 2019 - 2025 Andy Green <andy@warmcat.com>
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation:
+ *  version 2.1 of the License.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *  MA  02110-1301  USA
+ *
+ * The same tree often comes to us more than once, eg, a branch that was built
+ * and then merged to main without changes, or a release tag on something we
+ * already built.  Rebuilding the whole matrix again tells us nothing new.
+ *
+ * Each task gets a cache key when the .sai.json is expanded, which is a
+ * sha256 over the repo, the git tree (or commit hash if the hook didn't tell
+ * us the tree), and everything that defines what the task does: platform,
+ * taskname and the fully substituted build script, packages and artifacts.
+ * When a task passes, its key is remembered in the result_cache table in the
+ * events db.  When a later notification expands to a task with a key we know
+ * passed, the task is created as SAIES_CACHED_SUCCESS pointing to the task
+ * that did the work (cached_from), whose logs and artifacts are still there,
+ * and is never offered to a builder.
+ *
+ * A cached pass is forgotten when the task it points to leaves the SUCCESS
+ * state, eg, because it was rebuilt, or when its event is deleted.
+ */
+
+#include <libwebsockets.h>
+#include <string.h>
+
+#include "s-private.h"
+
+int
+sais_result_cache_init(struct vhd *vhd)
+{
+	return sai_sqlite3_statement(vhd->server.pdb,
+			"CREATE TABLE IF NOT EXISTS result_cache ("
+			" key varchar(65) primary key,"
+			" task_uuid varchar(65),"
+			" created integer"
+			");", "create result_cache table");
+}
+
+/*
+ * Compute the cache key for a task that was just expanded from the .sai.json.
+ * This doesn't touch anything else, so it's OK to call it from the ingest
+ * thread.
+ */
+
+int
+sais_result_cache_key(const char *repo_name, const char *tree,
+		      const sai_task_t *t, char *key65)
+{
+	const char *parts[] = { repo_name, tree, t->platform, t->taskname,
+				t->build, t->packages, t->artifacts };
+	struct lws_genhash_ctx ctx;
+	uint8_t digest[32];
+	size_t n;
+
+	key65[0] = '\0';
+
+	if (lws_genhash_init(&ctx, LWS_GENHASH_TYPE_SHA256))
+		return 1;
+
+	/* include the terminating NULs so the parts can't run together */
+
+	for (n = 0; n < LWS_ARRAY_SIZE(parts); n++)
+		if (lws_genhash_update(&ctx, parts[n], strlen(parts[n]) + 1)) {
+			lws_genhash_destroy(&ctx, NULL);
+
+			return 1;
+		}
+
+	if (lws_genhash_destroy(&ctx, digest))
+		return 1;
+
+	lws_hex_from_byte_array(digest, sizeof(digest), key65, 65);
+
+	return 0;
+}
+
+/*
+ * Look for a previous pass of a task with the same key, on the caller's own
+ * connection to the events db.  task_uuid65 gets the uuid of the task that
+ * passed if we have one.
+ */
+
+int
+sais_result_cache_lookup(sqlite3 *pdb, const char *key, char *task_uuid65)
+{
+	sqlite3_stmt *sm;
+	int r = 1;
+
+	task_uuid65[0] = '\0';
+
+	if (!key[0])
+		return 1;
+
+	if (sqlite3_prepare_v2(pdb, "select task_uuid from result_cache "
+				    "where key=?", -1, &sm, NULL) != SQLITE_OK)
+		return 1;
+
+	sqlite3_bind_text(sm, 1, key, -1, SQLITE_STATIC);
+
+	if (sqlite3_step(sm) == SQLITE_ROW) {
+		const char *u = (const char *)sqlite3_column_text(sm, 0);
+
+		if (u && strlen(u) == 64) {
+			lws_strncpy(task_uuid65, u, 65);
+			r = 0;
+		}
+	}
+
+	sqlite3_finalize(sm);
+
+	return r;
+}
+
+/*
+ * Called from sais_task_state_written() when a task changed state, with the
+ * event db open.  A pass is remembered, and a task that no longer stands as a
+ * pass stops being used for anyone else.
+ */
+
+void
+sais_result_cache_task_state(struct vhd *vhd, sqlite3 *pdb_event,
+			     const char *task_uuid, int ostate, int state)
+{
+	char key[65], q[256], esc[96];
+	sqlite3_stmt *sm;
+
+	if (ostate == SAIES_SUCCESS) {
+		sais_result_cache_forget(vhd, task_uuid);
+
+		return;
+	}
+
+	if (state != SAIES_SUCCESS)
+		return;
+
+	key[0] = '\0';
+	if (sqlite3_prepare_v2(pdb_event, "select cache_key from tasks "
+				"where uuid=?", -1, &sm, NULL) != SQLITE_OK)
+		return;
+
+	sqlite3_bind_text(sm, 1, task_uuid, -1, SQLITE_STATIC);
+	if (sqlite3_step(sm) == SQLITE_ROW) {
+		const char *k = (const char *)sqlite3_column_text(sm, 0);
+
+		if (k)
+			lws_strncpy(key, k, sizeof(key));
+	}
+	sqlite3_finalize(sm);
+
+	if (strlen(key) != 64)
+		/* eg, a task from before we had the cache */
+		return;
+
+	lws_sql_purify(esc, task_uuid, sizeof(esc));
+	lws_snprintf(q, sizeof(q), "insert or replace into result_cache "
+		     "(key, task_uuid, created) values ('%s', '%s', %llu)",
+		     key, esc, (unsigned long long)lws_now_secs());
+
+	sai_sqlite3_statement(vhd->server.pdb, q, "result_cache add");
+}
+
+/*
+ * Forget any cached pass from a task (64-char uuid) or from any task in an
+ * event (32-char uuid)
+ */
+
+void
+sais_result_cache_forget(struct vhd *vhd, const char *uuid)
+{
+	char q[192], esc[96];
+
+	lws_sql_purify(esc, uuid, sizeof(esc));
+
+	if (strlen(uuid) == SAI_EVENTID_LEN)
+		lws_snprintf(q, sizeof(q), "delete from result_cache where "
+			     "substr(task_uuid, 1, 32)='%s'", esc);
+	else
+		lws_snprintf(q, sizeof(q), "delete from result_cache where "
+			     "task_uuid='%s'", esc);
+
+	sai_sqlite3_statement(vhd->server.pdb, q, "result_cache forget");
+}
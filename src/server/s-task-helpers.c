@@ -72,49 +72,17 @@ sais_get_task_metrics_estimates(struct vhd *vhd, sai_task_t *task)
 	sqlite3_finalize(stmt);
 }
 
+/*
+ * Bind the task to a builder, or unbind it with NULLs.  The change goes via
+ * the db writer, cb is called on the loop when it landed.
+ */
+
 int
 sais_bind_task_to_builder(struct vhd *vhd, const char *builder_name,
-			  const char *builder_uuid, const char *task_uuid)
+			  const char *builder_uuid, const char *task_uuid,
+			  sais_dbw_cb_t cb)
 {
-	char update[384], esc[96], esc1[96], esc2[96], event_uuid[33];
-	struct lwsac *ac = NULL;
-	sai_event_t *e = NULL;
-	lws_dll2_owner_t o;
-	int n, r = 1;
-
-	/*
-	 * Extract the event uuid from the task uuid
-	 */
-
-	sai_task_uuid_to_event_uuid(event_uuid, task_uuid);
-
-	/*
-	 * Look up the task's event in the event database...
-	 */
-
-	lws_dll2_owner_clear(&o);
-	lws_sql_purify(esc1, event_uuid, sizeof(esc1));
-	lws_snprintf(esc2, sizeof(esc2), " and uuid='%s'", esc1);
-	n = lws_struct_sq3_deserialize(vhd->server.pdb, esc2, NULL,
-				       lsm_schema_sq3_map_event, &o, &ac, 0, 1);
-	if (n < 0 || !o.head) {
-		lwsl_err("%s: failed to get task_uuid %s\n", __func__, esc1);
-		goto bail;
-	}
-
-	e = lws_container_of(o.head, sai_event_t, list);
-
-	/*
-	 * Open the event-specific database on the temporary event object
-	 */
-
-	if (sai_event_db_ensure_open(vhd->context, &vhd->sqlite3_cache,
-			      vhd->sqlite3_path_lhs, event_uuid, 0, (sqlite3 **)&e->pdb)) {
-		lwsl_err("%s: unable to open event-specific database\n",
-				__func__);
-
-		return -1;
-	}
+	char update[384], esc[96], esc1[96], esc2[96];
 
 	if (builder_name)
 		lws_sql_purify(esc, builder_name, sizeof(esc));
@@ -135,113 +103,37 @@ sais_bind_task_to_builder(struct vhd *vhd, const char *builder_name,
 		"update tasks set builder='%s',builder_name='%s' where uuid='%s'",
 		 esc1, esc, esc2);
 
-	if (sqlite3_exec((sqlite3 *)e->pdb, update, NULL, NULL, NULL) != SQLITE_OK) {
-		lwsl_err("%s: %s: %s: fail\n", __func__, update,
-			 sqlite3_errmsg(vhd->server.pdb));
-		goto bail;
-	}
+	if (sais_dbw_queue_task_update(vhd, SAIS_DBW_OP_TASK_UPDATE, task_uuid,
+				       update, 0, cb)) {
+		lwsl_err("%s: unable to queue %s\n", __func__, update);
 
-	r = 0;
-
-bail:
-	if (e)
-		sai_event_db_close(&vhd->sqlite3_cache, (sqlite3 **)&e->pdb);
-	lwsac_free(&ac);
+		return 1;
+	}
 
-	return r;
+	return 0;
 }
 
-int
-sais_set_task_state(struct vhd *vhd, const char *task_uuid,
-		    sai_event_state_t state, uint64_t started, uint64_t duration)
+/*
+ * The db writer changed the task state, and told us what it was before and
+ * how the event's tasks stand now.  Let everyone know, and move the event
+ * state on if that changed too.
+ */
+
+static void
+sais_task_state_written(struct vhd *vhd, sais_dbw_job_t *j)
 {
-	char update[384], esc1[96], esc2[96], esc3[32], esc4[32], event_uuid[33];
-	sai_event_state_t oes, sta, task_ostate, ostate = state;
-	unsigned int count = 0, count_good = 0, count_bad = 0;
-	uint64_t started_orig = started;
+	sai_event_state_t sta, oes, state = (sai_event_state_t)j->state;
+	char event_uuid[33], update[192], esc[96];
 	struct lwsac *ac = NULL;
 	sai_event_t *e = NULL;
+	sqlite3 *pdb = NULL;
 	lws_dll2_owner_t o;
 	int n;
 
-	/*
-	 * Extract the event uuid from the task uuid
-	 */
-
-	sai_task_uuid_to_event_uuid(event_uuid, task_uuid);
-
-	/*
-	 * Look up the task's event in the event database...
-	 */
-
-	lws_dll2_owner_clear(&o);
-	lws_sql_purify(esc1, event_uuid, sizeof(esc1));
-	lws_snprintf(esc2, sizeof(esc2), " and uuid='%s'", esc1);
-	n = lws_struct_sq3_deserialize(vhd->server.pdb, esc2, NULL,
-				       lsm_schema_sq3_map_event, &o, &ac, 0, 1);
-	if (n < 0 || !o.head) {
-		lwsl_err("%s: failed to get task_uuid %s\n", __func__, esc1);
-		goto bail;
-	}
-
-	e = lws_container_of(o.head, sai_event_t, list);
-	oes = e->state;
-
-	/*
-	 * Open the event-specific database on the temporary event object
-	 */
-
-	if (sai_event_db_ensure_open(vhd->context, &vhd->sqlite3_cache,
-			      vhd->sqlite3_path_lhs, event_uuid, 0, (sqlite3 **)&e->pdb)) {
-		lwsl_err("%s: unable to open event-specific database\n",
-				__func__);
-
-		return -1;
-	}
-
-	lws_sql_purify(esc2, task_uuid, sizeof(esc2));
-
-	esc3[0] = esc4[0] = '\0';
-
-	/*
-	 * grab the current state of it for seeing if it changed
-	 */
-	lws_snprintf(update, sizeof(update),
-		     "select state from tasks where uuid='%s'", esc2);
-	if (sqlite3_exec((sqlite3 *)e->pdb, update,
-			 sql3_get_integer_cb, &task_ostate, NULL) != SQLITE_OK) {
-		lwsl_err("%s: %s: %s: fail\n", __func__, update,
-			 sqlite3_errmsg(vhd->server.pdb));
-		goto bail;
-	}
-
-	if (started) {
-		if (started == 1)
-			lws_snprintf(esc3, sizeof(esc3), ",started=0");
-		else
-			lws_snprintf(esc3, sizeof(esc3), ",started=%llu",
-			     (unsigned long long)started);
-	}
-	if (duration) {
-		if (duration == 1)
-			duration = 0;
-		lws_snprintf(esc4, sizeof(esc4), ",duration=%llu",
-			     (unsigned long long)duration);
-	}
-
-	/*
-	 * Update the task by uuid, in the event-specific database
-	 */
-
-	lws_snprintf(update, sizeof(update),
-		"update tasks set state=%d%s%s%s where uuid='%s'", state,
-		esc3, esc4, state == SAIES_WAITING && started_orig == 1 ?
-						",build_step=0" : "", esc2);
-
-	if (sqlite3_exec((sqlite3 *)e->pdb, update, NULL, NULL, NULL) != SQLITE_OK) {
-		lwsl_err("%s: %s: %s: fail\n", __func__, update,
-			 sqlite3_errmsg(vhd->server.pdb));
-		goto bail;
+	if (j->result) {
+		lwsl_err("%s: failed to set task %s to state %d\n", __func__,
+			 j->task_uuid, j->state);
+		return;
 	}
 
 	/*
@@ -250,7 +142,7 @@ sais_set_task_state(struct vhd *vhd, const char *task_uuid,
 	 * the state
 	 */
 
-	if (state != task_ostate) {
+	if (j->ostate != j->state) {
 
 		if ((state == SAIES_PASSED_TO_BUILDER ||
 		     state == SAIES_BEING_BUILT) &&
@@ -259,68 +151,68 @@ sais_set_task_state(struct vhd *vhd, const char *task_uuid,
 					 sais_activity_cb, 1 * LWS_US_PER_SEC);
 
 		lwsl_notice("%s: seen task [%s st %d -> %d\n", __func__,
-				task_uuid, task_ostate, state);
-
-		sais_taskchange(vhd->h_ss_websrv, task_uuid, state);
+				j->task_uuid, j->ostate, j->state);
 
-		if (state == SAIES_SUCCESS || state == SAIES_FAIL ||
-		    state == SAIES_CANCELLED)
-			lws_sul_schedule(vhd->context, 0, &vhd->sul_central,
-					 sais_central_cb, 1);
+		sais_taskchange(vhd->h_ss_websrv, j->task_uuid, state);
 
-		sais_platforms_with_tasks_pending(vhd);
+		sai_task_uuid_to_event_uuid(event_uuid, j->task_uuid);
 
-		/*
-		 * So, how many tasks for this event?
-		 */
-
-		if (sqlite3_exec((sqlite3 *)e->pdb, "select count(state) from tasks",
-				 sql3_get_integer_cb, &count, NULL) != SQLITE_OK) {
-			lwsl_err("%s: %s: %s: fail\n", __func__, update,
-				 sqlite3_errmsg(vhd->server.pdb));
-			goto bail;
+		if (!sai_event_db_ensure_open(vhd->context, &vhd->sqlite3_cache,
+					      vhd->sqlite3_path_lhs, event_uuid,
+					      0, &pdb)) {
+			sais_result_cache_task_state(vhd, pdb, j->task_uuid,
+						     j->ostate, j->state);
+			sai_event_db_close(&vhd->sqlite3_cache, &pdb);
 		}
 
 		/*
-		 * ... how many completed well?
+		 * The task may be able to go now, or a builder be free for
+		 * something else
 		 */
 
-		if (sqlite3_exec((sqlite3 *)e->pdb, "select count(state) from tasks where state == 3",
-				 sql3_get_integer_cb, &count_good, NULL) != SQLITE_OK) {
-			lwsl_err("%s: %s: %s: fail\n", __func__, update,
-				 sqlite3_errmsg(vhd->server.pdb));
-			goto bail;
-		}
+		if (state == SAIES_SUCCESS || state == SAIES_FAIL ||
+		    state == SAIES_CANCELLED || state == SAIES_WAITING)
+			lws_sul_schedule(vhd->context, 0, &vhd->sul_central,
+					 sais_central_cb, 1);
+
+		sais_platforms_with_tasks_pending(vhd);
 
 		/*
-		 * ... how many failed?
+		 * Look up the task's event in the event database...
 		 */
 
-		if (sqlite3_exec((sqlite3 *)e->pdb, "select count(state) from tasks where state == 4",
-				 sql3_get_integer_cb, &count_bad, NULL) != SQLITE_OK) {
-			lwsl_err("%s: %s: %s: fail\n", __func__, update,
-				 sqlite3_errmsg(vhd->server.pdb));
+		lws_dll2_owner_clear(&o);
+		lws_sql_purify(esc, event_uuid, sizeof(esc));
+		lws_snprintf(update, sizeof(update), " and uuid='%s'", esc);
+		n = lws_struct_sq3_deserialize(vhd->server.pdb, update, NULL,
+					lsm_schema_sq3_map_event, &o, &ac, 0, 1);
+		if (n < 0 || !o.head) {
+			lwsl_err("%s: failed to get event %s\n", __func__, esc);
 			goto bail;
 		}
 
+		e = lws_container_of(o.head, sai_event_t, list);
+		oes = e->state;
+
 		/*
 		 * Decide how to set the event state based on that
 		 */
 
 		lwsl_notice("%s: ev %s, task %s, state %d -> %d, count %u, good %u, bad %u, oes %d\n",
-			    __func__, event_uuid, task_uuid, task_ostate, state,
-			    count, count_good, count_bad, (int)oes);
+			    __func__, event_uuid, j->task_uuid, j->ostate,
+			    j->state, j->count, j->count_good, j->count_bad,
+			    (int)oes);
 
 		sta = SAIES_BEING_BUILT;
 
-		if (count) {
-			if (count == count_good)
+		if (j->count) {
+			if (j->count == j->count_good)
 				sta = SAIES_SUCCESS;
 			else
-				if (count == count_bad)
+				if (j->count == j->count_bad)
 					sta = SAIES_FAIL;
 				else
-					if (count_bad)
+					if (j->count_bad)
 						sta = SAIES_BEING_BUILT_HAS_FAILURES;
 		}
 
@@ -331,9 +223,8 @@ sais_set_task_state(struct vhd *vhd, const char *task_uuid,
 			 * Update the event
 			 */
 
-			lws_sql_purify(esc1, event_uuid, sizeof(esc1));
 			lws_snprintf(update, sizeof(update),
-				"update events set state=%d where uuid='%s'", sta, esc1);
+				"update events set state=%d where uuid='%s'", sta, esc);
 
 			if (sqlite3_exec(vhd->server.pdb, update, NULL, NULL, NULL) != SQLITE_OK) {
 				lwsl_err("%s: %s: %s: fail\n", __func__, update,
@@ -343,24 +234,71 @@ sais_set_task_state(struct vhd *vhd, const char *task_uuid,
 
 			sais_eventchange(vhd->h_ss_websrv, event_uuid, (int)sta);
 		}
-	}
 
-	sai_event_db_close(&vhd->sqlite3_cache, (sqlite3 **)&e->pdb);
-	lwsac_free(&ac);
+		lwsac_free(&ac);
+	}
 
-	if (ostate == SAIES_STEP_SUCCESS) {
-		lwsl_notice("%s: sais_set_task_state() is calling sais_create_and_offer_task_step()\n", __func__);
-		sais_create_and_offer_task_step(vhd, task_uuid);
+	if (state == SAIES_STEP_SUCCESS) {
+		lwsl_notice("%s: calling sais_create_and_offer_task_step()\n", __func__);
+		sais_create_and_offer_task_step(vhd, j->task_uuid);
 	}
 
-	return 0;
+	return;
 
 bail:
-	if (e)
-		sai_event_db_close(&vhd->sqlite3_cache, (sqlite3 **)&e->pdb);
 	lwsac_free(&ac);
+}
+
+/*
+ * Change the task state via the db writer, so the loop never waits for the
+ * event db while it is committing logs.  Everything that follows from the
+ * change is done in sais_task_state_written() once it landed.
+ */
 
-	return 1;
+int
+sais_set_task_state(struct vhd *vhd, const char *task_uuid,
+		    sai_event_state_t state, uint64_t started, uint64_t duration)
+{
+	char update[384], esc2[96], esc3[32], esc4[32];
+	uint64_t started_orig = started;
+
+	lws_sql_purify(esc2, task_uuid, sizeof(esc2));
+
+	esc3[0] = esc4[0] = '\0';
+
+	if (started) {
+		if (started == 1)
+			lws_snprintf(esc3, sizeof(esc3), ",started=0");
+		else
+			lws_snprintf(esc3, sizeof(esc3), ",started=%llu",
+			     (unsigned long long)started);
+	}
+	if (duration) {
+		if (duration == 1)
+			duration = 0;
+		lws_snprintf(esc4, sizeof(esc4), ",duration=%llu",
+			     (unsigned long long)duration);
+	}
+
+	/*
+	 * Update the task by uuid, in the event-specific database
+	 */
+
+	lws_snprintf(update, sizeof(update),
+		"update tasks set state=%d%s%s%s%s where uuid='%s'", state,
+		esc3, esc4, state == SAIES_WAITING && started_orig == 1 ?
+						",build_step=0" : "",
+		state == SAIES_WAITING ? ",cached_from=''" : "", esc2);
+
+	if (sais_dbw_queue_task_update(vhd, SAIS_DBW_OP_TASK_STATE, task_uuid,
+				       update, (int)state,
+				       sais_task_state_written)) {
+		lwsl_err("%s: unable to queue %s\n", __func__, update);
+
+		return 1;
+	}
+
+	return 0;
 }
 
 int
@@ -446,7 +384,7 @@ sais_task_stop_on_builders(struct vhd *vhd, const char *task_uuid)
 	 * This frees the sqlite task from being bound to any builder
 	 */
 
-	sais_bind_task_to_builder(vhd, NULL, NULL, task_uuid);
+	sais_bind_task_to_builder(vhd, NULL, NULL, task_uuid, NULL);
 
 	sp = sais_builder_from_uuid(vhd, builder_name);
 	if (!sp)
@@ -479,9 +417,37 @@ sais_task_stop_on_builders(struct vhd *vhd, const char *task_uuid)
 	return 0;
 }
 
+/*
+ * Put the task back to WAITING and stop it on any builder that has it, the
+ * caller takes care of its logs and artifacts
+ */
+
+void
+sais_task_reset_state(struct vhd *vhd, const char *task_uuid)
+{
+	/* 1,1 == reset started and duration in db for task to 0 */
+	sais_set_task_state(vhd, task_uuid, SAIES_WAITING, 1, 1);
+
+	sais_task_stop_on_builders(vhd, task_uuid);
+}
+
+/*
+ * The db writer has deleted the task's old logs, have anyone looking at the
+ * task fetch it again (sai-web gets the state from the db itself)
+ */
+
+static void
+sais_task_logs_cleared(struct vhd *vhd, sais_dbw_job_t *j)
+{
+	if (!j->result)
+		sais_taskchange(vhd->h_ss_websrv, j->task_uuid, SAIES_WAITING);
+}
+
 /*
  * Keep the task record itself, but remove all logs and artifacts related to
- * it and reset the task state back to WAITING.
+ * it and reset the task state back to WAITING.  Deleting the logs is queued
+ * on the db writer behind any of the task's logs it already has, so we don't
+ * have to wait for those to land first.
  */
 
 sai_db_result_t
@@ -507,18 +473,27 @@ sais_task_clear_build_and_logs(struct vhd *vhd, const char *task_uuid, int from_
 	}
 
 	lws_sql_purify(esc, task_uuid, sizeof(esc));
-	lws_snprintf(cmd, sizeof(cmd), "delete from logs where task_uuid='%s'",
-		     esc);
 
-	ret = sqlite3_exec(pdb, cmd, NULL, NULL, NULL);
-	if (ret != SQLITE_OK) {
-		sai_event_db_close(&vhd->sqlite3_cache, &pdb);
-		if (ret == SQLITE_BUSY)
-			return SAI_DB_RESULT_BUSY;
-		lwsl_err("%s: %s: %s: fail\n", __func__, cmd,
-			 sqlite3_errmsg(pdb));
-		return SAI_DB_RESULT_ERROR;
+	/* logs we are still holding go to the writer ahead of the reset */
+	sais_logcache_flush(vhd);
+
+	if (sais_dbw_queue_task_reset(vhd, task_uuid, sais_task_logs_cleared)) {
+		/* no writer... we have to do it ourselves then */
+		lws_snprintf(cmd, sizeof(cmd),
+			     "delete from logs where task_uuid='%s'", esc);
+
+		ret = sqlite3_exec(pdb, cmd, NULL, NULL, NULL);
+		if (ret != SQLITE_OK) {
+			sai_event_db_close(&vhd->sqlite3_cache, &pdb);
+			if (ret == SQLITE_BUSY)
+				return SAI_DB_RESULT_BUSY;
+			lwsl_err("%s: %s: %s: fail\n", __func__, cmd,
+				 sqlite3_errmsg(pdb));
+			return SAI_DB_RESULT_ERROR;
+		}
 	}
+	sais_artifact_store_release(vhd, pdb, task_uuid, NULL);
+
 	lws_snprintf(cmd, sizeof(cmd), "delete from artifacts where task_uuid='%s'",
 		     esc);
 
@@ -534,10 +509,7 @@ sais_task_clear_build_and_logs(struct vhd *vhd, const char *task_uuid, int from_
 
 	sai_event_db_close(&vhd->sqlite3_cache, &pdb);
 
-	/* 1,1 == reset started and duration in db for task to 0 */
-	sais_set_task_state(vhd, task_uuid, SAIES_WAITING, 1, 1);
-
-	sais_task_stop_on_builders(vhd, task_uuid);
+	sais_task_reset_state(vhd, task_uuid);
 
 	/*
 	 * Reassess now if there's a builder we can match to a pending task,
@@ -604,15 +576,14 @@ sais_task_rebuild_last_step(struct vhd *vhd, const char *task_uuid)
 			     "update tasks set build_step=%d where uuid='%s'",
 			     task->build_step - 1, esc);
 
-		ret = sqlite3_exec(pdb, cmd, NULL, NULL, NULL);
-		if (ret != SQLITE_OK) {
+		/* queued ahead of the state change, which the offer follows */
+
+		if (sais_dbw_queue_task_update(vhd, SAIS_DBW_OP_TASK_UPDATE,
+					       task_uuid, cmd, 0, NULL)) {
 			sai_event_db_close(&vhd->sqlite3_cache, &pdb);
 			lwsac_free(&ac);
-			if (ret == SQLITE_BUSY)
-				return SAI_DB_RESULT_BUSY;
+			lwsl_err("%s: unable to queue %s\n", __func__, cmd);
 
-			lwsl_err("%s: %s: %s: fail\n", __func__, cmd,
-				 sqlite3_errmsg(pdb));
 			return SAI_DB_RESULT_ERROR;
 		}
 	}
@@ -727,4 +698,101 @@ sais_metrics_db_init(struct vhd *vhd)
 	return 0;
 }
 
+/*
+ * Turn a repo fetch url into the name of the builders' local git mirror of it,
+ * which lives under ~/git-mirror on the builder
+ */
+
+void
+sais_git_mirror_name(const char *url, char *name, size_t len)
+{
+	char *q;
+
+	lws_strncpy(name, url, len);
+	lws_filename_purify_inplace(name);
+
+	for (q = name; *q; q++)
+		if (*q == '/' || *q == '.')
+			*q = '_';
+}
+
+/*
+ * Does the builder on this connection offer a platform that one of the tasks
+ * still needs building on?
+ */
+
+static int
+sais_prefetch_builder_wants(struct vhd *vhd, struct pss *pss,
+			    const lws_dll2_owner_t *tasks)
+{
+	lws_start_foreach_dll(struct lws_dll2 *, p,
+			      vhd->server.builder_owner.head) {
+		sai_plat_t *sp = lws_container_of(p, sai_plat_t, sai_plat_list);
+
+		if (sp->wsi == pss->wsi && sp->online) {
+			lws_start_foreach_dll(struct lws_dll2 *, pt, tasks->head) {
+				sai_task_t *t = lws_container_of(pt, sai_task_t,
+								 list);
+
+				if (t->state != SAIES_CACHED_SUCCESS &&
+				    !strcmp(t->platform, sp->platform))
+					return 1;
+			} lws_end_foreach_dll(pt);
+		}
+	} lws_end_foreach_dll(p);
+
+	return 0;
+}
+
+/*
+ * A new event was ingested with tasks.  Before any of them are offered, hint
+ * to every connected builder offering a platform the event needs that it can
+ * warm its git mirror with the commit in the background, so when the task
+ * arrives its mirror step finds it is already there.  It's only a hint, the
+ * builder is free to ignore it.
+ */
+
+void
+sais_prefetch_hint(struct vhd *vhd, const sai_event_t *e,
+		   const lws_dll2_owner_t *tasks)
+{
+	sai_prefetch_t *pf;
+	int n = 0;
+
+	lws_start_foreach_dll(struct lws_dll2 *, p, vhd->builders.head) {
+		struct pss *pss = lws_container_of(p, struct pss, same);
 
+		if (pss->prefetch_owner.count < SAIS_PREFETCH_MAX_QUEUED &&
+		    sais_prefetch_builder_wants(vhd, pss, tasks)) {
+			pf = malloc(sizeof(*pf));
+			if (!pf)
+				return;
+			memset(pf, 0, sizeof(*pf));
+
+			lws_strncpy(pf->repo_url, e->repo_fetchurl,
+				    sizeof(pf->repo_url));
+			lws_strncpy(pf->ref, e->ref, sizeof(pf->ref));
+			lws_strncpy(pf->hash, e->hash, sizeof(pf->hash));
+			sais_git_mirror_name(e->repo_fetchurl, pf->mirror,
+					     sizeof(pf->mirror));
+
+			lws_dll2_add_tail(&pf->list, &pss->prefetch_owner);
+			lws_callback_on_writable(pss->wsi);
+			n++;
+		}
+	} lws_end_foreach_dll(p);
+
+	if (n)
+		lwsl_info("%s: hinted %s@%s to %d builders\n", __func__,
+			  e->repo_name, e->hash, n);
+}
+
+void
+sais_prefetch_destroy(struct pss *pss)
+{
+	lws_start_foreach_dll_safe(struct lws_dll2 *, p, p1,
+				   pss->prefetch_owner.head) {
+		lws_dll2_remove(p);
+		free(lws_container_of(p, sai_prefetch_t, list));
+	} lws_end_foreach_dll_safe(p, p1);
+}
@@ -219,6 +219,7 @@ sais_task_pending(struct vhd *vhd, struct pss *pss, sai_plat_t *cb,
 		char prev_event_uuid[33] = "", checked_uuid[33] = "";
 		sqlite3 *pdb = NULL, *prev_pdb = NULL;
 		char esc_repo[96], esc_ref[96];
+		const sai_task_t *pick;
 		uint64_t last_created;
 		int m;
 
@@ -404,18 +405,23 @@ next1: ;
 		lws_dll2_owner_clear(&owner);
 		n = lws_struct_sq3_deserialize(pdb, pf, "uid asc ",
 					       lsm_schema_sq3_map_task,
-					       &owner, &pss->ac_alloc_task, 0, 1);
+					       &owner, &pss->ac_alloc_task, 0,
+					       SAIS_WARM_CANDIDATES);
 		// lwsl_notice("%s: deser returned %d\n", __func__, n);
 		if (!owner.count || !pss->ac_alloc_task)
 			goto close_next;
 
+		/* the earliest, unless warm dirs mean it should go elsewhere */
+
+		pick = sais_warm_pick(vhd, cb, e, &owner);
+		if (!pick)
+			goto close_next;
+
 		lwsl_notice("%s: orig exit\n", __func__);
 		sai_event_db_close(&vhd->sqlite3_cache, &pdb);
 		lwsac_free(&ac);
 		lwsac_free(&failed_ac);
-		memcpy(&pss->alloc_task, lws_container_of(
-						owner.head, sai_task_t, list),
-						sizeof(pss->alloc_task));
+		memcpy(&pss->alloc_task, pick, sizeof(pss->alloc_task));
 
 		return &pss->alloc_task;
 
@@ -574,6 +580,27 @@ bail:
 	return 1;
 }
 
+/*
+ * The task was bound to its builder in the db, drop the inflight listing that
+ * kept it for the builder meanwhile and offer it
+ */
+
+static void
+sais_task_bound(struct vhd *vhd, sais_dbw_job_t *j)
+{
+	sai_uuid_list_t *ul;
+
+	if (sais_is_task_inflight(vhd, NULL, j->task_uuid, &ul))
+		sais_inflight_entry_destroy(ul);
+
+	if (j->result || sais_create_and_offer_task_step(vhd, j->task_uuid))
+		return;
+
+	/* yes, we will offer it to him */
+
+	sais_list_builders(vhd);
+}
+
 /*
  * Look for any task on any event that needs building on platform_name, if found
  * the caller must take responsibility to free pss->a.ac
@@ -626,20 +653,27 @@ sais_allocate_task(struct vhd *vhd, struct pss *pss, sai_plat_t *sp,
 	}
 
 	/*
-	 * This marks the sqlite task as being bound to builder sp->name
+	 * This marks the sqlite task as being bound to builder sp->name.  That
+	 * goes via the db writer, we offer the task in sais_task_bound() when
+	 * it landed.  Until then, it's listed as inflight on sp so nobody else
+	 * takes it.
 	 */
 
-	sais_bind_task_to_builder(vhd, sp->name, sp->name, task_template->uuid);
+	if (sais_add_to_inflight_list_if_absent(vhd, sp, task_template->uuid))
+		return 1;
 
-	lwsl_notice("%s: %s: task %s found for %s\n", __func__,
-		    platform_name, task_template->uuid, sp->name);
+	if (sais_bind_task_to_builder(vhd, sp->name, sp->name,
+				      task_template->uuid, sais_task_bound)) {
+		sai_uuid_list_t *ul;
 
-	if (sais_create_and_offer_task_step(vhd, task_template->uuid))
-		return 1;
+		if (sais_is_task_inflight(vhd, sp, task_template->uuid, &ul))
+			sais_inflight_entry_destroy(ul);
 
-	/* yes, we will offer it to him */
+		return 1;
+	}
 
-	sais_list_builders(vhd);
+	lwsl_notice("%s: %s: task %s found for %s\n", __func__,
+		    platform_name, task_template->uuid, sp->name);
 
 	/* advance the task state first time we get logs */
 	pss->mark_started = 1;
@@ -762,8 +796,8 @@ nope:
 int
 sais_create_and_offer_task_step(struct vhd *vhd, const char *task_uuid)
 {
-	char event_uuid[33], esc_uuid[129], *p, *start, url[128],
-	     mirror_path[256], update[128];
+	char event_uuid[33], esc_uuid[129], *p, *start, mirror_path[256],
+	     update[128];
 	sai_task_t *temp_task = NULL, *task_template;
 	lws_dll2_owner_t o, o_event;
 	struct lwsac *ac = NULL;
@@ -867,15 +901,8 @@ sais_create_and_offer_task_step(struct vhd *vhd, const char *task_uuid)
 		goto bail;
 	}
 
-	lws_strncpy(url, temp_task->one_event->repo_fetchurl, sizeof(url));
-	lws_filename_purify_inplace(url);
-	char *q = url;
-	while (*q) {
-		if (*q == '/') *q = '_';
-		if (*q == '.') *q = '_';
-		q++;
-	}
-	lws_snprintf(mirror_path, sizeof(mirror_path), "%s", url);
+	sais_git_mirror_name(temp_task->one_event->repo_fetchurl, mirror_path,
+			     sizeof(mirror_path));
 
 	switch (build_step) {
 	case 0: /* git mirror */
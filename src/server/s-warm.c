@@ -0,0 +1,162 @@
+/*
+ * Sai server - ./src/server/s-warm.c
+ *
+ * Copyright (C) 2019 - 2025 Andy Green <andy@warmcat.com>
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation:
+ *  version 2.1 of the License.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *  MA  02110-1301  USA
+ *
+ * A configuration in .sai.json can set "warm": true, to say its build is
+ * incremental-safe.  Its tasks get a warm key, made from the repo, platform
+ * and taskname, so it is the same for that task on every event.  Builders
+ * keep a build dir for each warm key they built lately, and list the keys
+ * they hold in their platform advertisement (see b-warm.c).
+ *
+ * When picking a task for a builder, we prefer one whose warm dir it holds,
+ * and for a while leave alone warm tasks some other online builder of the
+ * platform holds, so they usually get to go where their warm dir is.  If the
+ * holder doesn't come for them in SAIS_WARM_AFFINITY_SECS, anybody can take
+ * them, they just build from cold.
+ */
+
+#include <libwebsockets.h>
+#include <string.h>
+
+#include "s-private.h"
+
+/*
+ * Compute the warm key for a task that was just expanded from the .sai.json.
+ * This doesn't touch anything else, so it's OK to call it from the ingest
+ * thread.
+ */
+
+void
+sais_warm_key(const char *repo_name, const sai_task_t *t, char *key17)
+{
+	const char *parts[] = { repo_name, t->platform, t->taskname };
+	struct lws_genhash_ctx ctx;
+	uint8_t digest[32];
+	size_t n;
+
+	key17[0] = '\0';
+
+	if (lws_genhash_init(&ctx, LWS_GENHASH_TYPE_SHA256))
+		return;
+
+	for (n = 0; n < LWS_ARRAY_SIZE(parts); n++)
+		if (lws_genhash_update(&ctx, parts[n], strlen(parts[n]) + 1)) {
+			lws_genhash_destroy(&ctx, NULL);
+
+			return;
+		}
+
+	if (lws_genhash_destroy(&ctx, digest))
+		return;
+
+	lws_hex_from_byte_array(digest, 8, key17, 17);
+}
+
+/* is key in the comma-separated list of warm keys a builder sent us */
+
+static int
+sais_warm_list_has(const char *list, const char *key)
+{
+	size_t kl = strlen(key);
+
+	while (*list) {
+		if (!strncmp(list, key, kl) &&
+		    (list[kl] == ',' || !list[kl]))
+			return 1;
+
+		list = strchr(list, ',');
+		if (!list)
+			break;
+		list++;
+	}
+
+	return 0;
+}
+
+static int
+sais_warm_held_elsewhere(struct vhd *vhd, const sai_plat_t *cb,
+			 const char *key)
+{
+	lws_start_foreach_dll(struct lws_dll2 *, p,
+			      vhd->server.builder_owner.head) {
+		const sai_plat_t *sp = lws_container_of(p, sai_plat_t,
+							sai_plat_list);
+
+		if (sp != cb && sp->online && !strcmp(sp->platform, cb->platform) &&
+		    sais_warm_list_has(sp->warm, key))
+			return 1;
+	} lws_end_foreach_dll(p);
+
+	return 0;
+}
+
+/*
+ * tasks is a list of startable tasks for cb's platform from event e, in the
+ * order we'd normally take them.  Return the one cb should take, or NULL if
+ * they should all be left for builders holding their warm dirs for now.
+ */
+
+const sai_task_t *
+sais_warm_pick(struct vhd *vhd, sai_plat_t *cb, const sai_event_t *e,
+	       const lws_dll2_owner_t *tasks)
+{
+	const sai_task_t *cold = NULL, *elsewhere = NULL;
+	uint64_t now = lws_now_secs(), due;
+
+	lws_start_foreach_dll(struct lws_dll2 *, p, tasks->head) {
+		const sai_task_t *t = lws_container_of(p, sai_task_t, list);
+
+		if (!t->warm_key[0]) {
+			if (!cold)
+				cold = t;
+		} else
+			if (sais_warm_list_has(cb->warm, t->warm_key)) {
+				lwsl_notice("%s: %s holds warm dir for %s\n",
+					    __func__, cb->name, t->uuid);
+				return t;
+			} else
+				if (!sais_warm_held_elsewhere(vhd, cb,
+							      t->warm_key)) {
+					if (!cold)
+						cold = t;
+				} else
+					if (!elsewhere)
+						elsewhere = t;
+	} lws_end_foreach_dll(p);
+
+	if (cold || !elsewhere)
+		return cold;
+
+	due = e->created + SAIS_WARM_AFFINITY_SECS;
+	if (now >= due)
+		return elsewhere;
+
+	/*
+	 * Everything left is waiting for builders holding its warm dir.  If
+	 * they don't come for it in time, we need to look again then.
+	 */
+
+	lwsl_notice("%s: %s leaving %s for its warm builder\n", __func__,
+		    cb->name, elsewhere->uuid);
+
+	lws_sul_schedule(cb->cx, 0, &cb->sul_find_jobs, sais_plat_find_jobs_cb,
+			 (lws_usec_t)(due - now) * LWS_US_PER_SEC);
+
+	return NULL;
+}
@@ -21,7 +21,9 @@
  */
 
 #include <libwebsockets.h>
+#include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 #include <signal.h>
 #include <time.h>
 #include <assert.h>
@@ -55,7 +57,11 @@ static void
 _sais_websrv_broadcast(struct lws_ss_handle *h, void *arg)
 {
 	websrvss_srv_t *m	   = (websrvss_srv_t *)lws_ss_to_user_object(h);
-	lws_wsmsg_info_t *info	   = (lws_wsmsg_info_t *)arg;
+	/*
+	 * We adjust buf and len below, work on a copy so the next sai-web
+	 * client sees the caller's original info
+	 */
+	lws_wsmsg_info_t _info	   = *(lws_wsmsg_info_t *)arg, *info = &_info;
 	unsigned int *pi	   = (unsigned int *)((const char *)info->buf - sizeof(int));
 
 	info->head_upstream		= &m->bl_srv_to_web;
@@ -189,123 +195,282 @@ sais_eventchange(struct lws_ss_handle *hsrv, const char *event_uuid, int state)
 	}
 }
 
+static const char * const sais_event_op_names[] = {
+	"logs", "reset", "delete", "task-reset", "task-update", "task-state"
+};
+
+/*
+ * Let the browsers know how a background reset or delete of an event is
+ * getting on
+ */
+
+void
+sais_event_progress(struct vhd *vhd, const char *event_uuid, sais_dbw_op_t op,
+		    const char *phase, unsigned int done, unsigned int total)
+{
+	char tc[LWS_PRE + 256], *start = tc + LWS_PRE;
+	lws_wsmsg_info_t info;
+	int n;
+
+	n = lws_snprintf(start, sizeof(tc) - LWS_PRE,
+			 "{\"schema\":\"com.warmcat.sai.eventprogress\","
+			 "\"event_hash\":\"%s\",\"op\":\"%s\","
+			 "\"phase\":\"%s\",\"done\":%u,\"total\":%u}",
+			 event_uuid, sais_event_op_names[op], phase, done, total);
+
+	memset(&info, 0, sizeof(info));
+	info.private_source_idx		= SAI_WEBSRV_PB__GENERATED;
+	info.buf			= (uint8_t *)start;
+	info.len			= (size_t)n;
+	info.ss_flags			= LWSSS_FLAG_SOM | LWSSS_FLAG_EOM;
+
+	if (sais_websrv_broadcast_REQUIRES_LWS_PRE(vhd->h_ss_websrv, &info) < 0)
+		lwsl_warn("%s: unable to broadcast\n", __func__);
+}
+
+static void
+sais_event_job_done(struct vhd *vhd, sais_dbw_job_t *j)
+{
+	sais_event_progress(vhd, j->event_uuid, j->op,
+			    j->result ? "failed" : "finished", 1, 1);
+}
+
+/*
+ * Events that were deleted, but whose files the db writer didn't get to
+ * remove before we stopped, are left tombstoned... queue them again
+ */
+
+int
+sais_event_tombstones_resume(struct vhd *vhd)
+{
+	char uuid[SAI_EVENTID_LEN + 1];
+	sqlite3_stmt *sm;
+	int n = 0;
+
+	if (sai_sqlite3_statement(vhd->server.pdb,
+			"CREATE TABLE IF NOT EXISTS event_tombstones ("
+			" uuid varchar(33) primary key"
+			");", "create event_tombstones table"))
+		return 1;
+
+	if (sqlite3_prepare_v2(vhd->server.pdb,
+			       "select uuid from event_tombstones", -1, &sm,
+			       NULL) != SQLITE_OK)
+		return 1;
+
+	while (sqlite3_step(sm) == SQLITE_ROW) {
+		const char *u = (const char *)sqlite3_column_text(sm, 0);
+
+		if (!u || strlen(u) != SAI_EVENTID_LEN)
+			continue;
+
+		lws_strncpy(uuid, u, sizeof(uuid));
+		if (!sais_dbw_queue_event_op(vhd, uuid, SAIS_DBW_OP_EVENT_DELETE,
+					     NULL, sais_event_job_done))
+			n++;
+	}
+
+	sqlite3_finalize(sm);
+
+	if (n)
+		lwsl_notice("%s: resuming %d event deletions\n", __func__, n);
+
+	return 0;
+}
+
+/*
+ * Put all the event's tasks back to WAITING.  Dropping the artifact refs and
+ * rows is quick and done here, but deleting the logs and unlinking content
+ * nobody refers to any more is left to the db writer thread.  Any logs we
+ * still hold go to the writer ahead of the reset, so they are cleared too.
+ */
+
 sai_db_result_t
 sais_event_reset(struct vhd *vhd, const char *event_uuid)
 {
+	lws_dll2_owner_t o, unlinks;
 	struct lwsac *ac = NULL;
 	sqlite3 *pdb = NULL;
-	lws_dll2_owner_t o;
 	char *err = NULL;
 	int ret;
 
+	memset(&unlinks, 0, sizeof(unlinks));
+
+	sais_logcache_flush(vhd);
+
 	if (sai_event_db_ensure_open(vhd->context, &vhd->sqlite3_cache,
 			      vhd->sqlite3_path_lhs, event_uuid, 0, &pdb))
 		return SAI_DB_RESULT_ERROR;
 
 	if (lws_struct_sq3_deserialize(pdb, NULL, NULL,
 				       lsm_schema_sq3_map_task,
-				       &o, &ac, 0, 999) >= 0) {
-
-		ret = sqlite3_exec(pdb, "BEGIN TRANSACTION", NULL, NULL, &err);
-		if (ret != SQLITE_OK) {
-			sai_event_db_close(&vhd->sqlite3_cache, &pdb);
-			lwsac_free(&ac);
-			if (ret == SQLITE_BUSY)
-				return SAI_DB_RESULT_BUSY;
-			return SAI_DB_RESULT_ERROR;
-		}
-		sqlite3_free(err);
-
-		lws_start_foreach_dll(struct lws_dll2 *, p, o.head) {
-			sai_task_t *t = lws_container_of(p, sai_task_t, list);
-			if (sais_task_clear_build_and_logs(vhd, t->uuid, 0) == SAI_DB_RESULT_BUSY) {
-				sqlite3_exec(pdb, "END TRANSACTION", NULL, NULL, &err);
-				sai_event_db_close(&vhd->sqlite3_cache, &pdb);
-				lwsac_free(&ac);
-				return SAI_DB_RESULT_BUSY;
-			}
-		} lws_end_foreach_dll(p);
+				       &o, &ac, 0, 999) < 0) {
+		sai_event_db_close(&vhd->sqlite3_cache, &pdb);
 
-		ret = sqlite3_exec(pdb, "END TRANSACTION", NULL, NULL, &err);
-		if (ret != SQLITE_OK) {
-			sai_event_db_close(&vhd->sqlite3_cache, &pdb);
-			lwsac_free(&ac);
-			if (ret == SQLITE_BUSY)
-				return SAI_DB_RESULT_BUSY;
-			return SAI_DB_RESULT_ERROR;
-		}
-		sqlite3_free(err);
+		return SAI_DB_RESULT_ERROR;
 	}
 
+	ret = sqlite3_exec(pdb, "BEGIN TRANSACTION", NULL, NULL, &err);
+	if (ret != SQLITE_OK) {
+		sai_event_db_close(&vhd->sqlite3_cache, &pdb);
+		lwsac_free(&ac);
+		if (ret == SQLITE_BUSY)
+			return SAI_DB_RESULT_BUSY;
+		return SAI_DB_RESULT_ERROR;
+	}
+	sqlite3_free(err);
+
+	sais_artifact_store_release(vhd, pdb, NULL, &unlinks);
+	sai_sqlite3_statement(pdb, "delete from artifacts", "artifacts reset");
+
+	if (sais_dbw_queue_event_op(vhd, event_uuid, SAIS_DBW_OP_EVENT_RESET,
+				    &unlinks, sais_event_job_done)) {
+		/* no writer... we have to do it all ourselves then */
+		sai_sqlite3_statement(pdb, "delete from logs", "logs reset");
+		lws_start_foreach_dll_safe(struct lws_dll2 *, p, p1,
+					   unlinks.head) {
+			unlink((const char *)&lws_container_of(p,
+					sais_dbw_path_t, list)[1]);
+			lws_dll2_remove(p);
+			free(lws_container_of(p, sais_dbw_path_t, list));
+		} lws_end_foreach_dll_safe(p, p1);
+	} else
+		sais_event_progress(vhd, event_uuid, SAIS_DBW_OP_EVENT_RESET,
+				    "queued", 0, 1);
+
+	lws_start_foreach_dll(struct lws_dll2 *, p, o.head) {
+		sai_task_t *t = lws_container_of(p, sai_task_t, list);
+
+		sais_task_reset_state(vhd, t->uuid);
+	} lws_end_foreach_dll(p);
+
+	ret = sqlite3_exec(pdb, "END TRANSACTION", NULL, NULL, &err);
+	sqlite3_free(err);
 	sai_event_db_close(&vhd->sqlite3_cache, &pdb);
 	lwsac_free(&ac);
 
+	if (ret != SQLITE_OK)
+		return ret == SQLITE_BUSY ? SAI_DB_RESULT_BUSY :
+					    SAI_DB_RESULT_ERROR;
+
+	lws_sul_schedule(vhd->context, 0, &vhd->sul_central, sais_central_cb, 1);
+	sais_platforms_with_tasks_pending(vhd);
+
 	return SAI_DB_RESULT_OK;
 }
 
+/*
+ * Builder connections uploading an artifact for the event hold its db open
+ * and will write to it... drop the upload and the connection, so nothing is
+ * still using the db when we close it and the writer unlinks it
+ */
+
+static void
+sais_event_detach_uploads(struct vhd *vhd, const char *event_uuid)
+{
+	char ev[33];
+
+	lws_start_foreach_dll(struct lws_dll2 *, p, vhd->builders.head) {
+		struct pss *pss = lws_container_of(p, struct pss, same);
+
+		if (!pss->pdb_artifact)
+			continue;
+
+		sai_task_uuid_to_event_uuid(ev, pss->artifact.task_uuid);
+		if (strcmp(ev, event_uuid))
+			continue;
+
+		lwsl_notice("%s: dropping upload of %s for deleted event\n",
+			    __func__, pss->artifact.blob_filename);
+
+		sais_artifact_store_abandon(pss);
+		pss->artifact_resume_pending = 0;
+		sai_event_db_close(&vhd->sqlite3_cache, &pss->pdb_artifact);
+		lws_set_timeout(pss->wsi, PENDING_TIMEOUT_HTTP_CONTENT,
+				LWS_TO_KILL_ASYNC);
+	} lws_end_foreach_dll(p);
+}
+
+/*
+ * The event is tombstoned in the events db straight away, so it disappears
+ * for everyone, and any tasks still going are cancelled.  Removing its files
+ * happens later in the db writer thread, which removes the tombstone when
+ * it's done.
+ */
+
 sai_db_result_t
 sais_event_delete(struct vhd *vhd, const char *event_uuid)
 {
-	char qu[128], esc[96], pre[LWS_PRE + 128];
+	char qu[256], esc[96], pre[LWS_PRE + 128];
+	lws_dll2_owner_t o, unlinks;
 	struct lwsac *ac = NULL;
 	lws_wsmsg_info_t info;
 	sqlite3 *pdb = NULL;
-	lws_dll2_owner_t o;
 	char *err = NULL;
 	size_t len;
 	int ret;
 
+	memset(&unlinks, 0, sizeof(unlinks));
+
+	lws_sql_purify(esc, event_uuid, sizeof(esc));
+	lws_snprintf(qu, sizeof(qu), "BEGIN TRANSACTION; "
+		     "insert or replace into event_tombstones (uuid) "
+		     "values ('%s'); delete from events where uuid='%s'; "
+		     "END TRANSACTION;", esc, esc);
+	ret = sqlite3_exec(vhd->server.pdb, qu, NULL, NULL, &err);
+	if (ret != SQLITE_OK) {
+		sqlite3_exec(vhd->server.pdb, "ROLLBACK", NULL, NULL, NULL);
+		if (ret == SQLITE_BUSY)
+			return SAI_DB_RESULT_BUSY;
+		lwsl_err("%s: evdel uuid %s, sq3 err %s\n", __func__, esc, err);
+		sqlite3_free(err);
+		return SAI_DB_RESULT_ERROR;
+	}
+
 	if (sai_event_db_ensure_open(vhd->context, &vhd->sqlite3_cache,
 			      vhd->sqlite3_path_lhs, event_uuid, 0, &pdb) == 0) {
 		if (lws_struct_sq3_deserialize(pdb, NULL, NULL,
 					       lsm_schema_sq3_map_task,
 					       &o, &ac, 0, 999) >= 0) {
 
-			ret = sqlite3_exec(pdb, "BEGIN TRANSACTION", NULL, NULL, &err);
-			if (ret != SQLITE_OK) {
-				sai_event_db_close(&vhd->sqlite3_cache, &pdb);
-				lwsac_free(&ac);
-				if (ret == SQLITE_BUSY)
-					return SAI_DB_RESULT_BUSY;
-				return SAI_DB_RESULT_ERROR;
-			}
-
 			lws_start_foreach_dll(struct lws_dll2 *, p, o.head) {
 				sai_task_t *t = lws_container_of(p, sai_task_t, list);
 
 				if (t->state != SAIES_WAITING &&
 				    t->state != SAIES_SUCCESS &&
+				    t->state != SAIES_CACHED_SUCCESS &&
 				    t->state != SAIES_FAIL &&
 				    t->state != SAIES_CANCELLED)
 					sais_task_cancel(vhd, t->uuid);
 
 			} lws_end_foreach_dll(p);
-
-			ret = sqlite3_exec(pdb, "END TRANSACTION", NULL, NULL, &err);
-			if (ret != SQLITE_OK) {
-				sai_event_db_close(&vhd->sqlite3_cache, &pdb);
-				lwsac_free(&ac);
-				if (ret == SQLITE_BUSY)
-					return SAI_DB_RESULT_BUSY;
-				return SAI_DB_RESULT_ERROR;
-			}
 		}
+		sais_artifact_store_release(vhd, pdb, NULL, &unlinks);
 		sai_event_db_close(&vhd->sqlite3_cache, &pdb);
 		lwsac_free(&ac);
 	}
 
-	lws_sql_purify(esc, event_uuid, sizeof(esc));
-	lws_snprintf(qu, sizeof(qu), "delete from events where uuid='%s'", esc);
-	ret = sqlite3_exec(vhd->server.pdb, qu, NULL, NULL, &err);
-	if (ret != SQLITE_OK) {
-		if (ret == SQLITE_BUSY)
-			return SAI_DB_RESULT_BUSY;
-		lwsl_err("%s: evdel uuid %s, sq3 err %s\n", __func__, esc, err);
-		sqlite3_free(err);
-		return SAI_DB_RESULT_ERROR;
-	}
-
-	sai_event_db_delete_database(vhd->sqlite3_path_lhs, event_uuid);
+	/* nothing on the loop should be holding it open now */
+	sais_event_detach_uploads(vhd, event_uuid);
+	sai_event_db_close_now(&vhd->sqlite3_cache, event_uuid);
+
+	if (sais_dbw_queue_event_op(vhd, event_uuid, SAIS_DBW_OP_EVENT_DELETE,
+				    &unlinks, sais_event_job_done)) {
+		/*
+		 * The tombstone stays and we try again next time we start,
+		 * the renamed artifact content is swept then as well
+		 */
+		lwsl_err("%s: unable to queue deletion of %s\n", __func__, esc);
+		lws_start_foreach_dll_safe(struct lws_dll2 *, p, p1,
+					   unlinks.head) {
+			lws_dll2_remove(p);
+			free(lws_container_of(p, sais_dbw_path_t, list));
+		} lws_end_foreach_dll_safe(p, p1);
+	} else
+		sais_event_progress(vhd, event_uuid, SAIS_DBW_OP_EVENT_DELETE,
+				    "queued", 0, 1);
+
+	sais_result_cache_forget(vhd, event_uuid);
 	sais_eventchange(vhd->h_ss_websrv, event_uuid, SAIES_DELETED);
 
 	len = (size_t)lws_snprintf(pre + LWS_PRE, sizeof(pre) - LWS_PRE,
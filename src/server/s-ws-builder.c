@@ -53,8 +53,8 @@ typedef struct sais_logcache_pertask {
  * The Schema that may be sent to us by a builder
  *
  * Artifacts are sent on secondary SS connections so they don't block ongoing
- * log delivery etc.  The JSON is immediately followed by binary data to the
- * length told in the JSON.
+ * log delivery etc.  After the artifact JSON, they are sent in chunks, each a
+ * chunk JSON immediately followed by binary data to the length told in it.
  */
 
 static const lws_struct_map_t lsm_schema_map_ba[] = {
@@ -72,6 +72,8 @@ static const lws_struct_map_t lsm_schema_map_ba[] = {
 						"com-warmcat-sai-resource"),
 	LSM_SCHEMA	(sai_build_metric_t, NULL, lsm_build_metric,
 						"com.warmcat.sai.build-metric"),
+	LSM_SCHEMA	(sai_artifact_chunk_t, NULL, lsm_artifact_chunk,
+						"com-warmcat-sai-artifact-chunk"),
 };
 
 enum {
@@ -82,85 +84,68 @@ enum {
 	SAIM_WSSCH_BUILDER_LOADREPORT,
 	SAIM_WSSCH_BUILDER_RESOURCE_REQ,
 	SAIM_WSSCH_BUILDER_METRIC,
+	SAIM_WSSCH_BUILDER_ARTIFACT_CHUNK,
 };
 
+/*
+ * The db writer committed a task's logs: tell anybody who's looking at this
+ * task's logs that something changed (event_hash is actually the task hash)
+ */
+
+static void
+sais_logs_committed(struct vhd *vhd, sais_dbw_job_t *j)
+{
+	char sw[192 + LWS_PRE];
+	lws_wsmsg_info_t info;
+	int n;
+
+	if (j->result)
+		return;
+
+	n = lws_snprintf(sw + LWS_PRE, sizeof(sw) - LWS_PRE,
+			"{\"schema\":\"sai-tasklogs\","
+			 "\"event_hash\":\"%s\"}", j->task_uuid);
+
+	memset(&info, 0, sizeof(info));
+
+	info.private_source_idx		= SAI_WEBSRV_PB__LOGS;
+	info.buf			= (uint8_t *)sw + LWS_PRE;
+	info.len			= (unsigned int)n;
+	info.ss_flags			= LWSSS_FLAG_SOM | LWSSS_FLAG_EOM;
+
+	if (sais_websrv_broadcast_REQUIRES_LWS_PRE(vhd->h_ss_websrv, &info) < 0)
+		lwsl_warn("%s: unable to broadcast to web\n", __func__);
+}
+
 static void
 sais_dump_logs_to_db(lws_sorted_usec_list_t *sul)
 {
 	struct vhd *vhd = lws_container_of(sul, struct vhd, sul_logcache);
-	char event_uuid[33], sw[192 + LWS_PRE];
 	sais_logcache_pertask_t *lcpt;
-	lws_wsmsg_info_t info;
-	sqlite3 *pdb = NULL;
 	sai_log_t *hlog;
-	char *err;
-	int n;
 
 	/*
-	 * for each task that acquired logs in the interval
+	 * for each task that acquired logs in the interval, hand its logs to
+	 * the db writer thread, which commits them in one transaction per
+	 * event db and lets us know when it's done
 	 */
 
 	lws_start_foreach_dll_safe(struct lws_dll2 *, p, p1,
 				   vhd->tasklog_cache.head) {
 		lcpt = lws_container_of(p, sais_logcache_pertask_t, list);
 
-		sai_task_uuid_to_event_uuid(event_uuid, lcpt->uuid);
-
-		pdb = NULL;
-		if (!sai_event_db_ensure_open(vhd->context, &vhd->sqlite3_cache,
-				      vhd->sqlite3_path_lhs, event_uuid, 0, &pdb)) {
-
-			/*
-			 * Empty the task-specific log cache into the event-
-			 * specific db for the task in one go, this is much
-			 * more efficient
-			 */
-
-			sqlite3_exec(pdb, "BEGIN TRANSACTION", NULL, NULL, &err);
-			if (err)
-				sqlite3_free(err);
-
-			lws_struct_sq3_serialize(pdb, lsm_schema_sq3_map_log,
-					 &lcpt->cache, 0);
-
-			sqlite3_exec(pdb, "END TRANSACTION", NULL, NULL, &err);
-			if (err)
-				sqlite3_free(err);
-			sai_event_db_close(&vhd->sqlite3_cache, &pdb);
-
-		} else
-			lwsl_err("%s: unable to open event-specific database\n",
-					__func__);
-
-		/*
-		 * Destroy the logs in the task cache and the task cache
-		 */
-
-		lws_start_foreach_dll_safe(struct lws_dll2 *, pq, pq1,
-					   lcpt->cache.head) {
-			hlog = lws_container_of(pq, sai_log_t, list);
-			lws_dll2_remove(&hlog->list);
-			free(hlog);
-		} lws_end_foreach_dll_safe(pq, pq1);
-
-		/*
-		 * Inform anybody who's looking at this task's logs that
-		 * something changed (event_hash is actually the task hash)
-		 */
-
-		n = lws_snprintf(sw + LWS_PRE, sizeof(sw) - LWS_PRE,
-				"{\"schema\":\"sai-tasklogs\","
-				 "\"event_hash\":\"%s\"}", lcpt->uuid);
-
-		memset(&info, 0, sizeof(info));
-
-		info.private_source_idx		= SAI_WEBSRV_PB__LOGS;
-		info.buf			= (uint8_t *)sw + LWS_PRE;
-		info.len			= (unsigned int)n;
-		info.ss_flags			= LWSSS_FLAG_SOM | LWSSS_FLAG_EOM;
-
-		if (sais_websrv_broadcast_REQUIRES_LWS_PRE(vhd->h_ss_websrv, &info) < 0)
-			lwsl_warn("%s: unable to broadcast to web\n", __func__);
+		if (sais_dbw_queue_logs(vhd, lcpt->uuid, &lcpt->cache,
+					sais_logs_committed)) {
+			lwsl_err("%s: unable to queue logs for %s\n",
+					__func__, lcpt->uuid);
+
+			lws_start_foreach_dll_safe(struct lws_dll2 *, pq, pq1,
+						   lcpt->cache.head) {
+				hlog = lws_container_of(pq, sai_log_t, list);
+				lws_dll2_remove(&hlog->list);
+				free(hlog);
+			} lws_end_foreach_dll_safe(pq, pq1);
+		}
 
 		/*
 		 * Destroy the whole task-specific cache, it will regenerate
@@ -174,6 +159,18 @@ sais_dump_logs_to_db(lws_sorted_usec_list_t *sul)
 
 }
 
+/*
+ * Hand any logs we are still holding to the db writer now, so they are queued
+ * ahead of whatever the caller is about to queue
+ */
+
+void
+sais_logcache_flush(struct vhd *vhd)
+{
+	lws_sul_cancel(&vhd->sul_logcache);
+	sais_dump_logs_to_db(&vhd->sul_logcache);
+}
+
 /*
  * We're going to stash these logs on a per-task list, and deal with them
  * inside a single trasaction per task efficiently on a timer.
@@ -513,8 +510,12 @@ sais_process_rej(struct vhd *vhd, struct pss *pss,
 				 NULL) != SQLITE_OK)
 			build_step = -1;
 
+		sai_event_db_close(&vhd->sqlite3_cache, &pdb);
+
 		/*
-		 * Bump the build step on the accepted task
+		 * Bump the build step on the accepted task.  This step was
+		 * offered after the last one's writes landed, so what we read
+		 * is current.
 		 */
 
 		build_step++;
@@ -522,7 +523,8 @@ sais_process_rej(struct vhd *vhd, struct pss *pss,
 			     "update tasks set build_step=%d "
 			     "where state != 4 and uuid='%s'",
 			     build_step, esc_uuid);
-		sqlite3_exec(pdb, q, NULL, NULL, NULL);
+		sais_dbw_queue_task_update(vhd, SAIS_DBW_OP_TASK_UPDATE,
+					   rej->task_uuid, q, 0, NULL);
 
 		lwsl_notice("%s: &&&&&&&& build_step set to %d\n", __func__, build_step);
 
@@ -535,14 +537,14 @@ sais_process_rej(struct vhd *vhd, struct pss *pss,
 			lwsl_warn("%s: &&&&&&&&&&&&&&&&&&&&&&&&&& setting task %s started to %llu\n",
 				  __func__, esc_uuid, (unsigned long long)pss->first_log_timestamp);
 
-			if (sqlite3_exec(pdb, q, NULL, NULL, NULL) != SQLITE_OK)
+			if (sais_dbw_queue_task_update(vhd,
+					SAIS_DBW_OP_TASK_UPDATE, rej->task_uuid,
+					q, 0, NULL))
 				lwsl_notice("%s: unable to set started\n", __func__);
 		}
 
 		lwsl_notice("%s: exiting, setting build_step %d\n", __func__, build_step);
 
-		sai_event_db_close(&vhd->sqlite3_cache, &pdb);
-
 		if (sais_set_task_state(vhd,
 					rej->task_uuid,
 					SAIES_BEING_BUILT,
@@ -607,15 +609,86 @@ sais_process_rej(struct vhd *vhd, struct pss *pss,
 		// sais_task_clear_build_and_logs(vhd, rej->task_uuid, 1);
 	}
 
-	if (rej->reason == SAI_TASK_REASON_DESTROYED)
-		/* uuid will not be found listed as inflight for this */
-		sais_create_and_offer_task_step(vhd, rej->task_uuid);
-
 	sais_list_builders(vhd);
 
 	return 0;
 }
 
+/*
+ * We have all the artifact content... put it in the store (unless we took a
+ * reference on content we already had) and record it in the event's artifacts
+ * table, so browsers can see it
+ */
+
+static int
+sais_artifact_finish(struct vhd *vhd, struct pss *pss)
+{
+	lws_dll2_owner_t o;
+	char s[192], esc[96];
+	int state = 0;
+
+	if (pss->artifact_open &&
+	    sais_artifact_store_commit(vhd, pss, pss->artifact.hash,
+				       sizeof(pss->artifact.hash)))
+		return 1;
+
+	/*
+	 * Create a random download nonce unrelated to the random upload
+	 * nonce (so knowing the download one won't let you upload anything).
+	 */
+
+	sai_uuid16_create(vhd->context, pss->artifact.artifact_down_nonce);
+
+	lws_dll2_owner_clear(&o);
+	lws_dll2_add_head(&pss->artifact.list, &o);
+
+	if (lws_struct_sq3_serialize(pss->pdb_artifact,
+				     lsm_schema_sq3_map_artifact,
+				     &o, (unsigned int)pss->artifact.uid)) {
+		lwsl_err("%s: failed artifact struct insert\n", __func__);
+		lws_dll2_remove(&pss->artifact.list);
+
+		return 1;
+	}
+
+	lws_dll2_remove(&pss->artifact.list);
+
+	lws_sql_purify(esc, pss->artifact.task_uuid, sizeof(esc));
+	lws_snprintf(s, sizeof(s)," select state from tasks where uuid == \"%s\"", esc);
+	if (sqlite3_exec(pss->pdb_artifact, s, sql3_get_integer_cb, &state,
+			 NULL) != SQLITE_OK) {
+		lwsl_err("%s: %s: %s: fail\n", __func__, s,
+			 sqlite3_errmsg(pss->pdb_artifact));
+
+		return 0;
+	}
+
+	sais_taskchange(vhd->h_ss_websrv, pss->artifact.task_uuid, state);
+
+	return 0;
+}
+
+/*
+ * The content hash of a partial artifact we're resuming has been caught up to
+ * what we have of it, so the builder can be told where to go on from
+ */
+
+void
+sais_artifact_caught_up(struct pss *pss)
+{
+	/* we already had all of it */
+
+	if (pss->artifact_offset == pss->artifact_length &&
+	    sais_artifact_finish(pss->vhd, pss)) {
+		lws_set_timeout(pss->wsi, PENDING_TIMEOUT_HTTP_CONTENT,
+				LWS_TO_KILL_ASYNC);
+		return;
+	}
+
+	pss->artifact_resume_pending = 1;
+	lws_callback_on_writable(pss->wsi);
+}
+
 /*
  * Server received a communication from a builder
  *
@@ -627,7 +700,7 @@ sais_process_rej(struct vhd *vhd, struct pss *pss,
 int
 sais_ws_json_rx_builder(struct vhd *vhd, struct pss *pss, uint8_t *buf, size_t bl, unsigned int ss_flags)
 {
-	char event_uuid[33], s[128], esc[96];
+	char event_uuid[33], s[256], esc[96];
 	sai_resource_requisition_t *rr;
 	sai_resource_wellknown_t *wk;
 	sai_plat_owner_t *bp_owner;
@@ -640,11 +713,10 @@ sais_ws_json_rx_builder(struct vhd *vhd, struct pss *pss, uint8_t *buf, size_t b
 	sai_resource_t *res;
 	lws_dll2_owner_t o;
 	sai_artifact_t *ap;
-	uint8_t xbuf[2048];
+	uint8_t xbuf[LWS_PRE + 4096];
 	sai_task_t *task;
 	size_t used = 0;
 	sai_log_t *log;
-	uint64_t rid;
 	int n, m;
 
 	sais_metrics_db_init(vhd);
@@ -703,40 +775,6 @@ sais_ws_json_rx_builder(struct vhd *vhd, struct pss *pss, uint8_t *buf, size_t b
 		// lwsl_hexdump_notice(buf, bl);
 
 		if (m == LEJP_CONTINUE) { /* ie, we used all of bl and need more */
-			if (pss->a.top_schema_index == SAIM_WSSCH_BUILDER_LOADREPORT) {
-
-				/*
-				 * We can't directly proxy these pieces, because
-				 * with several builders connected and spamming
-				 * fragmented load reports, when we forward them
-				 * the adjacent fragments will be randomly
-				 * ordered (* shows where this code is)
-				 *
-				 *   b1 --\   sai-        sai-   /-- browser
-				 *   b2 ----- server ---- web ------ browser
-				 *   b3 --/   *                  \-- browser
-				 *
-				 * Even though each builder is sending
-				 * them correctly ordered, when all combined
-				 * together on the srv -> web link, the fragments
-				 * will be disorderd.  Eg, b1 first frag, b2
-				 * first frag, b1 last frag, b2 last frag is
-				 * legal for each builder, but illegal when
-				 * proxied and forwarded in the order they were
-				 * received on a single connection.
-				 *
-				 * Instead we have to collect the pieces per-
-				 * builder and forward them when we have an
-				 * atomic message.
-				 */
-
-				*((unsigned int *)(buf - sizeof(int))) = ss_flags;
-				if (lws_buflist_append_segment(&pss->onward_reassembly,
-							       buf - sizeof(int),
-							       bl + sizeof(int)) < 0)
-					return -1;
-			}
-
 			pss->frag = 1;
 			return 0;
 		}
@@ -821,6 +859,8 @@ sais_ws_json_rx_builder(struct vhd *vhd, struct pss *pss, uint8_t *buf, size_t b
 					lws_strncpy(live_sp->lws_hash, build->lws_hash,
 						    sizeof(live_sp->lws_hash));
 					live_sp->windows			= build->windows;
+					lws_strncpy(live_sp->warm, build->warm,
+						    sizeof(live_sp->warm));
 					live_sp->online				= 1;
 					live_sp->avail_mem_kib			= (unsigned int)-1;
 					live_sp->avail_sto_kib			= (unsigned int)-1;
@@ -845,6 +885,8 @@ sais_ws_json_rx_builder(struct vhd *vhd, struct pss *pss, uint8_t *buf, size_t b
 						lws_strncpy(live_sp->lws_hash, build->lws_hash,
 							    sizeof(live_sp->lws_hash));
 						live_sp->windows			= build->windows;
+						lws_strncpy(live_sp->warm, build->warm,
+							    sizeof(live_sp->warm));
 						live_sp->avail_mem_kib			= (unsigned int)-1;
 						live_sp->avail_sto_kib			= (unsigned int)-1;
 						live_sp->wsi				= pss->wsi;
@@ -954,217 +996,261 @@ sais_ws_json_rx_builder(struct vhd *vhd, struct pss *pss, uint8_t *buf, size_t b
 		case SAIM_WSSCH_BUILDER_LOADREPORT:
 
 			/*
-			 * If we got here, we have any intermediate parts
-			 * already, let's add this final part there first
+			 * This may only be the members that changed, we merge
+			 * it into what we know about the platform and forward
+			 * the result to sai-web at a limited rate.  That way
+			 * we also don't have to worry about interleaving the
+			 * fragments from different builders on the onward
+			 * link to sai-web.
 			 */
 
-			*((unsigned int *)(buf - sizeof(int))) = ss_flags;
-			if (lws_buflist_append_segment(&pss->onward_reassembly,
-						       buf - sizeof(int),
-						       bl + sizeof(int)) < 0)
-				return -1;
-
-			/*
-			 * Then let's forward the whole reassembly buflist on
-			 * to the proxying buflist atomically.
-			 */
-
-			sais_websrv_broadcast_buflist(vhd->h_ss_websrv,
-						      &pss->onward_reassembly);
-
+			sais_loadreport_rx(vhd, (sai_load_report_t *)pss->a.dest);
+			lwsac_free(&pss->a.ac);
 			break;
 
 		case SAIM_WSSCH_BUILDER_ARTIFACT:
 			/*
 			 * Builder wants to send us an artifact.
 			 *
-			 * We get sent a JSON object immediately followed by binary
-			 * data for the artifact.
+			 * We get sent a JSON object describing it, we reply
+			 * with how much of it we already have from any earlier
+			 * attempt, and it follows up with the rest as chunks
+			 * (SAIM_WSSCH_BUILDER_ARTIFACT_CHUNK).
 			 *
-			 * We place the binary data as a blob in the sql record in the
-			 * artifact table.
+			 * We place the binary data in the content-addressed artifact
+			 * store, and a record pointing to it in the artifact table.
 			 */
 
-			lwsl_info("%s: SAIM_WSSCH_BUILDER_ARTIFACT: m = %d, bl = %d\n", __func__, m, (int)bl);
+			ap = (sai_artifact_t *)pss->a.dest;
 
-			if (!pss->bulk_binary_data) {
+			if (pss->artifact_open || pss->pdb_artifact) {
+				lwsl_err("%s: one artifact per connection\n",
+					 __func__);
+				goto afail;
+			}
 
-				lwsl_info("%s: BUILDER_ARTIFACT: blob start, m = %d\n", __func__, m);
+			sai_task_uuid_to_event_uuid(event_uuid, ap->task_uuid);
 
-				ap = (sai_artifact_t *)pss->a.dest;
+			/*
+			 * Open the event-specific database object... the
+			 * handle is closed when the stream closes, for whatever
+			 * reason.
+			 */
 
-				sai_task_uuid_to_event_uuid(event_uuid, ap->task_uuid);
+			if (sai_event_db_ensure_open(vhd->context, &vhd->sqlite3_cache,
+					      vhd->sqlite3_path_lhs, event_uuid, 0,
+						      &pss->pdb_artifact)) {
+				lwsl_err("%s: unable to open event-specific "
+					 "database\n", __func__);
 
-				/*
-				 * Open the event-specific database object... the
-				 * handle is closed when the stream closes, for whatever
-				 * reason.
-				 */
+				lwsac_free(&pss->a.ac);
+				return -1;
+			}
 
-				if (sai_event_db_ensure_open(vhd->context, &vhd->sqlite3_cache,
-						      vhd->sqlite3_path_lhs, event_uuid, 0,
-							      &pss->pdb_artifact)) {
-					lwsl_err("%s: unable to open event-specific "
-						 "database\n", __func__);
+			/*
+			 * Retreive the task object
+			 */
 
-					lwsac_free(&pss->a.ac);
-					return -1;
-				}
+			lws_sql_purify(esc, ap->task_uuid, sizeof(esc));
+			lws_snprintf(s, sizeof(s)," and uuid == \"%s\"", esc);
+			n = lws_struct_sq3_deserialize(pss->pdb_artifact, s,
+						       NULL, lsm_schema_sq3_map_task,
+						       &o, &ac, 0, 1);
+			if (n < 0 || !o.head) {
+				sai_event_db_close(&vhd->sqlite3_cache, &pss->pdb_artifact);
+				lwsl_notice("%s: no task of that id\n", __func__);
+				lwsac_free(&pss->a.ac);
+				return -1;
+			}
 
-				/*
-				 * Retreive the task object
-				 */
+			task = (sai_task_t *)o.head;
+			n = strcmp(task->art_up_nonce, ap->artifact_up_nonce);
+			lwsac_free(&ac);
 
-				lws_sql_purify(esc, ap->task_uuid, sizeof(esc));
-				lws_snprintf(s, sizeof(s)," and uuid == \"%s\"", esc);
-				n = lws_struct_sq3_deserialize(pss->pdb_artifact, s,
-							       NULL, lsm_schema_sq3_map_task,
-							       &o, &ac, 0, 1);
-				if (n < 0 || !o.head) {
-					sai_event_db_close(&vhd->sqlite3_cache, &pss->pdb_artifact);
-					lwsl_notice("%s: no task of that id\n", __func__);
-					lwsac_free(&pss->a.ac);
-					return -1;
-				}
+			if (n) {
+				lwsl_err("%s: artifact nonce mismatch\n",
+					 __func__);
+				goto afail;
+			}
 
-				task = (sai_task_t *)o.head;
-				n = strcmp(task->art_up_nonce, ap->artifact_up_nonce);
+			/*
+			 * The task the sender is sending us an artifact for
+			 * exists.  The sender knows the random upload nonce
+			 * for that task's artifacts.
+			 *
+			 * Take our own copy of the artifact description, since
+			 * the chunks will be parsed into pss->a after this.
+			 */
 
-				if (n) {
-					lwsl_err("%s: artifact nonce mismatch\n",
-						 __func__);
-					goto afail;
-				}
+			pss->artifact		= *ap;
+			pss->artifact.blob	= NULL;
+			memset(&pss->artifact.list, 0, sizeof(pss->artifact.list));
+			lwsac_free(&pss->a.ac);
 
-				/*
-				 * The task the sender is sending us an artifact for
-				 * exists.  The sender knows the random upload nonce
-				 * for that task's artifacts.
-				 *
-				 * Create a random download nonce unrelated to the
-				 * random upload nonce (so knowing the download one
-				 * won't let you upload anything).
-				 *
-				 * Create the artifact's entry in the event-specific
-				 * database
-				 */
+			if (pss->artifact.encoding[0] &&
+			    strcmp(pss->artifact.encoding, "gzip")) {
+				lwsl_err("%s: unknown artifact encoding %s\n",
+					 __func__, pss->artifact.encoding);
+				goto afail;
+			}
 
-				sai_uuid16_create(pss->vhd->context,
-						  ap->artifact_down_nonce);
+			/* builders that don't encode may not send enc_len */
+			if (!pss->artifact.encoding[0])
+				pss->artifact.enc_len = pss->artifact.len;
 
-				lws_dll2_owner_clear(&o);
-				lws_dll2_add_head(&ap->list, &o);
+			pss->artifact_length	= pss->artifact.enc_len;
+			pss->artifact_offset	= 0;
 
+			/*
+			 * If we completed this upload before but the builder
+			 * never saw our ack, just ack it again
+			 */
+
+			n = 0;
+			{
+				char esc1[160], q[384];
+
+				lws_sql_purify(esc1, pss->artifact.blob_filename,
+					       sizeof(esc1));
+				lws_snprintf(q, sizeof(q), "select count(*) from "
+					     "artifacts where task_uuid='%s' and "
+					     "blob_filename='%s' and timestamp=%llu "
+					     "and hash != ''", esc, esc1,
+					     (unsigned long long)pss->artifact.timestamp);
+				if (sqlite3_exec(pss->pdb_artifact, q,
+						 sql3_get_integer_cb, &n,
+						 NULL) != SQLITE_OK)
+					n = 0;
+			}
+
+			if (n)
+				pss->artifact_offset = pss->artifact_length;
+			else if (!sais_artifact_store_ref(vhd, pss)) {
 				/*
-				 * Create the task in event-specific database
+				 * We already store content with the hash the
+				 * builder told us, just record it for this
+				 * task and tell the builder we have it all
 				 */
 
-				if (lws_struct_sq3_serialize(pss->pdb_artifact,
-							 lsm_schema_sq3_map_artifact,
-							 &o, (unsigned int)ap->uid)) {
-					lwsl_err("%s: failed artifact struct insert\n",
-							__func__);
-
+				if (sais_artifact_finish(vhd, pss))
 					goto afail;
-				}
 
+				pss->artifact_offset = pss->artifact_length;
+			} else {
 				/*
-				 * recover the rowid
+				 * Spool the content into a part file in the
+				 * store while we hash it... the name in the
+				 * store is what we compute, not what we're told
 				 */
 
-				lws_snprintf(s, sizeof(s),
-					     "select rowid from artifacts "
-						"where timestamp=%llu",
-					     (unsigned long long)ap->timestamp);
+				pss->artifact.hash[0] = '\0';
 
-				if (sqlite3_exec((sqlite3 *)pss->pdb_artifact, s,
-						sai_sql3_get_uint64_cb, &rid, NULL) !=
-									 SQLITE_OK) {
-					lwsl_err("%s: %s: %s: fail\n", __func__, s,
-						 sqlite3_errmsg(pss->pdb_artifact));
+				if (sais_artifact_store_open(vhd, pss))
 					goto afail;
-				}
 
 				/*
-				 * Set the blob size on associated row
+				 * If we have some of it, the builder hears
+				 * where to resume from once we caught up the
+				 * hash, in sais_artifact_caught_up()
 				 */
 
-				lws_snprintf(s, sizeof(s),
-					     "update artifacts set blob=zeroblob(%llu) "
-						"where rowid=%llu",
-					     (unsigned long long)ap->len,
-					     (unsigned long long)rid);
+				if (pss->artifact_catching_up) {
+					lws_set_timeout(pss->wsi,
+						PENDING_TIMEOUT_HTTP_CONTENT,
+						SAIS_ARTIFACT_IDLE_SECS);
+					m = 0;
+					break;
+				}
+
+				/* it's empty */
 
-				if (sqlite3_exec((sqlite3 *)pss->pdb_artifact, s,
-						 NULL, NULL, NULL) != SQLITE_OK) {
-					lwsl_err("%s: %s: %s: fail\n", __func__, s,
-						 sqlite3_errmsg(pss->pdb_artifact));
+				if (pss->artifact_offset == pss->artifact_length &&
+				    sais_artifact_finish(vhd, pss))
 					goto afail;
-				}
+			}
 
-				/*
-				 * Open a blob on the associated row... the blob handle
-				 * is closed when this stream closes for whatever
-				 * reason.
-				 */
+			/* tell the builder where to resume from */
+
+			pss->artifact_resume_pending = 1;
+			lws_callback_on_writable(pss->wsi);
+			lws_set_timeout(pss->wsi, PENDING_TIMEOUT_HTTP_CONTENT,
+					SAIS_ARTIFACT_IDLE_SECS);
+
+			m = 0;
+
+			break;
+
+		case SAIM_WSSCH_BUILDER_ARTIFACT_CHUNK:
+			/*
+			 * A chunk header JSON, immediately followed by binary
+			 * data to the length in it, which must hash to the
+			 * sha256 in it
+			 */
 
-				if (sqlite3_blob_open(pss->pdb_artifact, "main",
-						  "artifacts", "blob", (sqlite3_int64)rid, 1,
-						  &pss->blob_artifact) != SQLITE_OK) {
-					lwsl_err("%s: unable to open blob\n", __func__);
+			if (!pss->bulk_binary_data) {
+				if (sais_artifact_store_chunk_begin(pss,
+					(sai_artifact_chunk_t *)pss->a.dest)) {
+					lwsl_err("%s: bad artifact chunk\n",
+						 __func__);
 					goto afail;
 				}
 
+				lwsac_free(&pss->a.ac);
+
 				/*
-				 * First time around, m == number of bytes let in buf
-				 * after JSON, (bl - m) offset
+				 * First time around, m == number of bytes left
+				 * in buf after JSON, (bl - m) offset
 				 */
 				pss->bulk_binary_data = 1;
-				pss->artifact_length = ap->len;
-			} else {
+			} else
 				m = (int)bl;
-				lwsl_info("%s: BUILDER_ARTIFACT: blob bulk\n", __func__);
-			}
 
 			if (m) {
-				lwsl_info("%s: blob write +%d, ofs %llu / %llu, len %d (0x%02x)\n",
+				if ((uint64_t)m > pss->artifact_chunk_end -
+							pss->artifact_offset) {
+					lwsl_err("%s: artifact chunk overflow\n",
+						 __func__);
+					goto afail;
+				}
+
+				lwsl_info("%s: artifact write +%d, ofs %llu / %llu, len %d\n",
 					    __func__, (int)(bl - (unsigned int)m),
 					    (unsigned long long)pss->artifact_offset,
-					    (unsigned long long)pss->artifact_length, m, buf[0]);
-				if (sqlite3_blob_write(pss->blob_artifact,
-						   (uint8_t *)buf + (bl - (unsigned int)m), (int)m,
-						   (int)pss->artifact_offset)) {
-					lwsl_err("%s: writing blob failed\n", __func__);
+					    (unsigned long long)pss->artifact_length, m);
+				if (sais_artifact_store_write(pss,
+						   (uint8_t *)buf + (bl - (unsigned int)m),
+						   (size_t)m)) {
+					lwsl_err("%s: writing artifact failed\n", __func__);
 					goto afail;
 				}
 
-				lws_set_timeout(pss->wsi, PENDING_TIMEOUT_HTTP_CONTENT, 5);
+				lws_set_timeout(pss->wsi, PENDING_TIMEOUT_HTTP_CONTENT,
+						SAIS_ARTIFACT_IDLE_SECS);
 				pss->artifact_offset = pss->artifact_offset + (uint64_t)m;
-			} else
-				lwsl_info("%s: no m\n", __func__);
-
-			lwsl_info("%s: ofs %d, len %d\n", __func__, (int)pss->artifact_offset, (int)pss->artifact_length);
-
-			if (pss->artifact_offset == pss->artifact_length) {
-				int state;
+			}
 
-				lwsl_notice("%s: blob upload finished\n", __func__);
+			if (pss->artifact_offset == pss->artifact_chunk_end) {
 				pss->bulk_binary_data = 0;
 
-				ap = (sai_artifact_t *)pss->a.dest;
+				/*
+				 * The builder will reconnect and resume from
+				 * the last good chunk if we hang up on it
+				 */
 
-				lws_sql_purify(esc, ap->task_uuid, sizeof(esc));
-				lws_snprintf(s, sizeof(s)," select state from tasks where uuid == \"%s\"", esc);
-				if (sqlite3_exec((sqlite3 *)pss->pdb_artifact, s,
-						 sql3_get_integer_cb, &state, NULL) != SQLITE_OK) {
-					lwsl_err("%s: %s: %s: fail\n", __func__, s,
-						 sqlite3_errmsg(pss->pdb_artifact));
-					goto bail;
-				}
+				if (sais_artifact_store_chunk_end(pss))
+					goto afail;
 
-				sais_taskchange(pss->vhd->h_ss_websrv, ap->task_uuid, state);
+				if (pss->artifact_offset == pss->artifact_length) {
+					lwsl_notice("%s: artifact upload finished\n",
+						    __func__);
 
-				goto afail;
+					if (sais_artifact_finish(vhd, pss))
+						goto afail;
+
+					/* ack with a resume at the end */
+					pss->artifact_resume_pending = 1;
+					lws_callback_on_writable(pss->wsi);
+				}
 			}
 
 			m = 0;
@@ -1341,6 +1427,7 @@ sais_ws_json_rx_builder(struct vhd *vhd, struct pss *pss, uint8_t *buf, size_t b
 afail:
 	lwsac_free(&ac);
 	lwsac_free(&pss->a.ac);
+	sais_artifact_store_abandon(pss);
 	sai_event_db_close(&vhd->sqlite3_cache, &pss->pdb_artifact);
 
 	return -1;
@@ -1402,6 +1489,31 @@ sais_ws_json_tx_builder(struct vhd *vhd, struct pss *pss, uint8_t *buf,
 		goto send_json;
 	}
 
+	if (pss->artifact_resume_pending) {
+		/*
+		 * Tell an artifact upload connection how much of the artifact
+		 * we already have
+		 */
+		sai_artifact_chunk_t r;
+
+		memset(&r, 0, sizeof(r));
+		r.ofs = pss->artifact_offset;
+		r.len = pss->artifact_length;
+		pss->artifact_resume_pending = 0;
+
+		js = lws_struct_json_serialize_create(
+				lsm_schema_json_map_artifact_resume,
+				LWS_ARRAY_SIZE(lsm_schema_json_map_artifact_resume),
+				0, &r);
+		if (!js)
+			return 1;
+
+		n = (int)lws_struct_json_serialize(js, p, lws_ptr_diff_size_t(end, p), &w);
+		lws_struct_json_serialize_destroy(&js);
+
+		goto send_json;
+	}
+
 	if (pss->rebuild_owner.head) {
 		/*
 		 * Pending rebuild message to send
@@ -1467,6 +1579,28 @@ sais_ws_json_tx_builder(struct vhd *vhd, struct pss *pss, uint8_t *buf,
 		goto send_json;
 	}
 
+	if (pss->prefetch_owner.head && !pss->issue_task_owner.head) {
+		/*
+		 * Hint the builder to warm its git mirror, only when there's
+		 * no real task waiting to go
+		 */
+		sai_prefetch_t *pf = lws_container_of(pss->prefetch_owner.head,
+						      sai_prefetch_t, list);
+
+		js = lws_struct_json_serialize_create(lsm_schema_prefetch,
+				LWS_ARRAY_SIZE(lsm_schema_prefetch), 0, pf);
+		if (!js)
+			return 1;
+
+		n = (int)lws_struct_json_serialize(js, p, lws_ptr_diff_size_t(end, p), &w);
+		lws_struct_json_serialize_destroy(&js);
+
+		lws_dll2_remove(&pf->list);
+		free(pf);
+
+		goto send_json;
+	}
+
        if (!pss->issue_task_owner.head)
 		return 0; /* nothing to send */
 
@@ -1521,7 +1655,7 @@ send_json:
 
 	if (pss->viewer_state_owner.head || pss->task_cancel_owner.head ||
 	    pss->res_pending_reply_owner.count ||
-	    pss->issue_task_owner.count)
+	    pss->issue_task_owner.count || pss->prefetch_owner.count)
 		lws_callback_on_writable(pss->wsi);
 
 	return 0;
@@ -27,7 +27,8 @@
  *
  * The server notifies the sai-web instances of event and task changes (just
  * that a particular event or task changed) and builder list updates (the
- * whole current builder list JSON each time).
+ * whole builder list when a sai-web connects or builders come or go, otherwise
+ * just the builders whose state changed).
  *
  * Sai-web instances can send requests to restart or delete tasks and whole
  * events made by authenticated clients.
@@ -37,6 +38,7 @@
  */
 
 #include <libwebsockets.h>
+#include <stdlib.h>
 #include <string.h>
 #include <signal.h>
 #include <time.h>
@@ -97,6 +99,11 @@ static const lws_struct_map_t lsm_schema_json_map[] = {
 						"com.warmcat.sai.taskinfo")
 };
 
+static const lws_struct_map_t lsm_schema_loadreport[] = {
+	LSM_SCHEMA	(sai_load_report_t,	 NULL, lsm_load_report_members,
+					      "com.warmcat.sai.loadreport"),
+};
+
 enum {
 	SAIS_WS_WEBSRV_RX_TASKRESET,
 	SAIS_WS_WEBSRV_RX_TASKREBUILDLASTSTEP,
@@ -155,22 +162,95 @@ reject:
 	return 1;
 }
 
-int
-sais_list_pcons(struct vhd *vhd)
+/*
+ * Growable heap buffer with LWS_PRE headroom, so whatever we collect in it can
+ * be broadcast directly
+ */
+
+typedef struct sais_jbuf {
+	uint8_t			*buf;
+	size_t			len; /* JSON length, after the LWS_PRE */
+	size_t			alloc;
+} sais_jbuf_t;
+
+static int
+sais_jbuf_append(sais_jbuf_t *jb, const void *d, size_t len)
 {
-	char json_pcons[LWS_PRE + 8192], *start = json_pcons + LWS_PRE,
-	     *p = start, *end = p + sizeof(json_pcons) - LWS_PRE;
-	unsigned int ss_flags = LWSSS_FLAG_SOM | LWSSS_FLAG_EOM;
+	if (LWS_PRE + jb->len + len > jb->alloc) {
+		size_t na = (LWS_PRE + jb->len + len + 4096) & ~(size_t)4095;
+		uint8_t *nb = realloc(jb->buf, na);
+
+		if (!nb)
+			return 1;
+
+		jb->buf		= nb;
+		jb->alloc	= na;
+	}
+
+	memcpy(jb->buf + LWS_PRE + jb->len, d, len);
+	jb->len += len;
+
+	return 0;
+}
+
+static int
+sais_jbuf_serialize(sais_jbuf_t *jb, const lws_struct_map_t *map,
+		    size_t map_entries, void *obj)
+{
+	lws_struct_json_serialize_result_t r;
 	lws_struct_serialize_t *js;
-	struct lwsac *ac = NULL;
-	lws_wsmsg_info_t info;
+	uint8_t chunk[2048];
 	size_t w;
-	lws_struct_json_serialize_result_t r;
 
+	js = lws_struct_json_serialize_create(map, map_entries, 0, obj);
+	if (!js)
+		return 1;
+
+	do {
+		r = lws_struct_json_serialize(js, chunk, sizeof(chunk), &w);
+		if (r == LSJS_RESULT_ERROR || sais_jbuf_append(jb, chunk, w)) {
+			lws_struct_json_serialize_destroy(&js);
+			return 1;
+		}
+	} while (r == LSJS_RESULT_CONTINUE);
+
+	lws_struct_json_serialize_destroy(&js);
+
+	return 0;
+}
+
+static void
+sais_jbuf_broadcast(struct vhd *vhd, sais_jbuf_t *jb)
+{
+	lws_wsmsg_info_t info;
+
+	memset(&info, 0, sizeof(info));
+
+	info.private_source_idx		= SAI_WEBSRV_PB__GENERATED;
+	info.buf			= jb->buf + LWS_PRE;
+	info.len			= jb->len;
+	info.ss_flags			= LWSSS_FLAG_SOM | LWSSS_FLAG_EOM;
+
+	if (sais_websrv_broadcast_REQUIRES_LWS_PRE(vhd->h_ss_websrv, &info) < 0)
+		lwsl_warn("%s: unable to broadcast to web\n", __func__);
+}
+
+/*
+ * The PCON topology rarely changes, so we only send it to sai-web when it is
+ * different from what we sent last time, or we are forced to because a new
+ * sai-web connected
+ */
+
+static int
+sais_list_pcons(struct vhd *vhd, int force)
+{
 	sai_power_managed_builders_t pmb;
 	sai_power_controller_t *pc;
+	struct lwsac *ac = NULL;
+	sais_jbuf_t jb;
 
 	memset(&pmb, 0, sizeof(pmb));
+	memset(&jb, 0, sizeof(jb));
 
 	/* Query PCONs from DB using schema map */
 	if (lws_struct_sq3_deserialize(vhd->server.pdb, NULL, "name ",
@@ -192,70 +272,266 @@ sais_list_pcons(struct vhd *vhd)
 
 	} lws_end_foreach_dll(d);
 
-	/* Serialize */
-	js = lws_struct_json_serialize_create(lsm_schema_power_managed_builders,
-					      LWS_ARRAY_SIZE(lsm_schema_power_managed_builders),
-					      0, &pmb);
-	if (!js)
+	if (sais_jbuf_serialize(&jb, lsm_schema_power_managed_builders,
+				LWS_ARRAY_SIZE(lsm_schema_power_managed_builders),
+				&pmb))
 		goto bail;
 
-	do {
-		r = lws_struct_json_serialize(js, (uint8_t *)p,
-				lws_ptr_diff_size_t(end, p) - 2, &w);
-		p += w;
-
-		switch (r) {
-		case LSJS_RESULT_FINISH:
-			/* fallthru */
-		case LSJS_RESULT_CONTINUE:
-			memset(&info, 0, sizeof(info));
-
-			info.private_source_idx		= SAI_WEBSRV_PB__GENERATED;
-			info.buf			= (uint8_t *)start;
-			info.len			= lws_ptr_diff_size_t(p, start);
-			info.ss_flags			= ss_flags;
-
-			if (sais_websrv_broadcast_REQUIRES_LWS_PRE(vhd->h_ss_websrv, &info) < 0)
-				lwsl_warn("%s: unable to broadcast pcons to web\n", __func__);
-
-			p = start;
-			ss_flags &= ~((unsigned int)LWSSS_FLAG_SOM);
-			break;
+	lwsac_free(&ac);
 
-		case LSJS_RESULT_ERROR:
-			lws_struct_json_serialize_destroy(&js);
-			goto bail;
-		}
+	if (!force && vhd->pcon_snap && jb.len == vhd->pcon_snap_len &&
+	    !memcmp(jb.buf + LWS_PRE, vhd->pcon_snap + LWS_PRE, jb.len)) {
+		/* nothing changed since sai-web last heard about PCONs */
+		free(jb.buf);
+		return 0;
+	}
 
-	} while (r == LSJS_RESULT_CONTINUE);
+	sais_jbuf_broadcast(vhd, &jb);
+
+	free(vhd->pcon_snap);
+	vhd->pcon_snap		= jb.buf;
+	vhd->pcon_snap_len	= jb.len;
 
-	lws_struct_json_serialize_destroy(&js);
-	lwsac_free(&ac);
 	return 0;
 
 bail:
+	free(jb.buf);
 	lwsac_free(&ac);
 	return 1;
 }
 
+static void
+sais_builder_snap_clear(lws_dll2_owner_t *owner)
+{
+	lws_start_foreach_dll_safe(struct lws_dll2 *, p, p1, owner->head) {
+		sais_builder_snap_t *bs = lws_container_of(p,
+						sais_builder_snap_t, list);
+
+		lws_dll2_remove(&bs->list);
+		free(bs);
+	} lws_end_foreach_dll_safe(p, p1);
+}
+
+void
+sais_builder_snap_destroy(struct vhd *vhd)
+{
+	lws_sul_cancel(&vhd->sul_builders);
+	sais_builder_snap_clear(&vhd->builder_snap);
+	free(vhd->pcon_snap);
+	vhd->pcon_snap		= NULL;
+	vhd->pcon_snap_len	= 0;
+}
+
+static void
+sais_loadreport_free(sais_loadreport_t *e)
+{
+	lws_dll2_remove(&e->list);
+	lwsac_free(&e->ac);
+	free(e);
+}
+
+static void
+sais_loadreport_fwd_cb(lws_sorted_usec_list_t *sul)
+{
+	struct vhd *vhd = lws_container_of(sul, struct vhd, sul_loadreports);
+	sais_jbuf_t jb;
+
+	vhd->last_loadreport_fwd = lws_now_usecs();
+
+	lws_start_foreach_dll(struct lws_dll2 *, p, vhd->loadreports.head) {
+		sais_loadreport_t *e = lws_container_of(p, sais_loadreport_t,
+							list);
+
+		if (e->dirty) {
+			e->dirty = 0;
+			memset(&jb, 0, sizeof(jb));
+
+			if (!sais_jbuf_serialize(&jb, lsm_schema_loadreport,
+					LWS_ARRAY_SIZE(lsm_schema_loadreport),
+					&e->lr))
+				sais_jbuf_broadcast(vhd, &jb);
+
+			free(jb.buf);
+		}
+	} lws_end_foreach_dll(p);
+}
+
+/*
+ * A builder sent us a load report for one of its platforms, either all of it
+ * or just the members that changed.  Builders with many platforms send a lot
+ * of these, so rather than proxy each one to sai-web, we keep the merged state
+ * per platform and forward the ones that changed at most once per
+ * SAIS_LOADREPORT_FWD_US.
+ */
+
 int
-sais_list_builders(struct vhd *vhd)
+sais_loadreport_rx(struct vhd *vhd, const sai_load_report_t *lr)
 {
-	char json_builders[LWS_PRE + 8192], *start = json_builders + LWS_PRE,
-	     *p = start, *end = p + sizeof(json_builders) - LWS_PRE,
-	     subsequent = 0;
-	unsigned int ss_flags = LWSSS_FLAG_SOM;
-	lws_dll2_owner_t db_builders_owner;
-	lws_struct_serialize_t *js;
+	unsigned int chg = lr->changed ? lr->changed : SAI_LR_CHG_ALL;
+	sais_loadreport_t *e = NULL;
+	lws_usec_t now = lws_now_usecs(), us;
+
+	lws_start_foreach_dll_safe(struct lws_dll2 *, p, p1,
+				   vhd->loadreports.head) {
+		sais_loadreport_t *x = lws_container_of(p, sais_loadreport_t,
+							list);
+
+		if (!strcmp(x->lr.builder_name, lr->builder_name))
+			e = x;
+		else
+			if (now - x->updated > SAIS_LOADREPORT_STALE_US)
+				/* platform went away or got renamed */
+				sais_loadreport_free(x);
+	} lws_end_foreach_dll_safe(p, p1);
+
+	if (!e) {
+		if (lr->changed)
+			/*
+			 * We can't apply a delta to nothing, eg, we restarted.
+			 * The builder sends the full picture periodically.
+			 */
+			return 0;
+
+		e = calloc(1, sizeof(*e));
+		if (!e)
+			return 1;
+
+		lws_strncpy(e->lr.builder_name, lr->builder_name,
+			    sizeof(e->lr.builder_name));
+		lws_dll2_add_tail(&e->list, &vhd->loadreports);
+	}
+
+	if (chg & SAI_LR_CHG_CORE_COUNT)
+		e->lr.core_count = lr->core_count;
+	if (chg & SAI_LR_CHG_RAM)
+		e->lr.initial_free_ram_kib = lr->initial_free_ram_kib;
+	if (chg & SAI_LR_CHG_RESERVED_RAM)
+		e->lr.reserved_ram_kib = lr->reserved_ram_kib;
+	if (chg & SAI_LR_CHG_DISK)
+		e->lr.initial_free_disk_kib = lr->initial_free_disk_kib;
+	if (chg & SAI_LR_CHG_RESERVED_DISK)
+		e->lr.reserved_disk_kib = lr->reserved_disk_kib;
+	if (chg & SAI_LR_CHG_ACTIVE_STEPS)
+		e->lr.active_steps = lr->active_steps;
+	if (chg & SAI_LR_CHG_CPU)
+		e->lr.cpu_percent = lr->cpu_percent;
+	if (chg & SAI_LR_CHG_TXQ_MEM)
+		e->lr.txq_mem_kib = lr->txq_mem_kib;
+	if (chg & SAI_LR_CHG_TXQ_SPILL)
+		e->lr.txq_spill_kib = lr->txq_spill_kib;
+	if (chg & SAI_LR_CHG_TXQ_DROPPED)
+		e->lr.txq_dropped = lr->txq_dropped;
+
+	if (chg & SAI_LR_CHG_ACTIVE_TASKS) {
+		lwsac_free(&e->ac);
+		lws_dll2_owner_clear(&e->lr.active_tasks);
+
+		lws_start_foreach_dll(struct lws_dll2 *, p,
+				      lr->active_tasks.head) {
+			const sai_active_task_info_t *a = lws_container_of(p,
+						sai_active_task_info_t, list);
+			sai_active_task_info_t *ati = lwsac_use_zero(&e->ac,
+							sizeof(*ati), 512);
+
+			if (ati) {
+				*ati = *a;
+				lws_dll2_clear(&ati->list);
+				lws_dll2_add_tail(&ati->list,
+						  &e->lr.active_tasks);
+			}
+		} lws_end_foreach_dll(p);
+	}
+
+	e->updated	= now;
+	e->dirty	= 1;
+
+	if (!vhd->sul_loadreports.list.owner) {
+		us = vhd->last_loadreport_fwd + SAIS_LOADREPORT_FWD_US - now;
+		if (us < 1)
+			us = 1;
+		lws_sul_schedule(vhd->context, 0, &vhd->sul_loadreports,
+				 sais_loadreport_fwd_cb, us);
+	}
+
+	return 0;
+}
+
+void
+sais_loadreport_destroy(struct vhd *vhd)
+{
+	lws_sul_cancel(&vhd->sul_loadreports);
+
+	lws_start_foreach_dll_safe(struct lws_dll2 *, p, p1,
+				   vhd->loadreports.head) {
+		sais_loadreport_free(lws_container_of(p, sais_loadreport_t,
+						      list));
+	} lws_end_foreach_dll_safe(p, p1);
+}
+
+/*
+ * Send either the whole builder list, or only the builders in it that changed
+ */
+
+static int
+sais_builders_send(struct vhd *vhd, lws_dll2_owner_t *snap, int full)
+{
+	const char *head = full ?
+		"{\"schema\":\"com.warmcat.sai.builders\",\"builders\":[" :
+		"{\"schema\":\"com.warmcat.sai.builder-deltas\",\"builders\":[";
+	char subsequent = 0;
+	sais_jbuf_t jb;
+
+	memset(&jb, 0, sizeof(jb));
+
+	if (sais_jbuf_append(&jb, head, strlen(head)))
+		goto bail;
+
+	lws_start_foreach_dll(struct lws_dll2 *, p, snap->head) {
+		sais_builder_snap_t *bs = lws_container_of(p,
+						sais_builder_snap_t, list);
+
+		if (full || bs->changed) {
+			if ((subsequent && sais_jbuf_append(&jb, ",", 1)) ||
+			    sais_jbuf_append(&jb, &bs[1], bs->len))
+				goto bail;
+			subsequent = 1;
+		}
+	} lws_end_foreach_dll(p);
+
+	if (sais_jbuf_append(&jb, "]}", 2))
+		goto bail;
+
+	// lwsl_notice("%s: %.*s\n", __func__, (int)jb.len, jb.buf + LWS_PRE);
+	sais_jbuf_broadcast(vhd, &jb);
+	free(jb.buf);
+
+	return 0;
+
+bail:
+	free(jb.buf);
+	return 1;
+}
+
+static int
+sais_list_builders_now(struct vhd *vhd)
+{
+	lws_dll2_owner_t db_builders_owner, snap;
+	int force = !!vhd->builders_snap_force,
+	    full = force, changed = 0;
+	struct lws_dll2 *old;
 	struct lwsac *ac = NULL;
-	lws_wsmsg_info_t info;
+	sais_builder_snap_t *bs;
 	sai_plat_t *sp;
-	size_t w;
+	sais_jbuf_t jb;
+
+	vhd->builders_snap_force = 0;
 
 	/* Send PCONs first */
-	sais_list_pcons(vhd);
+	sais_list_pcons(vhd, force);
 
 	memset(&db_builders_owner, 0, sizeof(db_builders_owner));
+	memset(&snap, 0, sizeof(snap));
+	memset(&jb, 0, sizeof(jb));
 
 	/* Query builders table, which now includes 'pcon' column */
 	if (lws_struct_sq3_deserialize(vhd->server.pdb, NULL, "name ",
@@ -267,15 +543,11 @@ sais_list_builders(struct vhd *vhd)
 
 	// lwsl_warn("%s: count deserialized %d\n", __func__, (int)db_builders_owner.count);
 
-	p += lws_snprintf((char *)p, lws_ptr_diff_size_t(end, p),
-			"{\"schema\":\"com.warmcat.sai.builders\",\"builders\":[");
-
 	lws_start_foreach_dll(struct lws_dll2 *, walk, db_builders_owner.head) {
-		lws_struct_json_serialize_result_t r;
 		sai_plat_t *live_builder;
 
 		sp = lws_container_of(walk, sai_plat_t, sai_plat_list);
-		lwsl_notice("%s: listing builder '%s', pcon='%s'\n", __func__, sp->name, sp->pcon ? sp->pcon : "(null)");
+		lwsl_info("%s: listing builder '%s', pcon='%s'\n", __func__, sp->name, sp->pcon ? sp->pcon : "(null)");
 
 		live_builder = sais_builder_from_uuid(vhd, sp->name);
 
@@ -316,71 +588,117 @@ sais_list_builders(struct vhd *vhd)
 		} lws_end_foreach_dll(p);
 
 		/* Use schema including pcon if available */
-		js = lws_struct_json_serialize_create(lsm_schema_map_plat_simple,
-						      LWS_ARRAY_SIZE(lsm_schema_map_plat_simple),
-						      0, sp);
-		if (!js)
+		jb.len = 0;
+		if (sais_jbuf_serialize(&jb, lsm_schema_map_plat_simple,
+					LWS_ARRAY_SIZE(lsm_schema_map_plat_simple),
+					sp))
 			goto bail;
 
-		if (subsequent)
-			*p++ = ',';
-		subsequent = 1;
+		bs = malloc(sizeof(*bs) + jb.len);
+		if (!bs)
+			goto bail;
 
-		do {
-			r = lws_struct_json_serialize(js, (uint8_t *)p,
-					lws_ptr_diff_size_t(end, p) - 2, &w);
-			p += w;
+		memset(bs, 0, sizeof(*bs));
+		lws_snprintf(bs->ident, sizeof(bs->ident), "%s/%s/%s", sp->name,
+			     sp->platform ? sp->platform : "",
+			     sp->pcon ? sp->pcon : "");
+		bs->len = jb.len;
+		memcpy(&bs[1], jb.buf + LWS_PRE, jb.len);
+		lws_dll2_add_tail(&bs->list, &snap);
 
-			switch (r) {
-			case LSJS_RESULT_FINISH:
-				/* fallthru */
-			case LSJS_RESULT_CONTINUE:
-				memset(&info, 0, sizeof(info));
+	} lws_end_foreach_dll(walk);
 
-				info.private_source_idx		= SAI_WEBSRV_PB__GENERATED;
-				info.buf			= (uint8_t *)start;
-				info.len			= lws_ptr_diff_size_t(p, start);
-				info.ss_flags			= ss_flags;
+	free(jb.buf);
+	jb.buf = NULL;
+	lwsac_free(&ac);
 
-				if (sais_websrv_broadcast_REQUIRES_LWS_PRE(vhd->h_ss_websrv, &info) < 0)
-					lwsl_warn("%s: unable to broadcast to web\n", __func__);
+	/*
+	 * Both lists are ordered by name... if the set of builders or what
+	 * they are changed, browsers need the whole list again.  Otherwise
+	 * we only need to tell them about builders whose JSON differs.
+	 */
 
-				p = start;
-				ss_flags &= ~((unsigned int)LWSSS_FLAG_SOM);
-				break;
+	if (snap.count != vhd->builder_snap.count)
+		full = 1;
 
-			case LSJS_RESULT_ERROR:
-				lws_struct_json_serialize_destroy(&js);
-				goto bail;
-			}
+	old = vhd->builder_snap.head;
+	lws_start_foreach_dll(struct lws_dll2 *, p, snap.head) {
+		sais_builder_snap_t *o;
 
-		} while (r == LSJS_RESULT_CONTINUE);
+		bs = lws_container_of(p, sais_builder_snap_t, list);
+		if (full || !old)
+			break;
 
-		lws_struct_json_serialize_destroy(&js);
+		o = lws_container_of(old, sais_builder_snap_t, list);
+		if (strcmp(o->ident, bs->ident))
+			full = 1;
+		else
+			if (o->len != bs->len || memcmp(&o[1], &bs[1], bs->len)) {
+				bs->changed = 1;
+				changed = 1;
+			}
 
-	} lws_end_foreach_dll(walk);
+		old = old->next;
+	} lws_end_foreach_dll(p);
 
-	ss_flags |= LWSSS_FLAG_EOM;
-	p += lws_snprintf((char *)p, lws_ptr_diff_size_t(end, p), "]}");
-	memset(&info, 0, sizeof(info));
+	if (full || changed)
+		sais_builders_send(vhd, &snap, full);
 
-	info.private_source_idx		= SAI_WEBSRV_PB__GENERATED;
-	info.buf			= (uint8_t *)start;
-	info.len			= lws_ptr_diff_size_t(p, start);
-	info.ss_flags			= ss_flags;
+	/* what we just computed becomes the new snapshot */
 
-	if (sais_websrv_broadcast_REQUIRES_LWS_PRE(vhd->h_ss_websrv, &info) < 0)
-		lwsl_warn("%s: unable to broadcast to web\n", __func__);
+	sais_builder_snap_clear(&vhd->builder_snap);
+	lws_start_foreach_dll_safe(struct lws_dll2 *, p, p1, snap.head) {
+		bs = lws_container_of(p, sais_builder_snap_t, list);
+
+		bs->changed = 0;
+		lws_dll2_remove(&bs->list);
+		lws_dll2_add_tail(&bs->list, &vhd->builder_snap);
+	} lws_end_foreach_dll_safe(p, p1);
 
-	// lwsl_notice("%s: Broadcasting builder list: %s\n", __func__, start);
-	lwsac_free(&ac);
 	return 0;
 
 bail:
+	free(jb.buf);
+	sais_builder_snap_clear(&snap);
 	lwsac_free(&ac);
 	return 1;
 }
 
+static void
+sais_list_builders_cb(lws_sorted_usec_list_t *sul)
+{
+	struct vhd *vhd = lws_container_of(sul, struct vhd, sul_builders);
+
+	sais_list_builders_now(vhd);
+}
+
+/*
+ * Builder state changes tend to come in bursts, eg, a builder connecting
+ * announces several platforms.  Coalesce them into one update on the next
+ * trip around the event loop.
+ */
+
+int
+sais_list_builders(struct vhd *vhd)
+{
+	if (!vhd->sul_builders.list.owner)
+		lws_sul_schedule(vhd->context, 0, &vhd->sul_builders,
+				 sais_list_builders_cb, 1);
+
+	return 0;
+}
+
+/*
+ * A new sai-web connected, it needs the whole picture rather than deltas
+ */
+
+void
+sais_list_builders_snapshot(struct vhd *vhd)
+{
+	vhd->builders_snap_force = 1;
+	sais_list_builders(vhd);
+}
+
 
 
 static void
@@ -659,7 +977,8 @@ websrvss_srv_state(void *userobj, void *sh, lws_ss_constate_t state,
 		return lws_ss_request_tx(m->ss);
 
 	case LWSSSCS_CONNECTED:
-		sais_list_builders(m->vhd);
+		/* a new sai-web needs the whole list, not deltas */
+		sais_list_builders_snapshot(m->vhd);
 		break;
 	case LWSSSCS_ALL_RETRIES_FAILED:
 		break;
@@ -20,9 +20,13 @@
  */
 
 #include <libwebsockets.h>
+#include <stdlib.h>
 #include <string.h>
 #include <signal.h>
 #include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <zlib.h>
 
 #include "w-private.h"
 
@@ -33,9 +37,20 @@ sai_task_uuid_to_event_uuid(char *event_uuid33, const char *task_uuid65)
 	event_uuid33[32] = '\0';
 }
 
+/*
+ * Artifacts uploaded since the artifact store was introduced are served from
+ * there by filepath, in which case path is filled in and *pdb / *blob are left
+ * NULL.  Older artifacts still have their content in a blob in the event db,
+ * for those we return live handles on the db and blob instead.
+ *
+ * Stored artifacts may be encoded, in which case the encoding is returned in
+ * encoding, and *length is the decoded length.
+ */
+
 int
-saiw_get_blob(struct vhd *vhd, const char *url, sqlite3 **pdb,
-	      sqlite3_blob **blob, uint64_t *length)
+saiw_get_artifact(struct vhd *vhd, const char *url, char *path, size_t path_len,
+		  char *encoding, size_t encoding_len, sqlite3 **pdb,
+		  sqlite3_blob **blob, uint64_t *length)
 {
 	char task_uuid[66], event_uuid[34], nonce[34], qu[200],
 	     esc[66], esc1[34];
@@ -84,7 +99,7 @@ saiw_get_blob(struct vhd *vhd, const char *url, sqlite3 **pdb,
 	/* open the event-specific database object */
 
 	if (sai_event_db_ensure_open(vhd->context, &vhd->sqlite3_cache,
-			      vhd->sqlite3_path_lhs, event_uuid, 0, pdb)) {
+			      vhd->sqlite3_path_lhs, event_uuid, SAI_DB_OPEN_RO, pdb)) {
 		lwsl_info("%s: unable to open event-specific database\n",
 				__func__);
 
@@ -111,6 +126,19 @@ saiw_get_blob(struct vhd *vhd, const char *url, sqlite3 **pdb,
 	a = (sai_artifact_t *)o.head;
 
 	*length = a->len;
+	encoding[0] = '\0';
+
+	if (a->hash[0]) {
+		lws_strncpy(encoding, a->encoding, encoding_len);
+		n = sai_artifact_store_path(path, path_len, vhd->artifact_store,
+					    a->hash);
+		lwsac_free(&ac);
+		sai_event_db_close(&vhd->sqlite3_cache, pdb);
+
+		return n ? -1 : 0;
+	}
+
+	path[0] = '\0';
 
 	/*
 	 * recover the rowid the blob api requires
@@ -150,3 +178,79 @@ fail:
 
 	return -1;
 }
+
+/*
+ * For clients that can't take the stored gzip encoding, we decode it for them
+ */
+
+int
+saiw_artifact_inflate_open(struct pss *pss, const char *path)
+{
+	pss->artifact_fd = lws_open(path, O_RDONLY);
+	if (pss->artifact_fd < 0)
+		return 1;
+
+	pss->artifact_zs = calloc(1, sizeof(z_stream));
+	pss->artifact_zin = malloc(4096);
+	if (!pss->artifact_zs || !pss->artifact_zin ||
+	    inflateInit2((z_stream *)pss->artifact_zs, 15 + 16) != Z_OK) {
+		free(pss->artifact_zs);
+		pss->artifact_zs = NULL;
+		saiw_artifact_inflate_close(pss);
+
+		return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Fill buf with up to len bytes of decoded content, returns the amount or -1
+ */
+
+int
+saiw_artifact_inflate_read(struct pss *pss, uint8_t *buf, size_t len)
+{
+	z_stream *zs = (z_stream *)pss->artifact_zs;
+	ssize_t n;
+	int r;
+
+	zs->next_out = buf;
+	zs->avail_out = (uInt)len;
+
+	while (zs->avail_out) {
+		if (!zs->avail_in) {
+			n = read(pss->artifact_fd, pss->artifact_zin, 4096);
+			if (n <= 0)
+				break;
+			zs->next_in = pss->artifact_zin;
+			zs->avail_in = (uInt)n;
+		}
+
+		r = inflate(zs, Z_NO_FLUSH);
+		if (r == Z_STREAM_END)
+			break;
+		if (r != Z_OK)
+			return -1;
+	}
+
+	return (int)(len - zs->avail_out);
+}
+
+void
+saiw_artifact_inflate_close(struct pss *pss)
+{
+	if (pss->artifact_zs) {
+		inflateEnd((z_stream *)pss->artifact_zs);
+		free(pss->artifact_zs);
+		pss->artifact_zs = NULL;
+	}
+
+	free(pss->artifact_zin);
+	pss->artifact_zin = NULL;
+
+	if (pss->artifact_fd > 0) {
+		close(pss->artifact_fd);
+		pss->artifact_fd = 0;
+	}
+}
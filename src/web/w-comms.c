@@ -94,28 +94,120 @@ saiw_task_cancel(struct vhd *vhd, const char *task_uuid)
 	return 0;
 }
 
+/*
+ * Status badges get fetched a lot by things that don't care how much it costs
+ * us, so keep the head state per project (and optionally ref) in memory.  On
+ * a miss we look it up once, afterwards eventchanges keep it current, and it
+ * is dropped whenever events are added or deleted.
+ */
+
+static int
+saiw_head_status_matches(const saiw_head_status_t *hs, const sai_event_t *e)
+{
+	if (e->sec || strcmp(hs->repo_name, e->repo_name))
+		return 0;
+
+	if (!hs->ref[0] || !strcmp(hs->ref, e->ref))
+		return 1;
+
+	return !strcmp(hs->ref, "refs/heads/master") &&
+	       !strcmp(e->ref, "refs/heads/main");
+}
+
+void
+saiw_head_status_update(struct vhd *vhd, const sai_event_t *e)
+{
+	lws_start_foreach_dll(struct lws_dll2 *, p, vhd->head_status.head) {
+		saiw_head_status_t *hs = lws_container_of(p,
+						saiw_head_status_t, list);
+
+		if (saiw_head_status_matches(hs, e) &&
+		    e->created >= hs->created) {
+			hs->created = e->created;
+			hs->state = (int)e->state;
+		}
+	} lws_end_foreach_dll(p);
+}
+
+void
+saiw_head_status_cache_destroy(struct vhd *vhd)
+{
+	lws_start_foreach_dll_safe(struct lws_dll2 *, p, p1,
+				   vhd->head_status.head) {
+		saiw_head_status_t *hs = lws_container_of(p,
+						saiw_head_status_t, list);
+
+		lws_dll2_remove(&hs->list);
+		free(hs);
+	} lws_end_foreach_dll_safe(p, p1);
+}
+
 int
-sai_get_head_status(struct vhd *vhd, const char *projname)
+sai_get_head_status(struct vhd *vhd, const char *projname, const char *ref)
 {
+	char filt[384], esc[96], esc1[96];
+	saiw_head_status_t *hs;
 	struct lwsac *ac = NULL;
 	lws_dll2_owner_t o;
 	sai_event_t *e;
-	int state;
 
-	if (lws_struct_sq3_deserialize(vhd->pdb, NULL, "created ",
+	lws_start_foreach_dll(struct lws_dll2 *, p, vhd->head_status.head) {
+		hs = lws_container_of(p, saiw_head_status_t, list);
+
+		if (!strcmp(hs->repo_name, projname) && !strcmp(hs->ref, ref)) {
+			lws_dll2_remove(&hs->list);
+			lws_dll2_add_head(&hs->list, &vhd->head_status);
+
+			return hs->state;
+		}
+	} lws_end_foreach_dll(p);
+
+	lws_sql_purify(esc, projname, sizeof(esc));
+	if (ref[0]) {
+		lws_sql_purify(esc1, ref, sizeof(esc1));
+		lws_snprintf(filt, sizeof(filt),
+			     " and repo_name='%s' and sec=0 and (ref='%s'%s)",
+			     esc, esc1, !strcmp(ref, "refs/heads/master") ?
+					" or ref='refs/heads/main'" : "");
+	} else
+		lws_snprintf(filt, sizeof(filt),
+			     " and repo_name='%s' and sec=0", esc);
+
+	/* we only want the newest one, not the whole history */
+
+	if (lws_struct_sq3_deserialize(vhd->pdb, filt, "created desc ",
 				       lsm_schema_sq3_map_event,
-				       &o, &ac, 0, -1))
+				       &o, &ac, 0, 1))
 		return -1;
 
-	if (!o.head)
+	if (vhd->head_status.count >= SAIW_HEAD_STATUS_CACHE_MAX) {
+		hs = lws_container_of(vhd->head_status.tail,
+				      saiw_head_status_t, list);
+		lws_dll2_remove(&hs->list);
+		free(hs);
+	}
+
+	hs = malloc(sizeof(*hs));
+	if (!hs) {
+		lwsac_free(&ac);
 		return -1;
+	}
+	memset(hs, 0, sizeof(*hs));
+
+	lws_strncpy(hs->repo_name, projname, sizeof(hs->repo_name));
+	lws_strncpy(hs->ref, ref, sizeof(hs->ref));
+	hs->state = -1; /* remember there are no events, too */
 
-	e = lws_container_of(o.head, sai_event_t, list);
-	state = (int)e->state;
+	if (o.head) {
+		e = lws_container_of(o.head, sai_event_t, list);
+		hs->state = (int)e->state;
+		hs->created = e->created;
+	}
 
+	lws_dll2_add_head(&hs->list, &vhd->head_status);
 	lwsac_free(&ac);
 
-	return state;
+	return hs->state;
 }
 
 
@@ -157,6 +249,40 @@ saiw_event_db_close_all_now(struct vhd *vhd)
 	return 0;
 }
 
+/*
+ * sai-server writes the dbs, we only ever read them.  But if we come up
+ * before it ever did, make sure the schema is there, then reopen read-only
+ * for the life of the process.
+ */
+
+static int
+saiw_db_open(struct vhd *vhd, const char *filepath,
+	     const lws_struct_map_t *schema, char wal, sqlite3 **ppdb)
+{
+	if (lws_struct_sq3_open(vhd->context, filepath, 1, ppdb)) {
+		lwsl_err("%s: Unable to open db %s: %s\n", __func__,
+			 filepath, sqlite3_errmsg(*ppdb));
+
+		return 1;
+	}
+
+	if (wal)
+		sai_sqlite3_statement(*ppdb, "PRAGMA journal_mode=WAL;",
+				      "set WAL");
+
+	if (lws_struct_sq3_create_table(*ppdb, schema)) {
+		lwsl_err("%s: unable to create table in %s\n", __func__,
+			 filepath);
+		lws_struct_sq3_close(ppdb);
+
+		return 1;
+	}
+
+	lws_struct_sq3_close(ppdb);
+
+	return sai_sqlite3_open_ro(filepath, ppdb);
+}
+
 static int
 w_callback_ws(struct lws *wsi, enum lws_callback_reasons reason, void *user,
 	    void *in, size_t len)
@@ -168,8 +294,8 @@ w_callback_ws(struct lws *wsi, enum lws_callback_reasons reason, void *user,
 	struct pss *pss = (struct pss *)user;
 	struct lws_jwt_sign_set_cookie ck;
 	sai_http_murl_t mu = SHMUT_NONE;
-	char projname[64];
-	int n, resp, r;
+	char projname[64], enc[16], ae[128], ref[80];
+	int n, m, resp, r;
 	const char *cp;
 	size_t cml;
 
@@ -189,6 +315,16 @@ w_callback_ws(struct lws *wsi, enum lws_callback_reasons reason, void *user,
 		vhd->context = lws_get_context(wsi);
 		vhd->vhost = lws_get_vhost(wsi);
 
+		/*
+		 * Overview versions restart with us, so browsers holding a
+		 * version from another run (or worker) must not resume on it
+		 */
+		while (!vhd->ov_epoch)
+			if (lws_get_random(vhd->context, &vhd->ov_epoch,
+					   sizeof(vhd->ov_epoch)) !=
+						sizeof(vhd->ov_epoch))
+				vhd->ov_epoch = (uint32_t)lws_now_usecs();
+
 		if (lws_pvo_get_str(in, "database", &vhd->sqlite3_path_lhs)) {
 			lwsl_err("%s: database pvo required\n", __func__);
 			return -1;
@@ -197,42 +333,38 @@ w_callback_ws(struct lws *wsi, enum lws_callback_reasons reason, void *user,
 		lws_snprintf((char *)buf, sizeof(buf), "%s-events.sqlite3",
 				vhd->sqlite3_path_lhs);
 
-		if (lws_struct_sq3_open(vhd->context, (char *)buf, 1, &vhd->pdb)) {
-			lwsl_err("%s: Unable to open session db %s: %s\n",
-				 __func__, vhd->sqlite3_path_lhs, sqlite3_errmsg(
-						 vhd->pdb));
-
+		if (saiw_db_open(vhd, (const char *)buf,
+				 lsm_schema_sq3_map_event, 1, &vhd->pdb))
 			return -1;
-		}
 
-		sai_sqlite3_statement(vhd->pdb,
-				      "PRAGMA journal_mode=WAL;", "set WAL");
+		/* we serve artifacts from the same store sai-server writes */
 
-		if (lws_struct_sq3_create_table(vhd->pdb,
-						lsm_schema_sq3_map_event)) {
-			lwsl_err("%s: unable to create event table\n", __func__);
-			return -1;
-		}
+		if (!lws_pvo_get_str(in, "artifact-store", &cp))
+			lws_strncpy(vhd->artifact_store, cp,
+				    sizeof(vhd->artifact_store));
+		else
+			lws_snprintf(vhd->artifact_store,
+				     sizeof(vhd->artifact_store),
+				     "%s-artifacts", vhd->sqlite3_path_lhs);
 
 		/* auth database */
 
 		lws_snprintf((char *)buf, sizeof(buf), "%s-auth.sqlite3",
 				vhd->sqlite3_path_lhs);
 
-		if (lws_struct_sq3_open(vhd->context, (char *)buf, 1,
-					&vhd->pdb_auth)) {
-			lwsl_err("%s: Unable to open auth db %s: %s\n",
-				 __func__, vhd->sqlite3_path_lhs, sqlite3_errmsg(
-						 vhd->pdb_auth));
-
+		if (saiw_db_open(vhd, (const char *)buf,
+				 lsm_schema_sq3_map_auth, 0, &vhd->pdb_auth))
 			return -1;
-		}
 
-		if (lws_struct_sq3_create_table(vhd->pdb_auth,
-						lsm_schema_sq3_map_auth)) {
-			lwsl_err("%s: unable to create auth table\n", __func__);
-			return -1;
-		}
+		/* step metrics, we can live without them */
+
+		lws_snprintf((char *)buf, sizeof(buf), "%s-build-metrics.sqlite3",
+				vhd->sqlite3_path_lhs);
+
+		if (saiw_db_open(vhd, (const char *)buf,
+				 lsm_schema_sq3_map_build_metric, 0,
+				 &vhd->pdb_metrics))
+			lwsl_warn("%s: no build metrics db\n", __func__);
 
 		/*
 		 * jwt-iss
@@ -318,8 +450,14 @@ w_callback_ws(struct lws *wsi, enum lws_callback_reasons reason, void *user,
 
 	case LWS_CALLBACK_PROTOCOL_DESTROY:
 		saiw_event_db_close_all_now(vhd);
+		saiw_overview_cache_destroy(vhd);
+		saiw_overview_history_destroy(vhd);
+		saiw_head_status_cache_destroy(vhd);
+		free(vhd->pcons);
+		vhd->pcons = NULL;
 		lws_struct_sq3_close(&vhd->pdb);
 		lws_struct_sq3_close(&vhd->pdb_auth);
+		lws_struct_sq3_close(&vhd->pdb_metrics);
 		lws_jwk_destroy(&vhd->jwt_jwk_auth);
 		goto passthru;
 
@@ -389,7 +527,8 @@ w_callback_ws(struct lws *wsi, enum lws_callback_reasons reason, void *user,
 
 		case SHMUT_STATUS:
 			/*
-			 * in is a string like /libwebsockets/status.svg
+			 * in is a string like /libwebsockets/status.svg, there
+			 * may be a ?h=branch arg to get the status for that
 			 */
 			cp = ((const char *)in) + 7;
 			while (*cp == '/')
@@ -399,20 +538,52 @@ w_callback_ws(struct lws *wsi, enum lws_callback_reasons reason, void *user,
 				projname[n++] = *cp++;
 			projname[n] = '\0';
 
+			ref[0] = '\0';
+			if (lws_get_urlarg_by_name_safe(wsi, "h=", ae,
+							sizeof(ae) - 1) > 0)
+				lws_snprintf(ref, sizeof(ref), "refs/heads/%s", ae);
+
 			// lwsl_notice("%s: status %s\n", __func__, projname);
 
-			r = sai_get_head_status(vhd, projname);
+			r = sai_get_head_status(vhd, projname, ref);
 			if (r < 2)
 				r = 2;
-			n = lws_snprintf(projname, sizeof(projname),
-				     "../decal-%d.svg", r);
 
-			if (lws_http_redirect(wsi, 307,
-					      (unsigned char *)projname, n,
-					      &p, end) < 0)
-				return -1;
+			/*
+			 * Let caches between us and the badge consumers keep
+			 * it a little while, and revalidate cheaply after
+			 */
 
-			goto passthru;
+			n = lws_snprintf(ae, sizeof(ae), "\"sai-decal-%d\"", r);
+			if (lws_hdr_copy(wsi, ref, sizeof(ref),
+					 WSI_TOKEN_HTTP_IF_NONE_MATCH) > 0 &&
+			    strstr(ref, ae)) {
+				if (lws_add_http_header_status(wsi,
+						HTTP_STATUS_NOT_MODIFIED, &p, end))
+					goto bail;
+			} else {
+				if (lws_add_http_header_status(wsi, 307, &p, end))
+					goto bail;
+				m = lws_snprintf(projname, sizeof(projname),
+						 "../decal-%d.svg", r);
+				if (lws_add_http_header_by_token(wsi,
+						WSI_TOKEN_HTTP_LOCATION,
+						(uint8_t *)projname, m, &p, end))
+					goto bail;
+			}
+
+			if (lws_add_http_header_by_token(wsi, WSI_TOKEN_HTTP_ETAG,
+						(uint8_t *)ae, n, &p, end) ||
+			    lws_add_http_header_by_token(wsi,
+						WSI_TOKEN_HTTP_CACHE_CONTROL,
+						(uint8_t *)SAIW_STATUS_CACHE_CONTROL,
+						(int)strlen(SAIW_STATUS_CACHE_CONTROL),
+						&p, end) ||
+			    lws_add_http_header_content_length(wsi, 0, &p, end) ||
+			    lws_finalize_write_http_header(wsi, start, &p, end))
+				goto bail;
+
+			goto try_to_reuse;
 
 		case SHMUT_LOGIN:
 			pss->login_form = 1;
@@ -427,15 +598,59 @@ w_callback_ws(struct lws *wsi, enum lws_callback_reasons reason, void *user,
 			 */
 			lwsl_notice("%s: SHMUT_ARTIFACTS\n", __func__);
 			pss->artifact_offset = 0;
-			if (saiw_get_blob(vhd, (const char *)in + 11,
-					  &pss->pdb_artifact,
-					  &pss->blob_artifact,
-					  &pss->artifact_length)) {
-				lwsl_notice("%s: get_blob failed\n", __func__);
+			if (saiw_get_artifact(vhd, (const char *)in + 11,
+					      (char *)buf, sizeof(buf),
+					      enc, sizeof(enc),
+					      &pss->pdb_artifact,
+					      &pss->blob_artifact,
+					      &pss->artifact_length)) {
+				lwsl_notice("%s: get_artifact failed\n", __func__);
 				resp = 404;
 				goto http_resp;
 			}
 
+			if (!pss->blob_artifact && enc[0] &&
+			    (lws_hdr_copy(wsi, ae, sizeof(ae),
+					  WSI_TOKEN_HTTP_ACCEPT_ENCODING) <= 0 ||
+			     !strstr(ae, enc))) {
+				/*
+				 * It's stored encoded, but the client didn't
+				 * say it can take that... decode it for him
+				 */
+
+				if (saiw_artifact_inflate_open(pss,
+							(const char *)buf)) {
+					resp = 500;
+					goto http_resp;
+				}
+
+				goto send_headers;
+			}
+
+			if (!pss->blob_artifact) {
+				/*
+				 * It's in the artifact store, let lws serve
+				 * the file directly, it takes care of the
+				 * content-length and any range request
+				 */
+
+				n = 0;
+				if (enc[0])
+					n = lws_snprintf(ae, sizeof(ae),
+						"content-encoding: %s\x0d\x0a", enc);
+
+				n = lws_serve_http_file(wsi, (const char *)buf,
+						"application/octet-stream",
+						n ? ae : NULL, n);
+				if (n < 0 || (n > 0 &&
+					      lws_http_transaction_completed(wsi)))
+					return -1;
+
+				return 0;
+			}
+
+send_headers:
+
 			/*
 			 * Well, it seems what he wanted exists..
 			 */
@@ -476,20 +691,38 @@ http_resp:
 		goto try_to_reuse;
 
 
+	case LWS_CALLBACK_CLOSED_HTTP:
+		if (pss)
+			saiw_artifact_inflate_close(pss);
+		if (pss && pss->blob_artifact) {
+			sqlite3_blob_close(pss->blob_artifact);
+			pss->blob_artifact = NULL;
+			sai_event_db_close(&vhd->sqlite3_cache,
+					   &pss->pdb_artifact);
+		}
+		goto passthru;
+
 	case LWS_CALLBACK_HTTP_WRITEABLE:
 
-		if (!pss || !pss->blob_artifact)
+		if (!pss || (!pss->blob_artifact && !pss->artifact_zs))
 			break;
 
 		n = lws_ptr_diff(end, start);
 		if ((int)(pss->artifact_length - pss->artifact_offset) < n)
 			n = (int)(pss->artifact_length - pss->artifact_offset);
 
-		if (sqlite3_blob_read(pss->blob_artifact, start, n,
-				      (int)pss->artifact_offset)) {
-			lwsl_err("%s: blob read failed\n", __func__);
-			return -1;
-		}
+		if (pss->artifact_zs) {
+			if (saiw_artifact_inflate_read(pss, start,
+						       (size_t)n) != n) {
+				lwsl_err("%s: artifact decode failed\n", __func__);
+				return -1;
+			}
+		} else
+			if (sqlite3_blob_read(pss->blob_artifact, start, n,
+					      (int)pss->artifact_offset)) {
+				lwsl_err("%s: blob read failed\n", __func__);
+				return -1;
+			}
 
 		pss->artifact_offset = pss->artifact_offset + (unsigned int)n;
 
@@ -887,7 +1120,7 @@ clean_spa:
 	case LWS_CALLBACK_CLOSED:
 
 		lwsl_wsi_err(wsi, "CLOSED browse conn");
-		lws_buflist_destroy_all_segments(&pss->raw_tx);
+		saiw_browser_tx_destroy(pss);
 		saiw_browser_state_changed(pss, 0);
 		lws_dll2_remove(&pss->subs_list);
 		lws_sul_cancel(&pss->sul_logcache);
@@ -914,34 +1147,18 @@ clean_spa:
 		break;
 
 	case LWS_CALLBACK_SERVER_WRITEABLE:
-		if (!vhd || !pss->raw_tx)
+		if (!vhd || !pss->tx_owner.head)
 			break;
 
-		{
-			int *pi = (int *)lws_buflist_get_frag_start_or_NULL(&pss->raw_tx), depi = *pi;
-			char som, eom, rb[1200];
-			int used, final = 1;
-			size_t fsl = lws_buflist_next_segment_len(&pss->raw_tx, NULL);
-
-			/* this is the only buflist user on pss->raw_tx */
-			used = lws_buflist_fragment_use(&pss->raw_tx, (uint8_t *)rb, sizeof(rb), &som, &eom);
-			if (!used)
-				return 0;
-			if (used < (int)fsl || (depi & LWS_WRITE_NO_FIN))
-				final = 0;
-
-			if (lws_write(pss->wsi, (uint8_t *)rb + ((size_t)som * sizeof(int)),
-						(size_t)used  - ((size_t)som * sizeof(int)),
-						(lws_ws_sending_multifragment(pss->wsi) ? LWS_WRITE_CONTINUATION : LWS_WRITE_TEXT) |
-							(!final * LWS_WRITE_NO_FIN)) < 0) {
-				lwsl_wsi_err(pss->wsi, "attempt to write %d failed", (int)used - (int)sizeof(int));
-
-				return -1;
-			}
-		}
+		if (saiw_browser_tx_drain(pss))
+			return -1;
 
-		if (pss->raw_tx)
+		if (pss->tx_owner.head)
 			lws_callback_on_writable(pss->wsi);
+		else
+			if (pss->ov_behind)
+				/* drained now, bring him up to date */
+				saiw_browser_ov_catchup(vhd, pss);
 		break;
 
 	default:
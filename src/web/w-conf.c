@@ -22,9 +22,30 @@
 #include <string.h>
 #include <signal.h>
 #include <time.h>
+#include <fcntl.h>
+#if !defined(WIN32)
+#include <unistd.h>
+#endif
 
 #define SAI_CONFIG_STRING_SIZE (16 * 1024)
 
+#if !defined(LWS_WITHOUT_EXTENSIONS)
+/*
+ * Browsers offer permessage-deflate by themselves, the mostly-JSON traffic
+ * compresses very well for dashboards on slow links
+ */
+static const struct lws_extension extensions[] = {
+	{
+		"permessage-deflate",
+		lws_extension_callback_pm_deflate,
+		"permessage-deflate"
+		 "; client_no_context_takeover"
+		 "; client_max_window_bits"
+	},
+	{ NULL, NULL, NULL /* terminator */ }
+};
+#endif
+
 struct lws_context *
 sai_lws_context_from_json(const char *config_dir,
 			  struct lws_context_creation_info *info,
@@ -50,6 +71,10 @@ sai_lws_context_from_json(const char *config_dir,
 		       LWS_SERVER_OPTION_EXPLICIT_VHOSTS |
 		       LWS_SERVER_OPTION_HTTP_HEADERS_SECURITY_BEST_PRACTICES_ENFORCE |
 		       LWS_SERVER_OPTION_VALIDATE_UTF8;
+#if defined(LWS_SERVER_OPTION_ALLOW_LISTEN_SHARE)
+	/* sai-web workers all listen on the same port, kernel spreads them */
+	info->options |= LWS_SERVER_OPTION_ALLOW_LISTEN_SHARE;
+#endif
 	info->pss_policies_json = pol;
 
 	lwsl_notice("Using config dir: \"%s\"\n", config_dir);
@@ -67,6 +92,9 @@ sai_lws_context_from_json(const char *config_dir,
 	}
 
 	info->pprotocols = pprotocols;
+#if !defined(LWS_WITHOUT_EXTENSIONS)
+	info->extensions = extensions;
+#endif
 
 	if (lwsws_get_config_vhosts(context, info, config_dir, &cs, &cs_len)) {
 		lwsl_err("%s: sai_lws_context_from_json failed\n", __func__);
@@ -82,3 +110,98 @@ init_failed:
 
 	return NULL;
 }
+
+#if !defined(WIN32)
+/*
+ * lws unlinks and rebinds a unix socket listener's path when it creates the
+ * vhost, so -w workers can't share one: each would steal it from the last.
+ * We look through the vhost configs for any unix socket vhosts before
+ * deciding how many workers we can run.
+ */
+
+static int
+saiw_conf_file_has_uds(const char *path)
+{
+	char *buf, *p, *q;
+	int found = 0, fd;
+	ssize_t n;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return 0;
+
+	buf = malloc(SAI_CONFIG_STRING_SIZE * 4);
+	if (!buf) {
+		close(fd);
+		return 0;
+	}
+
+	n = read(fd, buf, (SAI_CONFIG_STRING_SIZE * 4) - 1);
+	close(fd);
+	if (n <= 0) {
+		free(buf);
+		return 0;
+	}
+	buf[n] = '\0';
+
+	for (p = buf; p && *p; p = q) {
+		q = strchr(p, '\n');
+		if (q)
+			*q++ = '\0';
+
+		while (*p == ' ' || *p == '\t')
+			p++;
+		if (*p == '#')
+			continue;
+
+		p = strstr(p, "\"unix-socket\"");
+		if (!p)
+			continue;
+		p += 13;
+		while (*p == ' ' || *p == '\t' || *p == ':' || *p == '\"')
+			p++;
+		if ((*p >= '1' && *p <= '9') || *p == 't' || *p == 'o') {
+			lwsl_notice("%s: %s has a unix socket vhost\n",
+				    __func__, path);
+			found = 1;
+		}
+	}
+
+	free(buf);
+
+	return found;
+}
+
+static int
+saiw_conf_uds_cb(const char *dirpath, void *user, struct lws_dir_entry *lde)
+{
+	int *found = (int *)user;
+	char path[256];
+
+	if (lde->type != LDOT_FILE)
+		return 0;
+
+	lws_snprintf(path, sizeof(path), "%s/%s", dirpath, lde->name);
+	*found |= saiw_conf_file_has_uds(path);
+
+	return *found;
+}
+
+int
+saiw_conf_has_uds(const char *config_dir)
+{
+	char path[256];
+	int found;
+
+	/* vhosts may be in conf itself, or in the files in conf.d */
+
+	lws_snprintf(path, sizeof(path), "%s/conf", config_dir);
+	found = saiw_conf_file_has_uds(path);
+
+	lws_snprintf(path, sizeof(path), "%s/conf.d", config_dir);
+	if (!found)
+		lws_dir(path, &found, saiw_conf_uds_cb);
+
+	return found;
+}
+#endif
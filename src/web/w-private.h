@@ -23,10 +23,48 @@
 #include <sqlite3.h>
 #include <sys/stat.h>
 
-#define SAIW_API_VERSION 3
+#define SAIW_API_VERSION 4
+
+/* how many serialized per-event overview fragments we keep around */
+#define SAIW_OVERVIEW_CACHE_MAX		64
+/* sanity limit on tasks we will list for one event in the overview */
+#define SAIW_OVERVIEW_TASKS_MAX		4096
+/* events per overview page unless the browser asks otherwise, and max */
+#define SAIW_OVERVIEW_PAGE_DEFAULT	8
+#define SAIW_OVERVIEW_PAGE_MAX		50
+/* projects (and refs) we keep the status badge state in memory for */
+#define SAIW_HEAD_STATUS_CACHE_MAX	256
+#define SAIW_STATUS_CACHE_CONTROL	"public, max-age=60"
+/* overview changes we remember for browsers that fell behind */
+#define SAIW_OV_HISTORY_MAX		4096
+#define SAIW_OV_HISTORY_MAX_BYTES	(1024 * 1024)
+/* browsers with more than this queued wait to drain before more patches */
+#define SAIW_OV_BACKLOG_MAX		(64 * 1024)
+/* binary ws messages to browsers start with a type byte */
+#define SAIW_BIN_TYPE_LOG		1
+#define SAIW_BIN_LOG_HDR		16
 
 struct sai_plat;
 
+/*
+ * A message queued for one or more browsers.  It's immutable once created and
+ * the payload is only held once however many browsers it is going to... each
+ * browser's tx queue takes a reference, the last one to send it frees it.
+ */
+
+typedef struct saiw_txmsg {
+	unsigned int		refcount;
+	size_t			len;
+	int			flags; /* lws_write() flags */
+	/* payload follows */
+} saiw_txmsg_t;
+
+typedef struct saiw_txq {
+	lws_dll2_t		list; /* pss->tx_owner */
+	saiw_txmsg_t		*msg;
+	size_t			pos; /* how much of msg we sent so far */
+} saiw_txq_t;
+
 typedef struct sai_platm {
 	struct lws_dll2_owner builder_owner;
 	struct lws_dll2_owner subs_owner;
@@ -65,7 +103,8 @@ struct pss {
 
 	struct lws_spa		*spa;
 	struct lejp_ctx		ctx;
-	struct lws_buflist	*raw_tx;
+	lws_dll2_owner_t	tx_owner; /* saiw_txq_t */
+	size_t			tx_pending; /* unsent bytes in tx_owner */
 	struct lws_dll2		same; /* owner: vhd.browsers */
 
 	struct lws_dll2		subs_list;
@@ -79,6 +118,9 @@ struct pss {
 
 	sqlite3			*pdb_artifact;
 	sqlite3_blob		*blob_artifact;
+	void			*artifact_zs; /* z_stream, decoding for client */
+	uint8_t			*artifact_zin;
+	int			artifact_fd;
 
 	lws_dll2_owner_t	logs_owner;
 	lws_sorted_usec_list_t	sul_logcache;
@@ -113,6 +155,9 @@ struct pss {
 	uint64_t		initial_log_timestamp;
 	uint64_t		artifact_offset;
 	uint64_t		artifact_length;
+	uint64_t		ov_version; /* overview changes we dealt with */
+	uint64_t		ov_client_version; /* ...and the client has */
+	unsigned int		ov_limit; /* events per overview page */
 
 	unsigned int		spa_failed:1;
 	unsigned int		dry:1;
@@ -122,8 +167,54 @@ struct pss {
 	unsigned int		announced:1;
 	unsigned int		bulk_binary_data:1;
 	unsigned int		toggle_favour_sch:1;
+	unsigned int		ov_synced:1;
+	unsigned int		ov_behind:1;
+	unsigned int		bin_logs:1; /* send him logs as binary */
 };
 
+/*
+ * The serialized {"e":{...},"t":[...]} part of the overview for one event,
+ * so page loads don't have to go to the event db for every event every time.
+ * It's dropped when we hear a taskchange or eventchange for the event.
+ */
+
+typedef struct saiw_ov_frag {
+	lws_dll2_t		list; /* vhd->overview_cache, MRU at head */
+	char			event_uuid[65];
+	uint64_t		last_updated; /* of the event row it came from */
+	time_t			expires; /* a task rebuildable flag lapses */
+	size_t			len;
+	size_t			alloc;
+	int			state;
+	/* int for queue flags, then len bytes of JSON follow */
+} saiw_ov_frag_t;
+
+/*
+ * One change to the overview, eg, a task changed state, kept so browsers
+ * that didn't get it yet can be sent it later
+ */
+
+typedef struct saiw_ov_patch {
+	lws_dll2_t		list; /* vhd->ov_history, oldest at head */
+	uint64_t		version;
+	char			repo_name[65];
+	size_t			len; /* 0 = a change we couldn't describe */
+	int			sec;
+	/* len bytes of JSON patch object follow */
+} saiw_ov_patch_t;
+
+/*
+ * The latest state for a project, or a ref in it, for the status badge
+ */
+
+typedef struct saiw_head_status {
+	lws_dll2_t		list; /* vhd->head_status, MRU at head */
+	char			repo_name[65];
+	char			ref[80]; /* "" means any ref */
+	uint64_t		created; /* of the event the state came from */
+	int			state; /* -1 if no events */
+} saiw_head_status_t;
+
 struct vhd {
 	struct lws_context		*context;
 	struct lws_vhost		*vhost;
@@ -134,6 +225,15 @@ struct vhd {
 	struct lws_dll2_owner		builders_owner;
 	struct lwsac			*builders;
 
+	/*
+	 * sai-server only sends PCON topology when it changes, we keep the
+	 * last one (after LWS_PRE) to give to browsers that join later
+	 */
+	uint8_t				*pcons;
+	size_t				pcons_len;
+	size_t				pcons_alloc;
+	char				pcons_valid;
+
 	/* our keys */
 	struct lws_jwk			jwt_jwk_auth;
 	char				jwt_auth_alg[16];
@@ -144,13 +244,22 @@ struct vhd {
 	lws_dll2_owner_t		subs_owner;
 	sqlite3				*pdb;
 	sqlite3				*pdb_auth;
+	sqlite3				*pdb_metrics; /* may be NULL */
 
 	struct lws_ss_handle		*h_ss_websrv; /* client */
 
 	const char			*sqlite3_path_lhs;
+	char				artifact_store[256];
 
 	lws_dll2_owner_t		sqlite3_cache; /* sais_sqlite_cache_t */
 	lws_dll2_owner_t		tasklog_cache;
+	lws_dll2_owner_t		overview_cache; /* saiw_ov_frag_t */
+	lws_dll2_owner_t		ov_history; /* saiw_ov_patch_t */
+	size_t				ov_history_bytes;
+	uint64_t			ov_version;
+	uint32_t			ov_epoch; /* versions only mean anything
+						   * to the same ov_epoch */
+	lws_dll2_owner_t		head_status; /* saiw_head_status_t */
 };
 
 typedef struct saiw_websrv {
@@ -168,6 +277,10 @@ sai_lws_context_from_json(const char *config_dir,
 			  struct lws_context_creation_info *info,
 			  const struct lws_protocols **pprotocols,
 			  const char *pol);
+#if !defined(WIN32)
+int
+saiw_conf_has_uds(const char *config_dir);
+#endif
 extern const struct lws_protocols protocol_ws;
 extern const lws_ss_info_t ssi_saiw_websrv;
 
@@ -214,8 +327,18 @@ int
 saiw_task_cancel(struct vhd *vhd, const char *task_uuid);
 
 int
-saiw_get_blob(struct vhd *vhd, const char *url, sqlite3 **pdb,
-	      sqlite3_blob **blob, uint64_t *length);
+saiw_get_artifact(struct vhd *vhd, const char *url, char *path, size_t path_len,
+		  char *encoding, size_t encoding_len, sqlite3 **pdb,
+		  sqlite3_blob **blob, uint64_t *length);
+
+int
+saiw_artifact_inflate_open(struct pss *pss, const char *path);
+
+int
+saiw_artifact_inflate_read(struct pss *pss, uint8_t *buf, size_t len);
+
+void
+saiw_artifact_inflate_close(struct pss *pss);
 
 int
 saiw_browsers_task_state_change(struct vhd *vhd, const char *task_uuid);
@@ -225,6 +348,12 @@ void
 saiw_ws_broadcast_browsers_REQUIRES_LWS_PRE(struct vhd *vhd, const void *buf, size_t len,
 		      enum lws_write_protocol flags);
 
+int
+saiw_browser_tx_drain(struct pss *pss);
+
+void
+saiw_browser_tx_destroy(struct pss *pss);
+
 void
 saiw_browser_state_changed(struct pss *pss, int established);
 
@@ -237,7 +366,48 @@ saiw_broadcast_logs_batch(struct vhd *vhd, struct pss *pss);
 int
 saiw_browser_queue_overview(struct vhd *vhd, struct pss *pss);
 
+int
+saiw_browser_queue_overview_page(struct vhd *vhd, struct pss *pss,
+				 uint64_t before, const char *before_uuid,
+				 int limit);
+
+void
+saiw_overview_cache_invalidate(struct vhd *vhd, const char *event_uuid);
+
+void
+saiw_overview_cache_destroy(struct vhd *vhd);
+
+void
+saiw_overview_patch_task(struct vhd *vhd, const char *task_uuid);
+
+void
+saiw_overview_patch_event(struct vhd *vhd, const sai_event_t *e);
+
+sai_event_t *
+saiw_event_lookup(struct vhd *vhd, const char *event_uuid, struct lwsac **ac);
+
+void
+saiw_overview_history_destroy(struct vhd *vhd);
+
+int
+saiw_browser_ov_catchup(struct vhd *vhd, struct pss *pss);
+
+int
+saiw_browser_ov_resume(struct vhd *vhd, struct pss *pss, uint64_t from);
+
+int
+sai_get_head_status(struct vhd *vhd, const char *projname, const char *ref);
+
+void
+saiw_head_status_update(struct vhd *vhd, const sai_event_t *e);
+
+void
+saiw_head_status_cache_destroy(struct vhd *vhd);
+
 int
 saiw_browser_broadcast_queue_builders(struct vhd *vhd, struct pss *pss);
 
+int
+saiw_browser_queue_pcons(struct vhd *vhd, struct pss *pss);
+
 
@@ -23,9 +23,20 @@
 #include <string.h>
 #include <signal.h>
 #include <time.h>
+#if !defined(WIN32)
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <errno.h>
+#endif
 
 #include "w-private.h"
 
+/* sanity limit on -w */
+#define SAIW_WORKERS_MAX	64
+/* a worker that dies sooner than this after starting is respawned slowly */
+#define SAIW_WORKER_RESPAWN_SECS	5
+
 static int interrupted;
 struct lws_context *context;
 
@@ -64,13 +75,106 @@ static void sigint_handler(int sig)
 	interrupted = 1;
 }
 
+#if !defined(WIN32)
+/*
+ * With -w <n>, the original process doesn't serve anything itself, it forks
+ * n sai-web workers and looks after them: it respawns any that die, and when
+ * it's told to stop, it passes that on to them and waits for them to finish.
+ *
+ * Returns 1 in a new worker, which should go on to serve, or 0 in the
+ * supervisor once everything has stopped.
+ */
+
+static int
+saiw_supervise(int want)
+{
+	time_t started[SAIW_WORKERS_MAX];
+	pid_t workers[SAIW_WORKERS_MAX];
+	struct sigaction sa;
+	int n, status;
+	pid_t pid;
+
+	memset(workers, 0, sizeof(workers));
+	memset(started, 0, sizeof(started));
+
+	/* no SA_RESTART, we want waitpid() to notice */
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = sigint_handler;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	while (!interrupted) {
+		for (n = 0; n < want && !interrupted; n++) {
+			if (workers[n] > 0)
+				continue;
+
+			if (started[n] && time(NULL) - started[n] <
+						SAIW_WORKER_RESPAWN_SECS)
+				/* don't spin on a worker that can't start */
+				sleep(1);
+			if (interrupted)
+				break;
+
+			started[n] = time(NULL);
+			pid = fork();
+			if (!pid)
+				return 1;
+			if (pid < 0) {
+				lwsl_err("%s: fork failed\n", __func__);
+				continue;
+			}
+
+			lwsl_notice("%s: worker %d is pid %d\n", __func__, n,
+				    (int)pid);
+			workers[n] = pid;
+		}
+
+		pid = waitpid(-1, &status, 0);
+		if (pid <= 0) {
+			if (errno != EINTR)
+				sleep(1);
+			continue;
+		}
+
+		for (n = 0; n < want; n++)
+			if (workers[n] == pid) {
+				lwsl_warn("%s: worker %d (pid %d) exited, "
+					  "status 0x%x\n", __func__, n,
+					  (int)pid, status);
+				workers[n] = 0;
+			}
+	}
+
+	lwsl_notice("%s: stopping workers\n", __func__);
+
+	for (n = 0; n < want; n++)
+		if (workers[n] > 0)
+			kill(workers[n], SIGTERM);
+
+	for (n = 0; n < want; n++)
+		if (workers[n] > 0)
+			while (waitpid(workers[n], NULL, 0) < 0 &&
+			       errno == EINTR)
+				;
+
+	return 0;
+}
+#endif
+
 int main(int argc, const char **argv)
 {
 	int logs = LLL_USER | LLL_ERR | LLL_WARN | LLL_NOTICE;
 	const char *p, *conf = "/etc/sai/web";
 	struct lws_context_creation_info info;
+#if !defined(WIN32)
+	int want = 1;
+#endif
 
 	signal(SIGINT, sigint_handler);
+#if !defined(WIN32)
+	signal(SIGTERM, sigint_handler);
+#endif
 
 	if ((p = lws_cmdline_option(argc, argv, "-d")))
 		logs = atoi(p);
@@ -81,6 +185,36 @@ int main(int argc, const char **argv)
 	if ((p = lws_cmdline_option(argc, argv, "-c")))
 		conf = p;
 
+#if !defined(WIN32)
+	/*
+	 * -w <n> runs n sai-web worker processes.  They each have their own
+	 * link to sai-server and read-only db connections, and share the
+	 * listen socket with SO_REUSEPORT so the kernel spreads browsers
+	 * across them.
+	 *
+	 * Unix socket listeners can't be shared like that, lws unlinks and
+	 * rebinds the path for each one, so we refuse -w with those.
+	 */
+	if ((p = lws_cmdline_option(argc, argv, "-w")))
+		want = atoi(p);
+	if (want > SAIW_WORKERS_MAX)
+		want = SAIW_WORKERS_MAX;
+
+	if (want > 1) {
+		if (saiw_conf_has_uds(conf)) {
+			lwsl_err("%s: -w can't be used with unix socket "
+				 "vhosts, they can't share the listener\n",
+				 __func__);
+			return 1;
+		}
+
+		if (!saiw_supervise(want))
+			return 0;
+
+		/* we're a worker, we carry on below */
+	}
+#endif
+
 	context = sai_lws_context_from_json(conf, &info, pprotocols,
 					    default_ss_policy);
 	if (!context) {
@@ -27,6 +27,7 @@
  */
 
 #include <libwebsockets.h>
+#include <stdlib.h>
 #include <string.h>
 #include <signal.h>
 #include <assert.h>
@@ -56,6 +57,13 @@ static lws_struct_map_t lsm_browser_taskinfo[] = {
 	LSM_UNSIGNED	(sai_browse_rx_taskinfo_t, logs,		"logs"),
 	LSM_UNSIGNED    (sai_browse_rx_taskinfo_t, js_api_version,	"js_api_version"),
 	LSM_UNSIGNED    (sai_browse_rx_taskinfo_t, last_log_ts,		"last_log_ts"),
+	LSM_UNSIGNED    (sai_browse_rx_taskinfo_t, before,		"before"),
+	LSM_CARRAY	(sai_browse_rx_taskinfo_t, before_uuid,		"before_uuid"),
+	LSM_UNSIGNED    (sai_browse_rx_taskinfo_t, limit,		"limit"),
+	LSM_UNSIGNED    (sai_browse_rx_taskinfo_t, ov_from,		"ov_from"),
+	LSM_UNSIGNED    (sai_browse_rx_taskinfo_t, ov_epoch,		"ov_epoch"),
+	LSM_UNSIGNED    (sai_browse_rx_taskinfo_t, ov_auth,		"ov_auth"),
+	LSM_UNSIGNED    (sai_browse_rx_taskinfo_t, bin,			"bin"),
 };
 
 /*
@@ -130,47 +138,211 @@ const lws_struct_map_t lsm_schema_json_map_taskreply[] = {
 			 "com.warmcat.sai.taskinfo"),
 };
 
+/*
+ * The overview only renders these members of each task, so only fetch and
+ * send these... this also keeps the artifact nonces out of the overview
+ */
+
+static const lws_struct_map_t lsm_task_overview[] = {
+	LSM_UNSIGNED	(sai_task_t, state,		"state"),
+	LSM_UNSIGNED	(sai_task_t, started,		"started"),
+	LSM_UNSIGNED	(sai_task_t, duration,		"duration"),
+	LSM_CARRAY	(sai_task_t, platform,		"platform"),
+	LSM_CARRAY	(sai_task_t, taskname,		"taskname"),
+	LSM_CARRAY	(sai_task_t, uuid,		"uuid"),
+	LSM_SIGNED	(sai_task_t, rebuildable,	"rebuildable"),
+};
+
+static const lws_struct_map_t lsm_schema_sq3_map_task_overview[] = {
+	LSM_SCHEMA_DLL2	(sai_task_t, list, NULL, lsm_task_overview,	"tasks"),
+};
+
+static const lws_struct_map_t lsm_schema_json_map_task_overview[] = {
+	LSM_SCHEMA_DLL2	(sai_task_t, list, NULL, lsm_task_overview,
+						      "com.warmcat.sai.tasks"),
+};
+
 enum sai_overview_state {
 	SOS_EVENT,
 	SOS_TASKS,
 };
 
+static saiw_txmsg_t *
+saiw_txmsg_create(const void *buf, size_t len, enum lws_write_protocol flags)
+{
+	saiw_txmsg_t *msg = malloc(sizeof(*msg) + len);
+
+	if (!msg)
+		return NULL;
+
+	msg->refcount	= 0;
+	msg->len	= len;
+	msg->flags	= (int)flags;
+	memcpy(&msg[1], buf, len);
+
+	return msg;
+}
+
+static int
+saiw_txmsg_queue(struct pss *pss, saiw_txmsg_t *msg)
+{
+	saiw_txq_t *q = malloc(sizeof(*q));
+
+	if (!q) {
+		lwsl_wsi_err(pss->wsi, "OOM queueing tx");
+		lws_callback_on_writable(pss->wsi); /* still ask to drain */
+
+		return 1;
+	}
+
+	memset(q, 0, sizeof(*q));
+	q->msg = msg;
+	msg->refcount++;
+	lws_dll2_add_tail(&q->list, &pss->tx_owner);
+	pss->tx_pending += msg->len;
+
+	lws_callback_on_writable(pss->wsi);
+
+	return 0;
+}
+
+static void
+saiw_txq_destroy(struct pss *pss, saiw_txq_t *q)
+{
+	pss->tx_pending -= q->msg->len - q->pos;
+	lws_dll2_remove(&q->list);
+
+	if (!--q->msg->refcount)
+		free(q->msg);
+	free(q);
+}
+
+void
+saiw_browser_tx_destroy(struct pss *pss)
+{
+	lws_start_foreach_dll_safe(struct lws_dll2 *, p, p1,
+				   pss->tx_owner.head) {
+		saiw_txq_destroy(pss,
+				 lws_container_of(p, saiw_txq_t, list));
+	} lws_end_foreach_dll_safe(p, p1);
+}
+
+/*
+ * Called when the browser connection is writeable, send the next piece of
+ * whatever is at the head of its tx queue
+ */
+
+int
+saiw_browser_tx_drain(struct pss *pss)
+{
+	uint8_t rb[LWS_PRE + 1200];
+	int final, wp;
+	saiw_txq_t *q;
+	size_t chunk;
+
+	if (!pss->tx_owner.head)
+		return 0;
+
+	q = lws_container_of(pss->tx_owner.head, saiw_txq_t, list);
+
+	chunk = q->msg->len - q->pos;
+	if (chunk > sizeof(rb) - LWS_PRE)
+		chunk = sizeof(rb) - LWS_PRE;
+
+	final = q->pos + chunk == q->msg->len &&
+		!(q->msg->flags & LWS_WRITE_NO_FIN);
+
+	/*
+	 * lws_write() scribbles on the LWS_PRE before what it sends, the msg
+	 * payload is shared with other browsers so we send from a copy
+	 */
+	memcpy(rb + LWS_PRE, (const uint8_t *)&q->msg[1] + q->pos, chunk);
+
+	if (lws_ws_sending_multifragment(pss->wsi))
+		wp = LWS_WRITE_CONTINUATION;
+	else
+		wp = (q->msg->flags & 3) == LWS_WRITE_BINARY ?
+					LWS_WRITE_BINARY : LWS_WRITE_TEXT;
+	if (!final)
+		wp |= LWS_WRITE_NO_FIN;
+
+	if (lws_write(pss->wsi, rb + LWS_PRE, chunk,
+		      (enum lws_write_protocol)wp) < 0) {
+		lwsl_wsi_err(pss->wsi, "attempt to write %d failed", (int)chunk);
+
+		return -1;
+	}
+
+	q->pos += chunk;
+	pss->tx_pending -= chunk;
+	if (q->pos == q->msg->len)
+		saiw_txq_destroy(pss, q);
+
+	return 0;
+}
+
+/*
+ * The LWS_PRE requirement is historical, the payload is copied into a
+ * refcounted msg and the headroom is no longer touched
+ */
+
 int
 saiw_ws_browser_queue_REQUIRES_LWS_PRE(struct pss *pss, const void *buf,
 				       size_t len, enum lws_write_protocol flags)
 {
-	int *pi = (int *)((const char *)buf - sizeof(int)), r = 0;
+	saiw_txmsg_t *msg = saiw_txmsg_create(buf, len, flags);
 
-	*pi = (int)flags;
+	if (!msg) {
+		lwsl_wsi_err(pss->wsi, "OOM creating tx msg");
+		lws_callback_on_writable(pss->wsi); /* still ask to drain */
 
-	if (lws_buflist_append_segment(&pss->raw_tx, buf - sizeof(int), len + sizeof(int)) < 0) {
-		lwsl_wsi_err(pss->wsi, "unable to buflist_append"); /* still ask to drain */
-		r = 1;
+		return 1;
 	}
 
-	lws_callback_on_writable(pss->wsi);
+	if (saiw_txmsg_queue(pss, msg)) {
+		free(msg);
 
-	return r;
+		return 1;
+	}
+
+	return 0;
 }
 
 /*
  * This allows other parts of sai-web to queue a raw buffer to be sent to
  * all connected browsers, eg, for load reports.
  *
+ * The payload is copied once into a refcounted msg that every browser's tx
+ * queue points to, rather than once per browser.
+ *
  * The flags are lws_write() flags.
  */
 void
 saiw_ws_broadcast_browsers_REQUIRES_LWS_PRE(struct vhd *vhd, const void *buf,
 					    size_t len, enum lws_write_protocol flags)
 {
+	saiw_txmsg_t *msg;
+
+	if (!vhd->browsers.count)
+		return;
+
+	msg = saiw_txmsg_create(buf, len, flags);
+	if (!msg) {
+		lwsl_err("%s: OOM\n", __func__);
+		return;
+	}
+
 	lws_start_foreach_dll(struct lws_dll2 *, p, vhd->browsers.head) {
 		struct pss *pss = lws_container_of(p, struct pss, same);
 
-		saiw_ws_browser_queue_REQUIRES_LWS_PRE(pss, buf, len, flags);
+		saiw_txmsg_queue(pss, msg);
 
 	} lws_end_foreach_dll(p);
-}
 
+	if (!msg->refcount)
+		/* nobody could take it */
+		free(msg);
+}
 
 
 int
@@ -251,16 +423,89 @@ saiw_pss_schedule_eventinfo(struct pss *pss, const char *event_uuid)
 #endif
 	saiw_browser_queue_overview(pss->vhd, pss);
 	saiw_browser_broadcast_queue_builders(pss->vhd, pss);
+	saiw_browser_queue_pcons(pss->vhd, pss);
 
 	return 0;
 
 bail:
 	saiw_browser_queue_overview(pss->vhd, pss);
 	saiw_browser_broadcast_queue_builders(pss->vhd, pss);
+	saiw_browser_queue_pcons(pss->vhd, pss);
 
 	return 1;
 }
 
+/*
+ * Send the browser the stored metrics for each step of the task, including
+ * the resource time series, the same as it would have seen them live.  If
+ * the task was rebuilt, there are several sets, we only want the latest.
+ */
+
+static void
+saiw_pss_queue_step_metrics(struct pss *pss, const char *task_uuid)
+{
+	sai_build_metric_t *latest[64];
+	uint8_t buf[LWS_PRE + 4096];
+	lws_struct_serialize_t *js;
+	struct lwsac *ac = NULL;
+	char filt[128], esc[96];
+	lws_dll2_owner_t o;
+	size_t w;
+	int n;
+
+	if (!pss->vhd->pdb_metrics)
+		return;
+
+	lws_sql_purify(esc, task_uuid, sizeof(esc));
+	lws_snprintf(filt, sizeof(filt), " and task_uuid='%s'", esc);
+
+	/*
+	 * The default order is oldest first, ask for newest first so the
+	 * first metric we see for each step is from the latest run
+	 */
+
+	lws_dll2_owner_clear(&o);
+	if (lws_struct_sq3_deserialize(pss->vhd->pdb_metrics, filt,
+				       "_lws_idx desc ",
+				       lsm_schema_sq3_map_build_metric, &o,
+				       &ac, 0, 256) < 0 || !o.head)
+		goto bail;
+
+	memset(latest, 0, sizeof(latest));
+
+	lws_start_foreach_dll(struct lws_dll2 *, p, o.head) {
+		sai_build_metric_t *m = lws_container_of(p, sai_build_metric_t,
+							 list);
+
+		if (m->step > 0 && m->step < (int)LWS_ARRAY_SIZE(latest) &&
+		    !latest[m->step])
+			latest[m->step] = m;
+	} lws_end_foreach_dll(p);
+
+	for (n = 1; n < (int)LWS_ARRAY_SIZE(latest); n++) {
+		if (!latest[n])
+			continue;
+
+		js = lws_struct_json_serialize_create(lsm_schema_map_build_metric,
+				LWS_ARRAY_SIZE(lsm_schema_map_build_metric), 0,
+				latest[n]);
+		if (!js)
+			break;
+
+		if (lws_struct_json_serialize(js, buf + LWS_PRE,
+					      sizeof(buf) - LWS_PRE, &w) ==
+							LSJS_RESULT_FINISH)
+			saiw_ws_browser_queue_REQUIRES_LWS_PRE(pss,
+				buf + LWS_PRE, w,
+				lws_write_ws_flags(LWS_WRITE_TEXT, 1, 1));
+
+		lws_struct_json_serialize_destroy(&js);
+	}
+
+bail:
+	lwsac_free(&ac);
+}
+
 /* we leave an allocation in sch->query_ac ... */
 
 static int
@@ -301,7 +546,7 @@ saiw_pss_schedule_taskinfo(struct pss *pss, const char *task_uuid, int logsub)
 	/* open the event-specific database object */
 
 	if (sai_event_db_ensure_open(pss->vhd->context, &pss->vhd->sqlite3_cache,
-			      pss->vhd->sqlite3_path_lhs, event_uuid, 0, &pdb))
+			      pss->vhd->sqlite3_path_lhs, event_uuid, SAI_DB_OPEN_RO, &pdb))
 		return 0;
 
 	/*
@@ -423,7 +668,7 @@ saiw_pss_schedule_taskinfo(struct pss *pss, const char *task_uuid, int logsub)
 		lws_dll2_owner_clear(&owner);
 		if (!sai_event_db_ensure_open(pss->vhd->context, &pss->vhd->sqlite3_cache,
 					      pss->vhd->sqlite3_path_lhs, event_uuid,
-					      0, &pdb)) {
+					      SAI_DB_OPEN_RO, &pdb)) {
 
 			lws_snprintf(filt, sizeof(filt), " and (task_uuid == '%s')",
 				     one_task->uuid);
@@ -458,6 +703,9 @@ saiw_pss_schedule_taskinfo(struct pss *pss, const char *task_uuid, int logsub)
 
 	saiw_browser_broadcast_queue_builders(pss->vhd, pss);
 
+	if (logsub && one_task)
+		saiw_pss_queue_step_metrics(pss, one_task->uuid);
+
 	if (owner.head) {
 		sai_artifact_t *aft = (sai_artifact_t *)owner.head;
 
@@ -534,10 +782,24 @@ saiw_subs_task_state_change(struct vhd *vhd, const char *task_uuid)
 int
 saiw_browsers_task_state_change(struct vhd *vhd, const char *task_uuid)
 {
+	char event_uuid[33];
+
+	sai_task_uuid_to_event_uuid(event_uuid, task_uuid);
+	saiw_overview_cache_invalidate(vhd, event_uuid);
+	saiw_overview_patch_task(vhd, task_uuid);
+
+	/*
+	 * Task pages want the full taskinfo, everyone else is looking at an
+	 * overview and just needs the patch
+	 */
+
 	lws_start_foreach_dll(struct lws_dll2 *, p, vhd->browsers.head) {
 		struct pss *pss = lws_container_of(p, struct pss, same);
 
-		saiw_pss_schedule_taskinfo(pss, task_uuid, 0);
+		if (pss->specific_task[0])
+			saiw_pss_schedule_taskinfo(pss, task_uuid, 0);
+		else
+			saiw_browser_ov_catchup(vhd, pss);
 	} lws_end_foreach_dll(p);
 
 	return 0;
@@ -547,10 +809,24 @@ saiw_browsers_task_state_change(struct vhd *vhd, const char *task_uuid)
 int
 saiw_event_state_change(struct vhd *vhd, const char *event_uuid)
 {
+	struct lwsac *ac = NULL;
+	sai_event_t *e;
+
+	e = saiw_event_lookup(vhd, event_uuid, &ac);
+
+	saiw_overview_cache_invalidate(vhd, event_uuid);
+	saiw_overview_patch_event(vhd, e);
+	if (e)
+		saiw_head_status_update(vhd, e);
+	lwsac_free(&ac);
+
 	lws_start_foreach_dll(struct lws_dll2 *, p, vhd->browsers.head) {
 		struct pss *pss = lws_container_of(p, struct pss, same);
 
-		saiw_pss_schedule_eventinfo(pss, event_uuid);
+		if (pss->specific_task[0])
+			saiw_pss_schedule_eventinfo(pss, event_uuid);
+		else
+			saiw_browser_ov_catchup(vhd, pss);
 	} lws_end_foreach_dll(p);
 
 	return 0;
@@ -614,7 +890,31 @@ saiw_ws_json_rx_browser(struct vhd *vhd, struct pss *pss, uint8_t *buf,
 			if (ti->js_api_version)
 				pss->js_api_version = ti->js_api_version;
 
+			if (ti->before) {
+				/* he is scrolling back for older events */
+				saiw_browser_queue_overview_page(pss->vhd, pss,
+						ti->before, ti->before_uuid,
+						(int)ti->limit);
+				break;
+			}
+
+			if (ti->limit)
+				pss->ov_limit = ti->limit;
+
 			saiw_browser_broadcast_queue_builders(pss->vhd, pss);
+			saiw_browser_queue_pcons(pss->vhd, pss);
+
+			/*
+			 * If he already has the overview up to some version
+			 * we can still patch from, he doesn't need it again
+			 */
+
+			if (ti->ov_epoch && ti->ov_epoch == pss->vhd->ov_epoch &&
+			    ti->ov_auth == (pss->authorized ? 1u : 0u)) {
+				saiw_browser_ov_resume(pss->vhd, pss, ti->ov_from);
+				break;
+			}
+
 			saiw_browser_queue_overview(pss->vhd, pss);
 			break;
 		}
@@ -630,6 +930,9 @@ saiw_ws_json_rx_browser(struct vhd *vhd, struct pss *pss, uint8_t *buf,
 		else
 			pss->initial_log_timestamp = 0;
 
+		/* JSON logs remain the default for browsers that don't ask */
+		pss->bin_logs = ti->bin ? 1 : 0;
+
 		if (saiw_pss_schedule_taskinfo(pss, ti->task_hash, !!ti->logs))
 			goto soft_error;
 
@@ -786,6 +1089,52 @@ saiw_retry_logs(lws_sorted_usec_list_t *sul)
 	saiw_broadcast_logs_batch(pss->vhd, pss);
 }
 
+/*
+ * Browsers that asked for it get each log chunk as a binary ws message, so
+ * we don't have to wrap it in base64 and JSON
+ *
+ *   0  u8	SAIW_BIN_TYPE_LOG
+ *   1  u8	channel
+ *   2  u16	0
+ *   4  u32	finished (be)
+ *   8  u64	timestamp, us (be)
+ *  16		raw log bytes to the end of the message
+ *
+ * Returns nonzero if the caller should send it as JSON instead.
+ */
+
+static int
+saiw_log_queue_binary(struct pss *pss, const sai_log_t *log)
+{
+	uint8_t buf[LWS_PRE + SAIW_BIN_LOG_HDR + 2048], *p = buf + LWS_PRE;
+	size_t bl = log->log ? strlen(log->log) : 0,
+	       space = sizeof(buf) - LWS_PRE - SAIW_BIN_LOG_HDR;
+	int n = 0;
+
+	if ((bl / 4) * 3 + 3 > space)
+		return 1;
+
+	if (bl) {
+		n = lws_b64_decode_string_len(log->log, (int)bl,
+					(char *)p + SAIW_BIN_LOG_HDR, (int)space);
+		if (n < 0)
+			return 1;
+	}
+
+	p[0] = SAIW_BIN_TYPE_LOG;
+	p[1] = (uint8_t)log->channel;
+	p[2] = 0;
+	p[3] = 0;
+	lws_ser_wu32be(p + 4, (uint32_t)log->finished);
+	lws_ser_wu64be(p + 8, log->timestamp);
+
+	saiw_ws_browser_queue_REQUIRES_LWS_PRE(pss, p,
+				SAIW_BIN_LOG_HDR + (size_t)n,
+				lws_write_ws_flags(LWS_WRITE_BINARY, 1, 1));
+
+	return 0;
+}
+
 int
 saiw_broadcast_logs_batch(struct vhd *vhd, struct pss *pss)
 {
@@ -819,7 +1168,7 @@ saiw_broadcast_logs_batch(struct vhd *vhd, struct pss *pss)
 
 		if (sai_event_db_ensure_open(vhd->context, &vhd->sqlite3_cache,
 					     vhd->sqlite3_path_lhs, event_uuid,
-					     0, &pdb)) {
+					     SAI_DB_OPEN_RO, &pdb)) {
 			lwsl_notice("%s: unable to open event-specific database\n",
 					__func__);
 
@@ -855,6 +1204,11 @@ saiw_broadcast_logs_batch(struct vhd *vhd, struct pss *pss)
 
 		lws_dll2_remove(&log->list);
 
+		if (pss->bin_logs && !saiw_log_queue_binary(pss, log)) {
+			pss->sub_timestamp = log->timestamp;
+			continue;
+		}
+
 		/*
 		 * Turn it back into JSON so we can give it to
 		 * the browser
@@ -895,48 +1249,636 @@ saiw_broadcast_logs_batch(struct vhd *vhd, struct pss *pss)
 	return 0;
 }
 
-int
-saiw_browser_queue_overview(struct vhd *vhd, struct pss *pss)
+static int
+saiw_ov_frag_reserve(saiw_ov_frag_t **pf, size_t need)
+{
+	saiw_ov_frag_t *f = *pf;
+	size_t a = f ? f->alloc : 4096;
+
+	if (f && f->alloc - f->len >= need)
+		return 0;
+
+	while (a - (f ? f->len : 0) < need)
+		a *= 2;
+
+	f = realloc(f, sizeof(*f) + sizeof(int) + a);
+	if (!f)
+		return 1;
+
+	if (!*pf)
+		memset(f, 0, sizeof(*f));
+	f->alloc = a;
+	*pf = f;
+
+	return 0;
+}
+
+static uint8_t *
+saiw_ov_frag_data(saiw_ov_frag_t *f)
+{
+	return (uint8_t *)&f[1] + sizeof(int);
+}
+
+static int
+saiw_ov_frag_append(saiw_ov_frag_t **pf, const char *s)
+{
+	size_t n = strlen(s);
+
+	if (saiw_ov_frag_reserve(pf, n))
+		return 1;
+
+	memcpy(saiw_ov_frag_data(*pf) + (*pf)->len, s, n);
+	(*pf)->len += n;
+
+	return 0;
+}
+
+static int
+saiw_ov_frag_serialize(saiw_ov_frag_t **pf, const lws_struct_map_t *map,
+		       size_t map_entries, void *obj)
 {
-	char buf[4096 + LWS_PRE], *start = buf + LWS_PRE, *p = start,
-	     *end = buf + sizeof(buf);
-	char esc[256], esc1[33], filt[128], subsequent;
-	struct lwsac *task_ac = NULL, *ac = NULL;
-	lws_dll2_owner_t task_owner, owner;
-	unsigned int task_index = 0;
 	lws_struct_serialize_t *js;
+	size_t w;
+	int n;
+
+	js = lws_struct_json_serialize_create(map, map_entries, 0, obj);
+	if (!js)
+		return 1;
+
+	do {
+		if (saiw_ov_frag_reserve(pf, 1024)) {
+			lws_struct_json_serialize_destroy(&js);
+			return 1;
+		}
+
+		n = (int)lws_struct_json_serialize(js,
+				saiw_ov_frag_data(*pf) + (*pf)->len,
+				(*pf)->alloc - (*pf)->len, &w);
+		(*pf)->len += w;
+	} while (n == LSJS_RESULT_CONTINUE);
+
+	lws_struct_json_serialize_destroy(&js);
+
+	return n == LSJS_RESULT_ERROR;
+}
+
+/*
+ * Produce {"e":{...},"t":[...]} for one event, fetching all of its tasks
+ * in one query that only asks for the columns the overview uses
+ */
+
+static saiw_ov_frag_t *
+saiw_ov_frag_create(struct vhd *vhd, sai_event_t *e)
+{
+	struct lwsac *task_ac = NULL;
+	lws_dll2_owner_t task_owner;
+	saiw_ov_frag_t *f = NULL;
+	time_t now = (time_t)lws_now_secs(), exp;
 	sqlite3 *pdb = NULL;
-	lws_dll2_t *walk;
+	char subsequent = 0;
+
+	lws_dll2_owner_clear(&task_owner);
+
+	if (sai_event_db_ensure_open(vhd->context, &vhd->sqlite3_cache,
+				     vhd->sqlite3_path_lhs, e->uuid, SAI_DB_OPEN_RO, &pdb)) {
+		lwsl_err("%s: unable to open event-specific database\n",
+			 __func__);
+
+		return NULL;
+	}
+
+	if (lws_struct_sq3_deserialize(pdb, NULL, NULL,
+				       lsm_schema_sq3_map_task_overview,
+				       &task_owner, &task_ac, 0,
+				       SAIW_OVERVIEW_TASKS_MAX) < 0) {
+		lwsl_err("%s: OVERVIEW 1 failed\n", __func__);
+		sai_event_db_close(&vhd->sqlite3_cache, &pdb);
+
+		return NULL;
+	}
+	sai_event_db_close(&vhd->sqlite3_cache, &pdb);
+
+	if (saiw_ov_frag_append(&f, "{\"e\":") ||
+	    saiw_ov_frag_serialize(&f, lsm_schema_json_map_event,
+				   LWS_ARRAY_SIZE(lsm_schema_json_map_event), e) ||
+	    saiw_ov_frag_append(&f, ", \"t\":["))
+		goto bail;
+
+	lws_strncpy(f->event_uuid, e->uuid, sizeof(f->event_uuid));
+	f->last_updated = e->last_updated;
+	f->state = (int)e->state;
+	f->expires = 0;
+
+	lws_start_foreach_dll(struct lws_dll2 *, p, task_owner.head) {
+		sai_task_t *t = lws_container_of(p, sai_task_t, list);
+
+		/*
+		 * Rebuildable only holds for a day after the task ended, note
+		 * when the first such flag will lapse so we regenerate then
+		 */
+
+		exp = (time_t)(t->started + t->duration / 1000000) + 24 * 3600;
+		t->rebuildable = (t->state == SAIES_FAIL ||
+				  t->state == SAIES_CANCELLED) && now < exp;
+		if (t->rebuildable && (!f->expires || exp < f->expires))
+			f->expires = exp;
+
+		if ((subsequent && saiw_ov_frag_append(&f, ",")) ||
+		    saiw_ov_frag_serialize(&f, lsm_schema_json_map_task_overview,
+				LWS_ARRAY_SIZE(lsm_schema_json_map_task_overview), t))
+			goto bail;
+
+		subsequent = 1;
+	} lws_end_foreach_dll(p);
+
+	if (saiw_ov_frag_append(&f, "]}"))
+		goto bail;
+
+	lwsac_free(&task_ac);
+
+	return f;
+
+bail:
+	lwsl_err("%s: json ser fail\n", __func__);
+	lwsac_free(&task_ac);
+	free(f);
+
+	return NULL;
+}
+
+/*
+ * Find the cached fragment for the event, or make one, evicting the least
+ * recently used one if we are at the limit
+ */
+
+static saiw_ov_frag_t *
+saiw_ov_frag_get(struct vhd *vhd, sai_event_t *e)
+{
+	saiw_ov_frag_t *f;
+
+	lws_start_foreach_dll(struct lws_dll2 *, p, vhd->overview_cache.head) {
+		f = lws_container_of(p, saiw_ov_frag_t, list);
+
+		if (!strcmp(f->event_uuid, e->uuid)) {
+			if (f->last_updated == e->last_updated &&
+			    f->state == (int)e->state &&
+			    (!f->expires || f->expires > (time_t)lws_now_secs())) {
+				lws_dll2_remove(&f->list);
+				lws_dll2_add_head(&f->list, &vhd->overview_cache);
+
+				return f;
+			}
+
+			/* the event row moved on since, make it again */
+			lws_dll2_remove(&f->list);
+			free(f);
+			break;
+		}
+	} lws_end_foreach_dll(p);
+
+	f = saiw_ov_frag_create(vhd, e);
+	if (!f)
+		return NULL;
+
+	if (vhd->overview_cache.count >= SAIW_OVERVIEW_CACHE_MAX) {
+		saiw_ov_frag_t *lru = lws_container_of(vhd->overview_cache.tail,
+						      saiw_ov_frag_t, list);
+
+		lws_dll2_remove(&lru->list);
+		free(lru);
+	}
+
+	lws_dll2_clear(&f->list);
+	lws_dll2_add_head(&f->list, &vhd->overview_cache);
+
+	return f;
+}
+
+void
+saiw_overview_cache_invalidate(struct vhd *vhd, const char *event_uuid)
+{
+	lws_start_foreach_dll_safe(struct lws_dll2 *, p, p1,
+				   vhd->overview_cache.head) {
+		saiw_ov_frag_t *f = lws_container_of(p, saiw_ov_frag_t, list);
+
+		if (!event_uuid || !strncmp(f->event_uuid, event_uuid, 32)) {
+			lws_dll2_remove(&f->list);
+			free(f);
+		}
+	} lws_end_foreach_dll_safe(p, p1);
+}
+
+void
+saiw_overview_cache_destroy(struct vhd *vhd)
+{
+	saiw_overview_cache_invalidate(vhd, NULL);
+}
+
+/*
+ * Browsers showing the overview are kept up to date by small patches rather
+ * than resending the overview.  Each change gets the next vhd->ov_version
+ * and is kept in a history bounded in count and size, so a browser that
+ * fell behind, or noticed a gap and asks to resume from the version it has,
+ * can be sent everything it missed.  Only if that's no longer in the
+ * history, or a change in the range couldn't be described, does it get the
+ * whole overview again.
+ */
+
+static void
+saiw_overview_history_trim(struct vhd *vhd)
+{
+	while (vhd->ov_history.count > SAIW_OV_HISTORY_MAX ||
+	       vhd->ov_history_bytes > SAIW_OV_HISTORY_MAX_BYTES) {
+		saiw_ov_patch_t *pa = lws_container_of(vhd->ov_history.head,
+						       saiw_ov_patch_t, list);
+
+		vhd->ov_history_bytes -= sizeof(*pa) + pa->len;
+		lws_dll2_remove(&pa->list);
+		free(pa);
+	}
+}
+
+static void
+saiw_overview_history_add(struct vhd *vhd, const char *repo_name, int sec,
+			  const char *json, size_t len)
+{
+	saiw_ov_patch_t *pa;
+
+	/*
+	 * If we can't record it, the version still moves on, anyone who
+	 * would have needed it will find the gap and resync
+	 */
+
+	vhd->ov_version++;
+
+	pa = malloc(sizeof(*pa) + len);
+	if (!pa)
+		return;
+
+	memset(pa, 0, sizeof(*pa));
+	pa->version = vhd->ov_version;
+	lws_strncpy(pa->repo_name, repo_name, sizeof(pa->repo_name));
+	pa->sec = sec;
+	pa->len = len;
+	if (len)
+		memcpy(&pa[1], json, len);
+
+	lws_dll2_add_tail(&pa->list, &vhd->ov_history);
+	vhd->ov_history_bytes += sizeof(*pa) + len;
+
+	saiw_overview_history_trim(vhd);
+}
+
+/*
+ * Something changed that we couldn't make a patch for... it's recorded as
+ * an empty patch, so anyone catching up across it gets the whole overview
+ */
+
+static void
+saiw_overview_history_gap(struct vhd *vhd)
+{
+	saiw_overview_history_add(vhd, "", 0, NULL, 0);
+}
+
+sai_event_t *
+saiw_event_lookup(struct vhd *vhd, const char *event_uuid, struct lwsac **ac)
+{
+	char esc[96], qu[128];
+	lws_dll2_owner_t o;
+
+	lws_sql_purify(esc, event_uuid, sizeof(esc));
+	lws_snprintf(qu, sizeof(qu), " and uuid='%s'", esc);
+
+	if (lws_struct_sq3_deserialize(vhd->pdb, qu, NULL,
+				       lsm_schema_sq3_map_event, &o, ac,
+				       0, 1) < 0 || !o.head)
+		return NULL;
+
+	return lws_container_of(o.head, sai_event_t, list);
+}
+
+void
+saiw_overview_patch_task(struct vhd *vhd, const char *task_uuid)
+{
+	char event_uuid[33], esc[96], qu[128], js[256];
+	struct lwsac *ac = NULL;
+	sqlite3 *pdb = NULL;
+	lws_dll2_owner_t o;
+	sai_event_t *e;
 	sai_task_t *t;
 	int n, iu;
+
+	sai_task_uuid_to_event_uuid(event_uuid, task_uuid);
+
+	if (sai_event_db_ensure_open(vhd->context, &vhd->sqlite3_cache,
+				     vhd->sqlite3_path_lhs, event_uuid, SAI_DB_OPEN_RO, &pdb))
+		goto gap;
+
+	lws_sql_purify(esc, task_uuid, sizeof(esc));
+	lws_snprintf(qu, sizeof(qu), " and uuid='%s'", esc);
+	n = lws_struct_sq3_deserialize(pdb, qu, NULL,
+				       lsm_schema_sq3_map_task_overview,
+				       &o, &ac, 0, 1);
+	sai_event_db_close(&vhd->sqlite3_cache, &pdb);
+	if (n < 0 || !o.head)
+		goto gap;
+
+	t = lws_container_of(o.head, sai_task_t, list);
+
+	/* the event tells us who is allowed to see the change */
+
+	e = saiw_event_lookup(vhd, event_uuid, &ac);
+	if (!e)
+		goto gap;
+
+	t->rebuildable = (t->state == SAIES_FAIL || t->state == SAIES_CANCELLED) &&
+			 (lws_now_secs() - (t->started + t->duration / 1000000) <
+								24 * 3600);
+
+	n = lws_snprintf(js, sizeof(js),
+			 "{\"t\":\"%s\",\"s\":%d,\"d\":%llu,\"r\":%d}",
+			 lws_json_purify(esc, t->uuid, sizeof(esc) - 1, &iu),
+			 (int)t->state, (unsigned long long)t->duration,
+			 t->rebuildable);
+
+	saiw_overview_history_add(vhd, e->repo_name, e->sec, js, (size_t)n);
+	lwsac_free(&ac);
+
+	return;
+
+gap:
+	lwsac_free(&ac);
+	saiw_overview_history_gap(vhd);
+}
+
+void
+saiw_overview_patch_event(struct vhd *vhd, const sai_event_t *e)
+{
+	char js[2048], *p = js, *end = js + sizeof(js) - 2;
+	lws_struct_serialize_t *ser;
 	size_t w;
+	int n;
+
+	if (!e)
+		goto gap;
+
+	p += lws_snprintf(p, lws_ptr_diff_size_t(end, p), "{\"e\":");
+
+	ser = lws_struct_json_serialize_create(lsm_schema_json_map_event,
+				LWS_ARRAY_SIZE(lsm_schema_json_map_event), 0,
+				(void *)e);
+	if (!ser)
+		goto gap;
+
+	n = (int)lws_struct_json_serialize(ser, (uint8_t *)p,
+					   lws_ptr_diff_size_t(end, p), &w);
+	lws_struct_json_serialize_destroy(&ser);
+	if (n != LSJS_RESULT_FINISH)
+		goto gap;
+
+	p += w;
+	*p++ = '}';
+
+	saiw_overview_history_add(vhd, e->repo_name, e->sec, js,
+				  lws_ptr_diff_size_t(p, js));
+	return;
+
+gap:
+	saiw_overview_history_gap(vhd);
+}
+
+void
+saiw_overview_history_destroy(struct vhd *vhd)
+{
+	lws_start_foreach_dll_safe(struct lws_dll2 *, p, p1,
+				   vhd->ov_history.head) {
+		saiw_ov_patch_t *pa = lws_container_of(p, saiw_ov_patch_t, list);
+
+		lws_dll2_remove(&pa->list);
+		free(pa);
+	} lws_end_foreach_dll_safe(p, p1);
+
+	vhd->ov_history_bytes = 0;
+}
+
+/*
+ * Send the browser whatever patches it hasn't seen yet, or if it is too far
+ * behind for our history, the whole overview
+ */
+
+int
+saiw_browser_ov_catchup(struct vhd *vhd, struct pss *pss)
+{
+	char buf[4096 + LWS_PRE], *start = buf + LWS_PRE, *p = start,
+	     *end = buf + sizeof(buf);
+	saiw_ov_patch_t *pa = NULL;
+	char fi = 1, subsequent = 0;
+	lws_dll2_t *d;
+
+	if (!pss->ov_synced || pss->ov_version == vhd->ov_version)
+		return 0;
+
+	if (pss->tx_pending > SAIW_OV_BACKLOG_MAX) {
+		/* let him drain what he has first, we pick up after that */
+		pss->ov_behind = 1;
+
+		return 0;
+	}
+	pss->ov_behind = 0;
+
+	for (d = lws_dll2_get_head(&vhd->ov_history); d; d = d->next) {
+		pa = lws_container_of(d, saiw_ov_patch_t, list);
+		if (pa->version > pss->ov_version)
+			break;
+	}
+
+	if (!d || pa->version != pss->ov_version + 1)
+		goto resync;
+
+	/* a change we couldn't describe in the range means he needs it all */
+
+	for (; d; d = d->next)
+		if (!lws_container_of(d, saiw_ov_patch_t, list)->len)
+			goto resync;
+
+	pss->ov_version = vhd->ov_version;
+
+	for (d = &pa->list; d; d = d->next) {
+		pa = lws_container_of(d, saiw_ov_patch_t, list);
+
+		if ((pa->sec && !pss->authorized) ||
+		    (pss->specific_project[0] &&
+		     strcmp(pss->specific_project, pa->repo_name)))
+			continue;
+
+		if (!subsequent)
+			p += lws_snprintf(p, lws_ptr_diff_size_t(end, p),
+				"{\"schema\":\"com.warmcat.sai.ovpatch\","
+				"\"from\":%llu,\"v\":%llu,\"p\":[",
+				(unsigned long long)pss->ov_client_version,
+				(unsigned long long)vhd->ov_version);
+		else
+			*p++ = ',';
+		subsequent = 1;
+
+		if (lws_ptr_diff_size_t(end, p) < pa->len + 8) {
+			saiw_ws_browser_queue_REQUIRES_LWS_PRE(pss, start,
+					lws_ptr_diff_size_t(p, start),
+					lws_write_ws_flags(LWS_WRITE_TEXT, fi, 0));
+			p = start;
+			fi = 0;
+		}
+
+		memcpy(p, &pa[1], pa->len);
+		p += pa->len;
+	}
+
+	if (!subsequent)
+		/* nothing he can see changed, he doesn't need to hear */
+		return 0;
+
+	p += lws_snprintf(p, lws_ptr_diff_size_t(end, p), "]}");
+
+	saiw_ws_browser_queue_REQUIRES_LWS_PRE(pss, start,
+					       lws_ptr_diff_size_t(p, start),
+					       lws_write_ws_flags(LWS_WRITE_TEXT, fi, 1));
+	pss->ov_client_version = vhd->ov_version;
+
+	return 0;
+
+resync:
+	lwsl_info("%s: resync from %llu\n", __func__,
+		  (unsigned long long)pss->ov_version);
+
+	return saiw_browser_queue_overview(vhd, pss);
+}
+
+/*
+ * The browser already has the overview up to version from, in our epoch, and
+ * just missed some patches... if the history still covers what it missed,
+ * pick up from there instead of sending the whole overview again
+ */
+
+int
+saiw_browser_ov_resume(struct vhd *vhd, struct pss *pss, uint64_t from)
+{
+	saiw_ov_patch_t *pa;
+	lws_dll2_t *d;
+
+	if (from > vhd->ov_version)
+		return saiw_browser_queue_overview(vhd, pss);
+
+	if (from != vhd->ov_version) {
+		d = lws_dll2_get_head(&vhd->ov_history);
+		if (!d)
+			return saiw_browser_queue_overview(vhd, pss);
+		pa = lws_container_of(d, saiw_ov_patch_t, list);
+		if (pa->version > from + 1)
+			return saiw_browser_queue_overview(vhd, pss);
+	}
+
+	pss->wants_event_updates	= 1;
+	pss->ov_version			= from;
+	pss->ov_client_version		= from;
+	pss->ov_synced			= 1;
+	pss->ov_behind			= 0;
+
+	return saiw_browser_ov_catchup(vhd, pss);
+}
+
+/*
+ * Queue a page of the overview for the browser, newest first.  before == 0
+ * is the initial page, which the overview version is synced to; otherwise we
+ * send the page of events that sort after (before, before_uuid), for the
+ * browser to append.  created only has one-second resolution, so the uuid is
+ * needed to not lose events from the same second as the end of the last page.
+ */
+
+int
+saiw_browser_queue_overview_page(struct vhd *vhd, struct pss *pss,
+				 uint64_t before, const char *before_uuid,
+				 int limit)
+{
+	char buf[4096 + LWS_PRE], *start = buf + LWS_PRE, *p = start,
+	     *end = buf + sizeof(buf);
+	char esc[256], esc1[33], esc2[130], filt[512], oldest_uuid[65],
+	     subsequent;
+	struct lwsac *ac = NULL;
+	lws_dll2_owner_t owner;
+	uint64_t oldest = 0;
+	saiw_ov_frag_t *f;
+	lws_dll2_t *walk;
+	int n, iu;
 
-	filt[0] = '\0';
 	esc[0] = '\0';
-	n = -8;
+	n = 0;
 
+	if (limit <= 0)
+		limit = pss->ov_limit ? (int)pss->ov_limit :
+			(pss->specific_project[0] ? 1 : SAIW_OVERVIEW_PAGE_DEFAULT);
+	if (limit > SAIW_OVERVIEW_PAGE_MAX)
+		limit = SAIW_OVERVIEW_PAGE_MAX;
+
+	/*
+	 * All the filtering happens in the query, so the limit means the
+	 * same thing on every page.  (repo_name, created) is indexed.
+	 */
+
+	filt[0] = '\0';
 	if (pss->specific_project[0]) {
 		lws_sql_purify(esc, pss->specific_project, sizeof(esc) - 1);
-		lws_snprintf(filt, sizeof(filt), " and repo_name=\"%s\"", esc);
-		n = -1;
+		n += lws_snprintf(filt + n, sizeof(filt) - (unsigned int)n,
+				  " and repo_name=\"%s\"", esc);
 	}
 	if (!pss->authorized)
-		lws_snprintf(filt + strlen(filt), sizeof(filt) - strlen(filt), " and sec=0");
+		n += lws_snprintf(filt + n, sizeof(filt) - (unsigned int)n,
+				  " and sec=0");
+	if (pss->specificity && pss->specific_ref[0]) {
+		lws_sql_purify(esc, pss->specific_ref, sizeof(esc) - 1);
+		n += lws_snprintf(filt + n, sizeof(filt) - (unsigned int)n,
+				  " and (ref='%s' or hash='%s'%s)", esc, esc,
+				  !strcmp(pss->specific_ref, "refs/heads/master") ?
+					" or ref='refs/heads/main'" : "");
+	}
+	if (before && before_uuid && before_uuid[0]) {
+		lws_sql_purify(esc, before_uuid, sizeof(esc) - 1);
+		n += lws_snprintf(filt + n, sizeof(filt) - (unsigned int)n,
+				  " and (created < %llu or "
+				  "(created = %llu and uuid < '%s'))",
+				  (unsigned long long)before,
+				  (unsigned long long)before, esc);
+	} else
+		if (before)
+			n += lws_snprintf(filt + n,
+					  sizeof(filt) - (unsigned int)n,
+					  " and created < %llu",
+					  (unsigned long long)before);
 
 	pss->wants_event_updates = 1;
 	if (lws_struct_sq3_deserialize(vhd->pdb, filt[0] ? filt : NULL,
-				       "created ", lsm_schema_sq3_map_event,
-				       &owner, &ac, 0, n)) {
+				       "created desc, uuid desc ",
+				       lsm_schema_sq3_map_event,
+				       &owner, &ac, 0, limit)) {
 		lwsl_notice("%s: OVERVIEW 2 failed\n", __func__);
 
 		return 0;
 	}
 
 	/*
-	 * we get zero or more sai_event_t laid out in pss->query_ac,
-	 * and listed in pss->query_owner
+	 * we get zero or more sai_event_t laid out in ac, and listed in owner
 	 */
 
+	oldest_uuid[0] = '\0';
+	lws_start_foreach_dll(struct lws_dll2 *, d, owner.head) {
+		sai_event_t *e = lws_container_of(d, sai_event_t, list);
+
+		if (!oldest || e->created < oldest ||
+		    (e->created == oldest && strcmp(e->uuid, oldest_uuid) < 0)) {
+			oldest = e->created;
+			lws_strncpy(oldest_uuid, e->uuid, sizeof(oldest_uuid));
+		}
+	} lws_end_foreach_dll(d);
+
 	p += (size_t)lws_snprintf((char *)p, lws_ptr_diff_size_t(end, p),
 		"{\"schema\":\"sai.warmcat.com.overview\","
 		" \"api_version\":%u,"
@@ -944,12 +1886,30 @@ saiw_browser_queue_overview(struct vhd *vhd, struct pss *pss)
 		" \"authorized\": %d,"
 		" \"auth_secs\": %ld,"
 		" \"auth_user\": \"%s\","
+		" \"ov_version\": %llu,"
+		" \"ov_epoch\": %u,"
+		" \"before\": %llu,"
+		" \"oldest\": %llu,"
+		" \"oldest_uuid\": \"%s\","
+		" \"more\": %d,"
 		"\"overview\":[", SAIW_API_VERSION,
 		lws_json_purify(esc, pss->alang, sizeof(esc) - 1, &iu),
 		pss->authorized, pss->authorized ? pss->expiry_unix_time - lws_now_secs() : 0,
-		lws_json_purify(esc1, pss->auth_user, sizeof(esc1) - 1, &iu)
+		lws_json_purify(esc1, pss->auth_user, sizeof(esc1) - 1, &iu),
+		(unsigned long long)vhd->ov_version, (unsigned int)vhd->ov_epoch,
+		(unsigned long long)before, (unsigned long long)oldest,
+		lws_json_purify(esc2, oldest_uuid, sizeof(esc2) - 1, &iu),
+		(int)owner.count == limit
 	);
 
+	if (!before) {
+		/* patches from here on are relative to what we're about to send */
+
+		pss->ov_version = pss->ov_client_version = vhd->ov_version;
+		pss->ov_synced = 1;
+		pss->ov_behind = 0;
+	}
+
 	saiw_ws_browser_queue_REQUIRES_LWS_PRE(pss, start,
 					       lws_ptr_diff_size_t(p, start),
 					       lws_write_ws_flags(LWS_WRITE_TEXT, 1, 0));
@@ -973,159 +1933,40 @@ saiw_browser_queue_overview(struct vhd *vhd, struct pss *pss)
 
 	subsequent = 0;
 
-	if (!owner.count) /* nothing to do */
-		goto so_finish;
-
 	while (walk) {
 		sai_event_t *e = lws_container_of(walk, sai_event_t, list);
 
-		if (pss->specificity) {
-			if (!strcmp(pss->specific_ref, "refs/heads/master") &&
-			    !strcmp(e->ref, "refs/heads/main"))
-				; // any = 1;
-			else {
-				if (strcmp(e->hash, pss->specific_ref) &&
-				    strcmp(e->ref, pss->specific_ref)) {
-					walk = walk->next;
-					continue;
-				}
-				// any = 1;
-			}
-		}
-
-		js = lws_struct_json_serialize_create(
-			lsm_schema_json_map_event,
-			LWS_ARRAY_SIZE(lsm_schema_json_map_event), 0, e);
-		if (!js) {
-			lwsl_err("%s: json ser fail\n", __func__);
-			return 1;
-		}
-		if (subsequent)
-			*p++ = ',';
-		subsequent = 1;
-
-		p += lws_snprintf((char *)p, lws_ptr_diff_size_t(end, p), "{\"e\":");
-
-		if (lws_ptr_diff_size_t(end, p) < 256) {
-			saiw_ws_browser_queue_REQUIRES_LWS_PRE(pss, start,
-							       lws_ptr_diff_size_t(p, start),
-							       lws_write_ws_flags(LWS_WRITE_TEXT, 0, 0));
-			p = start;
-		}
-
-		n = (int)lws_struct_json_serialize(js, (uint8_t *)p, lws_ptr_diff_size_t(end, p), &w);
-		lws_struct_json_serialize_destroy(&js);
-		switch (n) {
-		case LSJS_RESULT_ERROR:
-			lwsl_err("%s: json ser error\n", __func__);
-			return 1;
+		if (pss->specificity)
+			walk = walk->next;
+		else
+			walk = walk->prev;
 
-		case LSJS_RESULT_FINISH:
-		case LSJS_RESULT_CONTINUE:
-			p += w;
-			task_index = 0;
-			p += lws_snprintf((char *)p, lws_ptr_diff_size_t(end, p), ", \"t\":[");
-			break;
-		}
+		f = saiw_ov_frag_get(vhd, e);
+		if (!f)
+			continue;
 
-		if (lws_ptr_diff_size_t(end, p) < 2560) {
+		if (subsequent) {
+			*p++ = ',';
 			saiw_ws_browser_queue_REQUIRES_LWS_PRE(pss, start,
-							       lws_ptr_diff_size_t(p, start),
-							       lws_write_ws_flags(LWS_WRITE_TEXT, 0, 0));
+						lws_ptr_diff_size_t(p, start),
+						lws_write_ws_flags(LWS_WRITE_TEXT, 0, 0));
 			p = start;
 		}
+		subsequent = 1;
 
 		/*
-		 * Enumerate the tasks associated with this event...
+		 * The fragment has an int's worth of space in front of its
+		 * data so it can be queued directly, it's copied into the
+		 * pss buflist by this
 		 */
 
-		e = lws_container_of(walk, sai_event_t, list);
-		lws_dll2_owner_clear(&task_owner);
-
-		do {
-			task_ac = NULL;
-
-			if (sai_event_db_ensure_open(vhd->context, &vhd->sqlite3_cache,
-					      vhd->sqlite3_path_lhs, e->uuid, 0, &pdb)) {
-				lwsl_err("%s: unable to open event-specific database\n",
-						__func__);
-
-				break;
-			}
-
-			lws_dll2_owner_clear(&task_owner);
-			if (lws_struct_sq3_deserialize(pdb, NULL, NULL,
-					lsm_schema_sq3_map_task, &task_owner,
-					&task_ac, (int)task_index, 1)) {
-				lwsl_err("%s: OVERVIEW 1 failed\n", __func__);
-				sai_event_db_close(&vhd->sqlite3_cache, &pdb);
-
-				break;
-			}
-			sai_event_db_close(&vhd->sqlite3_cache, &pdb);
-
-			if (!task_owner.count)
-				break;
-
-			if (task_index)
-				*p++ = ',';
-
-			/*
-			 * We don't want to send everyone the artifact nonces...
-			 * the up nonce is a key for uploading artifacts on to
-			 * this task, it should only be stored in the server db
-			 * and sent to the builder to use.
-			 *
-			 * The down nonce is used in generated links, but still
-			 * you should have to acquire such a link via whatever
-			 * auth rather than be able to cook them up yourself
-			 * from knowing the task uuid.
-			 */
-
-			t = (sai_task_t *)task_owner.head;
-			t->art_up_nonce[0] = '\0';
-			t->art_down_nonce[0] = '\0';
-
-			t->rebuildable = (t->state == SAIES_FAIL || t->state == SAIES_CANCELLED) &&
-				(lws_now_secs() - (t->started + t->duration / 1000000) < 24 * 3600);
-
-			/* only one in it at a time */
-			t = lws_container_of(task_owner.head, sai_task_t, list);
-
-			js = lws_struct_json_serialize_create(
-				lsm_schema_json_map_task,
-				LWS_ARRAY_SIZE(lsm_schema_json_map_task), 0, t);
-
-			t->build[0] = '\0';
-			n = (int)lws_struct_json_serialize(js, (uint8_t *)p, lws_ptr_diff_size_t(end, p), &w);
-			lws_struct_json_serialize_destroy(&js);
-			lwsac_free(&task_ac);
-			p += w;
-
-			if (lws_ptr_diff_size_t(end, p) < 2560) {
-				saiw_ws_browser_queue_REQUIRES_LWS_PRE(pss, start,
-								       lws_ptr_diff_size_t(p, start),
-								       lws_write_ws_flags(LWS_WRITE_TEXT, 0, 0));
-				p = start;
-			}
-
-			task_index++;
-		} while (1);
-
-		/* none left to do, go back up a level */
-
-		p += lws_snprintf((char *)p, lws_ptr_diff_size_t(end, p), "]}");
-
-		if (pss->specificity)
-			walk = walk->next;
-		else
-			walk = walk->prev;
-
-		if (walk && !pss->specificity)
-			continue;
+		saiw_ws_browser_queue_REQUIRES_LWS_PRE(pss, saiw_ov_frag_data(f),
+					f->len,
+					lws_write_ws_flags(LWS_WRITE_TEXT, 0, 0));
 	}
 
-so_finish:
+	lwsac_free(&ac);
+
 	p += lws_snprintf((char *)p, lws_ptr_diff_size_t(end, p), "]}");
 
 	saiw_ws_browser_queue_REQUIRES_LWS_PRE(pss, start,
@@ -1135,6 +1976,12 @@ so_finish:
 	return 0;
 }
 
+int
+saiw_browser_queue_overview(struct vhd *vhd, struct pss *pss)
+{
+	return saiw_browser_queue_overview_page(vhd, pss, 0, NULL, 0);
+}
+
 int
 saiw_browser_broadcast_queue_builders(struct vhd *vhd, struct pss *pss)
 {
@@ -1209,6 +2056,22 @@ saiw_browser_broadcast_queue_builders(struct vhd *vhd, struct pss *pss)
 	return 0;
 }
 
+/*
+ * sai-server only sends the PCON topology when it changes, give the browser
+ * our copy of the last one
+ */
+
+int
+saiw_browser_queue_pcons(struct vhd *vhd, struct pss *pss)
+{
+	if (!vhd || !vhd->pcons_valid)
+		return 0;
+
+	return saiw_ws_browser_queue_REQUIRES_LWS_PRE(pss,
+				vhd->pcons + LWS_PRE, vhd->pcons_len,
+				lws_write_ws_flags(LWS_WRITE_TEXT, 1, 1));
+}
+
 /*
  * This should be called from the browser-facing websocket protocol handler
  * on LWS_CALLBACK_ESTABLISHED and LWS_CALLBACK_CLOSED events to keep an
@@ -26,6 +26,7 @@
  */
 
 #include <libwebsockets.h>
+#include <stdlib.h>
 #include <string.h>
 #include <signal.h>
 #include <time.h>
@@ -55,6 +56,10 @@ const lws_struct_map_t lsm_schema_json_map[] = {
 	LSM_SCHEMA(sai_power_managed_builders_t, NULL,
 			lsm_power_managed_builders_list,
 			"com.warmcat.sai.power_managed_builders"),
+	LSM_SCHEMA	(sai_plat_owner_t, NULL, lsm_plat_list,
+			 "com.warmcat.sai.builder-deltas"),
+	LSM_SCHEMA	(sai_browse_rx_evinfo_t, NULL, lsm_websrv_evinfo,
+			/* shares struct */   "com.warmcat.sai.eventprogress"),
 };
 
 enum {
@@ -67,8 +72,86 @@ enum {
 	SAIS_WS_WEBSRV_RX_TASKACTIVITY,
 	SAIS_WS_WEBSRV_RX_BUILD_METRIC,
 	SAIS_WS_WEBSRV_RX_POWER_MANAGED_BUILDERS,
+	SAIS_WS_WEBSRV_RX_BUILDER_DELTAS, /* only builders that changed */
+	SAIS_WS_WEBSRV_RX_EVENTPROGRESS, /* background event reset / delete */
 };
 
+/*
+ * Keep a copy of the PCON topology message as it passes through, so we can
+ * hand it to browsers that connect after sai-server last sent it
+ */
+
+static void
+saiw_pcons_cache_append(struct vhd *vhd, const uint8_t *buf, size_t len,
+			int flags)
+{
+	if (flags & LWSSS_FLAG_SOM) {
+		vhd->pcons_len		= 0;
+		vhd->pcons_valid	= 0;
+	}
+
+	if (LWS_PRE + vhd->pcons_len + len > vhd->pcons_alloc) {
+		size_t na = (LWS_PRE + vhd->pcons_len + len + 4096) &
+								~(size_t)4095;
+		uint8_t *nb = realloc(vhd->pcons, na);
+
+		if (!nb) {
+			vhd->pcons_len = 0;
+			return;
+		}
+
+		vhd->pcons		= nb;
+		vhd->pcons_alloc	= na;
+	}
+
+	memcpy(vhd->pcons + LWS_PRE + vhd->pcons_len, buf, len);
+	vhd->pcons_len += len;
+
+	if (flags & LWSSS_FLAG_EOM)
+		vhd->pcons_valid = vhd->pcons_len ? 1 : 0;
+}
+
+/*
+ * Update our copy of the builder list from a delta message, so browsers that
+ * join later still get the current state from us
+ */
+
+static void
+saiw_builders_apply_deltas(struct vhd *vhd, sai_plat_owner_t *po)
+{
+	lws_start_foreach_dll(struct lws_dll2 *, p, po->plat_owner.head) {
+		sai_plat_t *d = lws_container_of(p, sai_plat_t, sai_plat_list);
+
+		lws_start_foreach_dll(struct lws_dll2 *, p1,
+				      d->name ? vhd->builders_owner.head : NULL) {
+			sai_plat_t *sp = lws_container_of(p1, sai_plat_t,
+							  sai_plat_list);
+
+			if (sp->name && !strcmp(sp->name, d->name)) {
+				/*
+				 * The strings belong to the parse ac, which
+				 * is about to go away, so only take the
+				 * members we can copy
+				 */
+				sp->online		= d->online;
+				sp->last_seen		= d->last_seen;
+				sp->powering_up		= d->powering_up;
+				sp->powering_down	= d->powering_down;
+				sp->windows		= d->windows;
+				sp->power_managed	= d->power_managed;
+				sp->stay_on		= d->stay_on;
+				lws_strncpy(sp->peer_ip, d->peer_ip,
+					    sizeof(sp->peer_ip));
+				lws_strncpy(sp->sai_hash, d->sai_hash,
+					    sizeof(sp->sai_hash));
+				lws_strncpy(sp->lws_hash, d->lws_hash,
+					    sizeof(sp->lws_hash));
+				break;
+			}
+		} lws_end_foreach_dll(p1);
+	} lws_end_foreach_dll(p);
+}
+
 /*
  * sai-web is receiving from sai-server
  *
@@ -118,10 +201,15 @@ saiw_lp_rx(void *userobj, const uint8_t *buf, size_t len, int flags)
 		 * "schema" member is parsed, even on the first fragment.
 		 */
 		switch (m->a.top_schema_index) {
+		case SAIS_WS_WEBSRV_RX_POWER_MANAGED_BUILDERS:
+			saiw_pcons_cache_append(vhd, buf, len, flags);
+			/* fallthru */
 		case SAIS_WS_WEBSRV_RX_LOADREPORT:
 		case SAIS_WS_WEBSRV_RX_TASKACTIVITY:
+		case SAIS_WS_WEBSRV_RX_BUILD_METRIC:
 		case SAIS_WS_WEBSRV_RX_SAI_BUILDERS:
-		case SAIS_WS_WEBSRV_RX_POWER_MANAGED_BUILDERS:
+		case SAIS_WS_WEBSRV_RX_BUILDER_DELTAS:
+		case SAIS_WS_WEBSRV_RX_EVENTPROGRESS:
 			saiw_ws_broadcast_browsers_REQUIRES_LWS_PRE(vhd, buf, len,
 				lws_write_ws_flags(LWS_WRITE_TEXT,
 						   flags & LWSSS_FLAG_SOM,
@@ -135,10 +223,15 @@ saiw_lp_rx(void *userobj, const uint8_t *buf, size_t len, int flags)
 		return 0;
 	} else {
 		switch (m->a.top_schema_index) {
+		case SAIS_WS_WEBSRV_RX_POWER_MANAGED_BUILDERS:
+			saiw_pcons_cache_append(vhd, buf, len, flags);
+			/* fallthru */
 		case SAIS_WS_WEBSRV_RX_TASKCHANGE:
 		case SAIS_WS_WEBSRV_RX_EVENTCHANGE:
+		case SAIS_WS_WEBSRV_RX_BUILD_METRIC:
 		case SAIS_WS_WEBSRV_RX_SAI_BUILDERS:
-		case SAIS_WS_WEBSRV_RX_POWER_MANAGED_BUILDERS:
+		case SAIS_WS_WEBSRV_RX_BUILDER_DELTAS:
+		case SAIS_WS_WEBSRV_RX_EVENTPROGRESS:
 			saiw_ws_broadcast_browsers_REQUIRES_LWS_PRE(vhd, buf, len,
 				lws_write_ws_flags(LWS_WRITE_TEXT,
 						   flags & LWSSS_FLAG_SOM,
@@ -196,6 +289,9 @@ saiw_lp_rx(void *userobj, const uint8_t *buf, size_t len, int flags)
 
 	case SAIS_WS_WEBSRV_RX_OVERVIEW:
 		lwsl_notice("%s: force overview\n", __func__);
+		/* events came or went, don't trust what we cached */
+		saiw_overview_cache_destroy(vhd);
+		saiw_head_status_cache_destroy(vhd);
 		lws_start_foreach_dll(struct lws_dll2 *, p, vhd->browsers.head) {
 			struct pss *pss = lws_container_of(p, struct pss, same);
 
@@ -223,49 +319,16 @@ saiw_lp_rx(void *userobj, const uint8_t *buf, size_t len, int flags)
 			lws_write_ws_flags(LWS_WRITE_TEXT, flags & LWSSS_FLAG_SOM, flags & LWSSS_FLAG_EOM));
 		break;
 	case SAIS_WS_WEBSRV_RX_POWER_MANAGED_BUILDERS:
-		/* Just forward to browser */
-		/* We already forwarded fragments in the LEJP_CONTINUE block?
-		 * Wait, in the LEJP_CONTINUE block above, we handle partial forwarding.
-		 * But if it arrives in one chunk (n >= 0 immediately), we must forward it here.
-		 * The existing logic for other types does this.
-		 * Wait, the LOADREPORT/TASKACTIVITY/BUILDERS cases below just call broadcast.
-		 * But they use 'len - n' which assumes n is the length processed?
-		 * Lejp returns LEJP_CONTINUE or a positive integer representing the number of bytes used?
-		 * No, lejp_parse returns LEJP_CONTINUE or 0 (success) or error code.
-		 *
-		 * Wait, lejp_parse returns a negative error code on failure.
-		 * On success, it returns 0.
-		 *
-		 * The code `len - (unsigned int)n` suggests n is bytes consumed?
-		 * Ah, older versions of lejp/lws might behave differently.
-		 * But if n == 0 (success), `len - 0` = len.
-		 * So it broadcasts the whole buffer.
-		 *
-		 * The `else` block of `if (n == LEJP_CONTINUE)` handles the `flags & EOM` case for fragments?
-		 * No, `if (n == LEJP_CONTINUE)` handles forwarding intermediate fragments.
-		 * The `else` block handles the FINAL fragment (where n == 0).
-		 * But wait, the `else` block logic is:
-		 *
-		 * ```c
-		 * } else {
-		 *   switch (m->a.top_schema_index) {
-		 *   case SAIS_WS_WEBSRV_RX_TASKCHANGE: ... broadcast ...
-		 *   }
-		 * }
-		 * ```
-		 *
-		 * It seems correct. I added `SAIS_WS_WEBSRV_RX_POWER_MANAGED_BUILDERS` to the `else` block switch as well.
-		 * But I should check if I need to add a case in the final switch (where parsing is complete).
-		 *
-		 * In the final switch (m->a.top_schema_index), `SAIS_WS_WEBSRV_RX_LOADREPORT` etc are handled.
-		 * I should add `SAIS_WS_WEBSRV_RX_POWER_MANAGED_BUILDERS` there too if I want to ensure the final chunk is sent if it wasn't handled by the `else` block?
-		 *
-		 * Actually, look at `SAIS_WS_WEBSRV_RX_SAI_BUILDERS` in the final switch. It does complex logic (updating vhd state).
-		 * `com.warmcat.sai.power_managed_builders` is just passthrough to the browser, sai-web doesn't need to statefully track PCONs (browsers do).
-		 * So treating it like LOADREPORT (passthrough) is correct.
-		 */
-		saiw_ws_broadcast_browsers_REQUIRES_LWS_PRE(vhd, buf, len - (unsigned int)n,
-			lws_write_ws_flags(LWS_WRITE_TEXT, flags & LWSSS_FLAG_SOM, flags & LWSSS_FLAG_EOM));
+		/* already proxied to browsers and cached above */
+		break;
+
+	case SAIS_WS_WEBSRV_RX_BUILDER_DELTAS:
+		/* already proxied to browsers above */
+		saiw_builders_apply_deltas(vhd, (sai_plat_owner_t *)m->a.dest);
+		break;
+
+	case SAIS_WS_WEBSRV_RX_EVENTPROGRESS:
+		/* already proxied to browsers above */
 		break;
 	}
 
@@ -314,6 +377,7 @@ saiw_lp_state(void *userobj, void *sh, lws_ss_constate_t state,
 	case LWSSSCS_DISCONNECTED:
 		lws_buflist_destroy_all_segments(&m->wbltx);
 		lwsac_detach(&vhd->builders);
+		vhd->pcons_valid = 0;
 		break;
 
 	case LWSSSCS_ALL_RETRIES_FAILED: